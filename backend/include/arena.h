@@ -0,0 +1,29 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+// bump allocator, all allocations are released at once with arena_reset()
+// @see: arena.c
+struct arena {
+  char *base;       // reserved address range, mapped on first use
+  size_t size;      // reserved bytes
+  size_t used;      // bump offset
+  size_t dirty;     // pages touched since the last trim
+  size_t allocated; // bytes handed out since the last reset
+};
+
+void *arena_calloc(struct arena *a, size_t nmemb, size_t size);
+char *arena_strdup(struct arena *a, const char *s);
+int arena_owns(struct arena *a, const void *p);
+void arena_reset(struct arena *a);
+void arena_free(struct arena *a);
+
+// request scoped allocations (surveyfcgi), outside of a request these fall back to calloc(), strdup() and free()
+void request_arena_begin(void);
+void request_arena_end(void);
+void *request_calloc(size_t nmemb, size_t size);
+char *request_strdup(const char *s);
+void request_free(void *p);
+
+#endif
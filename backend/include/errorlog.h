@@ -33,6 +33,7 @@ enum ss_err {
   SS_INVALID_UUID,              // malformed value for QTYPE_UUID
   SS_MISMATCH_NEXTQUESTIONS,    // answers don't match ses->next_questions
   SS_NOSUCH_QUESTION,           // question not defined
+  SS_SESSION_CONFLICT,          // (optimistic save) session was changed by another request
 
   // section: system errors
   SS_SYSTEM = 200,
@@ -45,6 +46,8 @@ enum ss_err {
   SS_SYSTEM_GET_NEXTQUESTIONS,
   SS_SYSTEM_GET_ANALYSIS,
   SS_SYSTEM_SAVE_SESSION,
+  SS_SYSTEM_HOOK_TIMEOUT,       // python hook exceeded its time budget
+  SS_SYSTEM_LOCK_SESSION_TIMEOUT, // session lock wait exceeded its budget
 
   // section: configuration errors
   SS_CONFIG = 300,
@@ -117,8 +120,11 @@ void code_instrumentation_unmute();
 FILE *open_log(char *name);
 int log_message(const char *severity, const char *file, const char *function, const int line, char *format, ...);
 
+// per-thread state: every thread has its own error log, file locks and request arena
+#define THREAD_LOCAL __thread
+
 #define MAX_ERRORS 20
-extern char error_messages[MAX_ERRORS][LOG_MSG_SHORT];
-extern int error_count;
+extern THREAD_LOCAL char error_messages[MAX_ERRORS][LOG_MSG_SHORT];
+extern THREAD_LOCAL int error_count;
 
 #endif
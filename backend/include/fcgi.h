@@ -7,6 +7,10 @@
 #define X_HEADER_MW_USER "X-SurveyProxy-Auth-User"
 #define X_HEADER_MW_GROUP "X-SurveyProxy-Auth-Group"
 
+#define FCGI_RETRY_AFTER 5 // seconds, Retry-After header of 503 responses (ENV SS_RETRY_AFTER)
+#define FCGI_METRICS_MAX_HOOKS 64
+#define FCGI_ANALYSIS_RETRY_AFTER 2 // seconds, polling interval for queued analysis jobs (ENV SS_ANALYSIS_RETRY_AFTER)
+
 // fcgi_main.c
 enum key {
   KEY_SURVEY_ID,
@@ -16,6 +20,7 @@ enum key {
 
   KEY_IF_MATCH,
   KEY_CHECK_EXTENDED,
+  KEY_CHECK_METRICS,
   KEY__MAX
 };
 
@@ -36,9 +41,11 @@ enum khttp fcgi_request_validate_meta_session(struct kreq *req, struct session *
 
 char *fcgi_request_get_field_value(enum key field, struct kreq *req);
 char *fcgi_request_get_consistency_hash(struct kreq *req); // #260
+int fcgi_request_etag_matches(struct kreq *req, const char *etag);
 
 struct session_meta *fcgi_request_parse_meta(struct kreq *req);
 int fcgi_request_validate_session_idendity(struct kreq *req, struct session_meta *meta);
+int fcgi_request_lock_mode(struct kreq *req, enum actions action);
 struct session *fcgi_request_load_and_verify_session(struct kreq *req, enum actions action, int *error);
 struct answer *fcgi_request_load_answer(struct kreq *req);
 
@@ -53,5 +60,11 @@ int http_open(struct kreq *req, enum khttp status, enum kmime mime, char *etag);
 void http_json_error(struct kreq *req, enum khttp status, const char *msg);
 
 int fcgi_response_nextquestion(struct kreq *req, struct session *ses, struct nextquestions *nq);
+int fcgi_response_metrics(struct kreq *req);
+int fcgi_response_analysis_job(struct kreq *req, struct session *ses, int status);
+
+// fcgi_pool.c
+
+int fcgi_pool_start(int count);
 #endif
 
@@ -0,0 +1,23 @@
+#ifndef __PATHS_H__
+#define __PATHS_H__
+
+/**
+ * Directory descriptors of SURVEY_HOME and its sub directories (paths.c).
+ * Session and survey io uses *at() calls (openat(), renameat(), ...) with names relative to these instead of
+ * absolute paths. Descriptors are cached per thread, session prefix directories (sessions/<prefix>) in an LRU.
+ */
+enum path_dir {
+  PATH_DIR_HOME,
+  PATH_DIR_SESSIONS,
+  PATH_DIR_LOCKS,
+  PATH_DIR_SURVEYS,
+  PATH_DIR_LOGS,
+  PATH_DIR_MAX,
+};
+
+int paths_init(void);
+void paths_close(void);
+int path_dirfd(enum path_dir dir);
+int session_dirfd(char *session_id, int create);
+
+#endif
@@ -11,7 +11,65 @@ int py_destroy();
 
 void py_object_log(char *label, PyObject *obj, FILE *fp);
 void py_log_error(FILE *fp);
+void py_hooks_clear(void);
+
+// pre-forked workers (fcgi_pool.c)
+int py_gc_freeze(void);
+void py_fork_prepare(void);
+void py_fork_parent(void);
+void py_fork_child(void);
+
+// lazy session proxy types, module "surveysystem"
+int py_session_types_init(void);
+void py_session_types_clear(void);
+PyObject *py_session_answers(struct session *ses, PyObject *meta);
+void py_session_answers_release(PyObject *answers);
+PyObject *py_answer_key(int field);
+PyObject *py_answer_field_value(struct answer *a, PyObject *question, int field);
+
+// per snapshot question objects
+int py_survey_objects(struct session *ses, PyObject **questions, PyObject **meta);
+PyObject *py_survey_question(struct session *ses, PyObject *meta, char *uid);
+void py_survey_cache_clear(void);
+
+// hook time budgets (py_watchdog.c) and latency statistics (py_stats.c)
+int py_watchdog_arm(int timeout_ms);
+int py_watchdog_disarm(void);
+int py_hook_budget(struct session *ses);
+int py_hook_timed_out(void);
+void py_hook_set_timed_out(int expired);
+
+#define PY_STATS_NAME_LEN 256
+
+struct py_hook_stats {
+  char function_name[PY_STATS_NAME_LEN];
+  unsigned long count;
+  unsigned long errors;
+  unsigned long timeouts;
+  double mean_ms;
+  double max_ms;
+  double p50_ms;
+  double p95_ms;
+  double p99_ms;
+};
+
+void py_stats_record(const char *function_name, unsigned long long us, int failed, int timed_out);
+int py_stats_get(struct py_hook_stats *out, int max);
+void py_stats_clear(void);
+
+// nextquestion hook memoisation ("with python memoise", py_memo.c)
+int py_memo_key(struct session *ses, enum actions action, int affected_answers_count, char *key_out, size_t len);
+char *py_memo_get(struct session *ses, const char *key);
+int py_memo_put(struct session *ses, const char *key, struct nextquestions *nq);
+void py_memo_clear(void);
+char *py_nextquestions_serialise(struct nextquestions *nq);
+int py_nextquestions_deserialise(struct session *ses, struct nextquestions *nq, enum actions action, char *body);
 
 int get_analysis_python(struct session *s, const char **output);
 int get_next_question_python(struct session *s, struct nextquestions *nq, enum actions action, int affected_answers_count);
+
+// out-of-process hooks (SS_PYTHON_WORKER_SOCKET, py_remote.c)
+int py_remote_enabled(void);
+int get_analysis_remote(struct session *s, const char **output);
+int get_next_question_remote(struct session *s, struct nextquestions *nq, enum actions action, int affected_answers_count);
 #endif
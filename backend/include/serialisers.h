@@ -14,6 +14,18 @@ int serialise_question(struct question *q, char *out, int max_len);
 int serialise_answer(struct answer *a, enum answer_scope scope, char *out, int max_len);
 int deserialise_question(char *in, struct question *q);
 int deserialise_answer(char *in, answer_scope scope, struct answer *a);
+int deserialise_question_inplace(char *in, struct question *q);
+int deserialise_answer_inplace(char *in, struct answer *a);
+int deserialise_parse_field_inplace(char **cursor, char **field);
+
+// binary session file format (v3), see docs/sessions.md
+#define SESSION_BINARY_MAGIC "\x89SSB"
+#define SESSION_BINARY_VERSION 3
+
+int serialise_session_header_binary(char *survey_id, int answer_count, char *out, size_t max_len);
+int deserialise_session_header_binary(char *in, size_t len, char **survey_id, int *answer_count);
+int serialise_answer_binary(struct answer *a, char *out, size_t max_len);
+int deserialise_answer_binary(char *in, size_t len, struct answer *a);
 
 int deserialise_int(char *field, int *s);
 int deserialise_string(char *field, char **s);
@@ -41,8 +53,9 @@ void free_string_list(struct string_list *list);
 
 // #461 deserialise a sequence of answers
 struct answer_list {
-  struct answer *answers[MAX_ANSWERS];
+  struct answer **answers;
   size_t len;
+  int capacity;
 };
 
 int dump_answer_list(FILE *fp, struct answer_list *list);
@@ -39,6 +39,17 @@ uint8_t *sha1_resultHmac(sha1nfo *s);
 
 int sha1_file(const char *filename, char *hash);
 
+/**
+ * name of the selected block compression implementation ("shani", "ssse3", "portable")
+ */
+const char *sha1_implementation(void);
+
+/**
+ * select a block compression implementation by name (NULL: fastest available)
+ * returns -1 if the implementation is unknown or not supported by the cpu
+ */
+int sha1_set_implementation(const char *name);
+
 /**
  * generates sha1 hash string
  * #268
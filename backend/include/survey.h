@@ -153,6 +153,15 @@ struct answer {
   long long stored;
 
 #define ANSWER_DELETED 1
+
+  /*
+   * In-memory only (not serialised)
+   */
+
+  // answer was changed since the session was loaded, see session journal in save_session()
+  int changed;
+  // string members point into the session file mapping (load_session()) and are not owned by the answer
+  int borrowed;
 };
 /* clang-format on */
 
@@ -174,6 +183,8 @@ typedef enum answer_scope {
 
 // question and answer limits
 // #363 introducing meta answers, decouple max values
+// arrays grow as required, these are the default soft limits which can be changed with the environment variables
+// SS_MAX_QUESTIONS, SS_MAX_ANSWERS and SS_MAX_NEXTQUESTIONS, see env_limit()
 #define MAX_QUESTIONS 8192
 #define MAX_ANSWERS 8192
 
@@ -186,8 +197,9 @@ struct nextquestions {
     //   progress[0]: number of given answers, excluding meta and system answers
     //   progress[1]: number of questions
     int progress[2];
-    struct question *next_questions[MAX_NEXTQUESTIONS];
+    struct question **next_questions;
     int question_count;
+    int question_capacity;
 };
 
 // #379 session live cycle
@@ -233,6 +245,45 @@ struct session_meta {
 
 void log_session_meta(struct session_meta *meta);
 
+// uid -> array position hash table for questions and answers
+// @see: uid_index.c
+typedef char *(*uid_index_key)(void *items, int index);
+struct uid_index {
+  int *slots;            // array position + 1, 0: empty slot
+  unsigned int *hashes;  // uid hash for each slot
+  int size;              // number of slots (power of 2)
+  int count;             // number of inserted array positions
+};
+
+// memoisation of nextquestion hook results, @see: py_memo.c
+enum py_memo_mode {
+  PY_MEMO_NONE,
+  PY_MEMO_PROCESS, // bounded LRU per process
+  PY_MEMO_DISK,    // LRU and SURVEY_HOME/memo, shared by processes
+};
+
+// parsed survey (form specification), shared between sessions
+// @see: survey_cache.c
+struct survey {
+  char *survey_id; // <survey name>/<hash>
+  char *description;
+  unsigned int nextquestions_flag;
+  int python_timeout; // ms, hook time budget ("with python timeout=<ms>"), 0: ENV SS_PYTHON_HOOK_TIMEOUT
+  int python_memoise; // enum py_memo_mode, memoise nextquestion hook results ("with python memoise[=disk]")
+
+  struct question **questions; // immutable while borrowed
+  int question_count;
+  int question_capacity;
+  struct uid_index question_index;
+  struct file_map *map;        // survey file mapping, question strings point into it
+
+  // cache management
+  unsigned long hash;      // hash of survey_id
+  unsigned long last_used; // cache clock on last survey_cache_get()
+  int refs;                // number of sessions borrowing this survey
+  int cached;              // survey is owned by the cache
+};
+
 struct session {
   char *survey_id; // <survey name>/<hash>
   char *survey_description;
@@ -249,16 +300,32 @@ struct session {
 #define NEXTQUESTIONS_FLAG_PYTHON 2
 
   // #363, update limit, offset for meta answers
-  struct question *questions[MAX_QUESTIONS];
+  // questions are borrowed from ses->survey and must not be freed or modified
+  struct question **questions;
   int question_count;
+  struct survey *survey;
 
-  struct answer *answers[MAX_ANSWERS];
+  struct answer **answers; // growable, see session_reserve_answers()
   int answer_offset;  // #363, add offset for header answers
   int answer_count;
+  int answer_capacity;
+  struct uid_index answer_index; // header and body answers, catches up with answer_count on lookup
   int given_answer_count; // #13 count given answers
 
   // #379 session state, set on loading, updated during session actions, saved to session file if changed
   enum session_state state;
+
+  // session has unsaved changes (answers, state, next questions), save_session() is a no-op otherwise
+  int dirty;
+
+  // number of records in the session journal file, see save_session()
+  int journal_records;
+
+  // identity of the loaded session file (SS_SESSION_OPTIMISTIC), save_session() publishes only if it is unchanged
+  char generation[64];
+
+  // session file mapping, borrowed answer strings point into it
+  struct file_map *map;
 };
 
 int generate_path(char *path_in, char *path_out, int max_len);
@@ -273,6 +340,50 @@ int mark_next_question(struct session *s, struct question *next_questions[], int
 
 struct nextquestions *get_next_questions(struct session *s, enum actions action, int affected_answers_count);
 int get_analysis(struct session *s, const char **output);
+int get_hook_id(struct session *s, char *out, size_t len);
+
+// asynchronous analysis jobs (analysis_queue.c)
+enum analysis_job_status {
+  ANALYSIS_JOB_NONE,
+  ANALYSIS_JOB_QUEUED,
+  ANALYSIS_JOB_RUNNING,
+  ANALYSIS_JOB_FAILED,
+};
+
+int analysis_queue_enabled(void);
+int analysis_job_submit(char *session_id);
+int analysis_job_status(char *session_id);
+int analysis_job_take_failure(char *session_id);
+int analysis_job_claim(char *session_id_out, size_t len);
+int analysis_job_finish(char *session_id, int error);
+int analysis_job_requeue_stale(void);
+
+// session lock manager (filelocks.c)
+enum lock_backend {
+  LOCK_BACKEND_FCNTL,
+  LOCK_BACKEND_SHM,
+};
+
+enum session_lock_mode {
+  SESSION_LOCK_SHARED,    // request does not change the session
+  SESSION_LOCK_EXCLUSIVE,
+};
+
+struct lock_stats {
+  int backend; // enum lock_backend
+  unsigned long acquisitions;
+  unsigned long shared;
+  unsigned long upgrades;
+  unsigned long waits; // acquisitions which had to wait for another holder
+  unsigned long timeouts;
+  unsigned long stale; // locks recovered from terminated holders
+  double wait_ms_total;
+  double wait_ms_max;
+};
+
+int lock_manager_init(void);
+int lock_wait_budget(void);
+void lock_manager_stats(struct lock_stats *out);
 
 // #239
 int create_session_id(char *session_id_out, int max_len);
@@ -281,12 +392,20 @@ struct session *load_session(char *session_id, int *error);
 int delete_session(char *session_id);
 int save_session(struct session *s);
 
+// session file formats, see docs/sessions.md
+enum session_format {
+  SESSION_FORMAT_TEXT,
+  SESSION_FORMAT_BINARY,
+};
+int convert_session(char *session_id, enum session_format format);
+
 int session_exists(char *session_id);
 int session_load_survey(struct session *ses);
 int session_add_answer(struct session *s, struct answer *a);
 int session_delete_answer(struct session *s, char *uid);
 
 void free_session(struct session *ses);
+void free_survey(struct survey *survey);
 void free_question(struct question *q);
 void free_answer(struct answer *a);
 
@@ -297,7 +416,13 @@ int answer_set_value_raw(struct answer *a, char *in); // #425
 
 int validate_session_action(enum actions action, struct session *ses, char *msg, size_t sz); // #379
 int session_add_datafile(char *session_id, char *filename_suffix, const char *data);
+int session_save_analysis(struct session *ses, const char *hook_id, const char *analysis);
+int session_get_cached_analysis(struct session *ses, const char *hook_id, struct file_map *map, size_t *offset);
+int session_optimistic(void);
 int lock_session(char *session_id);
+int lock_session_timeout(char *session_id, int timeout_ms);
+int lock_session_mode(char *session_id, int mode, int timeout_ms);
+int upgrade_session_lock(char *session_id, int timeout_ms, int *released);
 int release_my_session_locks(void);
 
 struct answer *session_get_answer(char *uid, struct session *ses);
@@ -318,6 +443,25 @@ int add_next_question(enum actions action, struct question *qn, struct nextquest
 int dump_next_questions(FILE *f, struct nextquestions *nq);
 int dump_session(FILE *f, struct session *ses);
 
+// survey cache
+struct survey *load_survey(char *survey_id, int *error);
+struct survey *survey_cache_get(char *survey_id, int *error);
+void survey_release(struct survey *survey);
+void survey_cache_clear(void);
+
+// survey snapshot registry
+struct stat;
+int create_survey_snapshot(char *survey_id, char *sha1, int sha1_len);
+int survey_snapshot_lookup(char *survey_id, struct stat *st, char *sha1, int sha1_len);
+int survey_snapshot_register(char *survey_id, struct stat *st, char *sha1);
+void survey_snapshot_cache_clear(void);
+int survey_snapshot_watch(void);
+
+// uid index
+int uid_index_insert(struct uid_index *idx, char *uid, int index, void *items, uid_index_key key);
+int uid_index_find(struct uid_index *idx, char *uid, void *items, uid_index_key key);
+void uid_index_free(struct uid_index *idx);
+
 // #363 session meta
 void free_session_meta(struct session_meta *meta);
 #endif
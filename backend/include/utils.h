@@ -1,6 +1,9 @@
 #ifndef __UTILS_H__
 #define __UTILS_H__
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <time.h>
 
 void freez(void *p);
@@ -8,4 +11,22 @@ void trim_crlf(char *line);
 struct tm *format_time_ISO8601(time_t t, char *buf, size_t len);
 
 char *parse_line(const char *body, char separator, char **saveptr); // #461
+
+// private, writable file mapping for tokenising files in place
+struct file_map {
+  char *data;     // file content, NUL terminated
+  size_t len;     // file size
+  size_t map_len; // size of the mapping (0: data was read into allocated memory)
+};
+
+int map_file(const char *path, struct file_map *map);
+int map_file_at(int dirfd, const char *path, struct file_map *map);
+FILE *fopen_at(int dirfd, const char *path, const char *mode);
+void unmap_file(struct file_map *map);
+char *map_next_line(struct file_map *map, char **saveptr);
+
+uint32_t crc32_checksum(const void *data, size_t len);
+
+void *array_reserve(void *items, int *capacity, int count, size_t item_size);
+int env_limit(const char *name, int default_value);
 #endif
@@ -6,15 +6,21 @@ Hook arguments supplied from backend:
 
 1) questions:
 
- - list of all defined question uids for this survey. The list is generated from a hashed copy of the main survey file, the hash is stored in the backend session file.
+ - tuple of all defined question uids for this survey. The tuple is generated from a hashed copy of the main survey file, the hash is stored in the backend session file.
  - The hashed copy definitions may differ from the main survey file.
+ - The tuple is created once per hashed copy and shared by all sessions of this survey.
 
-['question1', 'question2', 'question3' ]
+('question1', 'question2', 'question3')
 
 2) answers: a
 
- - list of dicts containing the already given answers for this session, including (since #449) some merged in matching question properties
+ - sequence of the already given answers for this session, including (since #449) some merged in matching question properties
  - internal system answers (generated by backend in run-time) are not included
+ - answers are read-only views of the backend session, fields are converted on access. They support the list and dict operations shown below
+   (len(), answers[-1], answers['question1'], 'question1' in answers, answer['uid'], answer.uid, answer.get(), dict(answer)).
+   Use answers.to_list() for a (json serialisable) list of dicts. The views are only valid during the hook call, keep copies instead.
+ - answer.question is a read-only mapping of the question properties below (the underscore prefixed keys), shared by all sessions of this survey
+ - ENV SS_PYTHON_HOOK_ARGS=dicts restores the previous behaviour of passing a list of question uids and a list of answer dicts
 
 [{
 
@@ -153,7 +159,7 @@ def analyse(questions, answers, **kwargs):
             'conditions': {
                 'condition': 'Facilisis volutpat',
                 'subcondition': 'Facilisis volutpat est velit egestas dui id ornare arcu.',
-                'mainText': answers,
+                'mainText': [dict(answer) for answer in answers],
                 'learnMore': questions,
                 'mainRecommendation': 'Sodales ut eu sem integer vitae justo eget magna fermentum.',
                 'mandatoryTips': 'Integer eget aliquet nibh praesent tristique magna sit amet.',
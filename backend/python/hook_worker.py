@@ -0,0 +1,341 @@
+#!/usr/bin/env python3
+"""
+Out-of-process worker pool for the nextquestion.py hooks (backend ENV SS_PYTHON_WORKER_SOCKET).
+
+The pool master binds a Unix domain socket and forks the workers, which share the listen socket. Workers which exit
+(crashing hooks, --max-requests) are restarted by the master. Each worker imports nextquestion.py once and serves
+several backend connections at a time (--max-connections); requests pipelined on a connection are answered in order.
+
+    SURVEY_PYTHONDIR=/path/to/hooks python3 hook_worker.py --socket /run/surveysystem/hooks.sock --workers 4
+
+See backend/src/py_remote.c for the wire format.
+"""
+
+import argparse
+import importlib
+import json
+import logging
+import os
+import selectors
+import signal
+import socket
+import struct
+import sys
+import time
+import traceback
+from types import MappingProxyType
+
+ANSWER_FIELDS = (
+    'uid', 'type', 'text', 'value', 'latitude', 'longitude', 'time_begin', 'time_end',
+    'time_zone_delta', 'dst_delta', 'unit', 'flags', 'stored',
+)
+QUESTION_FIELDS = ('_flags', '_default_value', '_min_value', '_max_value', '_choices', '_unit')
+QUESTION_DEFAULTS = MappingProxyType(dict.fromkeys(QUESTION_FIELDS))
+
+FRAME_HEADER = struct.Struct('>I')
+FRAME_MAX = 64 * 1024 * 1024
+SURVEY_CACHE_SIZE = 16
+RESPAWN_DELAY = 1  # seconds, throttles workers which fail right after start
+
+log = logging.getLogger('hook_worker')
+
+
+class Answer(dict):
+    """answer dict, also supports attribute access and answer.question like the in-process hook arguments"""
+
+    __slots__ = ('question',)
+
+    def __getattr__(self, name):
+        try:
+            return self[name]
+        except KeyError:
+            raise AttributeError(name)
+
+    def to_dict(self):
+        return dict(self)
+
+
+class Answers(list):
+    """list of Answer, also supports lookups by question uid"""
+
+    def __getitem__(self, key):
+        if isinstance(key, str):
+            for answer in self:
+                if answer['uid'] == key:
+                    return answer
+            raise KeyError(key)
+        return list.__getitem__(self, key)
+
+    def __contains__(self, key):
+        if isinstance(key, str):
+            return any(answer['uid'] == key for answer in self)
+        return list.__contains__(self, key)
+
+    def get(self, uid, default=None):
+        try:
+            return self[uid]
+        except KeyError:
+            return default
+
+    def uids(self):
+        return [answer['uid'] for answer in self]
+
+    def to_list(self):
+        return [dict(answer) for answer in self]
+
+
+class Worker:
+    """serves hook requests on the shared listen socket"""
+
+    def __init__(self, listener, max_connections, max_requests):
+        self.listener = listener
+        self.max_connections = max_connections
+        self.max_requests = max_requests
+        self.requests = 0
+        self.connections = {}
+        self.surveys = {}  # survey_id => (questions tuple, {uid: question mapping})
+        self.hooks = {}    # (base, survey_id) => function
+        self.selector = selectors.DefaultSelector()
+        self.accepting = False
+        self.module = importlib.import_module('nextquestion')
+
+    def run(self):
+        self.listener.setblocking(False)
+        self.accept(True)
+        while self.max_requests <= 0 or self.requests < self.max_requests:
+            for key, _ in self.selector.select():
+                if key.fileobj is self.listener:
+                    self.on_accept()
+                else:
+                    self.on_read(key.fileobj)
+        log.info('worker %d: served %d requests, exiting', os.getpid(), self.requests)
+
+    def accept(self, enable):
+        # per worker concurrency limit: stop accepting, other workers pick up new connections
+        if enable and not self.accepting:
+            self.selector.register(self.listener, selectors.EVENT_READ)
+        elif not enable and self.accepting:
+            self.selector.unregister(self.listener)
+        self.accepting = enable
+
+    def on_accept(self):
+        try:
+            conn, _ = self.listener.accept()
+        except (BlockingIOError, InterruptedError):
+            return
+        conn.setblocking(True)
+        self.connections[conn] = b''
+        self.selector.register(conn, selectors.EVENT_READ)
+        self.accept(len(self.connections) < self.max_connections)
+
+    def close(self, conn):
+        self.selector.unregister(conn)
+        del self.connections[conn]
+        conn.close()
+        self.accept(len(self.connections) < self.max_connections)
+
+    def on_read(self, conn):
+        try:
+            data = conn.recv(65536)
+        except OSError:
+            data = b''
+        if not data:
+            self.close(conn)
+            return
+
+        buffer = self.connections[conn] + data
+        replies = []
+        # process all complete (pipelined) frames in order
+        while len(buffer) >= FRAME_HEADER.size:
+            (length,) = FRAME_HEADER.unpack_from(buffer)
+            if length > FRAME_MAX:
+                log.error('worker %d: frame too large (%d bytes), closing connection', os.getpid(), length)
+                self.close(conn)
+                return
+            if len(buffer) < FRAME_HEADER.size + length:
+                break
+            frame = buffer[FRAME_HEADER.size:FRAME_HEADER.size + length]
+            buffer = buffer[FRAME_HEADER.size + length:]
+            reply = self.handle(frame).encode('utf-8')
+            replies.append(FRAME_HEADER.pack(len(reply)) + reply)
+            self.requests += 1
+
+        self.connections[conn] = buffer
+        try:
+            conn.sendall(b''.join(replies))
+        except OSError:
+            self.close(conn)
+
+    def handle(self, frame):
+        request_id = 0
+        try:
+            request = json.loads(frame)
+            request_id = int(request['id'])
+            survey = self.survey(request)
+            if survey is None:
+                return 'SURVEY %d\n' % request_id
+            questions, meta = survey
+            return 'OK %d\n%s' % (request_id, self.call(request, questions, meta))
+        except Exception as e:
+            log.error('worker %d: request %d failed\n%s', os.getpid(), request_id, traceback.format_exc())
+            return 'ERROR %d\n%s: %s' % (request_id, type(e).__name__, e)
+
+    def survey(self, request):
+        """question objects per survey snapshot, None if the backend needs to send the question definitions"""
+        survey_id = request['survey_id']
+        survey = self.surveys.get(survey_id)
+        if survey is not None:
+            return survey
+
+        rows = request.get('questions')
+        if rows is None:
+            return None
+
+        questions = tuple(sys.intern(row[0]) for row in rows)
+        meta = {row[0]: MappingProxyType(dict(zip(QUESTION_FIELDS, row[1:]))) for row in rows}
+        if len(self.surveys) >= SURVEY_CACHE_SIZE:
+            self.surveys.pop(next(iter(self.surveys)))
+        self.surveys[survey_id] = survey = (questions, meta)
+        return survey
+
+    def hook(self, base, survey_id):
+        """resolves <base>_<survey_id>_<hash>(), <base>_<survey_id>(), <base>() like py_get_hook_function()"""
+        func = self.hooks.get((base, survey_id))
+        if func is not None:
+            return func
+
+        names = (
+            '%s_%s' % (base, survey_id.replace('/', '_')),
+            '%s_%s' % (base, survey_id.split('/')[0]),
+            base,
+        )
+        for name in names:
+            func = getattr(self.module, name, None)
+            if func is not None:
+                break
+        if not callable(func):
+            raise LookupError("No matching python function for base '%s', survey '%s'" % (base, survey_id))
+
+        self.hooks[(base, survey_id)] = func
+        return func
+
+    def call(self, request, questions, meta):
+        answers = Answers()
+        for row in request['answers']:
+            answer = Answer(zip(ANSWER_FIELDS, row))
+            answer.question = meta.get(answer['uid'], QUESTION_DEFAULTS)
+            answer.update(answer.question)
+            answers.append(answer)
+
+        kwargs = {
+            'survey_id': request['survey_id'],
+            'session_id': request['session_id'],
+            'action': request['action'],
+            'affected_count': request['affected_count'],
+        }
+
+        if request['hook'] == 'analyse':
+            result = self.hook('analyse', request['survey_id'])(questions, answers, **kwargs)
+            if not isinstance(result, str):
+                raise TypeError('Return value from analyse hook is not a string.')
+            return result
+
+        if request['hook'] != 'nextquestion':
+            raise ValueError("unknown hook '%s'" % request['hook'])
+
+        result = self.hook('nextquestion', request['survey_id'])(questions, answers, **kwargs)
+        if not isinstance(result, dict):
+            raise TypeError('Reply from nextquestion hook is of invalid type (not a dict)')
+
+        progress = result['progress']
+        if len(progress) != 2:
+            raise ValueError('progress list length must be exact 2, %d given' % len(progress))
+        next_questions = [str(uid) for uid in result['next_questions']]
+        for uid in next_questions:
+            if not uid or '\n' in uid:
+                raise ValueError("invalid question uid '%s' in next_questions" % uid)
+
+        lines = ['%d' % int(result['status']), '%d %d' % (int(progress[0]), int(progress[1])), '%d' % len(next_questions)]
+        lines.extend(next_questions)
+        return '\n'.join(lines) + '\n' + str(result['message'])
+
+
+def spawn(listener, args):
+    pid = os.fork()
+    if pid:
+        return pid
+
+    signal.signal(signal.SIGTERM, signal.SIG_DFL)
+    signal.signal(signal.SIGINT, signal.SIG_DFL)
+    status = 0
+    try:
+        Worker(listener, args.max_connections, args.max_requests).run()
+    except Exception:
+        log.error('worker %d: %s', os.getpid(), traceback.format_exc())
+        status = 1
+    finally:
+        os._exit(status)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--socket', required=True, help='Unix domain socket path (backend ENV SS_PYTHON_WORKER_SOCKET)')
+    parser.add_argument('--workers', type=int, default=os.cpu_count() or 1, help='number of worker processes')
+    parser.add_argument('--max-connections', type=int, default=8, help='concurrent backend connections per worker')
+    parser.add_argument('--max-requests', type=int, default=0, help='restart a worker after n requests (0: never)')
+    args = parser.parse_args()
+
+    logging.basicConfig(level=logging.INFO, format='%(asctime)s %(name)s %(levelname)s %(message)s')
+
+    pythondir = os.environ.get('SURVEY_PYTHONDIR')
+    if not pythondir and os.environ.get('SURVEY_HOME'):
+        pythondir = os.path.join(os.environ['SURVEY_HOME'], 'python')
+    if pythondir:
+        sys.path.append(pythondir)
+
+    if os.path.exists(args.socket):
+        os.unlink(args.socket)
+    listener = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    listener.bind(args.socket)
+    listener.listen(128)
+
+    workers = {}
+    for _ in range(max(1, args.workers)):
+        workers[spawn(listener, args)] = time.monotonic()
+    log.info('started %d workers on %s', len(workers), args.socket)
+
+    stopping = []
+
+    def stop(signum, frame):
+        stopping.append(signum)
+        for pid in workers:
+            try:
+                os.kill(pid, signal.SIGTERM)
+            except ProcessLookupError:
+                pass
+
+    signal.signal(signal.SIGTERM, stop)
+    signal.signal(signal.SIGINT, stop)
+
+    # supervise: restart workers until stopped
+    while workers:
+        try:
+            pid, status = os.wait()
+        except ChildProcessError:
+            break
+        started = workers.pop(pid, None)
+        if started is None or stopping:
+            continue
+        log.info('worker %d exited with status %d, restarting', pid, status)
+        if time.monotonic() - started < RESPAWN_DELAY:
+            time.sleep(RESPAWN_DELAY)
+            if stopping:
+                continue
+        workers[spawn(listener, args)] = time.monotonic()
+
+    listener.close()
+    os.unlink(args.socket)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,297 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "errorlog.h"
+#include "survey.h"
+#include "utils.h"
+#include "validators.h"
+
+/**
+ * Asynchronous analysis jobs (ENV SS_ANALYSIS_ASYNC), an on-disk queue in SURVEY_HOME/analysis_queue
+ *
+ *  - <session_id>: queued job, created by GET /analysis
+ *  - running.<session_id>: claimed by a worker (surveycli analysis-worker), contains the worker pid
+ *  - failed.<session_id>: the analysis failed, contains the error code, reported by the next poll
+ *
+ * The result is the analysis cache of the session (session_save_analysis()), the job handle is the session id.
+ * State changes are atomic renames, any number of workers can share a queue.
+ */
+
+#define ANALYSIS_QUEUE_DIR "analysis_queue"
+#define ANALYSIS_CLAIM_GRACE 60 // seconds
+
+int analysis_queue_enabled(void) {
+  return env_limit("SS_ANALYSIS_ASYNC", 0) > 0;
+}
+
+/**
+ * build the path of a queue file (prefix: NULL, "running." or "failed.") or of the queue dir (session_id: NULL)
+ */
+static int analysis_queue_path(const char *prefix, char *session_id, char *path_out, int max_len) {
+  int retVal = 0;
+
+  do {
+    char path_in[1024];
+    if (!session_id) {
+      snprintf(path_in, 1024, "%s", ANALYSIS_QUEUE_DIR);
+    } else {
+      if (validate_session_id(session_id)) {
+        BREAK_CODEV(SS_INVALID_SESSION_ID, "session: '%s'", session_id);
+      }
+      snprintf(path_in, 1024, "%s/%s%s", ANALYSIS_QUEUE_DIR, (prefix) ? prefix : "", session_id);
+    }
+
+    if (generate_path(path_in, path_out, max_len)) {
+      BREAK_CODEV(SS_SYSTEM_FILE_PATH, "generate_path('%s') failed", path_in);
+    }
+  } while (0);
+
+  return retVal;
+}
+
+/**
+ * Queue an analysis job for a session, a job which is already queued or running is not duplicated
+ */
+int analysis_job_submit(char *session_id) {
+  int retVal = 0;
+
+  do {
+    char path[1024];
+    if (analysis_queue_path(NULL, NULL, path, 1024)) {
+      BREAK_CODE(SS_SYSTEM_FILE_PATH, "failed to build analysis queue path");
+    }
+    mkdir(path, 0750);
+
+    if (analysis_job_status(session_id) != ANALYSIS_JOB_NONE) {
+      break;
+    }
+
+    if (analysis_queue_path(NULL, session_id, path, 1024)) {
+      BREAK_CODEV(SS_SYSTEM_FILE_PATH, "failed to build analysis job path for session '%s'", session_id);
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0640);
+    if (fd < 0) {
+      if (errno == EEXIST) {
+        break;
+      }
+      BREAK_CODEV(SS_ERROR_OPEN_FILE, "Could not create analysis job '%s'", path);
+    }
+    close(fd);
+    LOG_INFOV("queued analysis job for session '%s'", session_id);
+  } while (0);
+
+  return retVal;
+}
+
+/**
+ * state of the analysis job of a session (enum analysis_job_status)
+ */
+int analysis_job_status(char *session_id) {
+  char path[1024];
+
+  if (!analysis_queue_path(NULL, session_id, path, 1024) && !access(path, F_OK)) {
+    return ANALYSIS_JOB_QUEUED;
+  }
+  if (!analysis_queue_path("running.", session_id, path, 1024) && !access(path, F_OK)) {
+    return ANALYSIS_JOB_RUNNING;
+  }
+  if (!analysis_queue_path("failed.", session_id, path, 1024) && !access(path, F_OK)) {
+    return ANALYSIS_JOB_FAILED;
+  }
+  return ANALYSIS_JOB_NONE;
+}
+
+/**
+ * Remove the failure marker of a session's analysis job, the next request queues a new job.
+ * returns the error code of the failed job
+ */
+int analysis_job_take_failure(char *session_id) {
+  int code = SS_SYSTEM_GET_ANALYSIS;
+  char path[1024];
+
+  if (analysis_queue_path("failed.", session_id, path, 1024)) {
+    return code;
+  }
+
+  FILE *fp = fopen(path, "r");
+  if (fp) {
+    if (fscanf(fp, "%d", &code) != 1 || code <= 0) {
+      code = SS_SYSTEM_GET_ANALYSIS;
+    }
+    fclose(fp);
+  }
+  unlink(path);
+
+  return code;
+}
+
+/**
+ * Claim the next queued job, writes the session id into session_id_out (empty string if the queue is empty)
+ */
+int analysis_job_claim(char *session_id_out, size_t len) {
+  int retVal = 0;
+  DIR *dir = NULL;
+
+  do {
+    BREAK_IF(session_id_out == NULL, SS_ERROR_ARG, "session_id_out");
+    session_id_out[0] = 0;
+
+    char path[1024];
+    if (analysis_queue_path(NULL, NULL, path, 1024)) {
+      BREAK_CODE(SS_SYSTEM_FILE_PATH, "failed to build analysis queue path");
+    }
+
+    dir = opendir(path);
+    if (!dir) {
+      if (errno == ENOENT) {
+        break;
+      }
+      BREAK_CODEV(SS_ERROR_OPEN_FILE, "Could not open analysis queue '%s'", path);
+    }
+
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+      // queued jobs only, skip running, failed and temp files
+      if (strlen(de->d_name) != 36 || validate_session_id(de->d_name)) {
+        continue;
+      }
+
+      char queued[1024];
+      char running[1024];
+      if (analysis_queue_path(NULL, de->d_name, queued, 1024) || analysis_queue_path("running.", de->d_name, running, 1024)) {
+        continue;
+      }
+
+      // another worker may claim the job first
+      if (rename(queued, running)) {
+        continue;
+      }
+
+      FILE *fp = fopen(running, "w");
+      if (fp) {
+        fprintf(fp, "%d\n", (int) getpid());
+        fclose(fp);
+      }
+
+      snprintf(session_id_out, len, "%s", de->d_name);
+      break;
+    }
+  } while (0);
+
+  if (dir) {
+    closedir(dir);
+  }
+
+  return retVal;
+}
+
+/**
+ * Complete a claimed job, a failure (error > 0) is recorded for the next poll
+ */
+int analysis_job_finish(char *session_id, int error) {
+  int retVal = 0;
+
+  do {
+    char path[1024];
+
+    if (error > 0) {
+      if (analysis_queue_path("failed.", session_id, path, 1024)) {
+        BREAK_CODEV(SS_SYSTEM_FILE_PATH, "failed to build analysis job path for session '%s'", session_id);
+      }
+      FILE *fp = fopen(path, "w");
+      if (!fp) {
+        BREAK_CODEV(SS_ERROR_OPEN_FILE, "Could not create analysis job failure '%s'", path);
+      }
+      fprintf(fp, "%d\n", error);
+      fclose(fp);
+    }
+
+    if (analysis_queue_path("running.", session_id, path, 1024)) {
+      BREAK_CODEV(SS_SYSTEM_FILE_PATH, "failed to build analysis job path for session '%s'", session_id);
+    }
+    if (unlink(path) && errno != ENOENT) {
+      BREAK_CODEV(SS_ERROR_OPEN_FILE, "Could not remove analysis job '%s'", path);
+    }
+  } while (0);
+
+  return retVal;
+}
+
+/**
+ * Queue running jobs again whose worker process no longer exists (crashed or killed workers).
+ * returns the number of jobs which have been queued again
+ */
+int analysis_job_requeue_stale(void) {
+  int count = 0;
+  DIR *dir = NULL;
+
+  do {
+    char path[1024];
+    if (analysis_queue_path(NULL, NULL, path, 1024)) {
+      break;
+    }
+
+    dir = opendir(path);
+    if (!dir) {
+      break;
+    }
+
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+      if (strncmp(de->d_name, "running.", 8) || strlen(de->d_name) != 8 + 36 || validate_session_id(de->d_name + 8)) {
+        continue;
+      }
+
+      char *session_id = de->d_name + 8;
+      char running[1024];
+      char queued[1024];
+      if (analysis_queue_path("running.", session_id, running, 1024) || analysis_queue_path(NULL, session_id, queued, 1024)) {
+        continue;
+      }
+
+      struct stat st;
+      if (stat(running, &st)) {
+        continue;
+      }
+
+      int pid = 0;
+      FILE *fp = fopen(running, "r");
+      if (fp) {
+        if (fscanf(fp, "%d", &pid) != 1) {
+          pid = 0;
+        }
+        fclose(fp);
+      }
+
+      if (pid > 0 && (!kill(pid, 0) || errno != ESRCH)) {
+        continue;
+      }
+
+      // a job which was claimed just now, the worker did not write its pid yet
+      if (pid <= 0 && time(NULL) - st.st_mtime < ANALYSIS_CLAIM_GRACE) {
+        continue;
+      }
+
+      if (!rename(running, queued)) {
+        LOG_INFOV("queued stale analysis job for session '%s' again (worker pid %d)", session_id, pid);
+        count++;
+      }
+    }
+  } while (0);
+
+  if (dir) {
+    closedir(dir);
+  }
+
+  return count;
+}
@@ -0,0 +1,197 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+#include "errorlog.h"
+
+/**
+ * Arena (bump) allocator
+ *
+ * Session, answer, next question and answer list structures of a request are allocated from a
+ * per-thread request arena while surveyfcgi handles a request. The arena is reset once the response
+ * has been sent, which releases everything in one step.
+ *
+ * An arena is a single reserved address range, pages are committed by the kernel on first use and kept
+ * across resets up to ARENA_KEEP bytes. Ownership of a pointer is therefore one range check.
+ *
+ * The free_*() functions release memory via request_free(), which ignores any pointer inside the request arena,
+ * also after the request has ended. Structures can mix arena allocations and memory allocated elsewhere
+ * (i.e. by a library or by calloc() once the arena is exhausted).
+ * Outside of a request (surveycli, tests) request_calloc() and friends behave like calloc(), strdup() and free().
+ */
+
+#define ARENA_RESERVE (64 * 1024 * 1024)
+#define ARENA_KEEP (256 * 1024)
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+
+/**
+ * reserve the address range of an arena, no memory is committed yet
+ */
+static int arena_reserve(struct arena *a) {
+  void *p = mmap(NULL, ARENA_RESERVE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) {
+    LOG_WARNV("arena: failed to reserve %d bytes", ARENA_RESERVE);
+    return -1;
+  }
+  a->base = p;
+  a->size = ARENA_RESERVE;
+  a->used = 0;
+  a->dirty = 0;
+  return 0;
+}
+
+/**
+ * allocate zeroed memory from the arena, returns NULL if the arena is exhausted
+ */
+void *arena_calloc(struct arena *a, size_t nmemb, size_t size) {
+  if (!a) {
+    return NULL;
+  }
+  if (size && nmemb > SIZE_MAX / size) {
+    return NULL;
+  }
+  if (!a->base && arena_reserve(a)) {
+    return NULL;
+  }
+
+  size_t len = ARENA_ROUND(nmemb * size);
+  if (!len) {
+    len = ARENA_ALIGN;
+  }
+  if (len > a->size - a->used) {
+    return NULL;
+  }
+
+  void *p = a->base + a->used;
+  a->used += len;
+  a->allocated += len;
+  if (a->used > a->dirty) {
+    a->dirty = a->used;
+  }
+
+  memset(p, 0, len);
+  return p;
+}
+
+char *arena_strdup(struct arena *a, const char *s) {
+  if (!s) {
+    return NULL;
+  }
+  size_t len = strlen(s) + 1;
+  char *d = arena_calloc(a, len, 1);
+  if (d) {
+    memcpy(d, s, len);
+  }
+  return d;
+}
+
+/**
+ * checks if a pointer lies within the address range of the arena, regardless of arena_reset()
+ */
+int arena_owns(struct arena *a, const void *p) {
+  if (!a || !a->base || !p) {
+    return 0;
+  }
+  return (const char *) p >= a->base && (const char *) p < a->base + a->size;
+}
+
+/**
+ * release all allocations, pages beyond ARENA_KEEP bytes are returned to the kernel
+ */
+void arena_reset(struct arena *a) {
+  if (!a) {
+    return;
+  }
+
+  if (a->dirty > ARENA_KEEP) {
+    madvise(a->base + ARENA_KEEP, a->dirty - ARENA_KEEP, MADV_DONTNEED);
+    a->dirty = ARENA_KEEP;
+  }
+
+  a->used = 0;
+  a->allocated = 0;
+  return;
+}
+
+void arena_free(struct arena *a) {
+  if (!a) {
+    return;
+  }
+
+  if (a->base) {
+    munmap(a->base, a->size);
+  }
+  a->base = NULL;
+  a->size = 0;
+  a->used = 0;
+  a->dirty = 0;
+  a->allocated = 0;
+  return;
+}
+
+/**
+ * request arena
+ */
+
+static THREAD_LOCAL struct arena request_arena;
+static THREAD_LOCAL int request_arena_active = 0;
+
+/**
+ * route request_calloc() and request_strdup() to the request arena
+ * Allocations left over from an interrupted request are released.
+ */
+void request_arena_begin(void) {
+  arena_reset(&request_arena);
+  request_arena_active = 1;
+  return;
+}
+
+/**
+ * release all allocations of the current request
+ */
+void request_arena_end(void) {
+  if (request_arena.allocated) {
+    LOG_INFOV("request arena: released %zu bytes", request_arena.allocated);
+  }
+  request_arena_active = 0;
+  arena_reset(&request_arena);
+  return;
+}
+
+void *request_calloc(size_t nmemb, size_t size) {
+  if (request_arena_active) {
+    void *p = arena_calloc(&request_arena, nmemb, size);
+    if (p) {
+      return p;
+    }
+    // exhausted, the free_*() functions release heap memory as usual
+  }
+  return calloc(nmemb, size);
+}
+
+char *request_strdup(const char *s) {
+  if (!s) {
+    return NULL;
+  }
+  size_t len = strlen(s) + 1;
+  char *d = request_calloc(len, 1);
+  if (d) {
+    memcpy(d, s, len);
+  }
+  return d;
+}
+
+/**
+ * free memory allocated with request_calloc() or the system allocator, request arena memory is ignored
+ */
+void request_free(void *p) {
+  if (!p || arena_owns(&request_arena, p)) {
+    return;
+  }
+  free(p);
+  return;
+}
@@ -5,11 +5,11 @@
 
 #include "errorlog.h"
 
-char error_messages[MAX_ERRORS][LOG_MSG_SHORT];
-int error_count = 0;
+THREAD_LOCAL char error_messages[MAX_ERRORS][LOG_MSG_SHORT];
+THREAD_LOCAL int error_count = 0;
 
 // migrated from code_instrumentation.c/code_instrumentation.h (removed)
-int instrumentation_muted = 0;
+THREAD_LOCAL int instrumentation_muted = 0;
 
 /**
  * get error string for given code
@@ -45,6 +45,7 @@ const char *get_error(int err, int section, char *nope) {
     case SS_MISMATCH_NEXTQUESTIONS:       return "[ERROR] missing answer for required question";
     case SS_NOSUCH_QUESTION:              return "[ERROR] no such question";
     case SS_INVALID_UUID:                 return "[ERROR] malformed uuid";
+    case SS_SESSION_CONFLICT:             return "[ERROR] session was changed by another request";
 
     case SS_SYSTEM:                       return "[ERROR] system";
     case SS_SYSTEM_FILE_PATH:             return "[ERROR] generating file path";
@@ -56,6 +57,8 @@ const char *get_error(int err, int section, char *nope) {
     case SS_SYSTEM_GET_NEXTQUESTIONS:     return "[ERROR] failed to get next questions";
     case SS_SYSTEM_GET_ANALYSIS:          return "[ERROR] failed to get next analysis";
     case SS_SYSTEM_SAVE_SESSION:          return "[ERROR] failed to save session";
+    case SS_SYSTEM_HOOK_TIMEOUT:          return "[ERROR] python hook exceeded its time budget";
+    case SS_SYSTEM_LOCK_SESSION_TIMEOUT:  return "[ERROR] timeout waiting for session lock";
 
     case SS_CONFIG:                       return "[ERROR] configuration error";
     case SS_CONFIG_PROXY:                 return "[ERROR] middleware configuration";
@@ -13,13 +13,16 @@
 #include "kcgi.h"
 #include "kcgijson.h"
 
+#include "arena.h"
 #include "errorlog.h"
+#include "paths.h"
 #include "question_types.h"
 #include "serialisers.h"
 #include "survey.h"
 #include "validators.h"
 #include "utils.h"
 #include "sha1.h"
+#include "py_module.h"
 
 #include "fcgi.h"
 
@@ -30,6 +33,7 @@ static const struct kvalid keys[KEY__MAX] = {
   { kvalid_stringne, "answer" },
   { kvalid_stringne, "if-match" },
   { kvalid_stringne, "extended" },
+  { kvalid_stringne, "metrics" },
 };
 
 typedef void (*disp)(struct kreq *);
@@ -65,6 +69,77 @@ static const char *const pages[PAGE__MAX] = {
     "status",
 };
 
+/**
+ * request loop of a kcgi FastCGI context, runs until the FastCGI server terminates
+ */
+static void fcgi_request_loop(struct kfcgi *fcgi) {
+  struct kreq req;
+  enum kcgi_err er;
+
+  // For each request
+  for (;;) {
+
+    // clear internal error log
+    clear_errors();
+
+    // parse request
+    fprintf(stderr, "Calling fcgi_parse()\n");
+    er = khttp_fcgi_parse(fcgi, &req);
+
+    fprintf(stderr, "Returned from fcgi_parse()\n");
+
+    if (KCGI_EXIT == er) {
+
+      LOG_WARNV("khttp_fcgi_parse: terminate, becausee er == KCGI_EXIT", 1);
+      fprintf(stderr, "khttp_fcgi_parse: terminate, becausee er == KCGI_EXIT");
+      break;
+
+    } else if (KCGI_OK != er) {
+
+      LOG_WARNV("khttp_fcgi_parse: error: %d\n", er);
+      fprintf(stderr, "khttp_fcgi_parse: error: %d\n", er);
+      break;
+
+    }
+
+    // session, answer and next question structures are allocated from the request arena
+    request_arena_begin();
+
+    // #437 add 404 page handler and request prevalidation
+    enum khttp valid = fcgi_sanitise_page_request(&req);
+    if (valid != KHTTP_200) {
+
+      er = http_open(&req, valid, req.mime, NULL);
+      if (KCGI_HUP == er) {
+        continue;
+      }
+
+    } else {
+
+      if (KMETHOD_OPTIONS == req.method) {
+
+          khttp_head(&req, kresps[KRESP_ALLOW], "OPTIONS HEAD GET POST");
+          er = http_open(&req, KHTTP_200, req.mime, NULL);
+          if (KCGI_HUP == er) {
+            continue;
+          }
+
+      } else {
+          // Call page dispatcher
+          (*disps[req.page])(&req);
+          // Make sure no sessions are locked when done.
+          release_my_session_locks();
+      }
+
+    }
+
+    // Close off request
+    khttp_free(&req);
+    request_arena_end();
+  } // end for
+  return;
+}
+
 void usage(void) {
   fprintf(stderr, "usage: surveyfcgi -- Start fast CGI service\n");
 };
@@ -87,10 +162,35 @@ int main(int argc, char **argv) {
       break;
     }
 
-    struct kreq req;
-    struct kfcgi *fcgi = NULL;
-    enum kcgi_err er;
+    // optional: snapshot updated surveys in the background, see survey_snapshots.c
+    char *snapshot_watch = getenv("SS_SNAPSHOT_WATCH");
+    if (snapshot_watch && atoi(snapshot_watch) > 0) {
+      survey_snapshot_watch();
+    }
+
+    // session locks, the shared lock table (SS_LOCK_BACKEND=shm) must exist before workers are forked
+    if (lock_manager_init()) {
+      BREAK_ERROR("Failed to initialise session lock manager");
+    }
+
+    // directory descriptors of SURVEY_HOME, inherited by pool workers, see paths.c
+    paths_init();
+
+    // optional: pre-forked workers with warm python and survey caches, see fcgi_pool.c
+    // a process serves one request at a time (one kcgi context), concurrency comes from the pool
+    char *pool_workers = getenv("SS_FCGI_WORKERS");
+    if (pool_workers && atoi(pool_workers) > 1) {
+      int role = fcgi_pool_start(atoi(pool_workers));
+      if (role < 0) {
+        BREAK_ERROR("Failed to start worker pool");
+      }
+      if (role > 0) {
+        // master: the pool has been shut down
+        break;
+      }
+    }
 
+    struct kfcgi *fcgi = NULL;
     if (KCGI_OK != khttp_fcgi_init(&fcgi, keys,
       KEY__MAX, // CGI variable parse definitions
       pages, PAGE__MAX, // Pages for parsing
@@ -102,63 +202,7 @@ int main(int argc, char **argv) {
       BREAK_ERROR("fcgi==NULL after call to khttp_fcgi_init()");
     }
 
-    // For each request
-    for (;;) {
-
-      // clear internal error log
-      clear_errors();
-
-      // parse request
-      fprintf(stderr, "Calling fcgi_parse()\n");
-      er = khttp_fcgi_parse(fcgi, &req);
-
-      fprintf(stderr, "Returned from fcgi_parse()\n");
-
-      if (KCGI_EXIT == er) {
-
-        LOG_WARNV("khttp_fcgi_parse: terminate, becausee er == KCGI_EXIT", 1);
-        fprintf(stderr, "khttp_fcgi_parse: terminate, becausee er == KCGI_EXIT");
-        break;
-
-      } else if (KCGI_OK != er) {
-
-        LOG_WARNV("khttp_fcgi_parse: error: %d\n", er);
-        fprintf(stderr, "khttp_fcgi_parse: error: %d\n", er);
-        break;
-
-      }
-
-      // #437 add 404 page handler and request prevalidation
-      enum khttp valid = fcgi_sanitise_page_request(&req);
-      if (valid != KHTTP_200) {
-
-        er = http_open(&req, valid, req.mime, NULL);
-        if (KCGI_HUP == er) {
-          continue;
-        }
-
-      } else {
-
-        if (KMETHOD_OPTIONS == req.method) {
-
-            khttp_head(&req, kresps[KRESP_ALLOW], "OPTIONS HEAD GET POST");
-            er = http_open(&req, KHTTP_200, req.mime, NULL);
-            if (KCGI_HUP == er) {
-              continue;
-            }
-
-        } else {
-            // Call page dispatcher
-            (*disps[req.page])(&req);
-            // Make sure no sessions are locked when done.
-            release_my_session_locks();
-        }
-
-      }
-
-      // Close off request
-      khttp_free(&req);
-    } // end for
+    fcgi_request_loop(fcgi);
 
     CHECKPOINT();
     khttp_fcgi_free(fcgi);
@@ -542,7 +586,7 @@ static void fcgi_page_questions(struct kreq *req) {
 
     nq = get_next_questions(ses, action, 0);
     if (!nq) {
-      BREAK_CODE(SS_SYSTEM_GET_NEXTQUESTIONS, "failed to get next questions'");
+      BREAK_CODE((py_hook_timed_out()) ? SS_SYSTEM_HOOK_TIMEOUT : SS_SYSTEM_GET_NEXTQUESTIONS, "failed to get next questions'");
     }
 
     // #494  HEAD request: do not create and exit
@@ -664,7 +708,7 @@ static void fcgi_page_answers(struct kreq *req) {
 
     nq = get_next_questions(ses, action, affected_count);
     if (!nq) {
-      BREAK_CODE(SS_SYSTEM_GET_NEXTQUESTIONS, "failed to get next questions'");
+      BREAK_CODE((py_hook_timed_out()) ? SS_SYSTEM_HOOK_TIMEOUT : SS_SYSTEM_GET_NEXTQUESTIONS, "failed to get next questions'");
     }
 
     // #494  HEAD request: do not create and exit
@@ -718,6 +762,8 @@ static void fcgi_page_analysis(struct kreq *req) {
 
   struct session *ses = NULL;
   const char *analysis = NULL;
+  struct file_map cached = { NULL, 0, 0 };
+  char hook_id[1024];
 
   enum actions action;
   int res;
@@ -751,13 +797,92 @@ static void fcgi_page_analysis(struct kreq *req) {
       BREAK_CODE(res, "failed to load session");
     }
 
+    // serve the cached analysis if the session did not change since it was computed
+
+    if (get_hook_id(ses, hook_id, 1024)) {
+      BREAK_CODE(SS_SYSTEM_GET_ANALYSIS, "get_hook_id() failed");
+    }
+
+    size_t offset = 0;
+    res = session_get_cached_analysis(ses, hook_id, &cached, &offset);
+    if (res) {
+      // do not break on error here, recompute the analysis
+      LOG_CODE(res, "Could not read analysis cache for session.");
+    }
+
+    if (cached.data) {
+      if (fcgi_request_etag_matches(req, ses->consistency_hash)) {
+        if (http_open(req, KHTTP_304, KMIME_APP_JSON, ses->consistency_hash)) {
+          BREAK_ERROR("http_open(): unable to initialise http response");
+        }
+        LOG_INFO("Leaving page handler (analysis not modified)");
+        break;
+      }
+
+      if (http_open(req, KHTTP_200, KMIME_APP_JSON, ses->consistency_hash)) {
+        BREAK_ERROR("http_open(): unable to initialise http response");
+      }
+
+      er = khttp_write(req, cached.data + offset, cached.len - offset);
+      if (er != KCGI_OK) {
+        BREAK_ERROR("khttp_write() failed");
+      }
+
+      LOG_INFO("Leaving page handler (cached analysis)");
+      break;
+    }
+
+    // asynchronous mode: queue the analysis for a worker (surveycli analysis-worker), clients poll until it is cached
+
+    if (analysis_queue_enabled()) {
+      int status = analysis_job_status(ses->session_id);
+      if (status == ANALYSIS_JOB_FAILED) {
+        // report once, the next request queues a new job
+        BREAK_CODE(analysis_job_take_failure(ses->session_id), "analysis job failed");
+      }
+
+      if (status == ANALYSIS_JOB_NONE) {
+        res = analysis_job_submit(ses->session_id);
+        if (res) {
+          BREAK_CODE(res, "analysis_job_submit() failed");
+        }
+        status = ANALYSIS_JOB_QUEUED;
+      }
+
+      if (fcgi_response_analysis_job(req, ses, status)) {
+        BREAK_ERROR("fcgi_response_analysis_job() failed");
+      }
+
+      LOG_INFO("Leaving page handler (analysis job)");
+      break;
+    }
+
+    // get_analysis() closes and saves the session: upgrade to an exclusive lock, reload the session if the shared
+    // lock had to be released. Optimistic mode: no lock, the save fails if the session changed meanwhile
+
+    int released = 0;
+    if (!session_optimistic()) {
+      res = upgrade_session_lock(ses->session_id, lock_wait_budget(), &released);
+      if (res) {
+        BREAK_CODE(res, "upgrade_session_lock() failed");
+      }
+    }
+
+    if (released) {
+      free_session(ses);
+      ses = fcgi_request_load_and_verify_session(req, action, &res);
+      if (!ses) {
+        BREAK_CODE(res, "failed to reload session");
+      }
+    }
+
     // get analysis
 
     // string is allocated into heap to since we have no control over the lifetime of the Python string.
     //    You need to free it
     res = get_analysis(ses, &analysis);
     if (res) {
-      BREAK_CODE(SS_SYSTEM_GET_ANALYSIS, "get_analysis() failed");
+      BREAK_CODE((py_hook_timed_out()) ? SS_SYSTEM_HOOK_TIMEOUT : (res == SS_SESSION_CONFLICT) ? res : SS_SYSTEM_GET_ANALYSIS, "get_analysis() failed");
     }
 
     if (!analysis) {
@@ -768,7 +893,7 @@ static void fcgi_page_analysis(struct kreq *req) {
       BREAK_CODE(SS_SYSTEM_GET_ANALYSIS, "get_analysis() failed (empty)");
     }
 
-    // save analysis
+    // save analysis, get_analysis() closed the session: the cache key is the updated consistency hash
     char fname[256];
     snprintf(fname, 256, "%s.analysis.json", ses->session_id);
     res = session_add_datafile(ses->session_id, fname, analysis);
@@ -777,6 +902,11 @@ static void fcgi_page_analysis(struct kreq *req) {
       LOG_CODE(res, "Could not add analysis.json for session.");
     }
 
+    res = session_save_analysis(ses, hook_id, analysis);
+    if (res) {
+      LOG_CODE(res, "Could not cache analysis for session.");
+    }
+
     // response
 
     if (http_open(req, KHTTP_200, KMIME_APP_JSON, ses->consistency_hash)) {
@@ -794,6 +924,7 @@ static void fcgi_page_analysis(struct kreq *req) {
   // destruct
   free_session(ses);
   freez((char *)analysis);
+  unmap_file(&cached);
 
   if (retVal) {
     fcgi_error_response(req, retVal);
@@ -895,6 +1026,15 @@ static void fcgi_page_check(struct kreq *req) {
       extended = fcgi_request_get_field_value(KEY_CHECK_EXTENDED, req); // check only pure existence, value doesn't matter
     }
 
+    // python hook latency statistics of this process
+    if (req->method != KMETHOD_HEAD && fcgi_request_get_field_value(KEY_CHECK_METRICS, req)) {
+      if (fcgi_response_metrics(req)) {
+        BREAK_ERROR("fcgi_response_metrics() failed");
+      }
+      LOG_INFO("Leaving page handler.");
+      break;
+    }
+
     if (!extended) {
       if (http_open(req, KHTTP_200, KMIME_TEXT_PLAIN, NULL)) {
         BREAK_ERROR("http_open(): unable to initialise http response");
@@ -0,0 +1,254 @@
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include "errorlog.h"
+#include "sha1.h"
+#include "survey.h"
+#include "utils.h"
+#include "validators.h"
+#include "py_module.h"
+
+#include "fcgi.h"
+
+/**
+ * Pre-forked worker pool (surveyfcgi, SS_FCGI_WORKERS)
+ *
+ * The master process warms up what a worker would otherwise initialise on its first request: python (including
+ * "import nextquestion"), the snapshots of all surveys and the parsed survey cache. Python objects created so far
+ * are moved into the permanent gc generation (gc.freeze()), so garbage collection in the workers does not touch
+ * (and copy) the inherited pages.
+ * The master then forks the workers, which inherit this state copy-on-write and each run their own
+ * khttp_fcgi_parse() loop on the shared FastCGI listen socket. The master only supervises: workers which exit are
+ * respawned, SIGTERM, SIGINT and SIGHUP are forwarded to all workers.
+ */
+
+#define FCGI_POOL_MAX_WORKERS 256
+#define FCGI_POOL_RESPAWN_DELAY 1 // seconds, throttles workers which fail right after start
+
+struct fcgi_pool_worker {
+  pid_t pid;
+  time_t started;
+};
+
+static volatile sig_atomic_t fcgi_pool_stop = 0;
+
+static void fcgi_pool_signal(int sig) {
+  fcgi_pool_stop = sig;
+}
+
+/**
+ * snapshot all surveys and load the snapshots into the survey cache
+ * returns the number of cached surveys
+ */
+static int fcgi_pool_warmup_surveys(void) {
+  char path[1024];
+  char sha1[HASHSTRING_LENGTH + 1];
+  char survey_id[1024];
+  int count = 0;
+
+  if (generate_path("surveys", path, 1024)) {
+    return 0;
+  }
+
+  DIR *dir = opendir(path);
+  if (!dir) {
+    LOG_INFOV("worker pool: cannot open '%s': %s", path, strerror(errno));
+    return 0;
+  }
+
+  struct dirent *de;
+  while ((de = readdir(dir))) {
+    if (de->d_name[0] == '.' || validate_survey_id(de->d_name)) {
+      continue;
+    }
+    if (create_survey_snapshot(de->d_name, sha1, HASHSTRING_LENGTH + 1)) {
+      LOG_INFOV("worker pool: failed to snapshot survey '%s'", de->d_name);
+      continue;
+    }
+
+    int res;
+    snprintf(survey_id, 1024, "%s/%s", de->d_name, sha1);
+    struct survey *survey = survey_cache_get(survey_id, &res);
+    if (!survey) {
+      LOG_INFOV("worker pool: failed to load survey '%s'", survey_id);
+      continue;
+    }
+    survey_release(survey);
+    count++;
+  }
+  closedir(dir);
+
+  return count;
+}
+
+/**
+ * warm up the master process before forking, failures are not fatal: workers initialise lazily as usual
+ */
+static void fcgi_pool_warmup(void) {
+  int surveys = fcgi_pool_warmup_surveys();
+
+  if (py_remote_enabled()) {
+    LOG_INFO("worker pool: python hooks run in the worker pool at SS_PYTHON_WORKER_SOCKET");
+  } else if (py_init()) {
+    LOG_INFO("worker pool: python warm up failed, workers initialise python on demand");
+  } else if (py_gc_freeze()) {
+    LOG_INFO("worker pool: gc.freeze() failed");
+  }
+
+  LOG_INFOV("worker pool: warmed up %d surveys", surveys);
+  clear_errors();
+  return;
+}
+
+/**
+ * fork a worker
+ * returns the pid in the master, 0 in the worker and -1 on error
+ */
+static pid_t fcgi_pool_fork(struct fcgi_pool_worker *worker) {
+  pid_t master = getpid();
+
+  py_fork_prepare();
+  pid_t pid = fork();
+
+  if (pid < 0) {
+    py_fork_parent();
+    LOG_INFOV("worker pool: fork() failed: %s", strerror(errno));
+    return -1;
+  }
+
+  if (pid > 0) {
+    py_fork_parent();
+    worker->pid = pid;
+    worker->started = time(NULL);
+    return pid;
+  }
+
+  py_fork_child();
+
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGHUP, SIG_DFL);
+
+#ifdef __linux__
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+  if (getppid() != master) {
+    _exit(0);
+  }
+
+  clear_errors();
+  return 0;
+}
+
+/**
+ * Start the worker pool: warms up the master and forks the workers, the master then supervises the workers
+ * until it receives SIGTERM, SIGINT or SIGHUP.
+ * returns 0 in a worker, which continues with the request loop, 1 in the master after the pool was shut down
+ * and -1 on error
+ */
+int fcgi_pool_start(int count) {
+  int retVal = 0;
+
+  struct fcgi_pool_worker *workers = NULL;
+
+  do {
+    if (count < 1 || count > FCGI_POOL_MAX_WORKERS) {
+      BREAK_ERRORV("worker pool: invalid number of workers %d (1 - %d)", count, FCGI_POOL_MAX_WORKERS);
+    }
+
+    workers = calloc(count, sizeof(struct fcgi_pool_worker));
+    if (!workers) {
+      BREAK_ERROR("worker pool: calloc() failed");
+    }
+
+    fcgi_pool_warmup();
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = fcgi_pool_signal;
+    sigemptyset(&sa.sa_mask);
+    // no SA_RESTART: waitpid() returns on signals
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+
+    for (int i = 0; i < count; i++) {
+      pid_t pid = fcgi_pool_fork(&workers[i]);
+      if (pid == 0) {
+        free(workers);
+        return 0;
+      }
+    }
+
+    LOG_INFOV("worker pool: started %d workers", count);
+
+    // supervise
+    while (!fcgi_pool_stop) {
+      int status;
+      pid_t pid = waitpid(-1, &status, 0);
+
+      if (pid < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        // no children, respawn failed workers below
+        sleep(FCGI_POOL_RESPAWN_DELAY);
+      }
+
+      for (int i = 0; i < count; i++) {
+        if (pid > 0 && workers[i].pid == pid) {
+          if (WIFSIGNALED(status)) {
+            LOG_INFOV("worker pool: worker %d (pid %d) terminated by signal %d", i, pid, WTERMSIG(status));
+          } else {
+            LOG_INFOV("worker pool: worker %d (pid %d) exited with status %d", i, pid, WEXITSTATUS(status));
+          }
+          workers[i].pid = 0;
+        }
+
+        if (workers[i].pid || fcgi_pool_stop) {
+          continue;
+        }
+
+        if (time(NULL) - workers[i].started < FCGI_POOL_RESPAWN_DELAY) {
+          sleep(FCGI_POOL_RESPAWN_DELAY);
+        }
+
+        if (fcgi_pool_fork(&workers[i]) == 0) {
+          free(workers);
+          return 0;
+        }
+      }
+      clear_errors();
+    }
+
+    LOG_INFOV("worker pool: received signal %d, stopping workers", (int) fcgi_pool_stop);
+
+    for (int i = 0; i < count; i++) {
+      if (workers[i].pid > 0) {
+        kill(workers[i].pid, SIGTERM);
+      }
+    }
+    for (int i = 0; i < count; i++) {
+      if (workers[i].pid > 0) {
+        waitpid(workers[i].pid, NULL, 0);
+      }
+    }
+
+    retVal = 1;
+  } while (0);
+
+  free(workers);
+  return retVal;
+}
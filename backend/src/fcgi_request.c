@@ -9,7 +9,9 @@
 #include "fcgi.h"
 #include "serialisers.h"
 #include "validators.h"
+#include "arena.h"
 #include "errorlog.h"
+#include "utils.h"
 
 /**
  * Fetch the field value (param) for a given key from kreq.fieldmap or
@@ -67,6 +69,43 @@ char *fcgi_request_get_consistency_hash(struct kreq *req) {
 }
 
 
+/**
+ * checks if an 'If-None-Match' request header matches an etag (RFC 7232 weak comparison: "*", a comma separated
+ * list of quoted or unquoted, optionally weak (W/) tags)
+ */
+int fcgi_request_etag_matches(struct kreq *req, const char *etag) {
+  struct khead *header = req->reqmap[KREQU_IF_NONE_MATCH];
+  if (!header || !header->val || !etag || !etag[0]) {
+    return 0;
+  }
+
+  size_t len = strlen(etag);
+  const char *p = header->val;
+  while (*p) {
+    while (*p == ' ' || *p == '\t' || *p == ',') {
+      p++;
+    }
+    if (*p == '*') {
+      return 1;
+    }
+    if (!strncmp(p, "W/", 2)) {
+      p += 2;
+    }
+    int quoted = (*p == '"');
+    if (quoted) {
+      p++;
+    }
+    if (!strncmp(p, etag, len) && (quoted ? p[len] == '"' : (!p[len] || p[len] == ',' || p[len] == ' '))) {
+      return 1;
+    }
+    while (*p && *p != ',') {
+      p++;
+    }
+  }
+
+  return 0;
+}
+
 /**
  * parse and validate a list of deserialised answers from an incoming kreq (#260)
  *  - validate answers against list of uids and session questions
@@ -143,9 +182,12 @@ struct answer_list *fcgi_request_parse_answers_values(struct kreq *req, struct s
     uids = deserialise_string_list(ses->next_questions, ',');
     BREAK_IF(uids == NULL, SS_ERROR_MEM,  NULL);
 
-    list = calloc(1, sizeof(struct answer_list));
+    list = request_calloc(1, sizeof(struct answer_list));
     BREAK_IF(list == NULL, SS_ERROR_MEM, "struct answer list");
 
+    list->answers = array_reserve(NULL, &list->capacity, uids->len, sizeof(struct answer *));
+    BREAK_IF(list->answers == NULL, SS_ERROR_MEM, "answer list");
+
     char *value;
     struct question *qn;
 
@@ -157,15 +199,15 @@ struct answer_list *fcgi_request_parse_answers_values(struct kreq *req, struct s
       }
 
       // init answer
-      list->answers[i] = calloc(sizeof(struct answer), 1);
-      BREAK_IF(list == NULL, SS_ERROR_MEM, "struct answer");
+      list->answers[i] = request_calloc(sizeof(struct answer), 1);
+      BREAK_IF(list->answers[i] == NULL, SS_ERROR_MEM, "struct answer");
 
       // build answer
       qn = session_get_question(uids->items[i], ses);
       if (!qn) {
         BREAK_CODEV(SS_NOSUCH_QUESTION, "Could  answer '%s' does not exist in session (session corrupted?)", uids->items[i]);
       }
-      list->answers[i]->uid = strdup(qn->uid);
+      list->answers[i]->uid = request_strdup(qn->uid);
       list->answers[i]->type = qn->type;
 
       // set answer value
@@ -448,6 +490,20 @@ struct answer *fcgi_request_load_answer(struct kreq *req) {
   return ans;
 }
 
+/**
+ * session lock mode (enum session_lock_mode) of a request: HEAD requests and GET /analysis do not change the session
+ * and run concurrently, GET /analysis upgrades its lock if it has to compute the analysis
+ */
+int fcgi_request_lock_mode(struct kreq *req, enum actions action) {
+  if (req->method == KMETHOD_HEAD) {
+    return SESSION_LOCK_SHARED;
+  }
+  if (action == ACTION_SESSION_ANALYSIS && req->method == KMETHOD_GET) {
+    return SESSION_LOCK_SHARED;
+  }
+  return SESSION_LOCK_EXCLUSIVE;
+}
+
 /**
  * Fetch and desrialise the kreq 'sessionid' param to a session struct.
  * - param has to be validate beforehand
@@ -470,8 +526,12 @@ struct session *fcgi_request_load_and_verify_session(struct kreq *req, enum acti
     }
 
     // joerg: break if session could not be updated
-    if (lock_session(session_id)) {
-      BREAK_CODEV(SS_SYSTEM_LOCK_SESSION, "session: '%s'", session_id);
+    // optimistic mode: no lock, save_session() verifies that the session was not changed meanwhile
+    if (!session_optimistic()) {
+      res = lock_session_mode(session_id, fcgi_request_lock_mode(req, action), lock_wait_budget());
+      if (res) {
+        BREAK_CODEV(res, "session: '%s'", session_id);
+      }
     }
 
     // TODO verify path before loading, separate errors
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "kcgi.h"
 #include "kcgijson.h"
@@ -10,6 +11,8 @@
 #include "survey.h"
 #include "fcgi.h"
 #include "errorlog.h"
+#include "utils.h"
+#include "py_module.h"
 
 enum khttp fcgi_status(int code, int is_section) {
     switch (code) {
@@ -24,8 +27,11 @@ enum khttp fcgi_status(int code, int is_section) {
       case SS_INVALID_CREDENTIALS:       return KHTTP_401;
       case SS_INVALID_CREDENTIALS_PROXY: return KHTTP_407;
       case SS_INVALID_CONSISTENCY_HASH:  return KHTTP_412;
+      case SS_SESSION_CONFLICT:          return KHTTP_412;
       case SS_NOSUCH_SESSION:            return KHTTP_400;
       case SS_CONFIG_PROXY:              return KHTTP_502;
+      case SS_SYSTEM_HOOK_TIMEOUT:       return KHTTP_503;
+      case SS_SYSTEM_LOCK_SESSION_TIMEOUT: return KHTTP_503;
 
       default:
         return (!is_section) ? KHTTP__MAX : KHTTP_500;
@@ -53,6 +59,11 @@ int fcgi_error_response(struct kreq *req, int code) {
     }
     const char *message = get_error(code, is_section, "[ERROR] unkown");
 
+    // temporary failure (i.e. python hook time budget, session lock wait budget), clients may retry
+    if (status == KHTTP_503) {
+      khttp_head(req, kresps[KRESP_RETRY_AFTER], "%d", env_limit("SS_RETRY_AFTER", FCGI_RETRY_AFTER));
+    }
+
     // open request
     if(http_open(req, status, KMIME_APP_JSON, NULL)) {
       BREAK_ERROR("http_json_error(): unable to initialise http response");
@@ -291,3 +302,98 @@ int fcgi_response_nextquestion(struct kreq *req, struct session *ses, struct nex
 
   return retVal;
 }
+
+/**
+ * Write the python hook statistics of this process (/status?metrics), see py_stats.c
+ */
+int fcgi_response_metrics(struct kreq *req) {
+  int retVal = 0;
+
+  struct py_hook_stats *stats = NULL;
+
+  do {
+    stats = calloc(FCGI_METRICS_MAX_HOOKS, sizeof(struct py_hook_stats));
+    if (!stats) {
+      BREAK_ERROR("calloc(struct py_hook_stats) failed");
+    }
+    int count = py_stats_get(stats, FCGI_METRICS_MAX_HOOKS);
+
+    if (http_open(req, KHTTP_200, KMIME_APP_JSON, NULL)) {
+      BREAK_ERROR("response_metrics(): unable to initialise http response");
+    }
+
+    struct kjsonreq resp;
+    kjson_open(&resp, req);
+    kcgi_writer_disable(req);
+    kjson_obj_open(&resp);
+
+    kjson_putintp(&resp, "pid", (int64_t) getpid());
+
+    kjson_arrayp_open(&resp, "hooks");
+    for (int i = 0; i < count; i++) {
+      kjson_obj_open(&resp);
+      kjson_putstringp(&resp, "function", stats[i].function_name);
+      kjson_putintp(&resp, "count", (int64_t) stats[i].count);
+      kjson_putintp(&resp, "errors", (int64_t) stats[i].errors);
+      kjson_putintp(&resp, "timeouts", (int64_t) stats[i].timeouts);
+      kjson_putdoublep(&resp, "mean_ms", stats[i].mean_ms);
+      kjson_putdoublep(&resp, "p50_ms", stats[i].p50_ms);
+      kjson_putdoublep(&resp, "p95_ms", stats[i].p95_ms);
+      kjson_putdoublep(&resp, "p99_ms", stats[i].p99_ms);
+      kjson_putdoublep(&resp, "max_ms", stats[i].max_ms);
+      kjson_obj_close(&resp);
+    }
+    kjson_array_close(&resp);
+
+    struct lock_stats locks;
+    lock_manager_stats(&locks);
+    kjson_objp_open(&resp, "locks");
+    kjson_putstringp(&resp, "backend", (locks.backend == LOCK_BACKEND_SHM) ? "shm" : "fcntl");
+    kjson_putintp(&resp, "acquisitions", (int64_t) locks.acquisitions);
+    kjson_putintp(&resp, "shared", (int64_t) locks.shared);
+    kjson_putintp(&resp, "upgrades", (int64_t) locks.upgrades);
+    kjson_putintp(&resp, "waits", (int64_t) locks.waits);
+    kjson_putintp(&resp, "timeouts", (int64_t) locks.timeouts);
+    kjson_putintp(&resp, "stale", (int64_t) locks.stale);
+    kjson_putdoublep(&resp, "wait_ms_total", locks.wait_ms_total);
+    kjson_putdoublep(&resp, "wait_ms_max", locks.wait_ms_max);
+    kjson_obj_close(&resp);
+
+    kjson_obj_close(&resp);
+    kjson_close(&resp);
+  } while(0);
+
+  free(stats);
+  return retVal;
+}
+
+/**
+ * 202 response for a queued analysis job (SS_ANALYSIS_ASYNC), clients poll the same url
+ */
+int fcgi_response_analysis_job(struct kreq *req, struct session *ses, int status) {
+  int retVal = 0;
+
+  do {
+    BREAK_IF(req == NULL, SS_ERROR_ARG, "req");
+    BREAK_IF(ses == NULL, SS_ERROR_ARG, "ses");
+
+    khttp_head(req, kresps[KRESP_RETRY_AFTER], "%d", env_limit("SS_ANALYSIS_RETRY_AFTER", FCGI_ANALYSIS_RETRY_AFTER));
+
+    if (http_open(req, KHTTP_202, KMIME_APP_JSON, ses->consistency_hash)) {
+      BREAK_ERROR("response_analysis_job(): unable to initialise http response");
+    }
+
+    struct kjsonreq resp;
+    kjson_open(&resp, req);
+    kcgi_writer_disable(req);
+    kjson_obj_open(&resp);
+
+    kjson_putstringp(&resp, "job", ses->session_id);
+    kjson_putstringp(&resp, "status", (status == ANALYSIS_JOB_RUNNING) ? "running" : "queued");
+
+    kjson_obj_close(&resp);
+    kjson_close(&resp);
+  } while(0);
+
+  return retVal;
+}
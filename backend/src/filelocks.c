@@ -1,140 +1,741 @@
+#define _GNU_SOURCE // F_OFD_SETLK
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/file.h>
+#include <strings.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
-#include <sys/time.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "errorlog.h"
+#include "paths.h"
 #include "survey.h"
+#include "utils.h"
 #include "validators.h"
 
-struct locked_files {
-  FILE *file_handle;
-  char *path;
+/**
+ * Session lock manager (ENV SS_LOCK_BACKEND)
+ *
+ *  - "fcntl" (default): byte-range locks on SURVEY_HOME/locks/shard.<n>, the byte offset is derived from the session
+ *    id hash. The shard files are opened once per thread and never written. Open file description locks
+ *    (F_OFD_SETLK) exclude threads of the same process as well, the kernel releases the locks of
+ *    terminated processes. Excludes all processes sharing SURVEY_HOME (surveyfcgi, surveycli).
+ *  - "shm": lock table in shared memory, created by surveyfcgi before it forks its workers (SS_FCGI_WORKERS).
+ *    Requests of the pool wait in the table, locks of terminated holders are detected and recovered. The holder of a
+ *    slot takes the "fcntl" lock of the session as well, which excludes processes without the table (surveycli).
+ *
+ * Locks are shared (requests which do not change the session) or exclusive. A shared lock is upgraded in place if
+ * its holder is the only one, otherwise it is released and acquired exclusively: the caller has to reload the
+ * session (upgrade_session_lock()). Waiting exclusive requests block new shared holders in the "shm" backend only.
+ *
+ * Waits are bounded (ENV SS_LOCK_TIMEOUT, ms), a request which exceeds the budget fails with
+ * SS_SYSTEM_LOCK_SESSION_TIMEOUT (HTTP 503). Waits, timeouts, recovered locks and locks held longer than the budget
+ * are logged.
+ *
+ * Distinct sessions may share a lock (hash collision), which only serialises them. Locks are reentrant per thread
+ * and released by release_my_session_locks() at the end of a request.
+ */
+
+#ifdef F_OFD_SETLK
+#define LOCK_SETLK F_OFD_SETLK
+#define LOCK_SETLKW F_OFD_SETLKW
+#else
+// process associated locks: threads of one process are not excluded
+#define LOCK_SETLK F_SETLK
+#define LOCK_SETLKW F_SETLKW
+#endif
+
+#define LOCK_SHARDS 16
+#define LOCK_RANGE (1 << 30)      // byte offsets per shard file
+#define LOCK_TABLE_SLOTS 1024     // shm backend
+#define LOCK_SLOT_HOLDERS 8       // shm backend: max. concurrent shared holders of a slot
+#define LOCK_STALE_CHECK_MS 100   // shm backend: interval to check for terminated holders while waiting
+#define LOCK_BACKOFF_MAX_MS 32    // fcntl backend: polling interval for timed waits
+#define LOCK_TIMEOUT_MS 10000     // default wait budget
+
+struct lock_counters {
+  unsigned long acquisitions;
+  unsigned long shared;
+  unsigned long upgrades;
+  unsigned long waits;
+  unsigned long timeouts;
+  unsigned long stale;
+  unsigned long long wait_us_total;
+  unsigned long long wait_us_max;
+};
+
+struct lock_holder {
+  pid_t pid;
+  pid_t tid;
+};
+
+struct lock_slot {
+  pthread_mutex_t mutex; // robust, guards the slot
+  pthread_cond_t cond;
+  int exclusive;         // holders[0] holds the slot exclusively
+  int writers;           // waiting for exclusive access, new shared holders queue behind them
+  struct lock_holder holders[LOCK_SLOT_HOLDERS];
+};
+
+struct lock_table {
+  struct lock_counters counters;
+  struct lock_slot slots[LOCK_TABLE_SLOTS];
+};
+
+static struct lock_table *lock_table = NULL;
+static struct lock_counters lock_local_counters;
+
+struct locked_session {
+  unsigned long key; // fcntl: shard * LOCK_RANGE + offset, shm: slot
+  unsigned long range; // shm: fcntl key of the session
+  int mode;          // enum session_lock_mode
+  int count;
+  struct timespec acquired;
 };
 
 #define MAX_LOCKS 16
-struct locked_files locks[MAX_LOCKS];
-int lock_count = 0;
+static THREAD_LOCAL struct locked_session locks[MAX_LOCKS];
+static THREAD_LOCAL int lock_count = 0;
+static THREAD_LOCAL int lock_fds[LOCK_SHARDS]; // fd + 1, 0: not opened
+static THREAD_LOCAL pid_t lock_pid = 0;
 
-int lock_session(char *session_id) {
+static int lock_backend(void) {
+  char *env = getenv("SS_LOCK_BACKEND");
+  if (env && !strcasecmp(env, "shm") && lock_table) {
+    return LOCK_BACKEND_SHM;
+  }
+  return LOCK_BACKEND_FCNTL;
+}
+
+static struct lock_counters *lock_counters(void) {
+  return (lock_backend() == LOCK_BACKEND_SHM) ? &lock_table->counters : &lock_local_counters;
+}
+
+/**
+ * wait budget (ms) for session locks
+ */
+int lock_wait_budget(void) {
+  return env_limit("SS_LOCK_TIMEOUT", LOCK_TIMEOUT_MS);
+}
+
+static unsigned long lock_key(const char *session_id, int backend) {
+  // FNV-1a
+  unsigned long long h = 14695981039346656037ULL;
+  for (const char *c = session_id; *c; c++) {
+    h ^= (unsigned char) *c;
+    h *= 1099511628211ULL;
+  }
+
+  if (backend == LOCK_BACKEND_SHM) {
+    return (unsigned long) (h % LOCK_TABLE_SLOTS);
+  }
+  return (unsigned long) (h % LOCK_SHARDS) * LOCK_RANGE + (unsigned long) ((h / LOCK_SHARDS) % LOCK_RANGE);
+}
+
+static long long lock_elapsed_us(struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void lock_count_acquisition(long long wait_us, int waited) {
+  struct lock_counters *c = lock_counters();
+  __atomic_fetch_add(&c->acquisitions, 1, __ATOMIC_RELAXED);
+  if (!waited) {
+    return;
+  }
+
+  __atomic_fetch_add(&c->waits, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&c->wait_us_total, (unsigned long long) wait_us, __ATOMIC_RELAXED);
+  unsigned long long max = __atomic_load_n(&c->wait_us_max, __ATOMIC_RELAXED);
+  while ((unsigned long long) wait_us > max
+         && !__atomic_compare_exchange_n(&c->wait_us_max, &max, (unsigned long long) wait_us, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+  return;
+}
+
+/**
+ * Create the shared lock table (SS_LOCK_BACKEND=shm), called once by surveyfcgi before it forks workers.
+ */
+int lock_manager_init(void) {
+  int retVal = 0;
+
+  do {
+    char *env = getenv("SS_LOCK_BACKEND");
+    if (!env || strcasecmp(env, "shm") || lock_table) {
+      break;
+    }
+
+    struct lock_table *table = mmap(NULL, sizeof(struct lock_table), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED) {
+      BREAK_ERRORV("mmap() failed for lock table (errno=%d)", errno);
+    }
+    memset(table, 0, sizeof(struct lock_table));
+
+    pthread_mutexattr_t mattr;
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+
+    pthread_condattr_t cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+
+    for (int i = 0; i < LOCK_TABLE_SLOTS; i++) {
+      pthread_mutex_init(&table->slots[i].mutex, &mattr);
+      pthread_cond_init(&table->slots[i].cond, &cattr);
+    }
+
+    pthread_mutexattr_destroy(&mattr);
+    pthread_condattr_destroy(&cattr);
+
+    lock_table = table;
+    LOG_INFOV("created shared lock table (%d slots)", LOCK_TABLE_SLOTS);
+  } while (0);
+
+  return retVal;
+}
+
+/**
+ * A forked process inherits the held locks and the shard files of its parent thread, but it does not hold the locks
+ */
+static void lock_check_fork(void) {
+  if (lock_pid == getpid()) {
+    return;
+  }
+
+  for (int i = 0; i < LOCK_SHARDS; i++) {
+    if (lock_fds[i]) {
+      close(lock_fds[i] - 1);
+      lock_fds[i] = 0;
+    }
+  }
+  lock_count = 0;
+  lock_pid = getpid();
+  return;
+}
+
+/**
+ * fcntl backend: shard file of this thread
+ */
+static int lock_shard_fd(int shard) {
+  int retVal = 0;
+
+  do {
+    if (lock_fds[shard]) {
+      break;
+    }
+
+    int dirfd = path_dirfd(PATH_DIR_LOCKS);
+    if (dirfd < 0) {
+      BREAK_ERROR("Could not open lock directory");
+    }
+
+    char name[64];
+    snprintf(name, 64, "shard.%d", shard);
+
+    int fd = openat(dirfd, name, O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+    if (fd < 0) {
+      BREAK_ERRORV("Could not open lock file 'locks/%s' (errno=%d)", name, errno);
+    }
+    lock_fds[shard] = fd + 1;
+  } while (0);
+
+  return (retVal) ? -1 : lock_fds[shard] - 1;
+}
+
+static int lock_fcntl(unsigned long key, short type, int cmd) {
+  int fd = lock_shard_fd(key / LOCK_RANGE);
+  if (fd < 0) {
+    return -1;
+  }
+
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = key % LOCK_RANGE;
+  fl.l_len = 1;
+
+  int res;
+  do {
+    res = fcntl(fd, cmd, &fl);
+  } while (res && errno == EINTR && cmd == LOCK_SETLKW);
+  return res;
+}
+
+/**
+ * fcntl backend: acquire with an optional deadline (timeout_ms < 0: wait forever)
+ * returns 0 on success, 1 on timeout, -1 on error
+ */
+static int lock_fcntl_acquire(unsigned long key, int mode, int timeout_ms, int *waited) {
+  short type = (mode == SESSION_LOCK_SHARED) ? F_RDLCK : F_WRLCK;
+
+  if (!lock_fcntl(key, type, LOCK_SETLK)) {
+    return 0;
+  }
+  if (errno != EAGAIN && errno != EACCES) {
+    return -1;
+  }
+
+  *waited = 1;
+  if (timeout_ms < 0) {
+    return (lock_fcntl(key, type, LOCK_SETLKW)) ? -1 : 0;
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int backoff_ms = 1;
+
+  for (;;) {
+    long long left_ms = timeout_ms - lock_elapsed_us(&start) / 1000;
+    if (left_ms <= 0) {
+      return 1;
+    }
+
+    int sleep_ms = (backoff_ms < left_ms) ? backoff_ms : (int) left_ms;
+    struct timespec pause = { sleep_ms / 1000, (long) (sleep_ms % 1000) * 1000000L };
+    nanosleep(&pause, NULL);
+    backoff_ms = (backoff_ms * 2 < LOCK_BACKOFF_MAX_MS) ? backoff_ms * 2 : LOCK_BACKOFF_MAX_MS;
+
+    if (!lock_fcntl(key, type, LOCK_SETLK)) {
+      return 0;
+    }
+    if (errno != EAGAIN && errno != EACCES) {
+      return -1;
+    }
+  }
+}
+
+static int lock_slot_enter(struct lock_slot *slot) {
+  int res = pthread_mutex_lock(&slot->mutex);
+  if (res == EOWNERDEAD) {
+    // a holder terminated within the (short) critical section, the slot state is consistent
+    pthread_mutex_consistent(&slot->mutex);
+    res = 0;
+  }
+  return res;
+}
+
+/**
+ * shm backend: free the entries of holders which terminated without releasing the slot, called with the slot mutex
+ * held. returns the number of holders left
+ */
+static int lock_slot_recover(struct lock_slot *slot, unsigned long key) {
+  int count = 0;
+
+  for (int i = 0; i < LOCK_SLOT_HOLDERS; i++) {
+    struct lock_holder *h = &slot->holders[i];
+    if (!h->pid) {
+      continue;
+    }
+    if (h->pid != getpid() && kill(h->pid, 0) && errno == ESRCH) {
+      LOG_WARNV("recovered session lock slot %lu of terminated process %d", key, (int) h->pid);
+      __atomic_fetch_add(&lock_table->counters.stale, 1, __ATOMIC_RELAXED);
+      h->pid = 0;
+      h->tid = 0;
+      continue;
+    }
+    count++;
+  }
+
+  if (!count) {
+    slot->exclusive = 0;
+  }
+  return count;
+}
+
+/**
+ * shm backend: holder entry of the current thread, called with the slot mutex held
+ */
+static struct lock_holder *lock_slot_holder(struct lock_slot *slot, pid_t pid, pid_t tid) {
+  for (int i = 0; i < LOCK_SLOT_HOLDERS; i++) {
+    if (slot->holders[i].pid == pid && slot->holders[i].tid == tid) {
+      return &slot->holders[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * shm backend: acquire with an optional deadline (timeout_ms < 0: wait forever)
+ * returns 0 on success, 1 on timeout, -1 on error
+ */
+static int lock_shm_acquire(unsigned long key, int mode, int timeout_ms, int *waited) {
+  struct lock_slot *slot = &lock_table->slots[key];
+  int timed_out = 0;
+  int writer = 0;
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (lock_slot_enter(slot)) {
+    return -1;
+  }
+
+  for (;;) {
+    int holders = lock_slot_recover(slot, key);
+    if (mode == SESSION_LOCK_EXCLUSIVE && !holders) {
+      break;
+    }
+    if (mode == SESSION_LOCK_SHARED && !slot->exclusive && !slot->writers && holders < LOCK_SLOT_HOLDERS) {
+      break;
+    }
+
+    *waited = 1;
+    if (mode == SESSION_LOCK_EXCLUSIVE && !writer) {
+      slot->writers++;
+      writer = 1;
+    }
+
+    long long wait_ms = LOCK_STALE_CHECK_MS;
+    if (timeout_ms >= 0) {
+      long long left_ms = timeout_ms - lock_elapsed_us(&start) / 1000;
+      if (left_ms <= 0) {
+        timed_out = 1;
+        break;
+      }
+      wait_ms = (left_ms < wait_ms) ? left_ms : wait_ms;
+    }
+
+    struct timespec until;
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_sec += wait_ms / 1000;
+    until.tv_nsec += (wait_ms % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000L;
+    }
+
+    if (pthread_cond_timedwait(&slot->cond, &slot->mutex, &until) == EOWNERDEAD) {
+      pthread_mutex_consistent(&slot->mutex);
+    }
+  }
+
+  if (writer) {
+    slot->writers--;
+    if (timed_out) {
+      // shared requests queued behind this one
+      pthread_cond_broadcast(&slot->cond);
+    }
+  }
+
+  if (!timed_out) {
+    struct lock_holder *h = lock_slot_holder(slot, 0, 0);
+    h->pid = getpid();
+    h->tid = (pid_t) syscall(SYS_gettid);
+    slot->exclusive = (mode == SESSION_LOCK_EXCLUSIVE);
+  }
+
+  pthread_mutex_unlock(&slot->mutex);
+  return timed_out;
+}
+
+/**
+ * shm backend: upgrade a shared lock in place, fails (-1) if there are other holders
+ */
+static int lock_shm_convert(unsigned long key) {
+  struct lock_slot *slot = &lock_table->slots[key];
+  int res = -1;
+
+  if (lock_slot_enter(slot)) {
+    return -1;
+  }
+  if (lock_slot_recover(slot, key) == 1 && lock_slot_holder(slot, getpid(), (pid_t) syscall(SYS_gettid))) {
+    slot->exclusive = 1;
+    res = 0;
+  }
+  pthread_mutex_unlock(&slot->mutex);
+  return res;
+}
+
+static void lock_shm_release(unsigned long key) {
+  struct lock_slot *slot = &lock_table->slots[key];
+  if (lock_slot_enter(slot)) {
+    return;
+  }
+
+  struct lock_holder *h = lock_slot_holder(slot, getpid(), (pid_t) syscall(SYS_gettid));
+  if (h) {
+    h->pid = 0;
+    h->tid = 0;
+    lock_slot_recover(slot, key);
+    pthread_cond_broadcast(&slot->cond);
+  }
+  pthread_mutex_unlock(&slot->mutex);
+  return;
+}
+
+/**
+ * describe the current holders of a lock for the log
+ */
+static void lock_describe_holders(int backend, unsigned long key, char *out, size_t len) {
+  snprintf(out, len, "unknown");
+
+  if (backend == LOCK_BACKEND_SHM) {
+    struct lock_slot *slot = &lock_table->slots[key];
+    if (lock_slot_enter(slot)) {
+      return;
+    }
+    size_t pos = snprintf(out, len, "%s, %d waiting writers:", (slot->exclusive) ? "exclusive" : "shared", slot->writers);
+    for (int i = 0; i < LOCK_SLOT_HOLDERS && pos < len; i++) {
+      if (slot->holders[i].pid) {
+        pos += snprintf(out + pos, len - pos, " pid %d/tid %d", (int) slot->holders[i].pid, (int) slot->holders[i].tid);
+      }
+    }
+    pthread_mutex_unlock(&slot->mutex);
+    return;
+  }
+
+  int fd = lock_shard_fd(key / LOCK_RANGE);
+  if (fd < 0) {
+    return;
+  }
+
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = key % LOCK_RANGE;
+  fl.l_len = 1;
+#ifdef F_OFD_GETLK
+  int res = fcntl(fd, F_OFD_GETLK, &fl);
+#else
+  int res = fcntl(fd, F_GETLK, &fl);
+#endif
+  if (!res) {
+    // open file description locks have no owning process (l_pid -1)
+    snprintf(out, len, "%s, pid %d", (fl.l_type == F_UNLCK) ? "released" : (fl.l_type == F_RDLCK) ? "shared" : "exclusive", (int) fl.l_pid);
+  }
+  return;
+}
+
+/**
+ * acquire a lock which is not held by this thread, returns 0 on success, 1 on timeout, -1 on error
+ */
+static int lock_acquire(int backend, unsigned long key, int mode, int timeout_ms, const char *session_id) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int waited = 0;
+  const char *mode_name = (mode == SESSION_LOCK_SHARED) ? "shared" : "exclusive";
+
+  int res;
+  if (backend == LOCK_BACKEND_SHM) {
+    res = lock_shm_acquire(key, mode, timeout_ms, &waited);
+    if (!res) {
+      // exclude processes outside of the pool, only they compete for the byte range now
+      int left_ms = -1;
+      if (timeout_ms >= 0) {
+        left_ms = timeout_ms - (int) (lock_elapsed_us(&start) / 1000);
+        left_ms = (left_ms > 0) ? left_ms : 0;
+      }
+      res = lock_fcntl_acquire(lock_key(session_id, LOCK_BACKEND_FCNTL), mode, left_ms, &waited);
+      if (res) {
+        lock_shm_release(key);
+      }
+    }
+  } else {
+    res = lock_fcntl_acquire(key, mode, timeout_ms, &waited);
+  }
+  if (res > 0) {
+    char holders[256];
+    lock_describe_holders(backend, key, holders, 256);
+    LOG_INFOV("lock contention: timeout after %d ms waiting for %s lock of session '%s', held: %s", timeout_ms, mode_name, session_id, holders);
+    __atomic_fetch_add(&lock_counters()->timeouts, 1, __ATOMIC_RELAXED);
+  }
+  if (!res) {
+    long long wait_us = lock_elapsed_us(&start);
+    if (waited) {
+      LOG_INFOV("lock contention: waited %lld ms for %s lock of session '%s'", wait_us / 1000, mode_name, session_id);
+    }
+    lock_count_acquisition(wait_us, waited);
+  }
+  return res;
+}
+
+static void lock_release(int backend, struct locked_session *lock) {
+  unsigned long key = lock->key;
+
+  long long held_ms = lock_elapsed_us(&lock->acquired) / 1000;
+  if (held_ms > lock_wait_budget()) {
+    // other requests for this session may have failed meanwhile
+    LOG_INFOV("stale lock holder: session lock %lu was held for %lld ms (budget %d ms)", key, held_ms, lock_wait_budget());
+  }
+
+  unsigned long range = (backend == LOCK_BACKEND_SHM) ? lock->range : key;
+  if (lock_fcntl(range, F_UNLCK, LOCK_SETLK)) {
+    LOG_WARNV("releasing session lock %lu failed (errno=%d)", range, errno);
+  }
+  if (backend == LOCK_BACKEND_SHM) {
+    lock_shm_release(key);
+  }
+  return;
+}
+
+/**
+ * Lock a session for the current thread in the given mode (enum session_lock_mode), waits at most timeout_ms
+ * milliseconds (< 0: wait forever). A thread holding a shared lock which requests an exclusive one has to use
+ * upgrade_session_lock().
+ * returns 0 on success, SS_SYSTEM_LOCK_SESSION_TIMEOUT on timeout, SS_SYSTEM_LOCK_SESSION on failure
+ */
+int lock_session_mode(char *session_id, int mode, int timeout_ms) {
   int retVal = 0;
+
   do {
+    if (!session_id) {
+      BREAK_CODE(SS_SYSTEM_LOCK_SESSION, "session_id is NULL");
+    }
+    if (validate_session_id(session_id)) {
+      BREAK_CODEV(SS_SYSTEM_LOCK_SESSION, "Session ID '%s' is malformed", session_id);
+    }
+
+    lock_check_fork();
+
+    int backend = lock_backend();
+    unsigned long key = lock_key(session_id, backend);
 
-    time_t now = time(0);
-    struct tm *tm = localtime(&now);
-
-    if (!tm)
-      BREAK_ERROR("localtime() failed. Cannot acquire lock.");
-    struct timeval nowtv;
-
-    // If gettimeofday() fails or returns an invalid value, all else is lost!
-    if (gettimeofday(&nowtv, NULL) == -1)
-      BREAK_ERROR("gettimeofday() failed");
-
-    char session_prefix[5];
-    char session_path_suffix[1024];
-    char lock_path[1024];
-
-    if (!session_id)
-      BREAK_ERROR("session_id is NULL");
-    if (validate_session_id(session_id))
-      BREAK_ERRORV("Session ID '%s' is malformed", session_id);
-
-    for (int i = 0; i < 4; i++) {
-      session_prefix[i] = session_id[i];
-    }
-    session_prefix[4] = 0;
-
-    // Create subdirectory in locks directory if required
-    snprintf(session_path_suffix, 1024, "locks");
-    if (generate_path(session_path_suffix, lock_path, 1024))
-      BREAK_ERRORV("generate_path('%s') failed to build path for lock path when "
-                 "locking session '%s'",
-                 session_path_suffix, session_id);
-    mkdir(lock_path, 0750);
-
-    snprintf(session_path_suffix, 1024, "locks/%s", session_prefix);
-    if (generate_path(session_path_suffix, lock_path, 1024))
-      BREAK_ERRORV("generate_path('%s') failed to build path for lock path when "
-                 "locking session '%s'",
-                 session_path_suffix, session_id);
-    mkdir(lock_path, 0750);
-
-    snprintf(session_path_suffix, 1024, "locks/%s/lock.%s", session_prefix,
-             session_id);
-    if (generate_path(session_path_suffix, lock_path, 1024))
-      BREAK_ERRORV(
-          "generate_path('%s') failed to build path while locking session '%s'",
-          session_path_suffix, session_id);
-
-    // See if we already hold a lock to this session
+    // See if we already hold this lock
     int i;
     for (i = 0; i < lock_count; i++) {
-      if (!strcmp(lock_path, locks[i].path)) {
+      if (locks[i].key == key) {
         break;
       }
     }
 
     if (i < lock_count) {
-      // We already hold a lock. Nothing to do
-      retVal = 0;
+      if (locks[i].mode == SESSION_LOCK_SHARED && mode == SESSION_LOCK_EXCLUSIVE) {
+        BREAK_CODEV(SS_SYSTEM_LOCK_SESSION, "Session '%s' is locked shared by this thread, use upgrade_session_lock()", session_id);
+      }
+      locks[i].count++;
       break;
     }
 
-    // No existing lock, so acquire one
-
-    if (lock_count >= MAX_LOCKS)
-      BREAK_ERROR("Too many file locks open. Bug or increase MAX_LOCKS?");
+    if (lock_count >= MAX_LOCKS) {
+      BREAK_CODE(SS_SYSTEM_LOCK_SESSION, "Too many session locks held. Bug or increase MAX_LOCKS?");
+    }
 
-    FILE *f = fopen(lock_path, "a");
-    if (!f)
-      BREAK_ERRORV("Could not open lock file '%s' for append.", lock_path);
-    if (flock(fileno(f), LOCK_EX))
-      BREAK_ERRORV("flock('%s',LOCK_EX) failed", lock_path);
-    fprintf(f,
-            "%04d/%02d/%02d"
-            ".%02d:%02d.%d"
-            ":%ld.%06ld"
-            ":Lock acquired by pid %d.\n",
-            1900 + tm->tm_year, tm->tm_mon + 1, tm->tm_mday, tm->tm_hour,
-            tm->tm_min, tm->tm_sec, nowtv.tv_sec, nowtv.tv_usec, getpid());
-    fflush(f);
+    int res = lock_acquire(backend, key, mode, timeout_ms, session_id);
+    if (res > 0) {
+      BREAK_CODEV(SS_SYSTEM_LOCK_SESSION_TIMEOUT, "Timeout after %d ms waiting for lock of session '%s'", timeout_ms, session_id);
+    }
+    if (res < 0) {
+      BREAK_CODEV(SS_SYSTEM_LOCK_SESSION, "Could not lock session '%s' (errno=%d)", session_id, errno);
+    }
+    if (mode == SESSION_LOCK_SHARED) {
+      __atomic_fetch_add(&lock_counters()->shared, 1, __ATOMIC_RELAXED);
+    }
 
     // Record the lock
-    locks[lock_count].file_handle = f;
-    locks[lock_count].path = strdup(lock_path);
-    if (!locks[lock_count].path)
-      BREAK_ERROR("strdup() failed when remembering file lock");
+    locks[lock_count].key = key;
+    locks[lock_count].range = lock_key(session_id, LOCK_BACKEND_FCNTL);
+    locks[lock_count].mode = mode;
+    locks[lock_count].count = 1;
+    clock_gettime(CLOCK_MONOTONIC, &locks[lock_count].acquired);
     lock_count++;
+  } while (0);
+
+  return retVal;
+}
+
+/**
+ * Upgrade the shared lock of a session to an exclusive lock, waits at most timeout_ms milliseconds (< 0: forever).
+ * If other threads hold the lock as well, it is released before waiting (two upgrading threads would wait for each
+ * other): *released is set and the caller has to reload the session, it may have changed in between.
+ * returns 0 on success, SS_SYSTEM_LOCK_SESSION(_TIMEOUT) on failure or timeout (the lock is not held anymore)
+ */
+int upgrade_session_lock(char *session_id, int timeout_ms, int *released) {
+  int retVal = 0;
+
+  do {
+    BREAK_IF(released == NULL, SS_ERROR_ARG, "released");
+    *released = 0;
+
+    if (!session_id || validate_session_id(session_id)) {
+      BREAK_CODEV(SS_SYSTEM_LOCK_SESSION, "Session ID '%s' is malformed", (session_id) ? session_id : "(null)");
+    }
+
+    lock_check_fork();
+
+    int backend = lock_backend();
+    unsigned long key = lock_key(session_id, backend);
+
+    int i;
+    for (i = 0; i < lock_count; i++) {
+      if (locks[i].key == key) {
+        break;
+      }
+    }
 
+    if (i == lock_count) {
+      // not locked yet, nothing has been read under the lock
+      retVal = lock_session_mode(session_id, SESSION_LOCK_EXCLUSIVE, timeout_ms);
+      *released = 1;
+      break;
+    }
+
+    if (locks[i].mode == SESSION_LOCK_EXCLUSIVE) {
+      break;
+    }
+
+    int res = (backend == LOCK_BACKEND_SHM) ? lock_shm_convert(key) : 0;
+    if (!res) {
+      res = lock_fcntl(locks[i].range, F_WRLCK, LOCK_SETLK);
+    }
+    if (res) {
+      lock_release(backend, &locks[i]);
+      *released = 1;
+
+      res = lock_acquire(backend, key, SESSION_LOCK_EXCLUSIVE, timeout_ms, session_id);
+      if (res) {
+        // drop the entry, the lock is not held anymore
+        locks[i] = locks[lock_count - 1];
+        lock_count--;
+        BREAK_CODEV((res > 0) ? SS_SYSTEM_LOCK_SESSION_TIMEOUT : SS_SYSTEM_LOCK_SESSION, "Could not upgrade lock of session '%s'", session_id);
+      }
+      clock_gettime(CLOCK_MONOTONIC, &locks[i].acquired);
+    }
+
+    __atomic_fetch_add(&lock_counters()->upgrades, 1, __ATOMIC_RELAXED);
+    locks[i].mode = SESSION_LOCK_EXCLUSIVE;
   } while (0);
 
   return retVal;
 }
 
+/**
+ * Lock a session exclusively, waits at most timeout_ms milliseconds (< 0: wait forever)
+ */
+int lock_session_timeout(char *session_id, int timeout_ms) {
+  return lock_session_mode(session_id, SESSION_LOCK_EXCLUSIVE, timeout_ms);
+}
+
+/**
+ * Lock a session exclusively within the wait budget (SS_LOCK_TIMEOUT)
+ */
+int lock_session(char *session_id) {
+  return lock_session_timeout(session_id, lock_wait_budget());
+}
+
 int release_my_session_locks(void) {
   int retVal = 0;
 
   do {
+    lock_check_fork();
+    int backend = lock_backend();
+
     // Release locks and flush lock list
     for (int i = 0; i < lock_count; i++) {
-      if (flock(fileno(locks[i].file_handle), LOCK_UN))
-        BREAK_ERRORV("flock('%s',LOCK_UN) failed", locks[i].path);
-
-      // #284 close file handle
-      if (locks[i].file_handle) {
-        fclose(locks[i].file_handle);
-      }
-
-      locks[i].file_handle = NULL;
-      free(locks[i].path);
+      lock_release(backend, &locks[i]);
     }
     lock_count = 0;
 
@@ -142,3 +743,24 @@ int release_my_session_locks(void) {
 
   return retVal;
 }
+
+/**
+ * lock counters of this process (fcntl) or of all processes sharing the lock table (shm)
+ */
+void lock_manager_stats(struct lock_stats *out) {
+  if (!out) {
+    return;
+  }
+
+  struct lock_counters *c = lock_counters();
+  out->backend = lock_backend();
+  out->acquisitions = __atomic_load_n(&c->acquisitions, __ATOMIC_RELAXED);
+  out->shared = __atomic_load_n(&c->shared, __ATOMIC_RELAXED);
+  out->upgrades = __atomic_load_n(&c->upgrades, __ATOMIC_RELAXED);
+  out->waits = __atomic_load_n(&c->waits, __ATOMIC_RELAXED);
+  out->timeouts = __atomic_load_n(&c->timeouts, __ATOMIC_RELAXED);
+  out->stale = __atomic_load_n(&c->stale, __ATOMIC_RELAXED);
+  out->wait_ms_total = __atomic_load_n(&c->wait_us_total, __ATOMIC_RELAXED) / 1000.0;
+  out->wait_ms_max = __atomic_load_n(&c->wait_us_max, __ATOMIC_RELAXED) / 1000.0;
+  return;
+}
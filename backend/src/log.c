@@ -8,13 +8,16 @@
 #include <unistd.h>
 
 #include "errorlog.h"
+#include "paths.h"
 #include "survey.h"
+#include "utils.h"
 
-int log_recursed = 0;
+THREAD_LOCAL int log_recursed = 0;
 
+/**
+ * open a log file in <SURVEY_HOME>/logs for append
+ */
  FILE *open_log(char *name) {
-  char log_file[1024];
-
   if (!name) {
       fprintf(stderr, "Log name is null\n");
       return NULL;
@@ -24,16 +27,15 @@ int log_recursed = 0;
       return NULL;
   }
 
-  if (generate_path(name, log_file, 1024)) {
-      char log_name[1024];
-      fprintf(stderr, "generate_path('%s') failed to build path for log file: '%s'\n", log_name, log_file);
-      fprintf(stderr, "'%s'\n", log_file);
+  int dirfd = path_dirfd(PATH_DIR_LOGS);
+  if (dirfd < 0) {
+      fprintf(stderr, "Could not open log directory for log file: '%s'\n", name);
       return NULL;
   }
 
-  FILE *lf = fopen(log_file, "a");
+  FILE *lf = fopen_at(dirfd, name, "a");
   if (!lf) {
-      fprintf(stderr, "Could not open log file '%s' for append: %s\n", log_file, strerror(errno));
+      fprintf(stderr, "Could not open log file 'logs/%s' for append: %s\n", name, strerror(errno));
   }
 
   return lf;
@@ -55,16 +57,17 @@ int log_message(const char *severity, const char *file, const char *function, co
     }
 
     time_t now = time(0);
-    struct tm *tm = localtime(&now);
+    struct tm tm_now;
+    struct tm *tm = localtime_r(&now, &tm_now);
 
     char *custom_path = getenv("SS_LOG_FILE");
 
     if (!custom_path) {
 
       if (!tm) {
-        snprintf(log_name, 1024, "logs/surveysystem-UNKNOWNTIME.log");
+        snprintf(log_name, 1024, "surveysystem-UNKNOWNTIME.log");
       } else {
-        snprintf(log_name, 1024, "logs/surveysystem-%04d%02d%02d.%02d.log", 1900 + tm->tm_year, tm->tm_mon + 1, tm->tm_mday, tm->tm_hour);
+        snprintf(log_name, 1024, "surveysystem-%04d%02d%02d.%02d.log", 1900 + tm->tm_year, tm->tm_mon + 1, tm->tm_mday, tm->tm_hour);
       }
       lf = open_log(log_name);
 
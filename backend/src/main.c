@@ -1,7 +1,9 @@
+#include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "errorlog.h"
@@ -22,8 +24,10 @@ void usage(void) {
       "       surveycli delprevanswer <sessionid> <checksum> -- delete previous answer from an existing session\n"
       "       surveycli delsession <sessionid> -- delete an existing session\n"
       "       surveycli analyse <sessionid> -- get the analysis of a finished session\n"
+      "       surveycli analysis-worker [poll ms] -- process queued analysis jobs (SS_ANALYSIS_ASYNC) until terminated\n"
       "       surveycli progress <sessionid> -- get the progress count of an existing session\n"
-      "       surveycli getchecksum <sessionid> -- get consistency hash of an existing session\n");
+      "       surveycli getchecksum <sessionid> -- get consistency hash of an existing session\n"
+      "       surveycli convertsession <sessionid> <text|binary> -- rewrite a session file in text or binary (v3) format\n");
 };
 
 void init(int argc, char **argv) {
@@ -693,6 +697,172 @@ int do_analyse(char *session_id) {
   return retVal;
 }
 
+#define ANALYSIS_REQUEUE_INTERVAL 30 // seconds
+
+static volatile sig_atomic_t analysis_worker_stopping = 0;
+
+static void analysis_worker_stop(int signum) {
+  (void)signum;
+  analysis_worker_stopping = 1;
+}
+
+/**
+ * compute and cache the analysis of a queued job, returns an error code for the polling client
+ */
+int analysis_worker_run_job(char *session_id) {
+  int retVal = 0;
+
+  struct session *ses = NULL;
+  const char *analysis = NULL;
+  struct file_map cached = { NULL, 0, 0 };
+
+  do {
+    LOG_INFOV("Running analysis job for session '%s'", session_id);
+    int res;
+
+    // same lock as the request handlers
+    res = lock_session(session_id);
+    if (res) {
+      BREAK_CODEV(res, "session: '%s'", session_id);
+    }
+
+    ses = load_session(session_id, &res);
+    if (!ses) {
+      BREAK_CODEV(res, "session: '%s'", session_id);
+    }
+
+    char reason[1024];
+    res = validate_session_action(ACTION_SESSION_ANALYSIS, ses, reason, 1024);
+    if (res) {
+      BREAK_CODEV(res, "session: '%s', reason: '%s'", session_id, reason);
+    }
+
+    char hook_id[1024];
+    if (get_hook_id(ses, hook_id, 1024)) {
+      BREAK_CODE(SS_SYSTEM_GET_ANALYSIS, "get_hook_id() failed");
+    }
+
+    // a job queued again while the previous one completed
+    size_t offset;
+    if (!session_get_cached_analysis(ses, hook_id, &cached, &offset) && cached.data) {
+      LOG_INFOV("analysis of session '%s' is cached already", session_id);
+      break;
+    }
+
+    if (get_analysis(ses, &analysis)) {
+      BREAK_CODE(SS_SYSTEM_GET_ANALYSIS, "get_analysis() failed");
+    }
+
+    if (!analysis || !analysis[0]) {
+      BREAK_CODE(SS_SYSTEM_GET_ANALYSIS, "get_analysis() returned an empty result");
+    }
+
+    char fname[256];
+    snprintf(fname, 256, "%s.analysis.json", session_id);
+    if (session_add_datafile(ses->session_id, fname, analysis)) {
+      LOG_WARNV("Could not add analysis.json for session.", 0);
+      // do not break here
+    }
+
+    res = session_save_analysis(ses, hook_id, analysis);
+    if (res) {
+      BREAK_CODE(res, "session_save_analysis() failed");
+    }
+  } while (0);
+
+  // destruct
+  release_my_session_locks();
+  unmap_file(&cached);
+  free_session(ses);
+  freez((char *)analysis);
+
+  return retVal;
+}
+
+/**
+ * process queued analysis jobs until SIGTERM/SIGINT, idle workers poll the queue every poll_ms milliseconds
+ */
+int do_analysis_worker(int poll_ms) {
+  int retVal = 0;
+
+  do {
+    signal(SIGTERM, analysis_worker_stop);
+    signal(SIGINT, analysis_worker_stop);
+
+    // jobs of workers which die while this one is running are picked up on the next sweep
+    time_t last_requeue = 0;
+
+    while (!analysis_worker_stopping) {
+      clear_errors();
+
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (!last_requeue || now.tv_sec - last_requeue >= ANALYSIS_REQUEUE_INTERVAL) {
+        last_requeue = now.tv_sec;
+        int requeued = analysis_job_requeue_stale();
+        if (requeued) {
+          fprintf(stderr, "queued %d stale analysis jobs again\n", requeued);
+        }
+      }
+
+      char session_id[64];
+      int res = analysis_job_claim(session_id, 64);
+      if (res) {
+        BREAK_CODE(res, "analysis_job_claim() failed");
+      }
+
+      if (!session_id[0]) {
+        struct timespec idle = { poll_ms / 1000, (long) (poll_ms % 1000) * 1000000L };
+        nanosleep(&idle, NULL);
+        continue;
+      }
+
+      int error = analysis_worker_run_job(session_id);
+      if (error) {
+        fprintf(stderr, "analysis job for session '%s' failed: %s\n", session_id, get_error(error, 0, "[ERROR] unknown"));
+        dump_errors(stderr);
+      }
+
+      if (analysis_job_finish(session_id, error)) {
+        BREAK_ERRORV("analysis_job_finish() failed for session '%s'", session_id);
+      }
+    }
+  } while (0);
+
+  return retVal;
+}
+
+// rewrite session file in the given format
+int do_convertsession(char *session_id, char *format) {
+  int retVal = 0;
+
+  do {
+    LOG_INFO("Entering convertsession handler.");
+
+    enum session_format fmt;
+    if (!strcmp(format, "text")) {
+      fmt = SESSION_FORMAT_TEXT;
+    } else if (!strcmp(format, "binary")) {
+      fmt = SESSION_FORMAT_BINARY;
+    } else {
+      fprintf(stderr, "Unknown session format '%s', expected 'text' or 'binary'\n", format);
+      BREAK_ERRORV("Unknown session format '%s'", format);
+    }
+
+    int err = convert_session(session_id, fmt);
+    if (err) {
+      fprintf(stderr, "Could not convert session, error: '%s'\n", get_error(err, 0, "[ERROR] unknown"));
+      BREAK_ERROR("convert_session() failed");
+    }
+
+    printf("session converted to %s\n", format);
+    LOG_INFO("Leaving convertsession handler.");
+
+  } while (0);
+
+  return retVal;
+}
+
 int main(int argc, char **argv) {
   int retVal = 0;
 
@@ -825,6 +995,26 @@ int main(int argc, char **argv) {
         BREAK_ERROR("Failed fetch analysis");
       }
 
+    } else if (!strcmp(argv[1], "analysis-worker")) {
+
+      if (argc > 3) {
+        usage();
+        retVal = -1;
+        break;
+      }
+
+      int poll_ms = (argc == 3) ? atoi(argv[2]) : 500;
+      if (poll_ms < 1) {
+        usage();
+        retVal = -1;
+        break;
+      }
+
+      if (do_analysis_worker(poll_ms)) {
+        fprintf(stderr, "Analysis worker failed.\n");
+        BREAK_ERROR("Analysis worker failed");
+      }
+
     } else if (!strcmp(argv[1], "delsession")) {
 
       if (argc != 3) {
@@ -838,6 +1028,19 @@ int main(int argc, char **argv) {
         BREAK_ERROR("Failed to delete session");
       }
 
+    } else if (!strcmp(argv[1], "convertsession")) {
+
+      if (argc != 4) {
+        usage();
+        retVal = -1;
+        break;
+      }
+
+      if (do_convertsession(argv[2], argv[3])) {
+        fprintf(stderr, "Failed to convert session.\n");
+        BREAK_ERROR("Failed to convert session");
+      }
+
     } else {
       usage();
       retVal = -1;
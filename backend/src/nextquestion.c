@@ -1,11 +1,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
+#include "arena.h"
 #include "errorlog.h"
 #include "question_types.h"
 #include "survey.h"
 #include "serialisers.h"
+#include "sha1.h"
 #include "utils.h"
 #include "py_module.h"
 
@@ -102,15 +105,16 @@ void free_next_questions(struct nextquestions *nq) {
   if (!nq) {
     return;
   }
-  freez(nq->message);
+  request_free(nq->message);
   for (int i = 0; i < nq->question_count; i++) {
     free_question(nq->next_questions[i]);
   }
+  freez(nq->next_questions);
   nq->question_count = 0;
   // #13 add suport for progress indicator
   nq->progress[0] = 0;
   nq->progress[1] = 0;
-  free(nq);
+  request_free(nq);
   return;
 }
 
@@ -133,6 +137,15 @@ int add_next_question(enum actions action, struct question *qn, struct nextquest
     if (!qn) {
       BREAK_ERROR("question is NULL");
     }
+    if (nq->question_count >= env_limit("SS_MAX_NEXTQUESTIONS", MAX_NEXTQUESTIONS)) {
+      BREAK_ERRORV("add_next_question(): Too many next questions (increase SS_MAX_NEXTQUESTIONS?), adding '%s' failed", qn->uid);
+    }
+
+    struct question **next_questions = array_reserve(nq->next_questions, &nq->question_capacity, nq->question_count + 1, sizeof(struct question *));
+    if (!next_questions) {
+      BREAK_ERRORV("add_next_question(): Allocating list of next questions failed for '%s'", qn->uid);
+    }
+    nq->next_questions = next_questions;
 
     // #373 separate allocated space for questions
     struct answer *exists = session_get_answer(qn->uid, ses);
@@ -249,18 +262,50 @@ struct nextquestions *get_next_questions(struct session *s, enum actions action,
       BREAK_ERROR("session structure is NULL");
     }
 
-    nq = calloc(sizeof(struct nextquestions), 1);
+    nq = request_calloc(sizeof(struct nextquestions), 1);
     if (!nq) {
       BREAK_ERROR("init_next_questions() failed");
     }
 
     if (s->nextquestions_flag & NEXTQUESTIONS_FLAG_PYTHON) {
 
-      LOG_INFO("NEXTQUESTIONS_FLAG_PYTHON set, calling get_next_question_python()");
-      fail = get_next_question_python(s, nq, action, affected_answers_count);
+      // "with python memoise": identical session states reuse the hook result
+      char memo_key[HASHSTRING_LENGTH + 1] = { 0 };
+      char *memo = NULL;
+      if (s->survey && s->survey->python_memoise) {
+        if (py_memo_key(s, action, affected_answers_count, memo_key, HASHSTRING_LENGTH + 1)) {
+          LOG_WARNV("py_memo_key() failed, calling hook", 0);
+          memo_key[0] = 0;
+        } else {
+          memo = py_memo_get(s, memo_key);
+        }
+      }
 
-      if (fail) {
-        BREAK_ERRORV("get_next_question_python() failed with return code %d", fail);
+      if (memo) {
+        LOG_INFO("NEXTQUESTIONS_FLAG_PYTHON set, using memoised hook result");
+        fail = py_nextquestions_deserialise(s, nq, action, memo);
+        freez(memo);
+        if (fail) {
+          BREAK_ERRORV("py_nextquestions_deserialise() failed with return code %d", fail);
+        }
+        memo_key[0] = 0;
+      } else if (py_remote_enabled()) {
+        LOG_INFO("NEXTQUESTIONS_FLAG_PYTHON set, calling get_next_question_remote()");
+        fail = get_next_question_remote(s, nq, action, affected_answers_count);
+        if (fail) {
+          BREAK_ERRORV("get_next_question_remote() failed with return code %d", fail);
+        }
+      } else {
+        LOG_INFO("NEXTQUESTIONS_FLAG_PYTHON set, calling get_next_question_python()");
+        fail = get_next_question_python(s, nq, action, affected_answers_count);
+        if (fail) {
+          BREAK_ERRORV("get_next_question_python() failed with return code %d", fail);
+        }
+      }
+
+      if (memo_key[0] && py_memo_put(s, memo_key, nq)) {
+        // do not break here, the result is valid
+        LOG_WARNV("py_memo_put() failed", 0);
       }
 
     } else if (s->nextquestions_flag & NEXTQUESTIONS_FLAG_GENERIC) {
@@ -283,22 +328,29 @@ struct nextquestions *get_next_questions(struct session *s, enum actions action,
       // #408, nextquestion queries can pass now after a session was closed, prevent regression
       if (s->state < SESSION_FINISHED) {
         s->state = SESSION_FINISHED;
+        s->dirty = 1;
       }
       LOG_INFO("Set session state to SESSION_FINISHED");
     }
 
     // #461 purge previous next_questions from @ses->next_questions and set current next_question_uids
-    freez(s->next_questions);
+    char *previous = s->next_questions;
     s->next_questions = NULL;
 
     for (int i = 0; i < nq->question_count; i++) {
       s->next_questions = serialise_list_append_alloc(s->next_questions, nq->next_questions[i]->uid, ',');
     }
 
+    if ((!previous != !s->next_questions) || (previous && s->next_questions && strcmp(previous, s->next_questions))) {
+      s->dirty = 1;
+    }
+    freez(previous);
+
     // #379 update state (re-open finished session)
     if (nq->question_count > 0) {
       if (s->state == SESSION_FINISHED) {
         s->state = SESSION_OPEN;
+        s->dirty = 1;
         LOG_INFO("Set session state from SESSION_FINISHED to SESSION_OPEN");
       }
     }
@@ -329,6 +381,44 @@ int get_analysis_generic(struct session *s, const char **output) {
   return retVal;
 }
 
+/**
+ * Identity of the hooks of a session (analysis cache and memoisation keys): generic or python, the survey snapshot
+ * and the version (mtime, size) of nextquestion.py, so that a redeployed controller invalidates cached results.
+ */
+int get_hook_id(struct session *s, char *out, size_t len) {
+  int retVal = 0;
+
+  do {
+    BREAK_IF(s == NULL, SS_ERROR_ARG, "s");
+    BREAK_IF(out == NULL, SS_ERROR_ARG, "out");
+
+    int r;
+    if (s->nextquestions_flag & NEXTQUESTIONS_FLAG_PYTHON) {
+      char path[1024];
+      if (generate_python_path(path, 1024 - 16)) {
+        BREAK_ERROR("generate_python_path() failed");
+      }
+      strcat(path, "/nextquestion.py");
+
+      struct stat st;
+      if (stat(path, &st)) {
+        memset(&st, 0, sizeof(st));
+      }
+      // in-process and remote hooks (SS_PYTHON_WORKER_SOCKET) run the same controller
+      r = snprintf(out, len, "python:%s:%lld.%09ld:%lld", s->survey_id,
+                   (long long) st.st_mtim.tv_sec, st.st_mtim.tv_nsec, (long long) st.st_size);
+    } else {
+      r = snprintf(out, len, "generic:%s", s->survey_id);
+    }
+
+    if (r < 1 || (size_t) r >= len) {
+      BREAK_ERROR("snprintf() failed");
+    }
+  } while (0);
+
+  return retVal;
+}
+
 /**
  * Get analysis
  * dispatcher function (generic or python)
@@ -348,11 +438,18 @@ int get_analysis(struct session *s, const char **output) {
 
     if (s->nextquestions_flag & NEXTQUESTIONS_FLAG_PYTHON) {
 
-      LOG_INFO("NEXTQUESTIONS_FLAG_PYTHON set, calling get_analysis_python()");
-      fail = get_analysis_python(s, output);
-
-      if (fail) {
-        BREAK_ERRORV("get_analysis_python() failed with return code %d", fail);
+      if (py_remote_enabled()) {
+        LOG_INFO("NEXTQUESTIONS_FLAG_PYTHON set, calling get_analysis_remote()");
+        fail = get_analysis_remote(s, output);
+        if (fail) {
+          BREAK_ERRORV("get_analysis_remote() failed with return code %d", fail);
+        }
+      } else {
+        LOG_INFO("NEXTQUESTIONS_FLAG_PYTHON set, calling get_analysis_python()");
+        fail = get_analysis_python(s, output);
+        if (fail) {
+          BREAK_ERRORV("get_analysis_python() failed with return code %d", fail);
+        }
       }
 
     } else if (s->nextquestions_flag & NEXTQUESTIONS_FLAG_GENERIC) {
@@ -373,8 +470,11 @@ int get_analysis(struct session *s, const char **output) {
     // #379 update state (if not closed already) and save session
     if (s->state < SESSION_CLOSED) {
       s->state = SESSION_CLOSED;
-      if (save_session(s)) {
-        BREAK_ERROR("save_session( on SESSION_CLOSED failed");
+      s->dirty = 1;
+      fail = save_session(s);
+      if (fail) {
+        // optimistic mode: the session was changed meanwhile (SS_SESSION_CONFLICT)
+        BREAK_CODE((fail == SS_SESSION_CONFLICT) ? fail : SS_EVAL, "save_session( on SESSION_CLOSED failed");
       }
     }
 
@@ -1,12 +1,186 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "errorlog.h"
+#include "paths.h"
 #include "question_types.h"
 #include "survey.h"
 
+#define PATH_SHARD_CACHE 64 // cached session prefix directories per thread
+
+static const char *path_dir_names[PATH_DIR_MAX] = {
+  ".",
+  "sessions",
+  "locks",
+  "surveys",
+  "logs",
+};
+
+struct path_shard {
+  char prefix[5];
+  int fd;
+  unsigned long used;
+};
+
+struct path_cache {
+  const char *env;    // getenv("SURVEY_HOME") the descriptors were opened for
+  char home[1024];
+  int fds[PATH_DIR_MAX]; // fd + 1, 0: not opened
+  struct path_shard shards[PATH_SHARD_CACHE];
+  int shard_count;
+  unsigned long clock;
+};
+
+static THREAD_LOCAL struct path_cache path_cache;
+
+/**
+ * close all directory descriptors of this thread
+ */
+void paths_close(void) {
+  for (int i = 0; i < PATH_DIR_MAX; i++) {
+    if (path_cache.fds[i]) {
+      close(path_cache.fds[i] - 1);
+    }
+  }
+  for (int i = 0; i < path_cache.shard_count; i++) {
+    close(path_cache.shards[i].fd);
+  }
+  memset(&path_cache, 0, sizeof(struct path_cache));
+  return;
+}
+
+/**
+ * drops the cached descriptors if SURVEY_HOME changed (i.e. tests)
+ */
+static int path_check_home(void) {
+  char *env = getenv("SURVEY_HOME");
+  if (!env) {
+    return -1;
+  }
+  if (env == path_cache.env || !strcmp(env, path_cache.home)) {
+    path_cache.env = env;
+    return 0;
+  }
+
+  paths_close();
+  path_cache.env = env;
+  snprintf(path_cache.home, 1024, "%s", env);
+  return 0;
+}
+
+/**
+ * descriptor of SURVEY_HOME or one of its sub directories, missing sessions and locks directories are created.
+ * returns -1 on error
+ */
+int path_dirfd(enum path_dir dir) {
+  int retVal = 0;
+
+  do {
+    if (dir < 0 || dir >= PATH_DIR_MAX) {
+      BREAK_ERRORV("invalid directory %d", dir);
+    }
+    if (path_check_home()) {
+      BREAK_ERROR("SURVEY_HOME environment variable not set");
+    }
+    if (path_cache.fds[dir]) {
+      break;
+    }
+
+    int fd;
+    if (dir == PATH_DIR_HOME) {
+      fd = open(path_cache.home, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    } else {
+      int home = path_dirfd(PATH_DIR_HOME);
+      if (home < 0) {
+        BREAK_ERROR("Could not open SURVEY_HOME");
+      }
+      fd = openat(home, path_dir_names[dir], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (fd < 0 && errno == ENOENT && (dir == PATH_DIR_SESSIONS || dir == PATH_DIR_LOCKS)) {
+        mkdirat(home, path_dir_names[dir], 0750);
+        fd = openat(home, path_dir_names[dir], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      }
+    }
+
+    if (fd < 0) {
+      BREAK_ERRORV("Could not open directory '%s/%s' (errno=%d)", path_cache.home, path_dir_names[dir], errno);
+    }
+    path_cache.fds[dir] = fd + 1;
+  } while (0);
+
+  return (retVal) ? -1 : path_cache.fds[dir] - 1;
+}
+
+/**
+ * descriptor of the directory of a session (sessions/<prefix>), optionally created.
+ * returns -1 on error or if the directory does not exist
+ */
+int session_dirfd(char *session_id, int create) {
+  if (!session_id || strlen(session_id) < 4) {
+    return -1;
+  }
+
+  int sessions = path_dirfd(PATH_DIR_SESSIONS);
+  if (sessions < 0) {
+    return -1;
+  }
+
+  path_cache.clock++;
+  int lru = 0;
+  for (int i = 0; i < path_cache.shard_count; i++) {
+    struct path_shard *shard = &path_cache.shards[i];
+    if (!strncmp(shard->prefix, session_id, 4)) {
+      shard->used = path_cache.clock;
+      return shard->fd;
+    }
+    if (shard->used < path_cache.shards[lru].used) {
+      lru = i;
+    }
+  }
+
+  char prefix[5];
+  memcpy(prefix, session_id, 4);
+  prefix[4] = 0;
+
+  int fd = openat(sessions, prefix, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0 && errno == ENOENT && create) {
+    mkdirat(sessions, prefix, 0750);
+    fd = openat(sessions, prefix, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  }
+  if (fd < 0) {
+    return -1;
+  }
+
+  struct path_shard *shard;
+  if (path_cache.shard_count < PATH_SHARD_CACHE) {
+    shard = &path_cache.shards[path_cache.shard_count++];
+  } else {
+    shard = &path_cache.shards[lru];
+    close(shard->fd);
+  }
+  snprintf(shard->prefix, 5, "%s", prefix);
+  shard->fd = fd;
+  shard->used = path_cache.clock;
+
+  return fd;
+}
+
+/**
+ * open the directories of SURVEY_HOME at startup, errors are reported by later calls
+ */
+int paths_init(void) {
+  for (int dir = 0; dir < PATH_DIR_MAX; dir++) {
+    path_dirfd(dir);
+  }
+  clear_errors();
+  return 0;
+}
+
 int generate_path(char *path_in, char *path_out, int max_len) {
   int retVal = 0;
 
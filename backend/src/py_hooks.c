@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <Python.h>
 
 #include "errorlog.h"
@@ -13,6 +14,38 @@
 // TODO remove
 extern PyObject *py_module;
 
+/**
+ * Resolved hook callables, keyed by base function and survey id (<survey name>/<hash>)
+ * The cache holds a strong reference to each callable. Entries stay valid until the Python module is
+ * reloaded, see py_hooks_clear(), py_destroy().
+ */
+
+#define PY_HOOK_CACHE_SIZE 64
+
+struct py_hook {
+  char base_function[64];
+  char survey_id[1024];
+  char function_name[1024];
+  PyObject *func;
+};
+
+static struct py_hook py_hook_cache[PY_HOOK_CACHE_SIZE];
+static int py_hook_cache_next = 0; // round robin replacement
+
+/**
+ * dereference all cached hook callables, needs to be called before the Python module is unloaded
+ */
+void py_hooks_clear(void) {
+  for (int i = 0; i < PY_HOOK_CACHE_SIZE; i++) {
+    Py_XDECREF(py_hook_cache[i].func);
+    py_hook_cache[i].func = NULL;
+    py_hook_cache[i].base_function[0] = 0;
+    py_hook_cache[i].survey_id[0] = 0;
+  }
+  py_hook_cache_next = 0;
+  return;
+}
+
 /**
  * Loads Python next_question module and searches for defined functions with the following naming patterns:
  *  - <base_function>_<survey_id>_<survey_hash>
@@ -22,11 +55,14 @@ extern PyObject *py_module;
  *  - nextquestion_foo_12345
  *  - nextquestion_foo
  *  - nextquestion
- * returns a Python callable object and sets function_name (mainly for parent logging)
+ * Resolved functions are cached per base_function and survey_id.
+ * returns a new reference to the Python callable object, which the caller releases (a cache slot may be replaced
+ * while the hook runs), and sets function_name (mainly for parent logging)
  */
 static PyObject *py_get_hook_function(char *base_function, char *survey_id, char *function_name, size_t len) {
   int retVal = 0;
 
+  PyObject *parent = NULL;
   PyObject *func = NULL;
 
   do {
@@ -40,8 +76,18 @@ static PyObject *py_get_hook_function(char *base_function, char *survey_id, char
       BREAK_ERROR("survey_id is empty");
     }
 
-    PyObject *parent = PyObject_GetAttrString(py_module, "nq");
+    for (int i = 0; i < PY_HOOK_CACHE_SIZE; i++) {
+      struct py_hook *hook = &py_hook_cache[i];
+      if (hook->func && !strcmp(hook->base_function, base_function) && !strcmp(hook->survey_id, survey_id)) {
+        snprintf(function_name, len, "%s", hook->function_name);
+        Py_INCREF(hook->func);
+        return hook->func;
+      }
+    }
+
+    parent = PyObject_GetAttrString(py_module, "nq");
     if (!parent) {
+        PyErr_Clear();
         BREAK_ERROR("cannot fetch parent reference 'nq' from Python module");
     }
 
@@ -53,12 +99,12 @@ static PyObject *py_get_hook_function(char *base_function, char *survey_id, char
           function_name[i] = '_';
         }
     }
-    LOG_INFOV("Searching for python function '%s'", function_name);
     func = PyObject_GetAttrString(parent, function_name);
 
     // 2. <base_function>_<survey_id>()
 
     if (!func) {
+        PyErr_Clear();
         // Try again without _hash on the end
         snprintf(function_name, len, "%s_%s", base_function, survey_id);
         for (int i = 0; function_name[i]; i++) {
@@ -66,19 +112,19 @@ static PyObject *py_get_hook_function(char *base_function, char *survey_id, char
               function_name[i] = 0;
           }
         }
-        LOG_INFOV("Searching for python function '%s'", function_name);
         func = PyObject_GetAttrString(parent, function_name);
     }
 
     // 2. <base_function>()
 
     if (!func) {
+        PyErr_Clear();
         snprintf(function_name, len, "%s", base_function);
-        LOG_INFOV("Searching for python function '%s'", function_name);
         func = PyObject_GetAttrString(parent, function_name);
     }
 
     if (!func) {
+        PyErr_Clear();
         BREAK_ERRORV("No matching python function for base '%s', survey '%s'", base_function, survey_id);
     }
 
@@ -86,10 +132,27 @@ static PyObject *py_get_hook_function(char *base_function, char *survey_id, char
         BREAK_ERRORV("Python function '%s' is not a callable, survey '%s'", function_name, survey_id);
     }
 
-    LOG_INFOV("Preparing to call python hook '%s()' for base function '%s()'", base_function, function_name);
+    if (!strcmp(function_name, base_function)) {
+      LOG_INFOV("No survey specific python hook for survey '%s', falling back to generic '%s()'", survey_id, function_name);
+    } else {
+      LOG_INFOV("Resolved python hook '%s()' for base function '%s()', survey '%s'", function_name, base_function, survey_id);
+    }
+
+    // the cache keeps its own reference
+    struct py_hook *hook = &py_hook_cache[py_hook_cache_next];
+    py_hook_cache_next = (py_hook_cache_next + 1) % PY_HOOK_CACHE_SIZE;
+
+    Py_XDECREF(hook->func);
+    snprintf(hook->base_function, sizeof(hook->base_function), "%s", base_function);
+    snprintf(hook->survey_id, sizeof(hook->survey_id), "%s", survey_id);
+    snprintf(hook->function_name, sizeof(hook->function_name), "%s", function_name);
+    Py_INCREF(func);
+    hook->func = func;
 
   } while(0);
 
+  Py_XDECREF(parent);
+
   if (retVal) {
     Py_XDECREF(func);
     return NULL;
@@ -99,19 +162,20 @@ static PyObject *py_get_hook_function(char *base_function, char *survey_id, char
 };
 
 /**
- * Creates an answer Py_Dict
+ * Creates an answer Py_Dict, including (#449) some merged question properties prefixed with an underscore.
+ * For the sake of simplicitiy we refrain from creating a nested question dict.
+ * Keys are the interned strings shared with the surveysystem.Answer proxy type (py_session.c),
+ * question property values are shared with the cached question mapping (py_survey_objects())
  *
  * the caller is responsible for derferencing the dict:  if(dict) Py_DECREF(dict);
  */
-static PyObject *py_create_answer(struct answer *a) {
+static PyObject *py_create_answer(struct answer *a, PyObject *question) {
   int retVal = 0;
   PyObject *dict = NULL;
 
   do {
-    // #358 include question type
-    char stype[50];
-    if(!serialise_question_type(a->type, stype, 50)) { // serialise_question_type returns str length
-        return NULL;
+    if (!question) {
+      BREAK_ERRORV("question for answer '%s' is NULL", a->uid);
     }
 
     dict = PyDict_New();
@@ -119,53 +183,17 @@ static PyObject *py_create_answer(struct answer *a) {
       BREAK_ERROR("failed to create answer dict");
     }
 
-    PyObject *uid = PyUnicode_FromString(a->uid);
-    PyObject *type = PyUnicode_FromString(stype);
-    PyObject *text = PyUnicode_FromString(a->text);
-    PyObject *value = PyLong_FromLongLong(a->value);
-    PyObject *lat = PyLong_FromLongLong(a->lat);
-    PyObject *lon = PyLong_FromLongLong(a->lon);
-    PyObject *time_begin = PyLong_FromLongLong(a->time_begin);
-    PyObject *time_end = PyLong_FromLongLong(a->time_end);
-    PyObject *time_zone_delta = PyLong_FromLongLong(a->time_zone_delta);
-    PyObject *dst_delta = PyLong_FromLongLong(a->dst_delta);
-    //# 299
-    PyObject *unit = PyUnicode_FromString(a->unit);
-    PyObject *flags = PyLong_FromLongLong(a->flags);
-    PyObject *stored = PyLong_FromLongLong(a->stored);
-
-    PyObject *uid_l = PyUnicode_FromString("uid");
-    PyObject *type_l = PyUnicode_FromString("type");
-    PyObject *text_l = PyUnicode_FromString("text");
-    PyObject *value_l = PyUnicode_FromString("value");
-    PyObject *lat_l = PyUnicode_FromString("latitude");
-    PyObject *lon_l = PyUnicode_FromString("longitude");
-    PyObject *time_begin_l = PyUnicode_FromString("time_begin");
-    PyObject *time_end_l = PyUnicode_FromString("time_end");
-    PyObject *time_zone_delta_l = PyUnicode_FromString("time_zone_delta");
-    PyObject *dst_delta_l = PyUnicode_FromString("dst_delta");
-    //# 299
-    PyObject *unit_l = PyUnicode_FromString("unit");
-    PyObject *flags_l = PyUnicode_FromString("flags");
-    PyObject *stored_l = PyUnicode_FromString("stored");
-
-    int errors = PyDict_SetItem(dict, uid_l, uid);
-    errors += PyDict_SetItem(dict, type_l, type);
-    errors += PyDict_SetItem(dict, text_l, text);
-    errors += PyDict_SetItem(dict, value_l, value);
-    errors += PyDict_SetItem(dict, lat_l, lat);
-    errors += PyDict_SetItem(dict, lon_l, lon);
-    errors += PyDict_SetItem(dict, time_begin_l, time_begin);
-    errors += PyDict_SetItem(dict, time_end_l, time_end);
-    errors += PyDict_SetItem(dict, time_zone_delta_l, time_zone_delta);
-    errors += PyDict_SetItem(dict, dst_delta_l, dst_delta);
-    //# 299
-    errors += PyDict_SetItem(dict, unit_l, unit);
-    errors += PyDict_SetItem(dict, flags_l, flags);
-    errors += PyDict_SetItem(dict, stored_l, stored);
-
-    if (errors) {
-      BREAK_ERRORV("setting dict item failed with %d errors", errors);
+    for (int field = 0; py_answer_key(field); field++) {
+      PyObject *value = py_answer_field_value(a, question, field);
+      if (!value) {
+        BREAK_ERRORV("creating value for answer field '%s' failed", PyUnicode_AsUTF8(py_answer_key(field)));
+      }
+
+      int error = PyDict_SetItem(dict, py_answer_key(field), value);
+      Py_DECREF(value);
+      if (error) {
+        BREAK_ERRORV("setting dict item '%s' failed", PyUnicode_AsUTF8(py_answer_key(field)));
+      }
     }
 
   } while (0);
@@ -178,90 +206,13 @@ static PyObject *py_create_answer(struct answer *a) {
   return dict;
 }
 
-/**
- * Creates and a Python list of question uids for an existing session
- * #445
- * returns PyObject pointer or NULL on error
- */
-static PyObject *py_create_questions_list(struct session *ses) {
-    int retVal = 0;
-    PyObject *questions = NULL;
-
-    do {
-        questions = PyList_New(ses->question_count);
-
-        // build arguments: questions list
-        for (int i = 0; i < ses->question_count; i++) {
-            PyObject *item = PyUnicode_FromString(ses->questions[i]->uid);
-            if (PyList_SetItem(questions, i, item)) {
-                Py_DECREF(item);
-                BREAK_ERRORV("Error inserting question name '%s' into Python list", ses->questions[i]->uid);
-            }
-        }
-    } while(0);
-
-    if (retVal) {
-        Py_XDECREF(questions);
-        return NULL;
-    }
-
-    return questions;
-}
-
-/**
- * Merges some question properties into py dict answer
- * Question properties are prefixed with an underscore. For the sake of simplicitiy we refrain from creating a nested question dict.
- * Note: This function will not DECREF the answer dict on failure
- * #449
- */
-static int py_answer_merge_question(PyObject *ans, struct question *qn) {
-  int retVal = 0;
-
-  do {
-    if(!PyDict_Check(ans)) {
-      BREAK_ERROR("py dict answer is NULL or not a dict");
-    }
-    if(!qn) {
-      BREAK_ERROR("question is NULL");
-    }
-
-    PyObject *_flags = PyUnicode_FromString("_flags");
-    PyObject *_default_value = PyUnicode_FromString("_default_value");
-    PyObject *_min_value = PyUnicode_FromString("_min_value");
-    PyObject *_max_value = PyUnicode_FromString("_max_value");
-    PyObject *_choices = PyUnicode_FromString("_choices");
-    PyObject *_unit = PyUnicode_FromString("_unit"); // #448
-
-    PyObject *flags = PyLong_FromLongLong(qn->flags);
-    PyObject *default_value = PyUnicode_FromString(qn->default_value);
-    PyObject *min_value = PyLong_FromLongLong(qn->min_value);
-    PyObject *max_value = PyLong_FromLongLong(qn->max_value);
-    PyObject *choices = PyUnicode_FromString(qn->choices);
-    PyObject *unit = PyUnicode_FromString(qn->unit);
-
-    int errors = PyDict_SetItem(ans, _flags, flags);
-    errors += PyDict_SetItem(ans, _default_value, default_value);
-    errors += PyDict_SetItem(ans, _min_value, min_value);
-    errors += PyDict_SetItem(ans, _max_value, max_value);
-    errors += PyDict_SetItem(ans, _choices, choices);
-    errors += PyDict_SetItem(ans, _unit, unit);
-
-    if (errors) {
-      BREAK_ERRORV("setting dict item to py answer failed with %d errors", errors);
-    }
-
-  } while(0);
-
-  return retVal;
-}
-
 /**
  * Creates and a Python list of answer dicts for an existing session.
  * Header answers and system answers are excluded
  * #445
  * returns PyObject pointer or NULL on error
  */
-static PyObject *py_create_answers_list(struct session *ses) {
+static PyObject *py_create_answers_list(struct session *ses, PyObject *meta) {
     int retVal = 0;
     PyObject *answers = NULL;
 
@@ -273,19 +224,14 @@ static PyObject *py_create_answers_list(struct session *ses) {
         for (int i = ses->answer_offset; i < ses->answer_count; i++) {
 
           if (is_given_answer(ses->answers[i])) {
-            PyObject *item = py_create_answer(ses->answers[i]);
+            PyObject *question = py_survey_question(ses, meta, ses->answers[i]->uid);
+            PyObject *item = py_create_answer(ses->answers[i], question);
             if (!item) {
-              BREAK_ERRORV("Could not construct answer structure '%s' for Python. WARNING: Memory has been leaked.", ses->answers[i]->uid);
-            }
-
-            struct question *qn = session_get_question(ses->answers[i]->uid, ses);
-            if (py_answer_merge_question(item, qn)) {
-              Py_DECREF(item);
-              BREAK_ERRORV("Error merging question properties into PyDict answer '%s'", ses->answers[i]->uid);
+              BREAK_ERRORV("Could not construct answer structure '%s' for Python.", ses->answers[i]->uid);
             }
 
+            // steals item reference, also on failure
             if (PyList_SetItem(answers, listIndex, item)) {
-              Py_DECREF(item);
               BREAK_ERRORV("Error inserting answer name '%s' into Python list", ses->answers[i]->uid);
             }
 
@@ -308,14 +254,21 @@ static PyObject *py_create_answers_list(struct session *ses) {
  * Compiles arguments for a python callable (hook) and executes it
  * returns result
  *
+ * questions are passed as the cached tuple of question uids of the survey snapshot (py_survey_objects()),
+ * answers as a lazy surveysystem.Answers proxy (py_session.c).
+ * If env SS_PYTHON_HOOK_ARGS is set to "dicts" a list of question uids and a list of answer dicts are passed instead.
+ *
  * The result can be NULL. It's up to the callee to evaluate whether this is considered as an error or not.
  */
 static PyObject *py_invoke_hook_function(PyObject *function_reference, char *function_name, struct session *ses, enum actions action, int affected_answers_count) {
   int retVal = 0;
 
+  PyObject *args = NULL;
   PyObject *kwargs = NULL;
   PyObject *questions = NULL;
+  PyObject *meta = NULL;
   PyObject *answers = NULL;
+  int proxy = 0;
 
   PyObject *result = NULL;
 
@@ -332,17 +285,35 @@ static PyObject *py_invoke_hook_function(PyObject *function_reference, char *fun
 
     // build positional args
 
-    questions = py_create_questions_list(ses);
-    if (!questions) {
-        BREAK_ERROR("Error building positional arg (questions list)");
+    if (py_survey_objects(ses, &questions, &meta)) {
+        py_log_error(NULL);
+        BREAK_ERROR("Error building positional arg (questions)");
     }
 
-    answers = py_create_answers_list(ses);
+    char *hook_args = getenv("SS_PYTHON_HOOK_ARGS");
+    if (hook_args && !strcmp(hook_args, "dicts")) {
+      // hooks may modify the list, pass a copy
+      PyObject *list = PySequence_List(questions);
+      Py_DECREF(questions);
+      questions = list;
+      if (!questions) {
+        py_log_error(NULL);
+        BREAK_ERROR("Error building positional arg (questions list)");
+      }
+      answers = py_create_answers_list(ses, meta);
+    } else {
+      answers = py_session_answers(ses, meta);
+      proxy = 1;
+    }
     if (!answers) {
-        BREAK_ERROR("Error building positional arg (answers list)");
+        py_log_error(NULL);
+        BREAK_ERROR("Error building positional arg (answers)");
     }
 
-    PyObject *args = PyTuple_Pack(2, questions, answers);
+    args = PyTuple_Pack(2, questions, answers);
+    if (!args) {
+        BREAK_ERROR("Error building positional args");
+    }
 
     // build context args
 
@@ -358,9 +329,25 @@ static PyObject *py_invoke_hook_function(PyObject *function_reference, char *fun
       LOG_INFO("Failed to build keyword args (context)");
     }
 
+    // time budget and latency statistics, see py_watchdog.c, py_stats.c
+    int budget = py_hook_budget(ses);
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    py_watchdog_arm(budget);
     result = PyObject_Call(function_reference, args, kwargs);
-    Py_XDECREF(args);
-    Py_XDECREF(kwargs);
+    int expired = py_watchdog_disarm();
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    unsigned long long us = (end.tv_sec - begin.tv_sec) * 1000000ULL + (end.tv_nsec - begin.tv_nsec) / 1000;
+    int failed = (result == NULL || PyErr_Occurred());
+    py_stats_record(function_name, us, failed, expired && failed);
+
+    if (expired && failed) {
+      PyErr_Clear();
+      py_hook_set_timed_out(1);
+      BREAK_CODEV(SS_SYSTEM_HOOK_TIMEOUT, "Python function '%s' exceeded its time budget of %d ms", function_name, budget);
+    }
 
     if (PyErr_Occurred()) {
       py_log_error(NULL);
@@ -369,11 +356,18 @@ static PyObject *py_invoke_hook_function(PyObject *function_reference, char *fun
 
   } while(0);
 
-  if (retVal) {
-    Py_XDECREF(kwargs);
-    Py_XDECREF(questions);
+  Py_XDECREF(args);
+  Py_XDECREF(kwargs);
+  Py_XDECREF(questions);
+  Py_XDECREF(meta);
+  if (proxy) {
+    // answers kept by the hook are detached from the session
+    py_session_answers_release(answers);
+  } else {
     Py_XDECREF(answers);
+  }
 
+  if (retVal) {
     Py_XDECREF(result);
     return NULL;
   }
@@ -446,8 +440,11 @@ static int py_nextquestions_handle_progress(PyObject *result, struct nextquestio
 int get_next_question_python(struct session *ses, struct nextquestions *nq, enum actions action, int affected_answers_count) {
   int retVal = 0;
   int is_error = 0;
+  PyObject *function_reference = NULL;
   PyObject *result = NULL;
 
+  py_hook_set_timed_out(0);
+
   do {
     if (!ses) {
       BREAK_ERROR("session is null");
@@ -475,7 +472,7 @@ int get_next_question_python(struct session *ses, struct nextquestions *nq, enum
 
     // select from avaliable hook functions
     char function_name[1024];
-    PyObject *function_reference = py_get_hook_function("nextquestion", ses->survey_id, function_name, 1024);
+    function_reference = py_get_hook_function("nextquestion", ses->survey_id, function_name, 1024);
     if (!function_reference) {
       BREAK_ERROR("Failed to get hook function for 'nextquestion'");
     }
@@ -574,6 +571,8 @@ int get_next_question_python(struct session *ses, struct nextquestions *nq, enum
   } while (0);
 
   Py_XDECREF(result);
+  Py_XDECREF(function_reference);
+
   if (is_error) {
     retVal = -99;
   }
@@ -588,8 +587,11 @@ int get_next_question_python(struct session *ses, struct nextquestions *nq, enum
  */
 int get_analysis_python(struct session *ses, const char **output) {
   int retVal = 0;
+  PyObject *function_reference = NULL;
   PyObject *result = NULL;
 
+  py_hook_set_timed_out(0);
+
   do {
     if (!ses) {
       BREAK_ERROR("session is null");
@@ -611,7 +613,7 @@ int get_analysis_python(struct session *ses, const char **output) {
 
     // select from avaliable hook functions
     char function_name[1024];
-    PyObject *function_reference = py_get_hook_function("analyse", ses->survey_id, function_name, 1024);
+    function_reference = py_get_hook_function("analyse", ses->survey_id, function_name, 1024);
     if (!function_reference) {
       BREAK_ERROR("Failed to get hook function for 'analyse'");
     }
@@ -647,5 +649,7 @@ int get_analysis_python(struct session *ses, const char **output) {
   } while (0);
 
   Py_XDECREF(result);
+  Py_XDECREF(function_reference);
+
   return retVal;
 }
@@ -0,0 +1,556 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "errorlog.h"
+#include "serialisers.h"
+#include "sha1.h"
+#include "survey.h"
+#include "utils.h"
+#include "py_module.h"
+
+/**
+ * Memoisation of nextquestion hook results (survey directive "with python memoise[=disk]")
+ *
+ * For surveys whose nextquestion hook is a pure function of the survey snapshot, the given answers and the action
+ * (the hook must not depend on session_id or on time), the result of a hook call is stored under the sha1 of
+ * the hook identity (get_hook_id()), the action, the affected answer count and the checksum serialisations
+ * (ANSWER_SCOPE_CHECKSUM) of the given answers. Identical session states skip the interpreter.
+ *
+ * Results are kept in a bounded LRU per process (ENV SS_PYTHON_MEMO_SIZE entries) and, with "memoise=disk", in
+ * SURVEY_HOME/memo/<xx>/<key>, shared by all processes. Memo files can be removed at any time.
+ * The disk store is bounded as well: a write trims its directory to SS_PYTHON_MEMO_DISK_SIZE / 256 entries, least
+ * recently used first (hits update the mtime), and removes entries older than SS_PYTHON_MEMO_DISK_AGE seconds.
+ */
+
+#define PY_MEMO_SIZE 1024 // entries, ENV SS_PYTHON_MEMO_SIZE
+#define PY_MEMO_DISK_SIZE 65536 // entries, ENV SS_PYTHON_MEMO_DISK_SIZE
+#define PY_MEMO_DISK_AGE 604800 // seconds, ENV SS_PYTHON_MEMO_DISK_AGE
+#define PY_MEMO_DISK_DIRS 256 // memo/<xx>
+#define PY_MEMO_TEMP_AGE 60 // seconds, leftover temp files of crashed writers
+#define PY_MEMO_BUCKETS 1024
+#define PY_MEMO_DIR "memo"
+
+struct py_memo_entry {
+  char key[HASHSTRING_LENGTH + 1];
+  char *value;
+  struct py_memo_entry *prev; // LRU list, head is the most recently used entry
+  struct py_memo_entry *next;
+  struct py_memo_entry *chain; // hash bucket
+};
+
+static struct py_memo_entry *py_memo_buckets[PY_MEMO_BUCKETS];
+static struct py_memo_entry *py_memo_head = NULL;
+static struct py_memo_entry *py_memo_tail = NULL;
+static int py_memo_count = 0;
+static pthread_mutex_t py_memo_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int py_memo_bucket(const char *key) {
+  char prefix[9];
+  memcpy(prefix, key, 8);
+  prefix[8] = 0;
+  return (unsigned int) strtoul(prefix, NULL, 16) % PY_MEMO_BUCKETS;
+}
+
+static void py_memo_unlink(struct py_memo_entry *entry) {
+  if (entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    py_memo_head = entry->next;
+  }
+  if (entry->next) {
+    entry->next->prev = entry->prev;
+  } else {
+    py_memo_tail = entry->prev;
+  }
+  entry->prev = NULL;
+  entry->next = NULL;
+}
+
+static void py_memo_push(struct py_memo_entry *entry) {
+  entry->next = py_memo_head;
+  if (py_memo_head) {
+    py_memo_head->prev = entry;
+  }
+  py_memo_head = entry;
+  if (!py_memo_tail) {
+    py_memo_tail = entry;
+  }
+}
+
+static void py_memo_evict(struct py_memo_entry *entry) {
+  struct py_memo_entry **link = &py_memo_buckets[py_memo_bucket(entry->key)];
+  while (*link && *link != entry) {
+    link = &(*link)->chain;
+  }
+  if (*link) {
+    *link = entry->chain;
+  }
+
+  py_memo_unlink(entry);
+  free(entry->value);
+  free(entry);
+  py_memo_count--;
+}
+
+/**
+ * lookup in the process LRU, called with the mutex held, returns a copy of the value
+ */
+static char *py_memo_lru_get(const char *key) {
+  for (struct py_memo_entry *entry = py_memo_buckets[py_memo_bucket(key)]; entry; entry = entry->chain) {
+    if (!strcmp(entry->key, key)) {
+      py_memo_unlink(entry);
+      py_memo_push(entry);
+      return strdup(entry->value);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * insert into the process LRU, called with the mutex held
+ */
+static int py_memo_lru_put(const char *key, const char *value) {
+  int retVal = 0;
+
+  do {
+    for (struct py_memo_entry *entry = py_memo_buckets[py_memo_bucket(key)]; entry; entry = entry->chain) {
+      if (!strcmp(entry->key, key)) {
+        py_memo_evict(entry);
+        break;
+      }
+    }
+
+    int size = env_limit("SS_PYTHON_MEMO_SIZE", PY_MEMO_SIZE);
+    while (py_memo_count >= size && py_memo_tail) {
+      py_memo_evict(py_memo_tail);
+    }
+
+    struct py_memo_entry *entry = calloc(1, sizeof(struct py_memo_entry));
+    BREAK_IF(entry == NULL, SS_ERROR_MEM, "calloc(struct py_memo_entry)");
+    entry->value = strdup(value);
+    if (!entry->value) {
+      free(entry);
+      BREAK_CODE(SS_ERROR_MEM, "strdup(py_memo_entry->value)");
+    }
+    snprintf(entry->key, HASHSTRING_LENGTH + 1, "%s", key);
+
+    unsigned int bucket = py_memo_bucket(key);
+    entry->chain = py_memo_buckets[bucket];
+    py_memo_buckets[bucket] = entry;
+    py_memo_push(entry);
+    py_memo_count++;
+  } while (0);
+
+  return retVal;
+}
+
+/**
+ * path of a memo file (SURVEY_HOME/memo/<first two key chars>/<key>), optionally creates the directories
+ */
+static int py_memo_path(const char *key, const char *prefix, char *path_out, int max_len, int create) {
+  int retVal = 0;
+
+  do {
+    char path_in[1024];
+
+    if (create) {
+      if (generate_path(PY_MEMO_DIR, path_out, max_len)) {
+        BREAK_CODE(SS_SYSTEM_FILE_PATH, "generate_path() failed for memo dir");
+      }
+      mkdir(path_out, 0750);
+
+      snprintf(path_in, 1024, "%s/%.2s", PY_MEMO_DIR, key);
+      if (generate_path(path_in, path_out, max_len)) {
+        BREAK_CODEV(SS_SYSTEM_FILE_PATH, "generate_path('%s') failed", path_in);
+      }
+      mkdir(path_out, 0750);
+    }
+
+    snprintf(path_in, 1024, "%s/%.2s/%s%s", PY_MEMO_DIR, key, (prefix) ? prefix : "", key);
+    if (generate_path(path_in, path_out, max_len)) {
+      BREAK_CODEV(SS_SYSTEM_FILE_PATH, "generate_path('%s') failed", path_in);
+    }
+  } while (0);
+
+  return retVal;
+}
+
+static char *py_memo_disk_get(const char *key) {
+  char path[1024];
+  struct file_map map;
+
+  if (py_memo_path(key, NULL, path, 1024, 0) || access(path, F_OK)) {
+    return NULL;
+  }
+  if (map_file(path, &map)) {
+    return NULL;
+  }
+
+  char *value = strdup(map.data);
+  unmap_file(&map);
+
+  // recently used, see py_memo_disk_trim()
+  utimensat(AT_FDCWD, path, NULL, 0);
+  return value;
+}
+
+struct py_memo_file {
+  struct timespec mtime;
+  char name[HASHSTRING_LENGTH + 1];
+};
+
+static int py_memo_file_cmp(const void *a, const void *b) {
+  const struct py_memo_file *fa = a;
+  const struct py_memo_file *fb = b;
+  if (fa->mtime.tv_sec != fb->mtime.tv_sec) {
+    return (fa->mtime.tv_sec < fb->mtime.tv_sec) ? -1 : 1;
+  }
+  if (fa->mtime.tv_nsec != fb->mtime.tv_nsec) {
+    return (fa->mtime.tv_nsec < fb->mtime.tv_nsec) ? -1 : 1;
+  }
+  return strcmp(fa->name, fb->name);
+}
+
+/**
+ * bound the memo directory of a key: remove expired entries and temp files, then the least recently used entries
+ * above SS_PYTHON_MEMO_DISK_SIZE / PY_MEMO_DISK_DIRS, returns the number of removed entries
+ */
+static int py_memo_disk_trim(const char *key) {
+  int removed = 0;
+  DIR *dir = NULL;
+  struct py_memo_file *files = NULL;
+
+  do {
+    int size = env_limit("SS_PYTHON_MEMO_DISK_SIZE", PY_MEMO_DISK_SIZE);
+    int age = env_limit("SS_PYTHON_MEMO_DISK_AGE", PY_MEMO_DISK_AGE);
+    size_t keep = (size_t) (size + PY_MEMO_DISK_DIRS - 1) / PY_MEMO_DISK_DIRS;
+
+    char path_in[1024];
+    char path[1024];
+    snprintf(path_in, 1024, "%s/%.2s", PY_MEMO_DIR, key);
+    if (generate_path(path_in, path, 1024)) {
+      break;
+    }
+
+    dir = opendir(path);
+    if (!dir) {
+      break;
+    }
+    int dfd = dirfd(dir);
+    time_t now = time(NULL);
+
+    size_t count = 0;
+    size_t cap = 0;
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+      if (de->d_name[0] == '.') {
+        continue;
+      }
+
+      struct stat st;
+      if (fstatat(dfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) || !S_ISREG(st.st_mode)) {
+        continue;
+      }
+
+      int temp = !strncmp(de->d_name, "write.", 6);
+      if (!temp && strlen(de->d_name) != HASHSTRING_LENGTH) {
+        continue;
+      }
+      if (now - st.st_mtime > ((temp) ? PY_MEMO_TEMP_AGE : age)) {
+        if (!unlinkat(dfd, de->d_name, 0) && !temp) {
+          removed++;
+        }
+        continue;
+      }
+      if (temp) {
+        continue;
+      }
+
+      if (count == cap) {
+        cap = (cap) ? cap * 2 : 64;
+        struct py_memo_file *grown = realloc(files, cap * sizeof(struct py_memo_file));
+        if (!grown) {
+          LOG_WARNV("realloc(%zu memo files) failed", cap);
+          break;
+        }
+        files = grown;
+      }
+      files[count].mtime = st.st_mtim;
+      memcpy(files[count].name, de->d_name, HASHSTRING_LENGTH + 1);
+      count++;
+    }
+
+    if (count > keep) {
+      qsort(files, count, sizeof(struct py_memo_file), py_memo_file_cmp);
+      for (size_t i = 0; i < count - keep; i++) {
+        if (!unlinkat(dfd, files[i].name, 0)) {
+          removed++;
+        }
+      }
+    }
+  } while (0);
+
+  free(files);
+  if (dir) {
+    closedir(dir);
+  }
+
+  return removed;
+}
+
+static int py_memo_disk_put(const char *key, const char *value) {
+  int retVal = 0;
+  FILE *fp = NULL;
+  char temp_path[1024] = { 0 };
+
+  do {
+    char path[1024];
+    if (py_memo_path(key, NULL, path, 1024, 1)) {
+      BREAK_CODE(SS_SYSTEM_FILE_PATH, "failed to build memo path");
+    }
+
+    char prefix[64];
+    snprintf(prefix, 64, "write.%d.%lx.", (int) getpid(), (unsigned long) pthread_self());
+    if (py_memo_path(key, prefix, temp_path, 1024, 0)) {
+      temp_path[0] = 0;
+      BREAK_CODE(SS_SYSTEM_FILE_PATH, "failed to build memo path");
+    }
+
+    fp = fopen(temp_path, "w");
+    if (!fp) {
+      BREAK_CODEV(SS_ERROR_OPEN_FILE, "Could not create memo file '%s'", temp_path);
+    }
+    fputs(value, fp);
+    int res = fclose(fp);
+    fp = NULL;
+    if (res) {
+      BREAK_CODEV(SS_ERROR_OPEN_FILE, "Could not write memo file '%s'", temp_path);
+    }
+
+    if (rename(temp_path, path)) {
+      BREAK_CODEV(SS_ERROR_OPEN_FILE, "rename('%s','%s') failed for memo file (errno=%d)", temp_path, path, errno);
+    }
+    temp_path[0] = 0;
+
+    py_memo_disk_trim(key);
+  } while (0);
+
+  if (fp) {
+    fclose(fp);
+  }
+  if (temp_path[0]) {
+    unlink(temp_path);
+  }
+
+  return retVal;
+}
+
+/**
+ * memoisation key of a nextquestion hook call, key_out needs HASHSTRING_LENGTH + 1 bytes
+ */
+int py_memo_key(struct session *ses, enum actions action, int affected_answers_count, char *key_out, size_t len) {
+  int retVal = 0;
+  char *line = NULL;
+
+  do {
+    BREAK_IF(ses == NULL, SS_ERROR_ARG, "ses");
+    BREAK_IF(key_out == NULL || len < HASHSTRING_LENGTH + 1, SS_ERROR_ARG, "key_out");
+
+    line = malloc(MAX_LINE);
+    BREAK_IF(line == NULL, SS_ERROR_MEM, "malloc(line)");
+
+    char hook_id[1024];
+    if (get_hook_id(ses, hook_id, 1024)) {
+      BREAK_ERROR("get_hook_id() failed");
+    }
+
+    sha1nfo info;
+    sha1_init(&info);
+
+    snprintf(line, MAX_LINE, "nextquestion\n%s\n%d\n%d\n", hook_id, (int) action, affected_answers_count);
+    sha1_write(&info, line, strlen(line));
+
+    // the answers passed to the hook
+    for (int i = ses->answer_offset; i < ses->answer_count; i++) {
+      if (!is_given_answer(ses->answers[i])) {
+        continue;
+      }
+      if (serialise_answer(ses->answers[i], ANSWER_SCOPE_CHECKSUM, line, MAX_LINE)) {
+        BREAK_ERRORV("serialise_answer() failed for answer '%s'", ses->answers[i]->uid);
+      }
+      sha1_write(&info, line, strlen(line));
+      sha1_write(&info, "\n", 1);
+    }
+    if (retVal) {
+      break;
+    }
+
+    if (sha1_hash(&info, key_out)) {
+      BREAK_ERROR("sha1_hash() failed");
+    }
+  } while (0);
+
+  free(line);
+  return retVal;
+}
+
+/**
+ * memoised hook result (py_nextquestions_serialise() format) or NULL, the caller frees the result
+ */
+char *py_memo_get(struct session *ses, const char *key) {
+  char *value = NULL;
+
+  pthread_mutex_lock(&py_memo_mutex);
+  value = py_memo_lru_get(key);
+  pthread_mutex_unlock(&py_memo_mutex);
+
+  if (!value && ses && ses->survey && ses->survey->python_memoise == PY_MEMO_DISK) {
+    value = py_memo_disk_get(key);
+    if (value) {
+      pthread_mutex_lock(&py_memo_mutex);
+      py_memo_lru_put(key, value);
+      pthread_mutex_unlock(&py_memo_mutex);
+    }
+  }
+
+  return value;
+}
+
+/**
+ * memoise the result of a hook call
+ */
+int py_memo_put(struct session *ses, const char *key, struct nextquestions *nq) {
+  int retVal = 0;
+  char *value = NULL;
+
+  do {
+    BREAK_IF(ses == NULL, SS_ERROR_ARG, "ses");
+    BREAK_IF(key == NULL, SS_ERROR_ARG, "key");
+
+    value = py_nextquestions_serialise(nq);
+    BREAK_IF(value == NULL, SS_ERROR_MEM, "py_nextquestions_serialise()");
+
+    pthread_mutex_lock(&py_memo_mutex);
+    int res = py_memo_lru_put(key, value);
+    pthread_mutex_unlock(&py_memo_mutex);
+    if (res) {
+      BREAK_CODE(res, "py_memo_lru_put() failed");
+    }
+
+    if (ses->survey && ses->survey->python_memoise == PY_MEMO_DISK) {
+      res = py_memo_disk_put(key, value);
+      if (res) {
+        BREAK_CODE(res, "py_memo_disk_put() failed");
+      }
+    }
+  } while (0);
+
+  free(value);
+  return retVal;
+}
+
+/**
+ * empty the process LRU
+ */
+void py_memo_clear(void) {
+  pthread_mutex_lock(&py_memo_mutex);
+  while (py_memo_tail) {
+    py_memo_evict(py_memo_tail);
+  }
+  pthread_mutex_unlock(&py_memo_mutex);
+  return;
+}
+
+/**
+ * Serialise the result of a nextquestion hook: "<status>\n<progress0> <progress1>\n<count>\n<uid>\n...<message>"
+ * (memo entries and python worker replies, see py_remote.c)
+ */
+char *py_nextquestions_serialise(struct nextquestions *nq) {
+  if (!nq) {
+    return NULL;
+  }
+
+  const char *message = (nq->message) ? nq->message : "";
+  size_t len = 64 + strlen(message);
+  for (int i = 0; i < nq->question_count; i++) {
+    len += strlen(nq->next_questions[i]->uid) + 1;
+  }
+
+  char *out = malloc(len);
+  if (!out) {
+    return NULL;
+  }
+
+  size_t offset = snprintf(out, len, "%d\n%d %d\n%d\n", (int) nq->status, nq->progress[0], nq->progress[1], nq->question_count);
+  for (int i = 0; i < nq->question_count; i++) {
+    offset += snprintf(out + offset, len - offset, "%s\n", nq->next_questions[i]->uid);
+  }
+  snprintf(out + offset, len - offset, "%s", message);
+
+  return out;
+}
+
+/**
+ * Apply a serialised nextquestion hook result to nq, adds the next questions of the session (add_next_question())
+ * body is modified
+ */
+int py_nextquestions_deserialise(struct session *ses, struct nextquestions *nq, enum actions action, char *body) {
+  int retVal = 0;
+
+  do {
+    BREAK_IF(ses == NULL, SS_ERROR_ARG, "ses");
+    BREAK_IF(nq == NULL, SS_ERROR_ARG, "nq");
+    BREAK_IF(body == NULL, SS_ERROR_ARG, "body");
+
+    char *saveptr = NULL;
+    char *line = NULL;
+    int status, count;
+
+    line = strtok_r(body, "\n", &saveptr);
+    if (!line || sscanf(line, "%d", &status) != 1) {
+      BREAK_ERROR("Hook result: invalid member 'status'");
+    }
+    nq->status = status;
+
+    line = strtok_r(NULL, "\n", &saveptr);
+    if (!line || sscanf(line, "%d %d", &nq->progress[0], &nq->progress[1]) != 2) {
+      BREAK_ERROR("Hook result: invalid member 'progress'");
+    }
+
+    line = strtok_r(NULL, "\n", &saveptr);
+    if (!line || sscanf(line, "%d", &count) != 1 || count < 0) {
+      BREAK_ERROR("Hook result: invalid member 'next_questions'");
+    }
+
+    for (int i = 0; i < count; i++) {
+      char *uid = strtok_r(NULL, "\n", &saveptr);
+      if (!uid) {
+        BREAK_ERRORV("Hook result: %d of %d next questions missing", count - i, count);
+      }
+      struct question *qn = session_get_question(uid, ses);
+      if (!qn) {
+        BREAK_ERRORV("Error adding question '%s' to list of next questions, question does not exist.", uid);
+      }
+      if (add_next_question(action, qn, nq, ses)) {
+        BREAK_ERRORV("Error adding question '%s' to list of next questions", uid);
+      }
+    }
+    if (retVal) {
+      break;
+    }
+
+    // remaining bytes: message (may contain newlines)
+    nq->message = strdup((saveptr) ? saveptr : "");
+  } while (0);
+
+  return retVal;
+}
@@ -94,6 +94,11 @@ int py_destroy() {
   int retVal = 0;
 
   do {
+    // cached hook functions, snapshot objects and proxy types belong to the interpreter
+    py_hooks_clear();
+    py_survey_cache_clear();
+    py_session_types_clear();
+
     Py_XDECREF(py_module);
     Py_XDECREF(py_globals);
     Py_XDECREF(py_func_traceback);
@@ -163,6 +168,11 @@ static int py_module_init() {
 
     py_globals = PyModule_GetDict(py_module);
 
+    // lazy session proxies for hook args, must be available before nextquestion.py is imported
+    if (py_session_types_init()) {
+      BREAK_ERROR("initialising python session types failed");
+    }
+
     if (!strlen(py_module_path)) {
       if (generate_python_path(py_module_path, 1024)) {
         BREAK_ERROR("Failed to generate python search path");
@@ -213,3 +223,67 @@ static int py_module_init() {
   return retVal;
 }
 
+
+/**
+ * Move all python objects created so far into the permanent generation (gc.freeze()).
+ * Used by the pre-forked worker pool (fcgi_pool.c) after warming up python: the garbage collector of forked
+ * workers no longer touches these objects, which keeps the inherited memory pages shared.
+ */
+int py_gc_freeze(void) {
+  int retVal = 0;
+
+  PyObject *gc = NULL;
+  PyObject *result = NULL;
+
+  do {
+    if (!Py_IsInitialized()) {
+      BREAK_ERROR("python is not initialised");
+    }
+
+    gc = PyImport_ImportModule("gc");
+    if (!gc) {
+      py_log_error(NULL);
+      BREAK_ERROR("importing python module 'gc' failed");
+    }
+
+    // collect garbage first, it would otherwise be frozen, too
+    result = PyObject_CallMethod(gc, "collect", NULL);
+    if (!result) {
+      py_log_error(NULL);
+      BREAK_ERROR("gc.collect() failed");
+    }
+    Py_DECREF(result);
+
+    result = PyObject_CallMethod(gc, "freeze", NULL);
+    if (!result) {
+      py_log_error(NULL);
+      BREAK_ERROR("gc.freeze() failed");
+    }
+  } while(0);
+
+  Py_XDECREF(result);
+  Py_XDECREF(gc);
+
+  return retVal;
+}
+
+/**
+ * fork() handlers for an initialised interpreter, see PyOS_BeforeFork()
+ */
+void py_fork_prepare(void) {
+  if (Py_IsInitialized()) {
+    PyOS_BeforeFork();
+  }
+}
+
+void py_fork_parent(void) {
+  if (Py_IsInitialized()) {
+    PyOS_AfterFork_Parent();
+  }
+}
+
+void py_fork_child(void) {
+  if (Py_IsInitialized()) {
+    PyOS_AfterFork_Child();
+  }
+}
@@ -0,0 +1,497 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "errorlog.h"
+#include "question_types.h"
+#include "survey.h"
+#include "serialisers.h"
+#include "utils.h"
+#include "py_module.h"
+
+/**
+ * Out-of-process python hooks (ENV SS_PYTHON_WORKER_SOCKET)
+ *
+ * Instead of calling nextquestion.py in the embedded interpreter, hook calls are sent to a pool of long lived
+ * python workers (python/hook_worker.py) over a Unix domain socket. Python capacity can then be scaled
+ * independently of the surveyfcgi processes, and a crashing or restarting hook does not take down a request process.
+ *
+ * Messages are framed by a 4 byte (big endian) length prefix.
+ *  - request (JSON): {"id", "hook": "nextquestion"|"analyse", "survey_id", "session_id", "action", "affected_count",
+ *    "answers": [[uid, type, text, value, ..., stored], ...], "questions": [[uid, flags, default_value, min_value,
+ *    max_value, choices, unit], ...]}
+ *    Questions are only sent if the worker does not know the survey snapshot yet.
+ *  - reply (text), first line "<OK|SURVEY|ERROR> <id>":
+ *    - OK (nextquestion): "<status>\n<progress[0]> <progress[1]>\n<count>\n<uid>\n...<message>"
+ *    - OK (analyse): analysis string
+ *    - SURVEY: the worker asks for the question definitions of the survey snapshot
+ *    - ERROR: error message
+ *
+ * Every thread keeps a connection to the pool and has at most one request in flight: a surveyfcgi process serves one
+ * http request at a time, so there is nothing to pipeline. Workers would answer pipelined requests of a connection in
+ * order. A failed connection (i.e. the worker was restarted by the pool) is re-established once per call.
+ */
+
+#define REMOTE_FRAME_MAX (64 * 1024 * 1024)
+#define REMOTE_DEFAULT_TIMEOUT 30 // seconds
+
+static THREAD_LOCAL int remote_fd = -1;
+static THREAD_LOCAL unsigned long remote_request_id = 0;
+
+struct remote_buffer {
+  char *data;
+  size_t len;
+  size_t size;
+};
+
+static int remote_buffer_reserve(struct remote_buffer *b, size_t len) {
+  if (b->len + len + 1 <= b->size) {
+    return 0;
+  }
+  size_t size = (b->size) ? b->size : 4096;
+  while (size < b->len + len + 1) {
+    size *= 2;
+  }
+  char *data = realloc(b->data, size);
+  if (!data) {
+    return -1;
+  }
+  b->data = data;
+  b->size = size;
+  return 0;
+}
+
+static int remote_buffer_append(struct remote_buffer *b, const char *s, size_t len) {
+  if (remote_buffer_reserve(b, len)) {
+    return -1;
+  }
+  memcpy(b->data + b->len, s, len);
+  b->len += len;
+  b->data[b->len] = 0;
+  return 0;
+}
+
+static int remote_buffer_printf(struct remote_buffer *b, const char *format, ...) {
+  char tmp[256];
+  va_list argp;
+
+  va_start(argp, format);
+  int len = vsnprintf(tmp, sizeof(tmp), format, argp);
+  va_end(argp);
+
+  if (len < 0 || len >= (int) sizeof(tmp)) {
+    return -1;
+  }
+  return remote_buffer_append(b, tmp, len);
+}
+
+/**
+ * append a JSON string literal, NULL is written as an empty string
+ */
+static int remote_buffer_json_string(struct remote_buffer *b, const char *s) {
+  if (remote_buffer_append(b, "\"", 1)) {
+    return -1;
+  }
+  for (const unsigned char *c = (const unsigned char *) ((s) ? s : ""); *c; c++) {
+    int error = 0;
+    if (*c == '"' || *c == '\\') {
+      char esc[2] = { '\\', *c };
+      error = remote_buffer_append(b, esc, 2);
+    } else if (*c < 0x20) {
+      error = remote_buffer_printf(b, "\\u%04x", *c);
+    } else {
+      error = remote_buffer_append(b, (const char *) c, 1);
+    }
+    if (error) {
+      return -1;
+    }
+  }
+  return remote_buffer_append(b, "\"", 1);
+}
+
+/**
+ * build a hook request
+ */
+static int remote_build_request(struct remote_buffer *b, unsigned long id, const char *hook, struct session *ses,
+                                enum actions action, int affected_answers_count, int with_questions) {
+  int retVal = 0;
+  char stype[50];
+
+  do {
+    b->len = 0;
+    int error = remote_buffer_printf(b, "{\"id\":%lu,\"hook\":", id)
+      || remote_buffer_json_string(b, hook)
+      || remote_buffer_append(b, ",\"survey_id\":", 13)
+      || remote_buffer_json_string(b, ses->survey_id)
+      || remote_buffer_append(b, ",\"session_id\":", 14)
+      || remote_buffer_json_string(b, ses->session_id)
+      || remote_buffer_append(b, ",\"action\":", 10)
+      || remote_buffer_json_string(b, session_action_names[action])
+      || remote_buffer_printf(b, ",\"affected_count\":%d,\"answers\":[", affected_answers_count);
+    if (error) {
+      BREAK_ERROR("Failed to build python worker request");
+    }
+
+    int first = 1;
+    for (int i = ses->answer_offset; i < ses->answer_count; i++) {
+      struct answer *a = ses->answers[i];
+      if (!is_given_answer(a)) {
+        continue;
+      }
+      if (!serialise_question_type(a->type, stype, 50)) {
+        BREAK_ERRORV("invalid question type %d for answer '%s'", a->type, a->uid);
+      }
+
+      error = remote_buffer_append(b, (first) ? "[" : ",[", (first) ? 1 : 2)
+        || remote_buffer_json_string(b, a->uid)
+        || remote_buffer_append(b, ",", 1)
+        || remote_buffer_json_string(b, stype)
+        || remote_buffer_append(b, ",", 1)
+        || remote_buffer_json_string(b, a->text)
+        || remote_buffer_printf(b, ",%lld,%lld,%lld,%lld,%lld,%d,%d,", a->value, a->lat, a->lon, a->time_begin, a->time_end, a->time_zone_delta, a->dst_delta)
+        || remote_buffer_json_string(b, a->unit)
+        || remote_buffer_printf(b, ",%d,%lld]", a->flags, (long long) a->stored);
+      if (error) {
+        BREAK_ERRORV("Failed to serialise answer '%s' for python worker", a->uid);
+      }
+      first = 0;
+    }
+    if (retVal) {
+      break;
+    }
+
+    if (remote_buffer_append(b, "]", 1)) {
+      BREAK_ERROR("Failed to build python worker request");
+    }
+
+    if (with_questions) {
+      if (remote_buffer_append(b, ",\"questions\":[", 14)) {
+        BREAK_ERROR("Failed to build python worker request");
+      }
+      for (int i = 0; i < ses->question_count; i++) {
+        struct question *q = ses->questions[i];
+        error = remote_buffer_append(b, (i) ? ",[" : "[", (i) ? 2 : 1)
+          || remote_buffer_json_string(b, q->uid)
+          || remote_buffer_printf(b, ",%d,", q->flags)
+          || remote_buffer_json_string(b, q->default_value)
+          || remote_buffer_printf(b, ",%lld,%lld,", q->min_value, q->max_value)
+          || remote_buffer_json_string(b, q->choices)
+          || remote_buffer_append(b, ",", 1)
+          || remote_buffer_json_string(b, q->unit)
+          || remote_buffer_append(b, "]", 1);
+        if (error) {
+          BREAK_ERRORV("Failed to serialise question '%s' for python worker", q->uid);
+        }
+      }
+      if (retVal) {
+        break;
+      }
+      if (remote_buffer_append(b, "]", 1)) {
+        BREAK_ERROR("Failed to build python worker request");
+      }
+    }
+
+    if (remote_buffer_append(b, "}", 1)) {
+      BREAK_ERROR("Failed to build python worker request");
+    }
+  } while (0);
+
+  return retVal;
+}
+
+/**
+ * socket io
+ */
+
+static void remote_disconnect(void) {
+  if (remote_fd > -1) {
+    close(remote_fd);
+  }
+  remote_fd = -1;
+  return;
+}
+
+static void remote_set_timeout(int fd, int option, int ms) {
+  struct timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+  setsockopt(fd, SOL_SOCKET, option, &tv, sizeof(tv));
+  return;
+}
+
+static int remote_connect(const char *path) {
+  int retVal = 0;
+
+  do {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+      BREAK_ERRORV("python worker socket path '%s' is too long", path);
+    }
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      BREAK_ERRORV("socket() failed: %s", strerror(errno));
+    }
+
+    int seconds = env_limit("SS_PYTHON_WORKER_TIMEOUT", REMOTE_DEFAULT_TIMEOUT);
+    remote_set_timeout(fd, SO_RCVTIMEO, seconds * 1000);
+    remote_set_timeout(fd, SO_SNDTIMEO, seconds * 1000);
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+      close(fd);
+      BREAK_ERRORV("Could not connect to python worker socket '%s': %s", path, strerror(errno));
+    }
+
+    remote_fd = fd;
+  } while (0);
+
+  return retVal;
+}
+
+static int remote_write_all(const char *data, size_t len) {
+  while (len) {
+    ssize_t n = send(remote_fd, data, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int remote_read_all(char *data, size_t len) {
+  while (len) {
+    ssize_t n = read(remote_fd, data, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int remote_write_frame(struct remote_buffer *b) {
+  unsigned char header[4] = {
+    (b->len >> 24) & 0xff, (b->len >> 16) & 0xff, (b->len >> 8) & 0xff, b->len & 0xff
+  };
+  if (remote_write_all((char *) header, 4)) {
+    return -1;
+  }
+  return remote_write_all(b->data, b->len);
+}
+
+static int remote_read_frame(struct remote_buffer *b) {
+  unsigned char header[4];
+  if (remote_read_all((char *) header, 4)) {
+    return -1;
+  }
+  size_t len = ((size_t) header[0] << 24) | ((size_t) header[1] << 16) | ((size_t) header[2] << 8) | header[3];
+  if (len > REMOTE_FRAME_MAX) {
+    return -1;
+  }
+
+  b->len = 0;
+  if (remote_buffer_reserve(b, len)) {
+    return -1;
+  }
+  if (remote_read_all(b->data, len)) {
+    return -1;
+  }
+  b->len = len;
+  b->data[len] = 0;
+  return 0;
+}
+
+/**
+ * Sends a hook request to the worker pool and waits for the reply.
+ * returns 0 and a pointer to the reply body (after the first line) inside reply, or -1 on error
+ */
+static int remote_call(struct remote_buffer *reply, char **body, const char *hook, struct session *ses,
+                       enum actions action, int affected_answers_count) {
+  int retVal = 0;
+
+  struct remote_buffer request = { NULL, 0, 0 };
+  int with_questions = 0;
+  int reconnected = 0;
+
+  // the survey's hook time budget bounds the wait for a reply (503 on timeout), see py_watchdog.c
+  int budget = py_hook_budget(ses);
+  if (budget <= 0) {
+    budget = env_limit("SS_PYTHON_WORKER_TIMEOUT", REMOTE_DEFAULT_TIMEOUT) * 1000;
+  }
+
+  struct timespec begin, end;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+
+  do {
+    char *path = getenv("SS_PYTHON_WORKER_SOCKET");
+    if (!path || !path[0]) {
+      BREAK_ERROR("SS_PYTHON_WORKER_SOCKET is not set");
+    }
+
+    for (;;) {
+      if (remote_fd < 0 && remote_connect(path)) {
+        BREAK_ERROR("python worker pool is not available");
+      }
+      remote_set_timeout(remote_fd, SO_RCVTIMEO, budget);
+
+      unsigned long id = ++remote_request_id;
+      if (remote_build_request(&request, id, hook, ses, action, affected_answers_count, with_questions)) {
+        BREAK_ERROR("Failed to build python worker request");
+      }
+
+      errno = 0;
+      int failed = remote_write_frame(&request);
+      if (!failed && remote_read_frame(reply)) {
+        failed = 1;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          // a late reply would be read by the next request, drop the connection
+          remote_disconnect();
+          py_hook_set_timed_out(1);
+          BREAK_CODEV(SS_SYSTEM_HOOK_TIMEOUT, "python worker hook '%s' exceeded its time budget of %d ms", hook, budget);
+        }
+      }
+
+      if (failed) {
+        remote_disconnect();
+        if (reconnected) {
+          BREAK_ERRORV("python worker request '%s' failed: %s", hook, strerror(errno));
+        }
+        // the worker was restarted, retry once on a new connection
+        LOG_INFOV("python worker connection lost, reconnecting to '%s'", path);
+        reconnected = 1;
+        continue;
+      }
+
+      char *eol = strchr(reply->data, '\n');
+      char status[16];
+      unsigned long reply_id = 0;
+      if (!eol || sscanf(reply->data, "%15s %lu", status, &reply_id) != 2 || reply_id != id) {
+        remote_disconnect();
+        BREAK_ERROR("Malformed reply from python worker");
+      }
+      *body = eol + 1;
+
+      if (!strcmp(status, "SURVEY") && !with_questions) {
+        with_questions = 1;
+        continue;
+      }
+      if (!strcmp(status, "ERROR")) {
+        BREAK_ERRORV("python worker: hook '%s' failed: %s", hook, *body);
+      }
+      if (strcmp(status, "OK")) {
+        BREAK_ERRORV("Unexpected reply '%s' from python worker", status);
+      }
+      break;
+    }
+  } while (0);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  char function_name[1024];
+  snprintf(function_name, 1024, "remote:%s_%s", hook, ses->survey_id);
+  char *sep = strrchr(function_name, '/');
+  if (sep) {
+    *sep = 0;
+  }
+  unsigned long long us = (end.tv_sec - begin.tv_sec) * 1000000ULL + (end.tv_nsec - begin.tv_nsec) / 1000;
+  py_stats_record(function_name, us, retVal != 0, py_hook_timed_out());
+
+  free(request.data);
+  return retVal;
+}
+
+/**
+ * checks if hooks are executed by the worker pool
+ */
+int py_remote_enabled(void) {
+  char *path = getenv("SS_PYTHON_WORKER_SOCKET");
+  return path && path[0];
+}
+
+/**
+ * next questions via the worker pool, see get_next_question_python()
+ */
+int get_next_question_remote(struct session *ses, struct nextquestions *nq, enum actions action, int affected_answers_count) {
+  int retVal = 0;
+
+  struct remote_buffer reply = { NULL, 0, 0 };
+  char *body = NULL;
+  py_hook_set_timed_out(0);
+
+  do {
+    if (!ses) {
+      BREAK_ERROR("session is null");
+    }
+    if (!nq) {
+      BREAK_ERROR("nextquestions is NULL");
+    }
+    if (nq->question_count) {
+      BREAK_ERROR("nextquestions->question_count is > 0");
+    }
+
+    if (remote_call(&reply, &body, "nextquestion", ses, action, affected_answers_count)) {
+      BREAK_ERROR("Failed to call python worker hook 'nextquestion'");
+    }
+
+    if (py_nextquestions_deserialise(ses, nq, action, body)) {
+      BREAK_ERROR("Invalid reply from python worker for hook 'nextquestion'");
+    }
+
+    LOG_INFO("call python worker next question(s) finished.");
+  } while (0);
+
+  free(reply.data);
+  if (retVal) {
+    retVal = -99;
+  }
+  return retVal;
+}
+
+/**
+ * analysis via the worker pool, see get_analysis_python()
+ * the parent unit is responsible for freeing *output pointer
+ */
+int get_analysis_remote(struct session *ses, const char **output) {
+  int retVal = 0;
+
+  struct remote_buffer reply = { NULL, 0, 0 };
+  char *body = NULL;
+  py_hook_set_timed_out(0);
+
+  do {
+    if (!ses) {
+      BREAK_ERROR("session is null");
+    }
+
+    if (remote_call(&reply, &body, "analyse", ses, ACTION_SESSION_ANALYSIS, 0)) {
+      BREAK_ERROR("Failed to call python worker hook 'analyse'");
+    }
+
+    *output = strdup(body);
+    if (!*output) {
+      BREAK_ERROR("strdup() failed");
+    }
+
+    LOG_INFO("call python worker analysis finished.");
+  } while (0);
+
+  free(reply.data);
+  return retVal;
+}
@@ -0,0 +1,958 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <Python.h>
+
+#include "errorlog.h"
+#include "question_types.h"
+#include "survey.h"
+#include "serialisers.h"
+#include "sha1.h"
+#include "py_module.h"
+
+/**
+ * Lazy session proxy types for Python hooks, module "surveysystem"
+ *
+ *  - surveysystem.Answers: read-only sequence of the given answers of a session, answers can be looked up by
+ *    position (answers[-1]) or by uid (answers['q1'], 'q1' in answers, answers.get('q1'))
+ *  - surveysystem.Answer: a single answer, fields are available as attributes (answer.uid) and as mapping
+ *    items (answer['uid'], answer['_flags']), see py_answer_fields[]
+ *
+ * Field values are created from struct session on access, keys are interned strings shared by all answers.
+ * Hooks which look at a few answers therefore do not pay for the size of the session.
+ * Question properties (#449) are read from the frozen per-snapshot question objects, see py_survey_objects().
+ * The proxies are only valid during the hook call, accessing them afterwards raises a RuntimeError.
+ * Use Answer.to_dict() and Answers.to_list() to keep a copy (i.e. for json.dumps()).
+ *
+ * The types are created per interpreter (heap types) and released in py_destroy().
+ */
+
+enum py_answer_field {
+  PY_ANSWER_UID,
+  PY_ANSWER_TYPE,
+  PY_ANSWER_TEXT,
+  PY_ANSWER_VALUE,
+  PY_ANSWER_LATITUDE,
+  PY_ANSWER_LONGITUDE,
+  PY_ANSWER_TIME_BEGIN,
+  PY_ANSWER_TIME_END,
+  PY_ANSWER_TIME_ZONE_DELTA,
+  PY_ANSWER_DST_DELTA,
+  PY_ANSWER_UNIT,
+  PY_ANSWER_FLAGS,
+  PY_ANSWER_STORED,
+  // #449 merged question properties
+  PY_QUESTION_FLAGS,
+  PY_QUESTION_DEFAULT_VALUE,
+  PY_QUESTION_MIN_VALUE,
+  PY_QUESTION_MAX_VALUE,
+  PY_QUESTION_CHOICES,
+  PY_QUESTION_UNIT, // #448
+  PY_ANSWER_FIELD_COUNT
+};
+
+static const char *py_answer_fields[PY_ANSWER_FIELD_COUNT] = {
+  "uid",
+  "type",
+  "text",
+  "value",
+  "latitude",
+  "longitude",
+  "time_begin",
+  "time_end",
+  "time_zone_delta",
+  "dst_delta",
+  "unit",
+  "flags",
+  "stored",
+  "_flags",
+  "_default_value",
+  "_min_value",
+  "_max_value",
+  "_choices",
+  "_unit",
+};
+
+typedef struct {
+  PyObject_HEAD
+  struct session *ses; // NULL once the hook call returned
+  PyObject *meta;      // tuple of question property mappings of the survey snapshot
+  int *positions;      // ses->answers[] positions of given answers, built on first access
+  int count;
+} py_answers_object;
+
+typedef struct {
+  PyObject_HEAD
+  py_answers_object *parent;
+  struct answer *answer;
+  PyObject *question; // question property mapping or NULL
+} py_answer_object;
+
+static PyObject *py_session_module = NULL;
+static PyTypeObject *py_answers_type = NULL;
+static PyTypeObject *py_answer_type = NULL;
+static PyObject *py_answer_keys[PY_ANSWER_FIELD_COUNT]; // interned
+static PyObject *py_answer_keys_tuple = NULL;
+
+/**
+ * interned key for an answer field, used by the list-of-dicts call convention as well
+ * returns a borrowed reference
+ */
+PyObject *py_answer_key(int field) {
+  if (field < 0 || field >= PY_ANSWER_FIELD_COUNT) {
+    return NULL;
+  }
+  return py_answer_keys[field];
+}
+
+/**
+ * creates the Python value of an answer field
+ * question fields are taken from the question property mapping (py_survey_question()), they are None if
+ * the answer has no matching question
+ */
+PyObject *py_answer_field_value(struct answer *a, PyObject *question, int field) {
+  char stype[50];
+
+  if (field >= PY_QUESTION_FLAGS && field < PY_ANSWER_FIELD_COUNT) {
+    if (!question) {
+      Py_RETURN_NONE;
+    }
+    return PyObject_GetItem(question, py_answer_keys[field]);
+  }
+
+  switch (field) {
+    case PY_ANSWER_UID:
+      return PyUnicode_FromString(a->uid);
+    case PY_ANSWER_TYPE:
+      // #358 include question type
+      if (!serialise_question_type(a->type, stype, 50)) {
+        PyErr_Format(PyExc_ValueError, "invalid question type %d", a->type);
+        return NULL;
+      }
+      return PyUnicode_FromString(stype);
+    case PY_ANSWER_TEXT:
+      return PyUnicode_FromString(a->text);
+    case PY_ANSWER_VALUE:
+      return PyLong_FromLongLong(a->value);
+    case PY_ANSWER_LATITUDE:
+      return PyLong_FromLongLong(a->lat);
+    case PY_ANSWER_LONGITUDE:
+      return PyLong_FromLongLong(a->lon);
+    case PY_ANSWER_TIME_BEGIN:
+      return PyLong_FromLongLong(a->time_begin);
+    case PY_ANSWER_TIME_END:
+      return PyLong_FromLongLong(a->time_end);
+    case PY_ANSWER_TIME_ZONE_DELTA:
+      return PyLong_FromLongLong(a->time_zone_delta);
+    case PY_ANSWER_DST_DELTA:
+      return PyLong_FromLongLong(a->dst_delta);
+    case PY_ANSWER_UNIT:
+      return PyUnicode_FromString(a->unit);
+    case PY_ANSWER_FLAGS:
+      return PyLong_FromLongLong(a->flags);
+    case PY_ANSWER_STORED:
+      return PyLong_FromLongLong(a->stored);
+  }
+
+  PyErr_Format(PyExc_IndexError, "invalid answer field %d", field);
+  return NULL;
+}
+
+/**
+ * creates the Python value of a question property (#449), used for building the snapshot cache
+ */
+static PyObject *py_question_field_value(struct question *qn, int field) {
+  switch (field) {
+    case PY_QUESTION_FLAGS:
+      return PyLong_FromLongLong(qn->flags);
+    case PY_QUESTION_DEFAULT_VALUE:
+      return PyUnicode_FromString(qn->default_value);
+    case PY_QUESTION_MIN_VALUE:
+      return PyLong_FromLongLong(qn->min_value);
+    case PY_QUESTION_MAX_VALUE:
+      return PyLong_FromLongLong(qn->max_value);
+    case PY_QUESTION_CHOICES:
+      return PyUnicode_FromString(qn->choices);
+    case PY_QUESTION_UNIT:
+      return PyUnicode_FromString(qn->unit);
+  }
+
+  PyErr_Format(PyExc_IndexError, "invalid question field %d", field);
+  return NULL;
+}
+
+/**
+ * find the field for a key, interned keys are matched by identity
+ * returns field or -1
+ */
+static int py_answer_field(PyObject *key) {
+  if (!PyUnicode_Check(key)) {
+    return -1;
+  }
+  for (int i = 0; i < PY_ANSWER_FIELD_COUNT; i++) {
+    if (key == py_answer_keys[i]) {
+      return i;
+    }
+  }
+  for (int i = 0; i < PY_ANSWER_FIELD_COUNT; i++) {
+    if (!PyUnicode_Compare(key, py_answer_keys[i])) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int py_answers_check_valid(py_answers_object *self) {
+  if (!self->ses) {
+    PyErr_SetString(PyExc_RuntimeError, "session answers are only available during the hook call");
+    return -1;
+  }
+  if (self->positions) {
+    return 0;
+  }
+
+  struct session *ses = self->ses;
+  int len = ses->answer_count - ses->answer_offset;
+  self->positions = malloc(sizeof(int) * ((len > 0) ? len : 1));
+  if (!self->positions) {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  self->count = 0;
+  for (int i = ses->answer_offset; i < ses->answer_count; i++) {
+    if (is_given_answer(ses->answers[i])) {
+      self->positions[self->count++] = i;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Answer
+ */
+
+static PyObject *py_answer_new(py_answers_object *parent, struct answer *a) {
+  py_answer_object *self = (py_answer_object *) py_answer_type->tp_alloc(py_answer_type, 0);
+  if (!self) {
+    return NULL;
+  }
+  Py_INCREF(parent);
+  self->parent = parent;
+  self->answer = a;
+  self->question = py_survey_question(parent->ses, parent->meta, a->uid);
+  Py_XINCREF(self->question);
+  return (PyObject *) self;
+}
+
+static void py_answer_dealloc(py_answer_object *self) {
+  PyTypeObject *type = Py_TYPE(self);
+  Py_XDECREF(self->question);
+  Py_XDECREF(self->parent);
+  type->tp_free((PyObject *) self);
+  Py_DECREF(type);
+}
+
+static PyObject *py_answer_get_field(py_answer_object *self, int field) {
+  if (py_answers_check_valid(self->parent)) {
+    return NULL;
+  }
+  return py_answer_field_value(self->answer, self->question, field);
+}
+
+static PyObject *py_answer_getattro(py_answer_object *self, PyObject *name) {
+  int field = py_answer_field(name);
+  if (field < 0) {
+    return PyObject_GenericGetAttr((PyObject *) self, name);
+  }
+  return py_answer_get_field(self, field);
+}
+
+static PyObject *py_answer_subscript(py_answer_object *self, PyObject *key) {
+  int field = py_answer_field(key);
+  if (field < 0) {
+    PyErr_SetObject(PyExc_KeyError, key);
+    return NULL;
+  }
+  return py_answer_get_field(self, field);
+}
+
+static Py_ssize_t py_answer_length(py_answer_object *self) {
+  return PY_ANSWER_FIELD_COUNT;
+}
+
+static int py_answer_contains(py_answer_object *self, PyObject *key) {
+  return py_answer_field(key) > -1;
+}
+
+static PyObject *py_answer_iter(py_answer_object *self) {
+  return PyObject_GetIter(py_answer_keys_tuple);
+}
+
+static PyObject *py_answer_get(py_answer_object *self, PyObject *args) {
+  PyObject *key;
+  PyObject *fallback = Py_None;
+
+  if (!PyArg_ParseTuple(args, "O|O:get", &key, &fallback)) {
+    return NULL;
+  }
+  int field = py_answer_field(key);
+  if (field < 0) {
+    Py_INCREF(fallback);
+    return fallback;
+  }
+  return py_answer_get_field(self, field);
+}
+
+static PyObject *py_answer_keys_method(py_answer_object *self, PyObject *unused) {
+  Py_INCREF(py_answer_keys_tuple);
+  return py_answer_keys_tuple;
+}
+
+static PyObject *py_answer_to_dict(py_answer_object *self, PyObject *unused) {
+  if (py_answers_check_valid(self->parent)) {
+    return NULL;
+  }
+
+  PyObject *dict = PyDict_New();
+  if (!dict) {
+    return NULL;
+  }
+
+  for (int i = 0; i < PY_ANSWER_FIELD_COUNT; i++) {
+    PyObject *value = py_answer_field_value(self->answer, self->question, i);
+    if (!value || PyDict_SetItem(dict, py_answer_keys[i], value)) {
+      Py_XDECREF(value);
+      Py_DECREF(dict);
+      return NULL;
+    }
+    Py_DECREF(value);
+  }
+  return dict;
+}
+
+static PyObject *py_answer_values(py_answer_object *self, PyObject *unused) {
+  PyObject *dict = py_answer_to_dict(self, NULL);
+  if (!dict) {
+    return NULL;
+  }
+  PyObject *values = PyDict_Values(dict);
+  Py_DECREF(dict);
+  return values;
+}
+
+static PyObject *py_answer_items(py_answer_object *self, PyObject *unused) {
+  PyObject *dict = py_answer_to_dict(self, NULL);
+  if (!dict) {
+    return NULL;
+  }
+  PyObject *items = PyDict_Items(dict);
+  Py_DECREF(dict);
+  return items;
+}
+
+static PyObject *py_answer_repr(py_answer_object *self) {
+  if (!self->parent->ses) {
+    return PyUnicode_FromString("<Answer (released)>");
+  }
+  PyObject *dict = py_answer_to_dict(self, NULL);
+  if (!dict) {
+    return NULL;
+  }
+  PyObject *repr = PyObject_Repr(dict);
+  Py_DECREF(dict);
+  return repr;
+}
+
+static PyObject *py_answer_question(py_answer_object *self, void *closure) {
+  if (py_answers_check_valid(self->parent)) {
+    return NULL;
+  }
+  if (!self->question) {
+    Py_RETURN_NONE;
+  }
+  Py_INCREF(self->question);
+  return self->question;
+}
+
+static PyGetSetDef py_answer_getset[] = {
+  { "question", (getter) py_answer_question, NULL, "read-only question properties, shared by all sessions of the survey", NULL },
+  { NULL, NULL, NULL, NULL, NULL }
+};
+
+static PyMethodDef py_answer_methods[] = {
+  { "get", (PyCFunction) py_answer_get, METH_VARARGS, "get(key[, default]): answer field or default" },
+  { "keys", (PyCFunction) py_answer_keys_method, METH_NOARGS, "answer field names" },
+  { "values", (PyCFunction) py_answer_values, METH_NOARGS, "answer field values" },
+  { "items", (PyCFunction) py_answer_items, METH_NOARGS, "(field, value) pairs" },
+  { "to_dict", (PyCFunction) py_answer_to_dict, METH_NOARGS, "copy of the answer as a dict" },
+  { NULL, NULL, 0, NULL }
+};
+
+static PyType_Slot py_answer_slots[] = {
+  { Py_tp_dealloc, py_answer_dealloc },
+  { Py_tp_getattro, py_answer_getattro },
+  { Py_tp_iter, py_answer_iter },
+  { Py_tp_repr, py_answer_repr },
+  { Py_tp_methods, py_answer_methods },
+  { Py_tp_getset, py_answer_getset },
+  { Py_mp_subscript, py_answer_subscript },
+  { Py_mp_length, py_answer_length },
+  { Py_sq_contains, py_answer_contains },
+  { Py_tp_doc, "session answer, fields are read from the backend session on access" },
+  { 0, NULL }
+};
+
+static PyType_Spec py_answer_spec = {
+  "surveysystem.Answer",
+  sizeof(py_answer_object),
+  0,
+  Py_TPFLAGS_DEFAULT,
+  py_answer_slots
+};
+
+/**
+ * Answers
+ */
+
+static void py_answers_dealloc(py_answers_object *self) {
+  PyTypeObject *type = Py_TYPE(self);
+  Py_XDECREF(self->meta);
+  free(self->positions);
+  type->tp_free((PyObject *) self);
+  Py_DECREF(type);
+}
+
+static Py_ssize_t py_answers_length(py_answers_object *self) {
+  if (py_answers_check_valid(self)) {
+    return -1;
+  }
+  return self->count;
+}
+
+static PyObject *py_answers_item(py_answers_object *self, Py_ssize_t index) {
+  if (py_answers_check_valid(self)) {
+    return NULL;
+  }
+  if (index < 0 || index >= self->count) {
+    PyErr_SetString(PyExc_IndexError, "answer index out of range");
+    return NULL;
+  }
+  return py_answer_new(self, self->ses->answers[self->positions[index]]);
+}
+
+/**
+ * given answer by uid, returns a borrowed struct answer or NULL
+ */
+static struct answer *py_answers_find(py_answers_object *self, PyObject *key) {
+  const char *uid = PyUnicode_AsUTF8(key);
+  if (!uid) {
+    return NULL;
+  }
+  struct answer *a = session_get_answer((char *) uid, self->ses);
+  if (!a || !is_given_answer(a)) {
+    return NULL;
+  }
+  return a;
+}
+
+static PyObject *py_answers_subscript(py_answers_object *self, PyObject *key) {
+  if (py_answers_check_valid(self)) {
+    return NULL;
+  }
+
+  if (PyUnicode_Check(key)) {
+    struct answer *a = py_answers_find(self, key);
+    if (!a) {
+      if (!PyErr_Occurred()) {
+        PyErr_SetObject(PyExc_KeyError, key);
+      }
+      return NULL;
+    }
+    return py_answer_new(self, a);
+  }
+
+  if (PySlice_Check(key)) {
+    Py_ssize_t start, stop, step;
+    if (PySlice_Unpack(key, &start, &stop, &step) < 0) {
+      return NULL;
+    }
+    Py_ssize_t len = PySlice_AdjustIndices(self->count, &start, &stop, step);
+    PyObject *list = PyList_New(len);
+    if (!list) {
+      return NULL;
+    }
+    for (Py_ssize_t i = 0, pos = start; i < len; i++, pos += step) {
+      PyObject *item = py_answers_item(self, pos);
+      if (!item) {
+        Py_DECREF(list);
+        return NULL;
+      }
+      PyList_SET_ITEM(list, i, item);
+    }
+    return list;
+  }
+
+  Py_ssize_t index = PyNumber_AsSsize_t(key, PyExc_IndexError);
+  if (index == -1 && PyErr_Occurred()) {
+    return NULL;
+  }
+  if (index < 0) {
+    index += self->count;
+  }
+  return py_answers_item(self, index);
+}
+
+static int py_answers_contains(py_answers_object *self, PyObject *key) {
+  if (py_answers_check_valid(self)) {
+    return -1;
+  }
+  if (!PyUnicode_Check(key)) {
+    return 0;
+  }
+  struct answer *a = py_answers_find(self, key);
+  if (!a && PyErr_Occurred()) {
+    return -1;
+  }
+  return a != NULL;
+}
+
+static PyObject *py_answers_iter(py_answers_object *self) {
+  if (py_answers_check_valid(self)) {
+    return NULL;
+  }
+  return PySeqIter_New((PyObject *) self);
+}
+
+static PyObject *py_answers_get(py_answers_object *self, PyObject *args) {
+  PyObject *key;
+  PyObject *fallback = Py_None;
+
+  if (!PyArg_ParseTuple(args, "U|O:get", &key, &fallback)) {
+    return NULL;
+  }
+  if (py_answers_check_valid(self)) {
+    return NULL;
+  }
+  struct answer *a = py_answers_find(self, key);
+  if (!a) {
+    if (PyErr_Occurred()) {
+      return NULL;
+    }
+    Py_INCREF(fallback);
+    return fallback;
+  }
+  return py_answer_new(self, a);
+}
+
+static PyObject *py_answers_uids(py_answers_object *self, PyObject *unused) {
+  if (py_answers_check_valid(self)) {
+    return NULL;
+  }
+  PyObject *list = PyList_New(self->count);
+  if (!list) {
+    return NULL;
+  }
+  for (int i = 0; i < self->count; i++) {
+    PyObject *uid = PyUnicode_FromString(self->ses->answers[self->positions[i]]->uid);
+    if (!uid) {
+      Py_DECREF(list);
+      return NULL;
+    }
+    PyList_SET_ITEM(list, i, uid);
+  }
+  return list;
+}
+
+static PyObject *py_answers_to_list(py_answers_object *self, PyObject *unused) {
+  if (py_answers_check_valid(self)) {
+    return NULL;
+  }
+  PyObject *list = PyList_New(self->count);
+  if (!list) {
+    return NULL;
+  }
+  for (int i = 0; i < self->count; i++) {
+    PyObject *item = py_answers_item(self, i);
+    PyObject *dict = (item) ? py_answer_to_dict((py_answer_object *) item, NULL) : NULL;
+    Py_XDECREF(item);
+    if (!dict) {
+      Py_DECREF(list);
+      return NULL;
+    }
+    PyList_SET_ITEM(list, i, dict);
+  }
+  return list;
+}
+
+static PyObject *py_answers_repr(py_answers_object *self) {
+  if (!self->ses) {
+    return PyUnicode_FromString("<Answers (released)>");
+  }
+  if (py_answers_check_valid(self)) {
+    return NULL;
+  }
+  return PyUnicode_FromFormat("<Answers session='%s' count=%d>", self->ses->session_id, self->count);
+}
+
+static PyMethodDef py_answers_methods[] = {
+  { "get", (PyCFunction) py_answers_get, METH_VARARGS, "get(uid[, default]): given answer or default" },
+  { "uids", (PyCFunction) py_answers_uids, METH_NOARGS, "list of given answer uids" },
+  { "to_list", (PyCFunction) py_answers_to_list, METH_NOARGS, "copy of all given answers as list of dicts" },
+  { NULL, NULL, 0, NULL }
+};
+
+static PyType_Slot py_answers_slots[] = {
+  { Py_tp_dealloc, py_answers_dealloc },
+  { Py_tp_iter, py_answers_iter },
+  { Py_tp_repr, py_answers_repr },
+  { Py_tp_methods, py_answers_methods },
+  { Py_mp_subscript, py_answers_subscript },
+  { Py_mp_length, py_answers_length },
+  { Py_sq_length, py_answers_length },
+  { Py_sq_item, py_answers_item },
+  { Py_sq_contains, py_answers_contains },
+  { Py_tp_doc, "given answers of a session, read from the backend session on access" },
+  { 0, NULL }
+};
+
+static PyType_Spec py_answers_spec = {
+  "surveysystem.Answers",
+  sizeof(py_answers_object),
+  0,
+  Py_TPFLAGS_DEFAULT,
+  py_answers_slots
+};
+
+static struct PyModuleDef py_session_module_def = {
+  PyModuleDef_HEAD_INIT,
+  "surveysystem",
+  "survey system backend types",
+  -1,
+  NULL,
+};
+
+/**
+ * creates the proxy types and registers the module "surveysystem", called after Py_Initialize()
+ */
+int py_session_types_init(void) {
+  int retVal = 0;
+
+  do {
+    for (int i = 0; i < PY_ANSWER_FIELD_COUNT; i++) {
+      py_answer_keys[i] = PyUnicode_InternFromString(py_answer_fields[i]);
+      if (!py_answer_keys[i]) {
+        BREAK_ERRORV("Failed to intern answer key '%s'", py_answer_fields[i]);
+      }
+    }
+    if (retVal) {
+      break;
+    }
+
+    py_answer_keys_tuple = PyTuple_New(PY_ANSWER_FIELD_COUNT);
+    if (!py_answer_keys_tuple) {
+      BREAK_ERROR("Failed to create answer keys tuple");
+    }
+    for (int i = 0; i < PY_ANSWER_FIELD_COUNT; i++) {
+      Py_INCREF(py_answer_keys[i]);
+      PyTuple_SET_ITEM(py_answer_keys_tuple, i, py_answer_keys[i]);
+    }
+
+    py_answer_type = (PyTypeObject *) PyType_FromSpec(&py_answer_spec);
+    py_answers_type = (PyTypeObject *) PyType_FromSpec(&py_answers_spec);
+    if (!py_answer_type || !py_answers_type) {
+      BREAK_ERROR("Failed to create python session types");
+    }
+
+    py_session_module = PyModule_Create(&py_session_module_def);
+    if (!py_session_module) {
+      BREAK_ERROR("Failed to create python module 'surveysystem'");
+    }
+
+    Py_INCREF(py_answer_type);
+    if (PyModule_AddObject(py_session_module, "Answer", (PyObject *) py_answer_type)) {
+      Py_DECREF(py_answer_type);
+      BREAK_ERROR("Failed to add type 'Answer' to python module 'surveysystem'");
+    }
+    Py_INCREF(py_answers_type);
+    if (PyModule_AddObject(py_session_module, "Answers", (PyObject *) py_answers_type)) {
+      Py_DECREF(py_answers_type);
+      BREAK_ERROR("Failed to add type 'Answers' to python module 'surveysystem'");
+    }
+
+    PyObject *modules = PyImport_GetModuleDict();
+    if (PyDict_SetItemString(modules, "surveysystem", py_session_module)) {
+      BREAK_ERROR("Failed to register python module 'surveysystem'");
+    }
+  } while (0);
+
+  if (retVal) {
+    if (PyErr_Occurred()) {
+      py_log_error(NULL);
+    }
+    py_session_types_clear();
+  }
+
+  return retVal;
+}
+
+/**
+ * releases the proxy types, called before Py_FinalizeEx()
+ */
+void py_session_types_clear(void) {
+  for (int i = 0; i < PY_ANSWER_FIELD_COUNT; i++) {
+    Py_XDECREF(py_answer_keys[i]);
+    py_answer_keys[i] = NULL;
+  }
+  Py_XDECREF(py_answer_keys_tuple);
+  Py_XDECREF(py_answer_type);
+  Py_XDECREF(py_answers_type);
+  Py_XDECREF(py_session_module);
+
+  py_answer_keys_tuple = NULL;
+  py_answer_type = NULL;
+  py_answers_type = NULL;
+  py_session_module = NULL;
+  return;
+}
+
+/**
+ * creates the Answers proxy for a session, release it with py_session_answers_release()
+ * meta is the question property tuple of the session's survey snapshot, see py_survey_objects()
+ */
+PyObject *py_session_answers(struct session *ses, PyObject *meta) {
+  if (!py_answers_type) {
+    PyErr_SetString(PyExc_RuntimeError, "surveysystem types not initialised");
+    return NULL;
+  }
+
+  py_answers_object *self = (py_answers_object *) py_answers_type->tp_alloc(py_answers_type, 0);
+  if (!self) {
+    return NULL;
+  }
+  self->ses = ses;
+  Py_XINCREF(meta);
+  self->meta = meta;
+  self->positions = NULL;
+  self->count = 0;
+  return (PyObject *) self;
+}
+
+/**
+ * detaches the proxy from the session and drops the callers reference.
+ * Objects still referenced by Python (i.e. stored in a global) raise a RuntimeError on access
+ */
+void py_session_answers_release(PyObject *answers) {
+  if (!answers) {
+    return;
+  }
+  if (Py_TYPE(answers) == py_answers_type) {
+    py_answers_object *self = (py_answers_object *) answers;
+    self->ses = NULL;
+    free(self->positions);
+    self->positions = NULL;
+    self->count = 0;
+  }
+  Py_DECREF(answers);
+  return;
+}
+
+/**
+ * Survey snapshot objects
+ *
+ * The question uids and the question properties merged into answers (#449) only depend on the survey snapshot
+ * (survey_id <survey name>/<hash>). They are built once per snapshot and shared by all sessions of the survey:
+ *  - questions: tuple of (interned) question uids
+ *  - meta: tuple of read-only mappings (types.MappingProxyType) of question properties, same order as questions
+ * The cache holds strong references, entries are replaced round robin and released in py_destroy()
+ * Only snapshots are cached, keyed by their survey id (which contains the sha1). Surveys loaded by name
+ * ("<survey name>/current") may change between requests, their objects are built for every call.
+ */
+
+#define PY_SURVEY_CACHE_SIZE 16
+
+struct py_survey {
+  char survey_id[1024];
+  int question_count;
+  PyObject *questions;
+  PyObject *meta;
+};
+
+static struct py_survey py_survey_cache[PY_SURVEY_CACHE_SIZE];
+static int py_survey_cache_next = 0; // round robin replacement
+
+static void py_survey_free(struct py_survey *entry) {
+  Py_XDECREF(entry->questions);
+  Py_XDECREF(entry->meta);
+  entry->questions = NULL;
+  entry->meta = NULL;
+  entry->question_count = 0;
+  entry->survey_id[0] = 0;
+  return;
+}
+
+/**
+ * dereference all cached snapshot objects, needs to be called before the Python interpreter is finalised
+ */
+void py_survey_cache_clear(void) {
+  for (int i = 0; i < PY_SURVEY_CACHE_SIZE; i++) {
+    py_survey_free(&py_survey_cache[i]);
+  }
+  py_survey_cache_next = 0;
+  return;
+}
+
+/**
+ * creates the read-only property mapping of a question
+ */
+static PyObject *py_survey_create_question(struct question *qn) {
+  int retVal = 0;
+  PyObject *dict = NULL;
+  PyObject *proxy = NULL;
+
+  do {
+    dict = PyDict_New();
+    if (!dict) {
+      BREAK_ERROR("failed to create question dict");
+    }
+
+    for (int field = PY_QUESTION_FLAGS; field < PY_ANSWER_FIELD_COUNT; field++) {
+      PyObject *value = py_question_field_value(qn, field);
+      if (!value) {
+        BREAK_ERRORV("creating value for question field '%s' failed", py_answer_fields[field]);
+      }
+
+      int error = PyDict_SetItem(dict, py_answer_keys[field], value);
+      Py_DECREF(value);
+      if (error) {
+        BREAK_ERRORV("setting dict item '%s' failed", py_answer_fields[field]);
+      }
+    }
+    if (retVal) {
+      break;
+    }
+
+    proxy = PyDictProxy_New(dict);
+    if (!proxy) {
+      BREAK_ERROR("failed to create question mapping proxy");
+    }
+  } while (0);
+
+  Py_XDECREF(dict);
+  return proxy;
+}
+
+/**
+ * builds the snapshot objects of a session's survey into a cache entry
+ */
+static int py_survey_create(struct py_survey *entry, struct session *ses) {
+  int retVal = 0;
+
+  do {
+    entry->questions = PyTuple_New(ses->question_count);
+    entry->meta = PyTuple_New(ses->question_count);
+    if (!entry->questions || !entry->meta) {
+      BREAK_ERROR("failed to create question tuples");
+    }
+
+    for (int i = 0; i < ses->question_count; i++) {
+      PyObject *uid = PyUnicode_InternFromString(ses->questions[i]->uid);
+      if (!uid) {
+        BREAK_ERRORV("Error creating question uid '%s'", ses->questions[i]->uid);
+      }
+      PyTuple_SET_ITEM(entry->questions, i, uid);
+
+      PyObject *question = py_survey_create_question(ses->questions[i]);
+      if (!question) {
+        BREAK_ERRORV("Error creating question properties '%s'", ses->questions[i]->uid);
+      }
+      PyTuple_SET_ITEM(entry->meta, i, question);
+    }
+    if (retVal) {
+      break;
+    }
+
+    snprintf(entry->survey_id, sizeof(entry->survey_id), "%s", ses->survey_id);
+    entry->question_count = ses->question_count;
+    LOG_INFOV("Created python question objects for survey '%s' (%d questions)", ses->survey_id, ses->question_count);
+  } while (0);
+
+  if (retVal) {
+    py_survey_free(entry);
+  }
+
+  return retVal;
+}
+
+/**
+ * get the snapshot objects for the survey of a session, built on first use (snapshots) or per call (current)
+ * returns 0 and new references to the questions and meta tuples, or -1 on error
+ */
+int py_survey_objects(struct session *ses, PyObject **questions, PyObject **meta) {
+  int retVal = 0;
+  struct py_survey *entry = NULL;
+
+  do {
+    if (!ses || !ses->survey_id) {
+      BREAK_ERROR("session or survey id is NULL");
+    }
+
+    char *sep = strrchr(ses->survey_id, '/');
+    if (!sep || sha1_validate_string_hashlike(sep + 1)) {
+      // not a snapshot, the caller takes over the references
+      struct py_survey uncached = { 0 };
+      if (py_survey_create(&uncached, ses)) {
+        BREAK_ERRORV("Failed to create python question objects for survey '%s'", ses->survey_id);
+      }
+      *questions = uncached.questions;
+      *meta = uncached.meta;
+      break;
+    }
+
+    for (int i = 0; i < PY_SURVEY_CACHE_SIZE; i++) {
+      struct py_survey *cached = &py_survey_cache[i];
+      if (cached->questions && !strcmp(cached->survey_id, ses->survey_id)) {
+        entry = cached;
+        break;
+      }
+    }
+
+    // the snapshot hash is part of the survey id, a differing count means the session was not loaded from it
+    if (entry && entry->question_count != ses->question_count) {
+      LOG_WARNV("Cached python question objects for survey '%s' do not match session question count %d", ses->survey_id, ses->question_count);
+      py_survey_free(entry);
+      entry = NULL;
+    }
+
+    if (!entry) {
+      entry = &py_survey_cache[py_survey_cache_next];
+      py_survey_cache_next = (py_survey_cache_next + 1) % PY_SURVEY_CACHE_SIZE;
+      py_survey_free(entry);
+      if (py_survey_create(entry, ses)) {
+        BREAK_ERRORV("Failed to create python question objects for survey '%s'", ses->survey_id);
+      }
+    }
+
+    Py_INCREF(entry->questions);
+    Py_INCREF(entry->meta);
+    *questions = entry->questions;
+    *meta = entry->meta;
+  } while (0);
+
+  return retVal;
+}
+
+/**
+ * question property mapping for a question uid
+ * returns a borrowed reference or NULL if the question does not exist
+ */
+PyObject *py_survey_question(struct session *ses, PyObject *meta, char *uid) {
+  if (!ses || !meta) {
+    return NULL;
+  }
+  int index = session_get_question_index(uid, ses);
+  if (index < 0 || index >= PyTuple_GET_SIZE(meta)) {
+    return NULL;
+  }
+  return PyTuple_GET_ITEM(meta, index);
+}
@@ -0,0 +1,146 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "errorlog.h"
+#include "py_module.h"
+
+/**
+ * Python hook latency histograms, per resolved hook function name (i.e. "nextquestion_foo")
+ *
+ * Durations are counted in logarithmic buckets (4 per power of two microseconds, ~19% resolution) from which
+ * percentiles are estimated. Statistics are kept per surveyfcgi process and shared by its threads, see
+ * /status?metrics.
+ */
+
+#define PY_STATS_SIZE 64 // hook functions, further functions are counted in PY_STATS_OTHER
+#define PY_STATS_BUCKETS 128 // up to 2^32 us
+#define PY_STATS_OTHER "(other)"
+
+struct py_stats_entry {
+  char function_name[PY_STATS_NAME_LEN];
+  unsigned long buckets[PY_STATS_BUCKETS];
+  unsigned long count;
+  unsigned long errors;
+  unsigned long timeouts;
+  unsigned long long total_us;
+  unsigned long long max_us;
+};
+
+static struct py_stats_entry py_stats[PY_STATS_SIZE];
+static int py_stats_count = 0;
+static pthread_mutex_t py_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int py_stats_bucket(unsigned long long us) {
+  if (us < 1) {
+    return 0;
+  }
+  int bucket = (int) (4 * log2((double) us));
+  return (bucket < PY_STATS_BUCKETS) ? bucket : PY_STATS_BUCKETS - 1;
+}
+
+/**
+ * upper bound (microseconds) of a bucket
+ */
+static double py_stats_bucket_limit(int bucket) {
+  return exp2((bucket + 1) / 4.0);
+}
+
+static struct py_stats_entry *py_stats_find(const char *function_name) {
+  for (int i = 0; i < py_stats_count; i++) {
+    if (!strcmp(py_stats[i].function_name, function_name)) {
+      return &py_stats[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * record a hook call
+ */
+void py_stats_record(const char *function_name, unsigned long long us, int failed, int timed_out) {
+  pthread_mutex_lock(&py_stats_mutex);
+
+  struct py_stats_entry *entry = py_stats_find(function_name);
+  if (!entry) {
+    if (py_stats_count < PY_STATS_SIZE - 1) {
+      entry = &py_stats[py_stats_count++];
+      snprintf(entry->function_name, PY_STATS_NAME_LEN, "%s", function_name);
+    } else {
+      entry = py_stats_find(PY_STATS_OTHER);
+      if (!entry) {
+        entry = &py_stats[py_stats_count++];
+        snprintf(entry->function_name, PY_STATS_NAME_LEN, "%s", PY_STATS_OTHER);
+      }
+    }
+  }
+
+  entry->buckets[py_stats_bucket(us)]++;
+  entry->count++;
+  entry->errors += (failed) ? 1 : 0;
+  entry->timeouts += (timed_out) ? 1 : 0;
+  entry->total_us += us;
+  if (us > entry->max_us) {
+    entry->max_us = us;
+  }
+
+  pthread_mutex_unlock(&py_stats_mutex);
+  return;
+}
+
+/**
+ * estimated percentile (0 < p <= 1) in milliseconds
+ */
+static double py_stats_percentile(struct py_stats_entry *entry, double p) {
+  unsigned long rank = (unsigned long) ceil(p * entry->count);
+  unsigned long seen = 0;
+
+  for (int i = 0; i < PY_STATS_BUCKETS; i++) {
+    seen += entry->buckets[i];
+    if (seen >= rank && seen) {
+      double limit = py_stats_bucket_limit(i);
+      return ((limit < entry->max_us) ? limit : entry->max_us) / 1000.0;
+    }
+  }
+  return entry->max_us / 1000.0;
+}
+
+/**
+ * Copy the statistics of all hook functions
+ * returns the number of entries written to out
+ */
+int py_stats_get(struct py_hook_stats *out, int max) {
+  int count = 0;
+
+  pthread_mutex_lock(&py_stats_mutex);
+
+  for (int i = 0; i < py_stats_count && count < max; i++) {
+    struct py_stats_entry *entry = &py_stats[i];
+    struct py_hook_stats *stats = &out[count++];
+
+    memcpy(stats->function_name, entry->function_name, PY_STATS_NAME_LEN);
+    stats->count = entry->count;
+    stats->errors = entry->errors;
+    stats->timeouts = entry->timeouts;
+    stats->mean_ms = (entry->count) ? (entry->total_us / 1000.0) / entry->count : 0;
+    stats->max_ms = entry->max_us / 1000.0;
+    stats->p50_ms = py_stats_percentile(entry, 0.50);
+    stats->p95_ms = py_stats_percentile(entry, 0.95);
+    stats->p99_ms = py_stats_percentile(entry, 0.99);
+  }
+
+  pthread_mutex_unlock(&py_stats_mutex);
+  return count;
+}
+
+/**
+ * reset all statistics
+ */
+void py_stats_clear(void) {
+  pthread_mutex_lock(&py_stats_mutex);
+  memset(py_stats, 0, sizeof(py_stats));
+  py_stats_count = 0;
+  pthread_mutex_unlock(&py_stats_mutex);
+  return;
+}
@@ -0,0 +1,242 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <Python.h>
+
+#include "errorlog.h"
+#include "survey.h"
+#include "utils.h"
+#include "py_module.h"
+
+/**
+ * Python hook time budgets (ENV SS_PYTHON_HOOK_TIMEOUT, survey directive "with python timeout=<ms>")
+ *
+ * A hook call arms a deadline in its watchdog slot, a single watchdog thread per process interrupts hooks which
+ * are still running when their deadline has passed: the watchdog attaches to the hook's interpreter and raises
+ * KeyboardInterrupt asynchronously in the hook thread (PyThreadState_SetAsyncExc()). PyErr_SetInterrupt() is not
+ * used, called from a non-python thread it does not break pure python loops.
+ * Hooks blocked in C code (i.e. time.sleep(), socket io) are interrupted once they return to the interpreter.
+ * The caller maps the interrupt to SS_SYSTEM_HOOK_TIMEOUT (HTTP 503).
+ *
+ * Arming and disarming must be done with the GIL released: the watchdog holds the slot mutex while it waits for the
+ * GIL.
+ */
+
+#define PY_WATCHDOG_SLOTS 64 // threads running hooks
+
+struct py_watchdog_slot {
+  int used;
+  int active;
+  int expired;
+  struct timespec deadline;
+  PyInterpreterState *interp;
+  unsigned long thread_id;
+};
+
+static struct py_watchdog_slot py_watchdog_slots[PY_WATCHDOG_SLOTS];
+static pthread_mutex_t py_watchdog_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t py_watchdog_cond = PTHREAD_COND_INITIALIZER;
+static pid_t py_watchdog_pid = 0; // process which runs the watchdog thread (threads don't survive fork())
+
+static THREAD_LOCAL int py_watchdog_slot = -1;
+static THREAD_LOCAL int py_hook_expired = 0; // last hook call of this thread exceeded its budget
+
+static int timespec_before(struct timespec *a, struct timespec *b) {
+  return (a->tv_sec < b->tv_sec) || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/**
+ * interrupt an expired hook, called with the slot mutex held
+ */
+static void py_watchdog_interrupt(struct py_watchdog_slot *slot) {
+  slot->expired = 1;
+
+  PyThreadState *tstate = PyThreadState_New(slot->interp);
+  if (!tstate) {
+    return;
+  }
+  PyEval_AcquireThread(tstate);
+  PyThreadState_SetAsyncExc(slot->thread_id, PyExc_KeyboardInterrupt);
+  PyThreadState_Clear(tstate);
+  PyEval_ReleaseThread(tstate);
+  PyThreadState_Delete(tstate);
+  return;
+}
+
+static void *py_watchdog_thread(void *arg) {
+  (void) arg;
+
+  pthread_mutex_lock(&py_watchdog_mutex);
+  for (;;) {
+    struct timespec now;
+    struct timespec next = { 0, 0 };
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (int i = 0; i < PY_WATCHDOG_SLOTS; i++) {
+      struct py_watchdog_slot *slot = &py_watchdog_slots[i];
+      if (!slot->active || slot->expired) {
+        continue;
+      }
+      if (!timespec_before(&now, &slot->deadline)) {
+        py_watchdog_interrupt(slot);
+        continue;
+      }
+      if (!next.tv_sec || timespec_before(&slot->deadline, &next)) {
+        next = slot->deadline;
+      }
+    }
+
+    if (next.tv_sec) {
+      pthread_cond_timedwait(&py_watchdog_cond, &py_watchdog_mutex, &next);
+    } else {
+      pthread_cond_wait(&py_watchdog_cond, &py_watchdog_mutex);
+    }
+  }
+
+  pthread_mutex_unlock(&py_watchdog_mutex);
+  return NULL;
+}
+
+/**
+ * start the watchdog thread of this process, called with the slot mutex held
+ */
+static int py_watchdog_start(void) {
+  if (py_watchdog_pid == getpid()) {
+    return 0;
+  }
+
+  // a forked worker inherits the slots of its parent, but not its threads
+  memset(py_watchdog_slots, 0, sizeof(py_watchdog_slots));
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&py_watchdog_cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, py_watchdog_thread, NULL)) {
+    return -1;
+  }
+  pthread_detach(thread);
+
+  py_watchdog_pid = getpid();
+  return 0;
+}
+
+/**
+ * Arm the watchdog for the current hook call, called with the GIL held. A timeout <= 0 disables the watchdog.
+ * returns 0 on success or if disabled, -1 on error (the hook runs without budget)
+ */
+int py_watchdog_arm(int timeout_ms) {
+  int retVal = 0;
+
+  if (timeout_ms <= 0) {
+    return 0;
+  }
+
+  PyInterpreterState *interp = PyThreadState_Get()->interp;
+  unsigned long thread_id = PyThread_get_thread_ident();
+
+  Py_BEGIN_ALLOW_THREADS
+  pthread_mutex_lock(&py_watchdog_mutex);
+
+  do {
+    if (py_watchdog_start()) {
+      BREAK_ERROR("Failed to start python watchdog thread");
+    }
+
+    if (py_watchdog_slot < 0 || !py_watchdog_slots[py_watchdog_slot].used) {
+      py_watchdog_slot = -1;
+      for (int i = 0; i < PY_WATCHDOG_SLOTS; i++) {
+        if (!py_watchdog_slots[i].used) {
+          py_watchdog_slots[i].used = 1;
+          py_watchdog_slot = i;
+          break;
+        }
+      }
+    }
+    if (py_watchdog_slot < 0) {
+      BREAK_ERROR("No free python watchdog slot");
+    }
+
+    struct py_watchdog_slot *slot = &py_watchdog_slots[py_watchdog_slot];
+    clock_gettime(CLOCK_MONOTONIC, &slot->deadline);
+    slot->deadline.tv_sec += timeout_ms / 1000;
+    slot->deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000L;
+    if (slot->deadline.tv_nsec >= 1000000000L) {
+      slot->deadline.tv_sec++;
+      slot->deadline.tv_nsec -= 1000000000L;
+    }
+    slot->interp = interp;
+    slot->thread_id = thread_id;
+    slot->expired = 0;
+    slot->active = 1;
+
+    pthread_cond_signal(&py_watchdog_cond);
+  } while (0);
+
+  pthread_mutex_unlock(&py_watchdog_mutex);
+  Py_END_ALLOW_THREADS
+
+  return retVal;
+}
+
+/**
+ * Disarm the watchdog after the hook call returned, called with the GIL held.
+ * An interrupt which was issued but not yet raised by the hook is discarded.
+ * returns 1 if the hook exceeded its budget, 0 otherwise
+ */
+int py_watchdog_disarm(void) {
+  int expired = 0;
+
+  if (py_watchdog_slot < 0) {
+    return 0;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  pthread_mutex_lock(&py_watchdog_mutex);
+
+  struct py_watchdog_slot *slot = &py_watchdog_slots[py_watchdog_slot];
+  if (slot->used && slot->active) {
+    expired = slot->expired;
+    slot->active = 0;
+    slot->expired = 0;
+  }
+
+  pthread_mutex_unlock(&py_watchdog_mutex);
+  Py_END_ALLOW_THREADS
+
+  if (expired) {
+    // the hook may have returned before the interrupt was raised
+    PyThreadState_SetAsyncExc(PyThread_get_thread_ident(), NULL);
+  }
+
+  return expired;
+}
+
+/**
+ * time budget (ms) of a hook call for the survey of a session, 0: no budget
+ */
+int py_hook_budget(struct session *ses) {
+  if (ses && ses->survey && ses->survey->python_timeout > 0) {
+    return ses->survey->python_timeout;
+  }
+  return env_limit("SS_PYTHON_HOOK_TIMEOUT", 0);
+}
+
+/**
+ * checks if the last hook call of this thread failed because it exceeded its time budget (SS_SYSTEM_HOOK_TIMEOUT)
+ */
+int py_hook_timed_out(void) {
+  return py_hook_expired;
+}
+
+void py_hook_set_timed_out(int expired) {
+  py_hook_expired = expired;
+  return;
+}
@@ -2,11 +2,13 @@
   Serialisers and de-serialisers for various structures.
 */
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "utils.h"
+#include "arena.h"
 #include "errorlog.h"
 #include "question_types.h"
 #include "survey.h"
@@ -222,6 +224,71 @@ int deserialise_parse_field(char *in, int *in_offset, char *out) {
   return retVal;
 }
 
+/*
+  In-place variant of deserialise_parse_field() for buffers owned by the caller (i.e. mapped files):
+  terminates the next colon delimited field at *cursor and de-escapes it in place.
+  *field points into the input buffer, *cursor is set to NULL after the last field.
+*/
+int deserialise_parse_field_inplace(char **cursor, char **field) {
+  int retVal = 0;
+
+  do {
+    char *r = *cursor;
+    if (!r) {
+      BREAK_ERROR("no more fields in input string");
+    }
+
+    char *w = r;
+    *field = r;
+
+    for (; *r && *r != ':'; r++) {
+      // Allow some \ escape characters
+      if (*r != '\\') {
+        *w++ = *r;
+        continue;
+      }
+
+      r++;
+      switch (*r) {
+        case ':':
+        case '\\':
+          *w++ = *r;
+          break;
+        case 'r':
+          *w++ = '\r';
+          break;
+        case 'n':
+          *w++ = '\n';
+          break;
+        case 't':
+          *w++ = '\t';
+          break;
+        case 'b':
+          *w++ = '\b';
+          break;
+        case 0:
+          BREAK_ERRORV("String '%s' ends in \\", *field);
+          break;
+        default:
+          BREAK_ERRORV("Illegal escape character 0x%02x in '%s'", *r, *field);
+          break;
+      }
+      if (retVal) {
+        break;
+      }
+    } // endfor
+
+    if (retVal) {
+      break;
+    }
+
+    *cursor = (*r == ':') ? r + 1 : NULL;
+    *w = 0;
+  } while (0);
+
+  return retVal;
+}
+
 /*
   Take an integer from a CSV field, and turn it back into a C int
 */
@@ -296,7 +363,7 @@ int deserialise_string(char *field, char **s) {
     if (!field) {
       BREAK_ERROR("string field is NULL");
     } else {
-      *s = strdup(field);
+      *s = request_strdup(field);
     }
 
     if (!*s) {
@@ -346,6 +413,31 @@ int deserialise_string(char *field, char **s) {
 #define DESERIALISE_STRING(S) DESERIALISE_THING(S, deserialise_string);
 #define DESERIALISE_LONGLONG(S) DESERIALISE_THING(S, deserialise_longlong)
 
+/*
+  In-place variants of the above macros, used by deserialise_*_inplace().
+  String fields are not copied but point into the input buffer.
+*/
+#define DESERIALISE_INPLACE_BEGIN()                                            \
+  {                                                                            \
+    char *cursor = in;                                                         \
+    char *field = NULL;
+#define DESERIALISE_INPLACE_COMPLETE()                                         \
+  }
+#define DESERIALISE_INPLACE_NEXT_FIELD()                                       \
+  if (deserialise_parse_field_inplace(&cursor, &field)) {                      \
+    BREAK_ERROR("failed to parse next field");                                 \
+  }
+#define DESERIALISE_INPLACE_THING(S, DESERIALISER)                             \
+  DESERIALISE_INPLACE_NEXT_FIELD();                                            \
+  if (DESERIALISER(field, &S)) {                                               \
+    BREAK_ERRORV("call to " #DESERIALISER " failed with string '%s'", field);    \
+  }
+#define DESERIALISE_INPLACE_INT(S) DESERIALISE_INPLACE_THING(S, deserialise_int)
+#define DESERIALISE_INPLACE_LONGLONG(S) DESERIALISE_INPLACE_THING(S, deserialise_longlong)
+#define DESERIALISE_INPLACE_STRING(S)                                          \
+  DESERIALISE_INPLACE_NEXT_FIELD();                                            \
+  S = field;
+
 /*
   We then have a similar set of macros for the serialisation process.
   APPEND_STRING and APPEND_COLON append to the serialised string being
@@ -509,7 +601,7 @@ struct string_list *deserialise_string_list(char *in, const char separator) {
   struct string_list *list = NULL;
 
   do {
-    list = calloc(1, sizeof(struct string_list));
+    list = request_calloc(1, sizeof(struct string_list));
     BREAK_IF(list == NULL, SS_ERROR_MEM, "string list");
 
     if(!in) {
@@ -549,11 +641,12 @@ void free_string_list(struct string_list *list) {
   }
 
   for (size_t i = 0; i < list->len; i++) {
-    free(list->items[i]);
+    request_free(list->items[i]);
   }
+  freez(list->items);
 
   list->len = 0;
-  free(list);
+  request_free(list);
 }
 
 
@@ -743,6 +836,41 @@ int deserialise_question(char *in, struct question *q) {
   return retVal;
 }
 
+/*
+  In-place variant of deserialise_question(), the string members of the question
+  point into the (modified) input string and must not be freed.
+  Fields must be kept in step with deserialise_question().
+ */
+int deserialise_question_inplace(char *in, struct question *q) {
+  int retVal = 0;
+  do {
+    if (!in || !in[0]) {
+      BREAK_ERROR("question string is empty");
+    }
+
+    DESERIALISE_INPLACE_BEGIN();
+
+    DESERIALISE_INPLACE_STRING(q->uid);
+    DESERIALISE_INPLACE_STRING(q->question_text);
+    DESERIALISE_INPLACE_STRING(q->question_html);
+    DESERIALISE_INPLACE_THING(q->type, deserialise_question_type);
+    DESERIALISE_INPLACE_INT(q->flags);
+    DESERIALISE_INPLACE_STRING(q->default_value);
+    DESERIALISE_INPLACE_LONGLONG(q->min_value);
+    DESERIALISE_INPLACE_LONGLONG(q->max_value);
+    DESERIALISE_INPLACE_INT(q->decimal_places);
+    DESERIALISE_INPLACE_INT(q->num_choices);
+    DESERIALISE_INPLACE_STRING(q->choices);
+    // #72 unit field
+    DESERIALISE_INPLACE_STRING(q->unit);
+
+    DESERIALISE_INPLACE_COMPLETE();
+
+  } while (0);
+
+  return retVal;
+}
+
 /**
 * Top-level function for serialising a answer that has been passed in
 * in a struct answer.  It uses the various macros defined above to
@@ -905,6 +1033,291 @@ int deserialise_answer(char *in, enum answer_scope scope, struct answer *a) {
   return retVal;
 }
 
+/**
+* In-place variant of deserialise_answer() for ANSWER_SCOPE_FULL, used for loading session files.
+* The string members of the answer point into the (modified) input string and must not be freed.
+* Fields must be kept in step with deserialise_answer().
+*/
+int deserialise_answer_inplace(char *in, struct answer *a) {
+  int retVal = 0;
+
+  do {
+    if (!in) {
+      BREAK_ERROR("answer string is null");
+    }
+
+    int cols = serialiser_count_columns(':', in);
+    if (cols < 0) {
+      BREAK_ERROR("invalid answer line");
+    }
+    if (cols != ANSWER_SCOPE_FULL) {
+      BREAK_ERRORV("invalid column count in answer line: %d != %d", cols, ANSWER_SCOPE_FULL);
+    }
+
+    DESERIALISE_INPLACE_BEGIN();
+    DESERIALISE_INPLACE_STRING(a->uid);
+    DESERIALISE_INPLACE_THING(a->type, deserialise_question_type);
+    DESERIALISE_INPLACE_STRING(a->text);
+    DESERIALISE_INPLACE_LONGLONG(a->value);
+    DESERIALISE_INPLACE_LONGLONG(a->lat);
+    DESERIALISE_INPLACE_LONGLONG(a->lon);
+    DESERIALISE_INPLACE_LONGLONG(a->time_begin);
+    DESERIALISE_INPLACE_LONGLONG(a->time_end);
+    DESERIALISE_INPLACE_INT(a->time_zone_delta);
+    DESERIALISE_INPLACE_INT(a->dst_delta);
+    DESERIALISE_INPLACE_STRING(a->unit);
+    DESERIALISE_INPLACE_INT(a->flags);
+    DESERIALISE_INPLACE_LONGLONG(a->stored);
+    DESERIALISE_INPLACE_COMPLETE();
+
+  } while (0);
+
+  return retVal;
+}
+
+/*
+  Binary session file format (v3)
+
+  All integers are little endian. Strings are stored as a uint32 length followed by
+  the string and a terminating NUL, so that loaded strings can point into the file mapping.
+  As in the text format, NULL pointers are stored as empty strings.
+
+  header: <magic:4> <version:u32> <answer count:u32> <survey id:string> <crc32:u32>
+  record: <payload length:u32> <payload> <crc32 of payload:u32>
+  answer payload: <type:i32> <time_zone_delta:i32> <dst_delta:i32> <flags:i32>
+                  <value:i64> <lat:i64> <lon:i64> <time_begin:i64> <time_end:i64> <stored:i64>
+                  <uid:string> <text:string> <unit:string>
+*/
+static void binary_put_u32(char *out, uint32_t v) {
+  for (int i = 0; i < 4; i++) {
+    out[i] = (v >> (8 * i)) & 0xFF;
+  }
+}
+
+static uint32_t binary_get_u32(const char *in) {
+  uint32_t v = 0;
+  for (int i = 0; i < 4; i++) {
+    v |= (uint32_t)(unsigned char)in[i] << (8 * i);
+  }
+  return v;
+}
+
+static void binary_put_u64(char *out, uint64_t v) {
+  for (int i = 0; i < 8; i++) {
+    out[i] = (v >> (8 * i)) & 0xFF;
+  }
+}
+
+static uint64_t binary_get_u64(const char *in) {
+  uint64_t v = 0;
+  for (int i = 0; i < 8; i++) {
+    v |= (uint64_t)(unsigned char)in[i] << (8 * i);
+  }
+  return v;
+}
+
+/*
+  appends a length prefixed string, returns the new offset or -1 if out is too small
+*/
+static int binary_put_string(char *out, int offset, size_t max_len, char *str) {
+  if (!str) {
+    str = "";
+  }
+
+  size_t len = strlen(str);
+  if (offset + 4 + len + 1 > max_len) {
+    return -1;
+  }
+  binary_put_u32(&out[offset], len);
+  memcpy(&out[offset + 4], str, len + 1);
+  return offset + 4 + len + 1;
+}
+
+/*
+  reads a length prefixed string, *str points into the input buffer
+  returns the new offset or -1 if the string exceeds the input
+*/
+static int binary_get_string(char *in, int offset, size_t len, char **str) {
+  if (offset + 4 > len) {
+    return -1;
+  }
+
+  uint32_t slen = binary_get_u32(&in[offset]);
+  if (offset + 4 + (size_t)slen + 1 > len || in[offset + 4 + slen] != 0) {
+    return -1;
+  }
+  *str = &in[offset + 4];
+  return offset + 4 + slen + 1;
+}
+
+/**
+ * serialises the header of a binary session file
+ * returns the number of bytes written or -1 on error
+ */
+int serialise_session_header_binary(char *survey_id, int answer_count, char *out, size_t max_len) {
+  int retVal = 0;
+
+  do {
+    if (!survey_id || !out) {
+      BREAK_ERROR("survey_id or output buffer is NULL");
+    }
+    if (max_len < 12) {
+      BREAK_ERROR("output buffer is too small");
+    }
+
+    memcpy(out, SESSION_BINARY_MAGIC, 4);
+    binary_put_u32(&out[4], SESSION_BINARY_VERSION);
+    binary_put_u32(&out[8], answer_count);
+
+    int offset = binary_put_string(out, 12, max_len, survey_id);
+    if (offset < 0 || offset + 4 > max_len) {
+      BREAK_ERROR("output buffer is too small");
+    }
+
+    binary_put_u32(&out[offset], crc32_checksum(out, offset));
+    retVal = offset + 4;
+  } while (0);
+
+  return retVal;
+}
+
+/**
+ * deserialises the header of a binary session file, *survey_id points into the input buffer
+ * returns the number of bytes consumed or -1 on error
+ */
+int deserialise_session_header_binary(char *in, size_t len, char **survey_id, int *answer_count) {
+  int retVal = 0;
+
+  do {
+    if (!in || len < 12 || memcmp(in, SESSION_BINARY_MAGIC, 4)) {
+      BREAK_ERROR("not a binary session file");
+    }
+
+    uint32_t version = binary_get_u32(&in[4]);
+    if (version != SESSION_BINARY_VERSION) {
+      BREAK_ERRORV("unsupported binary session file version %u", version);
+    }
+    *answer_count = binary_get_u32(&in[8]);
+
+    int offset = binary_get_string(in, 12, len, survey_id);
+    if (offset < 0 || offset + 4 > len) {
+      BREAK_ERROR("truncated session file header");
+    }
+
+    if (binary_get_u32(&in[offset]) != crc32_checksum(in, offset)) {
+      BREAK_ERROR("checksum mismatch in session file header");
+    }
+    retVal = offset + 4;
+  } while (0);
+
+  return retVal;
+}
+
+/**
+ * serialises an answer (all members, equivalent to ANSWER_SCOPE_FULL) into a binary record
+ * returns the number of bytes written or -1 on error
+ */
+int serialise_answer_binary(struct answer *a, char *out, size_t max_len) {
+  int retVal = 0;
+
+  do {
+    if (!a || !out) {
+      BREAK_ERROR("answer or output buffer is NULL");
+    }
+    if (max_len < 4 + 64 + 4) {
+      BREAK_ERROR("output buffer is too small");
+    }
+
+    char *p = &out[4];
+    binary_put_u32(&p[0], a->type);
+    binary_put_u32(&p[4], a->time_zone_delta);
+    binary_put_u32(&p[8], a->dst_delta);
+    binary_put_u32(&p[12], a->flags);
+    binary_put_u64(&p[16], a->value);
+    binary_put_u64(&p[24], a->lat);
+    binary_put_u64(&p[32], a->lon);
+    binary_put_u64(&p[40], a->time_begin);
+    binary_put_u64(&p[48], a->time_end);
+    binary_put_u64(&p[56], a->stored);
+
+    int offset = 4 + 64;
+    offset = binary_put_string(out, offset, max_len, a->uid);
+    if (offset > -1) {
+      offset = binary_put_string(out, offset, max_len, a->text);
+    }
+    if (offset > -1) {
+      offset = binary_put_string(out, offset, max_len, a->unit);
+    }
+    if (offset < 0 || offset + 4 > max_len) {
+      BREAK_ERRORV("binary record for answer '%s' too long", a->uid);
+    }
+
+    binary_put_u32(out, offset - 4);
+    binary_put_u32(&out[offset], crc32_checksum(p, offset - 4));
+    retVal = offset + 4;
+  } while (0);
+
+  return retVal;
+}
+
+/**
+ * deserialises a binary answer record, the string members point into the input buffer and must not be freed
+ * returns the number of bytes consumed or -1 on error
+ */
+int deserialise_answer_binary(char *in, size_t len, struct answer *a) {
+  int retVal = 0;
+
+  do {
+    if (!in || !a) {
+      BREAK_ERROR("input buffer or answer is NULL");
+    }
+    if (len < 4) {
+      BREAK_ERROR("truncated answer record");
+    }
+
+    size_t payload_len = binary_get_u32(in);
+    if (payload_len < 64 || 4 + payload_len + 4 > len) {
+      BREAK_ERROR("truncated answer record");
+    }
+
+    char *p = &in[4];
+    if (binary_get_u32(&p[payload_len]) != crc32_checksum(p, payload_len)) {
+      BREAK_ERROR("checksum mismatch in answer record");
+    }
+
+    a->type = (int32_t)binary_get_u32(&p[0]);
+    a->time_zone_delta = (int32_t)binary_get_u32(&p[4]);
+    a->dst_delta = (int32_t)binary_get_u32(&p[8]);
+    a->flags = (int32_t)binary_get_u32(&p[12]);
+    a->value = (int64_t)binary_get_u64(&p[16]);
+    a->lat = (int64_t)binary_get_u64(&p[24]);
+    a->lon = (int64_t)binary_get_u64(&p[32]);
+    a->time_begin = (int64_t)binary_get_u64(&p[40]);
+    a->time_end = (int64_t)binary_get_u64(&p[48]);
+    a->stored = (int64_t)binary_get_u64(&p[56]);
+
+    int offset = 64;
+    offset = binary_get_string(p, offset, payload_len, &a->uid);
+    if (offset > -1) {
+      offset = binary_get_string(p, offset, payload_len, &a->text);
+    }
+    if (offset > -1) {
+      offset = binary_get_string(p, offset, payload_len, &a->unit);
+    }
+    if (offset != payload_len) {
+      BREAK_ERROR("malformed answer record");
+    }
+
+    if (a->type < 1 || a->type > NUM_QUESTION_TYPES) {
+      BREAK_ERRORV("invalid question type %d in answer record '%s'", a->type, a->uid);
+    }
+
+    retVal = 4 + payload_len + 4;
+  } while (0);
+
+  return retVal;
+}
+
 /*
   The following macros make it easier to compare fields between two instances of
   a structure.
@@ -1034,9 +1447,10 @@ void free_answer_list(struct answer_list *list) {
   for(size_t i = 0; i < list->len; i++) {
     free_answer(list->answers[i]);
   }
+  freez(list->answers);
   list->len = 0;
 
-  free(list);
+  request_free(list);
 }
 
 /**
@@ -1054,7 +1468,7 @@ struct answer_list *deserialise_answers(const char *body, enum answer_scope scop
       BREAK_ERROR("body to parse is empty");
     }
 
-    list = calloc(1, sizeof(struct answer_list));
+    list = request_calloc(1, sizeof(struct answer_list));
     if (!list) {
       BREAK_ERROR("error allocating memory for answer list");
     }
@@ -1063,11 +1477,23 @@ struct answer_list *deserialise_answers(const char *body, enum answer_scope scop
     char *sav;
     char *line = parse_line(body, '\n', &sav);
 
+    int max_answers = env_limit("SS_MAX_ANSWERS", MAX_ANSWERS);
+
     while(line != NULL) {
 
+      if (i >= max_answers) {
+        BREAK_ERRORV("too many answers (increase SS_MAX_ANSWERS?), line %d", i);
+      }
+
+      struct answer **answers = array_reserve(list->answers, &list->capacity, i + 1, sizeof(struct answer *));
+      if (!answers) {
+        BREAK_ERRORV("error allocating memory for answers in line %d", i);
+      }
+      list->answers = answers;
+
       // initialise answer
       list->len++; // placed here for comlete free_answer_list on retVal > 0
-      list->answers[i] = calloc(1, sizeof(struct answer));
+      list->answers[i] = request_calloc(1, sizeof(struct answer));
       if (list->answers[i] == NULL) {
         BREAK_ERRORV("error allocating memory for answer in line %d", i);
         break;
@@ -1078,7 +1504,7 @@ struct answer_list *deserialise_answers(const char *body, enum answer_scope scop
         BREAK_ERRORV("failed to deserialise answer for line %d, starting with '%.20s'", i, line);
         break;
       }
-      freez(line);
+      request_free(line);
       line = NULL;
 
       LOG_INFOV("parsed answer '%s' from line %d", list->answers[i]->uid, i);
@@ -1,14 +1,18 @@
+#define _GNU_SOURCE // F_OFD_SETLK
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "arena.h"
 #include "errorlog.h"
 #include "paths.h"
 #include "question_types.h"
@@ -44,6 +48,19 @@ char *session_state_names[NUM_SESSION_STATES] = {
   "SESSION_CLOSED",
 };
 
+/**
+ * make room for count answers in ses->answers
+ * returns 0 on success or -1 on error
+ */
+static int session_reserve_answers(struct session *ses, int count) {
+  struct answer **answers = array_reserve(ses->answers, &ses->answer_capacity, count, sizeof(struct answer *));
+  if (!answers) {
+    return -1;
+  }
+  ses->answers = answers;
+  return 0;
+}
+
 /**
  * #379 validate requested action against current session
  */
@@ -122,7 +139,7 @@ int urandombytes(unsigned char *buf, size_t len) {
       break;
     }
 
-    static int urandomfd = -1;
+    static THREAD_LOCAL int urandomfd = -1;
 
     int tries = 0;
 
@@ -258,8 +275,12 @@ int session_new_add_meta(struct session *ses, struct session_meta *meta) {
 
     enum Headers { HEADER_USER, HEADER_GROUP, HEADER_AUTHORITY, HEADER_STATE, HEADER_MAX };
 
+    if (session_reserve_answers(ses, HEADER_MAX)) {
+      BREAK_ERROR("allocating header answers failed.");
+    }
+
     for (int i = 0; i < HEADER_MAX; i++) {
-      ses->answers[i] = calloc(sizeof(struct answer), 1);
+      ses->answers[i] = request_calloc(sizeof(struct answer), 1);
       if (!ses->answers[i]) {
         BREAK_ERRORV("calloc() of answer structure (header line %d) failed.", i);
       }
@@ -276,29 +297,29 @@ int session_new_add_meta(struct session *ses, struct session_meta *meta) {
 
     // @user header
     a = ses->answers[HEADER_USER];
-    a->uid = strdup("@user");
+    a->uid = request_strdup("@user");
     if (meta->user) {
-      a->text = strdup(meta->user);
+      a->text = request_strdup(meta->user);
     }
 
     // @group header
     a = ses->answers[HEADER_GROUP];
-    a->uid = strdup("@group");
+    a->uid = request_strdup("@group");
     if (meta->group) {
-      a->text = strdup(meta->group);
+      a->text = request_strdup(meta->group);
     }
 
     // @authority header
     a = ses->answers[HEADER_AUTHORITY];
-    a->uid = strdup("@authority");
+    a->uid = request_strdup("@authority");
     a->value = meta->provider;
     if (meta->authority) {
-      a->text = strdup(meta->authority);
+      a->text = request_strdup(meta->authority);
     }
 
     // @astate header
     a = ses->answers[HEADER_STATE];
-    a->uid = strdup("@state");
+    a->uid = request_strdup("@state");
     a->value = ses->state;
     a->time_begin = stored;
 
@@ -342,9 +363,13 @@ void log_session_meta(struct session_meta *meta) {
 int create_survey_snapshot(char *survey_id, char *sha1, int sha1_len) {
   int retVal = 0;
 
+  struct stat st;
+  int registrable = 0;
+
   do {
     char survey_path[1024];
-    char snapshot_path[1024];
+    char current_name[1024];
+    char snapshot_name[1024];
     char temp_path[1024];
     int hash_len = HASH_LENGTH * 2 + 1; // @see sha1_file()
 
@@ -361,23 +386,40 @@ int create_survey_snapshot(char *survey_id, char *sha1, int sha1_len) {
       BREAK_ERROR("Invalid survey id");
     }
 
+    // survey files are accessed relative to <survey_home>/surveys
+    int dirfd = path_dirfd(PATH_DIR_SURVEYS);
+    if (dirfd < 0) {
+      BREAK_ERRORV("Could not open surveys directory for survey '%s'", survey_id);
+    }
+
     // get path to survey manifest
     if (generate_survey_path(survey_id, "current", survey_path, 1024)) {
       BREAK_ERRORV("generate_survey_path() failed to build path for survey '%s'", survey_id);
     }
-    if (access(survey_path, F_OK) == -1) {
+    snprintf(current_name, 1024, "%s/current", survey_id);
+    if (fstatat(dirfd, current_name, &st, 0)) {
       BREAK_ERRORV("Survey '%s' does not exist", survey_id);
     }
 
+    // known version of the survey file, see survey_snapshots.c
+    if (!survey_snapshot_lookup(survey_id, &st, sha1, sha1_len)) {
+      break;
+    }
+
     // Get sha1 hash of survey file
     if (sha1_file(survey_path, sha1)) {
       BREAK_ERRORV("Could not hash survey specification file '%s'", survey_path);
     }
-    if (generate_survey_path(survey_id, sha1, snapshot_path, 1024)) {
-      BREAK_ERRORV("generate_survey_path() failed to build path for snapshot '%s'", sha1);
+
+    // only register the hash if the file did not change while hashing
+    struct stat st_after;
+    if (!fstatat(dirfd, current_name, &st_after, 0)) {
+      registrable = st.st_dev == st_after.st_dev && st.st_ino == st_after.st_ino && st.st_size == st_after.st_size
+                    && st.st_mtim.tv_sec == st_after.st_mtim.tv_sec && st.st_mtim.tv_nsec == st_after.st_mtim.tv_nsec;
     }
+    snprintf(snapshot_name, 1024, "%s/%s", survey_id, sha1);
 
-    if (access(snapshot_path, F_OK) != -1) {
+    if (faccessat(dirfd, snapshot_name, F_OK, 0) != -1) {
         // a snapshot exists already, return
         break;
     }
@@ -388,21 +430,15 @@ int create_survey_snapshot(char *survey_id, char *sha1, int sha1_len) {
     // of what we read.
 
     // open input file (manifest)
-    FILE *in = fopen(survey_path, "r");
+    FILE *in = fopen_at(dirfd, current_name, "r");
     if (!in) {
         BREAK_ERRORV("Could not read from survey manifest '%s'", survey_path);
     }
 
     // make a hopefully unique name for the temporary file
-    char temp_name[1024];
-    snprintf(temp_name, 1024, "temp.%lld.%d.%s", (long long)time(0), getpid(), sha1);
+    snprintf(temp_path, 1024, "%s/temp.%lld.%d.%lx.%s", survey_id, (long long)time(0), getpid(), (unsigned long) pthread_self(), sha1);
 
-    if (generate_survey_path(survey_id, temp_name, temp_path, 1024)) {
-        fclose(in);
-        BREAK_ERRORV("generate_path() failed to build temporary path for survey '%s'", temp_name);
-    }
-
-    FILE *c = fopen(temp_path, "w");
+    FILE *c = fopen_at(dirfd, temp_path, "w");
     if (!c) {
         fclose(in);
         BREAK_ERRORV("Could not create temporary file '%s'", temp_path);
@@ -425,7 +461,7 @@ int create_survey_snapshot(char *survey_id, char *sha1, int sha1_len) {
             if (wrote != 1) {
                 fclose(in);
                 fclose(c);
-                unlink(temp_path);
+                unlinkat(dirfd, temp_path, 0);
                 BREAK_ERRORV("Failed to write all bytes during survey specification copy into '%s'", temp_path);
             }
         }
@@ -439,14 +475,21 @@ int create_survey_snapshot(char *survey_id, char *sha1, int sha1_len) {
     fclose(c);
 
     // Rename temporary file
-    if (rename(temp_path, snapshot_path)) {
-    BREAK_ERRORV("Could not rename survey specification copy to name of hash from '%s' to '%s'", temp_path, snapshot_path);
+    if (renameat(dirfd, temp_path, dirfd, snapshot_name)) {
+    BREAK_ERRORV("Could not rename survey specification copy to name of hash from '%s' to '%s'", temp_path, snapshot_name);
     }
 
-    LOG_INFOV("Created new hashed survey specification file '%s' for survey '%s'", snapshot_path, survey_id);
+    LOG_INFOV("Created new hashed survey specification file '%s' for survey '%s'", snapshot_name, survey_id);
 
   } while (0);
 
+  if (!retVal && registrable) {
+    // a failure to persist the registry only costs a rehash on the next session
+    if (survey_snapshot_register(survey_id, &st, sha1)) {
+      LOG_WARNV("Could not register snapshot '%s' for survey '%s'", sha1, survey_id);
+    }
+  }
+
   return retVal;
 }
 
@@ -462,7 +505,6 @@ int create_session_id(char *session_id_out, int max_len) {
     BREAK_IF(session_id_out == NULL, SS_ERROR_MEM, "session_id_out is a NULL pointer");
 
     session_id_out[0] = 0;
-    char path[1024];
 
     // Generate new unique session ID
     int tries = 0;
@@ -471,12 +513,9 @@ int create_session_id(char *session_id_out, int max_len) {
         BREAK_ERROR("random_session_id() failed to generate new session_id");
       }
 
-      if (generate_session_path(session_id_out, session_id_out, path, 1024)) {
-        BREAK_ERRORV("generate_path('%s') failed to build path for new session for session '%s'", session_id_out);
-      }
-
       // Try again if session ID already exists
-      if (access(path, F_OK) != -1) {
+      int dirfd = session_dirfd(session_id_out, 0);
+      if (dirfd > -1 && faccessat(dirfd, session_id_out, F_OK, 0) != -1) {
         session_id_out[0] = 0;
         continue;
       } else {
@@ -535,34 +574,13 @@ struct session *create_session(char *survey_id, char *session_id, struct session
         BREAK_CODEV(SS_SYSTEM_CREATE_SURVEY_SHA, "cannot create session for survey '%s'", survey_id);
     }
 
-    // Make directories if they don't already exist
-    char session_path[1024];
-
-    // mkdir /<survey_home>/sessions/
-    res = generate_path("sessions", session_path, 1024);
-    BREAK_IF(res != 0, SS_SYSTEM_FILE_PATH, "/<home>/sessions dir");
-
-    if (access(session_path, W_OK)) {
-      res = mkdir(session_path, 0750);
-      BREAK_IF(res != 0, SS_ERROR_CREATE_DIR, "/<home>/sessions dir");
-    }
-
-    // mkdir <survey_home>/sessions/<suffix>/
-    res = generate_session_path(session_id, NULL, session_path, 1024);
-    BREAK_IF(res != 0, SS_SYSTEM_FILE_PATH, "/<home>/sessions/<suffix> dir");
-
-    if (access(session_path, W_OK)) {
-      res = mkdir(session_path, 0750);
-      BREAK_IF(res != 0, SS_ERROR_CREATE_DIR, "/<home>/sessions/<suffix> dir");
-    }
-
-    // <survey_home>/sessions/<suffix>/<session_id>
-    res = generate_session_path(session_id, session_id, session_path, 1024);
-    BREAK_IF(res != 0, SS_SYSTEM_FILE_PATH, "/<home>/sessions/<suffix>/<session_id> dir");
+    // make <survey_home>/sessions/<prefix>/ if it doesn't already exist
+    int dirfd = session_dirfd(session_id, 1);
+    BREAK_IF(dirfd < 0, SS_ERROR_CREATE_DIR, "/<home>/sessions/<prefix> dir");
 
     // verify that session file does not exists
-    if (!access(session_path, R_OK)) {
-      BREAK_CODEV(SS_SESSION_EXISTS, "session file '%' exists already", session_path);
+    if (!faccessat(dirfd, session_id, R_OK, 0)) {
+      BREAK_CODEV(SS_SESSION_EXISTS, "session file '%s' exists already", session_id);
     }
 
     // Write survey_id to new empty session.
@@ -570,17 +588,18 @@ struct session *create_session(char *survey_id, char *session_id, struct session
     char sid[256];
     snprintf(sid, 256, "%s/%s", survey_id, survey_sha1);
 
-    ses = calloc(sizeof(struct session), 1);
+    ses = request_calloc(sizeof(struct session), 1);
     BREAK_IF(ses == NULL, SS_ERROR_MEM, "calloc(struct session)");
 
-    ses->survey_id = strdup(sid);
+    ses->survey_id = request_strdup(sid);
     BREAK_IF(ses->survey_id == NULL, SS_ERROR_MEM, "strdup(survey_id)");
 
-    ses->session_id = strdup(session_id);
+    ses->session_id = request_strdup(session_id);
     BREAK_IF(ses->session_id == NULL, SS_ERROR_MEM, "strdup(session_id)");
 
     // #379 set session state to SESSION_NEW
     ses->state = SESSION_NEW;
+    ses->dirty = 1;
 
     if (session_new_add_meta(ses, meta)) {
       BREAK_CODE(SS_SYSTEM_WRITE_SESSION_META, "Failed to load questions from survey");
@@ -604,7 +623,7 @@ struct session *create_session(char *survey_id, char *session_id, struct session
       BREAK_CODE(res, "save_session failed");
     }
 
-    LOG_INFOV("Created new session file '%s' for survey '%s'", session_path, survey_id);
+    LOG_INFOV("Created new session file '%s' for survey '%s'", session_id, survey_id);
   } while (0);
 
   free_next_questions(nq);
@@ -618,6 +637,153 @@ struct session *create_session(char *survey_id, char *session_id, struct session
   return ses;
 }
 
+/**
+ * Session journal (opt-in, env SS_SESSION_JOURNAL=<max records>)
+ * Instead of rewriting the whole session file, save_session() appends changed answers to
+ * sessions/<prefix>/<session_id>.journal. Once the journal exceeds <max records> it is compacted into a
+ * new session file.
+ * returns the maximum number of journal records or 0 if the journal is disabled
+ */
+static int session_journal_limit(void) {
+  char *env = getenv("SS_SESSION_JOURNAL");
+  if (!env) {
+    return 0;
+  }
+
+  int limit = atoi(env);
+  return (limit > 0) ? limit : 0;
+}
+
+static void session_journal_name(char *session_id, char *name_out, int max_len) {
+  snprintf(name_out, max_len, "%s.journal", session_id);
+}
+
+/**
+ * Optimistic concurrency (opt-in, env SS_SESSION_OPTIMISTIC=1)
+ * Requests don't lock sessions. Session files are only ever replaced by rename(), load_session() records the
+ * identity of the file it read (generation) and save_session() publishes the new file only if the session file
+ * still has this identity (compare and swap), otherwise it fails with SS_SESSION_CONFLICT (HTTP 412).
+ * The session journal is not used in this mode, appends can't be verified.
+ */
+int session_optimistic(void) {
+  return env_limit("SS_SESSION_OPTIMISTIC", 0) > 0;
+}
+
+/**
+ * identity of a session file: a new file is written for every update, inode and mtime change with each rename()
+ */
+static int session_file_generation(struct stat *st, char *out, size_t len) {
+  snprintf(out, len, "%lx-%lld.%09ld-%lld", (unsigned long) st->st_ino, (long long) st->st_mtim.tv_sec, st->st_mtim.tv_nsec, (long long) st->st_size);
+  return 0;
+}
+
+/**
+ * first line of a journal: "journal <generation>\n", the identity of the session file the records apply to.
+ * A journal of another session file generation is stale, save_session() was interrupted after compacting it.
+ */
+static int session_journal_header(int dirfd, char *session_id, char *out, size_t len) {
+  struct stat st;
+  if (fstatat(dirfd, session_id, &st, 0)) {
+    return -1;
+  }
+
+  char generation[64];
+  session_file_generation(&st, generation, 64);
+  snprintf(out, len, "journal %s\n", generation);
+  return 0;
+}
+
+/**
+ * lock a session claim (non blocking), the kernel releases the lock when the owning process exits
+ */
+static int session_claim_lock(int fd) {
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+#ifdef F_OFD_SETLK
+  return fcntl(fd, F_OFD_SETLK, &fl);
+#else
+  return fcntl(fd, F_SETLK, &fl);
+#endif
+}
+
+/**
+ * publish a written session file (compare and swap): the generation the session was loaded from is claimed with
+ * link() (one writer per generation), then the current session file is verified against it and replaced.
+ * The claim is the written file itself, locked before it is linked. A claim which another writer can lock has no
+ * live owner (the writer crashed) and is taken over, a locked claim is never broken.
+ */
+static int session_publish_cas(struct session *s, int dirfd, char *name_written) {
+  int retVal = 0;
+  char claim_name[1024] = { 0 };
+  int claimed = 0;
+  int claim_fd = -1;
+
+  do {
+    struct stat st;
+    char written_generation[64];
+    if (fstatat(dirfd, name_written, &st, 0)) {
+      BREAK_ERRORV("Could not stat written session file '%s'", name_written);
+    }
+    session_file_generation(&st, written_generation, 64);
+
+    snprintf(claim_name, 1024, "cas.%s.%s", s->session_id, s->generation);
+
+    claim_fd = openat(dirfd, name_written, O_RDWR | O_CLOEXEC);
+    if (claim_fd < 0 || session_claim_lock(claim_fd)) {
+      BREAK_ERRORV("Could not lock written session file '%s' (errno=%d)", name_written, errno);
+    }
+
+    if (linkat(dirfd, name_written, dirfd, claim_name, 0)) {
+      if (errno != EEXIST) {
+        BREAK_ERRORV("link('%s','%s') failed (errno=%d)", name_written, claim_name, errno);
+      }
+
+      close(claim_fd);
+      claim_fd = openat(dirfd, claim_name, O_RDWR | O_CLOEXEC);
+      if (claim_fd < 0 || session_claim_lock(claim_fd)) {
+        BREAK_CODEV(SS_SESSION_CONFLICT, "session '%s' is being updated by another request", s->session_id);
+      }
+
+      // the owner may have released the claim just now, the locked file must still be the claim
+      struct stat st_claim;
+      if (fstat(claim_fd, &st) || fstatat(dirfd, claim_name, &st_claim, 0)
+        || st.st_dev != st_claim.st_dev || st.st_ino != st_claim.st_ino) {
+        BREAK_CODEV(SS_SESSION_CONFLICT, "session '%s' is being updated by another request", s->session_id);
+      }
+
+      LOG_WARNV("Taking over stale session claim '%s'", claim_name);
+    }
+    claimed = 1;
+
+    char current_generation[64];
+    if (fstatat(dirfd, s->session_id, &st, 0)) {
+      BREAK_CODEV(SS_SESSION_CONFLICT, "session file '%s' was removed", s->session_id);
+    }
+    session_file_generation(&st, current_generation, 64);
+    if (strcmp(current_generation, s->generation)) {
+      BREAK_CODEV(SS_SESSION_CONFLICT, "session '%s' was changed by another request", s->session_id);
+    }
+
+    if (renameat(dirfd, name_written, dirfd, s->session_id)) {
+      BREAK_ERRORV("rename('%s','%s') failed when updating file for session '%s' (errno=%d)", name_written, s->session_id, s->session_id, errno);
+    }
+
+    snprintf(s->generation, sizeof(s->generation), "%s", written_generation);
+  } while (0);
+
+  // the claim is removed before its lock is released
+  if (claimed) {
+    unlinkat(dirfd, claim_name, 0);
+  }
+  if (claim_fd > -1) {
+    close(claim_fd);
+  }
+
+  return retVal;
+}
+
 /*
    The opposite of create_session().  It will complain if the session does not exist,
    or cannot be deleted.
@@ -626,10 +792,6 @@ int delete_session(char *session_id) {
   int retVal = 0;
 
   do {
-    char session_prefix[5];
-    char session_path_suffix[1024];
-    char session_path[1024];
-
     if (!session_id) {
       BREAK_ERROR("session_id is NULL");
     }
@@ -637,28 +799,21 @@ int delete_session(char *session_id) {
       BREAK_ERRORV("Session ID '%s' is malformed", session_id);
     }
 
-    for (int i = 0; i < 4; i++) {
-      session_prefix[i] = session_id[i];
+    int dirfd = session_dirfd(session_id, 0);
+    if (dirfd < 0 || faccessat(dirfd, session_id, F_OK, 0) == -1) {
+      BREAK_ERRORV("Session file '%s' does not exist", session_id);
     }
-    session_prefix[4] = 0;
 
-    snprintf(session_path_suffix, 1024, "sessions/%s/%s", session_prefix,
-             session_id);
-    if (generate_path(session_path_suffix, session_path, 1024)) {
-      BREAK_ERRORV("generate_path('%s') failed to build path while deleting "
-                 "session '%s'",
-                 session_path_suffix, session_id);
+    if (unlinkat(dirfd, session_id, 0)) {
+      BREAK_ERRORV("unlink('%s') failed", session_id);
     }
 
-    // Try again if session ID already exists
-    if (access(session_path, F_OK) == -1) {
-      BREAK_ERRORV("Session file '%s' does not exist", session_path);
+    char journal_name[1024];
+    session_journal_name(session_id, journal_name, 1024);
+    if (unlinkat(dirfd, journal_name, 0) && errno != ENOENT) {
+      BREAK_ERRORV("unlink('%s') failed", journal_name);
     }
-
-    if (unlink(session_path)) {
-      BREAK_ERRORV("unlink('%s') failed", session_path);
-    }
-    LOG_INFOV("Deleted session '%s'.", session_path);
+    LOG_INFOV("Deleted session '%s'.", session_id);
   } while (0);
 
   return retVal;
@@ -669,12 +824,15 @@ void free_answer(struct answer *a) {
     return;
   }
 
-  freez(a->uid);
-  freez(a->text);
-  // #72 unit field
-  freez(a->unit);
+  // strings are part of the session file mapping
+  if (!a->borrowed) {
+    request_free(a->uid);
+    request_free(a->text);
+    // #72 unit field
+    request_free(a->unit);
+  }
 
-  free(a);
+  request_free(a);
   return;
 }
 
@@ -683,14 +841,14 @@ void free_question(struct question *q) {
     return;
   }
 
-  freez(q->uid);
-  freez(q->question_text);
-  freez(q->question_html);
-  freez(q->default_value);
-  freez(q->choices);
+  request_free(q->uid);
+  request_free(q->question_text);
+  request_free(q->question_html);
+  request_free(q->default_value);
+  request_free(q->choices);
   // #72 unit field
-  freez(q->unit);
-  freez(q);
+  request_free(q->unit);
+  request_free(q);
   return;
 }
 
@@ -699,26 +857,34 @@ void free_session(struct session *ses) {
     return;
   }
 
-  freez(ses->survey_id);
-  freez(ses->survey_description);
-  freez(ses->session_id);
+  request_free(ses->survey_id);
+  request_free(ses->survey_description);
+  request_free(ses->session_id);
   freez(ses->consistency_hash);
   freez(ses->next_questions);
 
-  for (int i = 0; i < ses->question_count; i++) {
-    free_question(ses->questions[i]);
-  }
+  // questions are borrowed from the survey
+  survey_release(ses->survey);
+  ses->survey = NULL;
 
   for (int i = 0; i < ses->answer_count; i++) {
     free_answer(ses->answers[i]);
   }
+  freez(ses->answers);
+  ses->answers = NULL;
+  ses->questions = NULL;
+
+  uid_index_free(&ses->answer_index);
+
+  unmap_file(ses->map);
+  freez(ses->map);
 
   ses->answer_count = 0;
   ses->question_count = 0;
   ses->given_answer_count = 0;
   ses->state = SESSION_NULL;
 
-  free(ses);
+  request_free(ses);
   return;
 }
 
@@ -801,14 +967,13 @@ int dump_session(FILE *fp, struct session *ses) {
 /**
  * Load and deserialise the set of questions for the form corresponding to
  * this session.
+ * The questions are borrowed from the survey cache and released in free_session()
  *
  * #484 renamed and exposed to survey.h (load_survey_questions())
  */
 int session_load_survey(struct session *ses) {
   int retVal = 0;
 
-  FILE *fp = NULL;
-
   do {
     BREAK_IF(ses == NULL, SS_ERROR_ARG, "ses");
 
@@ -816,120 +981,261 @@ int session_load_survey(struct session *ses) {
       BREAK_CODE(SS_CONFIG_MALFORMED_SESSION, "survey_id in session structure is NULL");
     }
 
-    char survey_path_suffix[1024];
-    char survey_path[1024];
-
-    snprintf(survey_path_suffix, 1024, "surveys/%s", ses->survey_id);
-    if (generate_path(survey_path_suffix, survey_path, 1024)) {
-      BREAK_CODEV(SS_SYSTEM_FILE_PATH, "generate_path() failed builing surveypath for session '%s'", ses->session_id);
+    if (ses->survey) {
+      BREAK_CODEV(SS_ERROR_ARG, "survey already loaded for session '%s'", ses->session_id);
     }
 
-    fp = fopen(survey_path, "r");
-    if (!fp) {
-      BREAK_CODEV(SS_ERROR_OPEN_FILE, "Could not open survey file '%s'", survey_path);
+    int res;
+    struct survey *survey = survey_cache_get(ses->survey_id, &res);
+    if (!survey) {
+      BREAK_CODEV(res, "Failed to load survey for session '%s'", ses->session_id);
     }
-    char line[MAX_LINE];
+    ses->survey = survey;
 
-    // Check survey file format version
-    line[0] = 0;
-    if (!fgets(line, MAX_LINE, fp)) {
-      BREAK_CODEV(SS_CONFIG_MALFORMED_SURVEY, "Failed to read survey file format version in survey specification file '%s'", survey_path);
-    }
-    if (!line[0]) {
-      BREAK_CODEV(SS_CONFIG_MALFORMED_SURVEY, "Failed to read survey file format version in survey specification file '%s'", survey_path);
-    }
+    ses->survey_description = request_strdup(survey->description);
+    BREAK_IF(ses->survey_description == NULL, SS_ERROR_MEM, "strdup(ses->survey_description)");
 
-    int format_version = 0;
-    int offset = 0;
-    trim_crlf(line);
-    if (sscanf(line, "version %d%n", &format_version, &offset) != 1) {
-      BREAK_CODEV(SS_CONFIG_MALFORMED_SURVEY, "Error parsing file format version in survey file '%s'", survey_path);
-    }
+    ses->nextquestions_flag = survey->nextquestions_flag;
 
-    if (offset < strlen(line)) {
-      BREAK_CODEV(SS_CONFIG_MALFORMED_SURVEY, "Junk at end of version string in survey file '%s'. Line was '%s'", survey_path, line);
-    }
-    if (format_version < 1 || format_version > 2) {
-      BREAK_CODEV(SS_CONFIG_MALFORMED_SURVEY, "Unknown survey file format version in survey file '%s'", survey_path);
+    ses->questions = survey->questions;
+    ses->question_count = survey->question_count;
+  } while (0);
+
+  return retVal;
+}
+
+/**
+ * uid_index_key callbacks for ses->questions and ses->answers
+ */
+static char *session_question_uid(void *items, int index) {
+  return ((struct question **) items)[index]->uid;
+}
+
+static char *session_answer_uid(void *items, int index) {
+  return ((struct answer **) items)[index]->uid;
+}
+
+/**
+ * Add answers appended since the last call to the session answer index.
+ * Answers replaced in place keep their uid and don't need to be re-indexed.
+ * returns 0 on success or -1 on error
+ */
+static int session_index_answers(struct session *ses) {
+  if (ses->answer_index.count > ses->answer_count) {
+    uid_index_free(&ses->answer_index);
+  }
+
+  while (ses->answer_index.count < ses->answer_count) {
+    int i = ses->answer_index.count;
+    if (uid_index_insert(&ses->answer_index, ses->answers[i]->uid, i, ses->answers, session_answer_uid)) {
+      return -1;
     }
+  }
+  return 0;
+}
+
+/**
+ * find an answer or header answer by uid
+ * returns index position in session or -1 if answer was not found
+ */
+static int session_find_answer_index(struct session *ses, char *uid) {
+  if (!session_index_answers(ses)) {
+    return uid_index_find(&ses->answer_index, uid, ses->answers, session_answer_uid);
+  }
 
-    // Get survey file description
-    line[0] = 0;
-    if (!fgets(line, MAX_LINE, fp)) {
-      BREAK_CODEV(SS_CONFIG_MALFORMED_SURVEY, "Failed to read survey description in survey specification file '%s'", survey_path);
+  // index allocation failed
+  for (int i = 0; i < ses->answer_count; i++) {
+    if (!strcmp(ses->answers[i]->uid, uid)) {
+      return i;
     }
-    if (!line[0]) {
-      BREAK_CODEV(SS_CONFIG_MALFORMED_SURVEY, "Failed to read survey description in survey specification file '%s'", survey_path);
+  }
+  return -1;
+}
+
+/**
+ * find a question by uid, using the question index of the borrowed survey
+ * returns index position in session or -1 if question was not found
+ */
+static int session_find_question_index(struct session *ses, char *uid) {
+  if (ses->survey && ses->survey->question_count == ses->question_count) {
+    return uid_index_find(&ses->survey->question_index, uid, ses->questions, session_question_uid);
+  }
+
+  for (int i = 0; i < ses->question_count; i++) {
+    if (!strcmp(ses->questions[i]->uid, uid)) {
+      return i;
     }
+  }
+  return -1;
+}
 
-    // Trim CR and LF chars from description
-    trim_crlf(line);
+/**
+ * Replay the session journal on top of a loaded session file.
+ * Each record is a serialised answer (ANSWER_SCOPE_FULL) which replaces the session answer with the same uid,
+ * or is appended to the session. A journal of an older session file has already been compacted and is removed.
+ */
+static int session_replay_journal(struct session *ses, int dirfd) {
+  int retVal = 0;
 
-    ses->survey_description = strdup(line);
-    BREAK_IF(ses->survey_description == NULL, SS_ERROR_MEM, "strdup(ses->survey_description)");
+  FILE *fp = NULL;
+  struct answer *a = NULL;
 
-    // version 1: Only allow generic implementation of next question picker if explicitly allowed
-    ses->nextquestions_flag = NEXTQUESTIONS_FLAG_PYTHON;
+  do {
+    char journal_name[1024];
+    session_journal_name(ses->session_id, journal_name, 1024);
 
-    if (format_version > 1) {
-      // Check for python directives
-      line[0] = 0;
-      if (!fgets(line, MAX_LINE, fp)) {
-        BREAK_CODEV(SS_CONFIG_MALFORMED_SURVEY, "Failed to read survey description in survey specification file '%s'", survey_path);
+    fp = fopen_at(dirfd, journal_name, "r");
+    if (!fp) {
+      if (errno == ENOENT) {
+        break; // no journal
       }
+      BREAK_CODEV(SS_ERROR_OPEN_FILE, "Could not read from journal file '%s'", journal_name);
+    }
 
-      if (!line[0]) {
-        BREAK_CODEV(SS_CONFIG_MALFORMED_SURVEY, "Failed to read survey description in survey specification file '%s'", survey_path);
-      }
+    char header[128];
+    if (session_journal_header(dirfd, ses->session_id, header, 128)) {
+      BREAK_CODEV(SS_NOSUCH_SESSION, "Could not stat session file '%s'", ses->session_id);
+    }
 
-      // Trim CR and LF chars from description
-      trim_crlf(line);
-      if (!strcasecmp(line, "without python")) {
-        ses->nextquestions_flag = NEXTQUESTIONS_FLAG_GENERIC;
-      } else if (!strcasecmp(line, "with python")) {
-        // do nothing, see above
-        // We are using python, and have recorded a python library directory to add to the search path.
-      } else {
-        BREAK_CODEV(SS_CONFIG_MALFORMED_SURVEY, "Missing <without python|with python> directive in survey specification file '%s'", survey_path);
-      }
+    // save_session() was interrupted after compacting the journal into the session file
+    char line[MAX_LINE];
+    if (!fgets(line, MAX_LINE, fp) || strcmp(line, header)) {
+      LOG_WARNV("Removing stale journal '%s'", journal_name);
+      unlinkat(dirfd, journal_name, 0);
+      break;
     }
 
-    // Now read questions
     do {
       line[0] = 0;
       if (!fgets(line, MAX_LINE, fp)) {
         break;
       }
-      if (!line[0]) {
+
+      int len = strlen(line);
+      if (!len) {
         break;
       }
 
-      if (ses->question_count >= MAX_QUESTIONS) {
-        BREAK_CODEV(SS_CONFIG_MALFORMED_SURVEY, "Too many questions in survey '%s' (increase MAX_QUESTIONS?)", survey_path);
+      // incomplete last record of an interrupted write
+      if (line[len - 1] != '\n') {
+        LOG_WARNV("Ignoring incomplete record at end of journal '%s'", journal_name);
+        break;
       }
 
-      // Remove end of line markers
       trim_crlf(line);
 
-      // Skip blank lines
-      if (!line[0]) {
-        continue;
-      }
+      a = request_calloc(sizeof(struct answer), 1);
+      BREAK_IF(a == NULL, SS_ERROR_MEM, "calloc(struct answer)");
 
-      struct question *q = calloc(sizeof(struct question), 1);
-      BREAK_IF(q == NULL, SS_ERROR_MEM, "calloc(struct question)");
+      if (deserialise_answer(line, ANSWER_SCOPE_FULL, a)) {
+        BREAK_CODEV(SS_CONFIG_MALFORMED_SESSION, "Failed to deserialise answer '%s' from journal file '%s'", line, journal_name);
+      }
 
-      if (deserialise_question(line, q)) {
-        free_question(q);
-        q = NULL;
-        BREAK_CODEV(SS_CONFIG_MALFORMED_SURVEY, "Error deserialising question '%s' in survey file '%s'", line, survey_path);
+      int index = session_find_answer_index(ses, a->uid);
+      if (index < 0) {
+        if (a->uid[0] == '@') {
+          BREAK_CODEV(SS_CONFIG_MALFORMED_SESSION, "Unknown header '%s' in journal file '%s'", a->uid, journal_name);
+        }
+        if (ses->answer_count >= env_limit("SS_MAX_ANSWERS", MAX_ANSWERS)) {
+          BREAK_CODEV(SS_CONFIG_MALFORMED_SESSION, "Too many answers in journal file '%s' (increase SS_MAX_ANSWERS?)", journal_name);
+        }
+        if (session_reserve_answers(ses, ses->answer_count + 1)) {
+          BREAK_CODEV(SS_ERROR_MEM, "Failed to allocate answers while reading journal file '%s'", journal_name);
+        }
+        index = ses->answer_count++;
       } else {
-        ses->questions[ses->question_count++] = q;
+        if (is_given_answer(ses->answers[index])) {
+          ses->given_answer_count--;
+        }
+        free_answer(ses->answers[index]);
       }
 
+      ses->answers[index] = a;
+      a = NULL;
+
+      if (is_given_answer(ses->answers[index])) {
+        ses->given_answer_count++;
+      }
+      ses->journal_records++;
+
     } while (line[0]);
 
+  } while (0);
 
+  free_answer(a);
+  if (fp) {
+    fclose(fp);
+  }
+
+  return retVal;
+}
+
+/**
+ * Append all changed answers to the session journal
+ */
+static int session_append_journal(struct session *ses) {
+  int retVal = 0;
+
+  FILE *fp = NULL;
+
+  do {
+    int dirfd = session_dirfd(ses->session_id, 1);
+    if (dirfd < 0) {
+      BREAK_ERRORV("Could not open directory for session '%s'", ses->session_id);
+    }
+
+    char journal_name[1024];
+    session_journal_name(ses->session_id, journal_name, 1024);
+
+    char header[128];
+    if (session_journal_header(dirfd, ses->session_id, header, 128)) {
+      BREAK_ERRORV("Could not stat session file '%s'", ses->session_id);
+    }
+
+    int fd = openat(dirfd, journal_name, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (fd < 0) {
+      BREAK_ERRORV("Could not open journal file '%s' for append", journal_name);
+    }
+
+    // a new journal, or a stale one of an older session file which must not be appended to
+    char current[128] = { 0 };
+    int header_len = strlen(header);
+    if (pread(fd, current, header_len, 0) != header_len || strncmp(current, header, header_len)) {
+      if (ftruncate(fd, 0) || write(fd, header, header_len) != header_len) {
+        close(fd);
+        BREAK_ERRORV("Could not write journal file '%s'", journal_name);
+      }
+      ses->journal_records = 0;
+    }
+
+    fp = fdopen(fd, "a");
+    if (!fp) {
+      close(fd);
+      BREAK_ERRORV("Could not open journal file '%s' for append", journal_name);
+    }
+
+    for (int i = 0; i < ses->answer_count; i++) {
+      if (!ses->answers[i]->changed) {
+        continue;
+      }
+
+      char line[MAX_LINE];
+      if (serialise_answer(ses->answers[i], ANSWER_SCOPE_FULL, line, MAX_LINE)) {
+        BREAK_ERRORV("Could not serialise answer for question '%s' for session '%s'.  Text field too long?", ses->answers[i]->uid, ses->session_id);
+      }
+      fprintf(fp, "%s\n", line);
+      ses->journal_records++;
+    }
+
+    if (retVal) {
+      break;
+    }
+
+    if (fflush(fp)) {
+      BREAK_ERRORV("Could not write journal file '%s'", journal_name);
+    }
+
+    LOG_INFOV("Updated journal file '%s'.", journal_name);
   } while (0);
 
   if (fp) {
@@ -947,7 +1253,6 @@ struct session *load_session(char *session_id, int *error) {
   int retVal = 0;
 
   struct session *ses = NULL;
-  FILE *fp = NULL;
 
   do {
     *error = 0;
@@ -958,15 +1263,33 @@ struct session *load_session(char *session_id, int *error) {
       BREAK_CODEV(SS_INVALID_SESSION_ID, "validate_session_id('%s') failed", (session_id) ? session_id : "NULL");
     }
 
-    char session_path[1024];
+    if (path_dirfd(PATH_DIR_SESSIONS) < 0) {
+      BREAK_CODEV(SS_SYSTEM_FILE_PATH, "Could not open sessions directory for loading session '%s'", session_id);
+    }
 
-    if (generate_session_path(session_id, session_id, session_path, 1024)) {
-      BREAK_CODEV(SS_SYSTEM_FILE_PATH, "generate_session_path() failed to build path for loading session '%s'", session_id);
+    int dirfd = session_dirfd(session_id, 0);
+    if (dirfd < 0) {
+      BREAK_CODEV(SS_NOSUCH_SESSION, "Could not open directory of session file '%s'", session_id);
     }
 
-    fp = fopen(session_path, "r");
-    if (!fp) {
-      BREAK_CODEV(SS_NOSUCH_SESSION, "Could not read from session file '%s'", session_path);
+    ses = request_calloc(sizeof(struct session), 1);
+    BREAK_IF(ses == NULL, SS_ERROR_MEM, "calloc(struct session)");
+
+    // optimistic mode: identify the file before reading it, a file replaced in between fails the save (conflict)
+    if (session_optimistic()) {
+      struct stat st;
+      if (fstatat(dirfd, session_id, &st, 0)) {
+        BREAK_CODEV(SS_NOSUCH_SESSION, "Could not stat session file '%s'", session_id);
+      }
+      session_file_generation(&st, ses->generation, sizeof(ses->generation));
+    }
+
+    // the session file is tokenised in place, answer strings point into the mapping (see free_session())
+    ses->map = calloc(sizeof(struct file_map), 1);
+    BREAK_IF(ses->map == NULL, SS_ERROR_MEM, "calloc(struct file_map)");
+
+    if (map_file_at(dirfd, session_id, ses->map)) {
+      BREAK_CODEV(SS_NOSUCH_SESSION, "Could not read from session file '%s'", session_id);
     }
 
     // Session file consists of:
@@ -977,26 +1300,37 @@ struct session *load_session(char *session_id, int *error) {
     // @header answers: <serialised META answer> <add>
     // survey answers; <serialised MISC TYPES answer> <add|del>
 
-    // Read survey ID line
-    char survey_id[1024];
-    survey_id[0] = 0;
-    if (!fgets(survey_id, 1024, fp)) {
-      BREAK_CODEV(SS_CONFIG_MALFORMED_SESSION, "Could not read survey ID from session file '%s'", session_path);
-    }
-    if (!survey_id[0]) {
-      BREAK_CODEV(SS_CONFIG_MALFORMED_SESSION, "Could not read survey ID from session file '%s'", session_path);
-    }
+    // binary session files (v3) start with a versioned header, see serialisers.c
+    int binary = (ses->map->len >= 4 && !memcmp(ses->map->data, SESSION_BINARY_MAGIC, 4));
+    int record_count = 0;
+    size_t offset = 0;
 
-    // Trim CR / LF characters from the end
-    trim_crlf(survey_id);
+    char *sav = NULL;
+    char *survey_id = NULL;
 
-    ses = calloc(sizeof(struct session), 1);
-    BREAK_IF(ses == NULL, SS_ERROR_MEM, "calloc(struct session)");
+    if (binary) {
+      res = deserialise_session_header_binary(ses->map->data, ses->map->len, &survey_id, &record_count);
+      if (res < 0) {
+        BREAK_CODEV(SS_CONFIG_MALFORMED_SESSION, "Could not read header from session file '%s'", session_id);
+      }
+      offset = res;
+    } else {
+      if (!ses->map->len || ses->map->data[ses->map->len - 1] != '\n') {
+        BREAK_CODEV(SS_CONFIG_MALFORMED_SESSION, "Incomplete last line in session file '%s'", session_id);
+      }
+
+      // Read survey ID line
+      survey_id = map_next_line(ses->map, &sav);
+    }
 
-    ses->survey_id = strdup(survey_id);
+    if (!survey_id || !survey_id[0]) {
+      BREAK_CODEV(SS_CONFIG_MALFORMED_SESSION, "Could not read survey ID from session file '%s'", session_id);
+    }
+
+    ses->survey_id = request_strdup(survey_id);
     BREAK_IF(ses->survey_id == NULL, SS_ERROR_MEM, "strdup(ses->survey_id)");
 
-    ses->session_id = strdup(session_id);
+    ses->session_id = request_strdup(session_id);
     BREAK_IF(ses->session_id == NULL, SS_ERROR_MEM, "strdup(ses->session_id)");
 
     // Load survey
@@ -1010,42 +1344,57 @@ struct session *load_session(char *session_id, int *error) {
     }
 
     // Load answers from session file
-    char line[MAX_LINE];
-    line[0] = 0;
+    char *line = NULL;
+    int line_number = 1;
+    int max_answers = env_limit("SS_MAX_ANSWERS", MAX_ANSWERS);
 
-    do {
-      // Get next line with an answer in it
-      line[0] = 0;
-      if (!fgets(line, MAX_LINE, fp)) {
-        break;
-      }
-      if (!line[0]) {
-        break;
-      }
+    if (binary && record_count > max_answers) {
+      BREAK_CODEV(SS_CONFIG_MALFORMED_SESSION, "Too many answers in session file '%s' (increase SS_MAX_ANSWERS?)", session_id);
+    }
+    if (session_reserve_answers(ses, (binary) ? record_count : ses->question_count)) {
+      BREAK_CODEV(SS_ERROR_MEM, "Failed to allocate answers for session file '%s'", session_id);
+    }
 
-      int len = strlen(line);
-      if (!len) {
-        BREAK_CODEV(SS_CONFIG_MALFORMED_SESSION, "Empty line in session file '%s'", session_path);
-      }
-      if (line[len - 1] != '\n' && line[len - 1] != '\r') {
-        BREAK_CODEV(SS_CONFIG_MALFORMED_SESSION, "Line too long in session file '%s' (limit = 64K)", session_path);
+    while (1) {
+      if (binary) {
+        if (offset >= ses->map->len) {
+          break;
+        }
+      } else {
+        line = map_next_line(ses->map, &sav);
+        if (!line) {
+          break;
+        }
       }
-
-      trim_crlf(line);
+      line_number++;
 
       // Add answer to list of answers
-      if (ses->answer_count >= MAX_ANSWERS) {
-        BREAK_CODEV(SS_CONFIG_MALFORMED_SESSION, "Too many answers in session file '%s' (increase MAX_ANSWERS?)", session_path);
+      if (ses->answer_count >= max_answers) {
+        BREAK_CODEV(SS_CONFIG_MALFORMED_SESSION, "Too many answers in session file '%s' (increase SS_MAX_ANSWERS?)", session_id);
+      }
+      if (session_reserve_answers(ses, ses->answer_count + 1)) {
+        BREAK_CODEV(SS_ERROR_MEM, "Failed to allocate answers while reading session file '%s'", session_id);
       }
 
-      ses->answers[ses->answer_count] = calloc(sizeof(struct answer), 1);
+      ses->answers[ses->answer_count] = request_calloc(sizeof(struct answer), 1);
       if (!ses->answers[ses->answer_count]) {
-        BREAK_CODEV(SS_ERROR_MEM, "calloc(struct answer) failed while reading session file '%s' ", session_path);
+        BREAK_CODEV(SS_ERROR_MEM, "calloc(struct answer) failed while reading session file '%s' ", session_id);
       }
+      ses->answers[ses->answer_count]->borrowed = 1;
 
       // #162 load complete answer, including protected fields
-      if (deserialise_answer(line, ANSWER_SCOPE_FULL, ses->answers[ses->answer_count])) {
-        BREAK_CODEV(SS_CONFIG_MALFORMED_SESSION, "Failed to deserialise answer '%s' from session file '%s'", line, session_path);
+      if (binary) {
+        res = deserialise_answer_binary(&ses->map->data[offset], ses->map->len - offset, ses->answers[ses->answer_count]);
+        if (res < 0) {
+          request_free(ses->answers[ses->answer_count]);
+          ses->answers[ses->answer_count] = NULL;
+          BREAK_CODEV(SS_CONFIG_MALFORMED_SESSION, "Failed to deserialise answer record %d from session file '%s'", line_number - 1, session_id);
+        }
+        offset += res;
+      } else if (deserialise_answer_inplace(line, ses->answers[ses->answer_count])) {
+        request_free(ses->answers[ses->answer_count]);
+        ses->answers[ses->answer_count] = NULL;
+        BREAK_CODEV(SS_CONFIG_MALFORMED_SESSION, "Failed to deserialise answer in line %d from session file '%s'", line_number, session_id);
       }
 
       // #363 set header offset
@@ -1067,12 +1416,26 @@ struct session *load_session(char *session_id, int *error) {
         ses->answer_offset = ses->answer_count;
       }
 
-    } while (line[0]);
+    }
 
     if(retVal) {
       break;
     }
 
+    if (binary && ses->answer_count != record_count) {
+      BREAK_CODEV(SS_CONFIG_MALFORMED_SESSION, "Truncated session file '%s': %d of %d answers", session_id, ses->answer_count, record_count);
+    }
+
+    if (session_index_answers(ses)) {
+      BREAK_CODEV(SS_ERROR_MEM, "Failed to index answers of session '%s'", session_id);
+    }
+
+    // replay changes recorded since the session file was written
+    res = session_replay_journal(ses, dirfd);
+    if (res) {
+      BREAK_CODEV(res, "Failed to replay journal for session '%s'", session_id);
+    }
+
     // #379 record current state of loaded sesion
     struct answer *current_state = session_get_header("@state", ses);
     if (!current_state) {
@@ -1092,10 +1455,6 @@ struct session *load_session(char *session_id, int *error) {
 
   } while (0);
 
-  if (fp) {
-   fclose(fp);
-  }
-
   if (retVal) {
     free_session(ses);
     ses = NULL;
@@ -1105,13 +1464,168 @@ struct session *load_session(char *session_id, int *error) {
   return ses;
 }
 
+/**
+ * session file format for writing sessions, env SS_SESSION_FORMAT=<text|binary>, default: text
+ * load_session() detects the format of existing session files
+ */
+static enum session_format session_file_format(void) {
+  char *env = getenv("SS_SESSION_FORMAT");
+  if (env && !strcasecmp(env, "binary")) {
+    return SESSION_FORMAT_BINARY;
+  }
+  return SESSION_FORMAT_TEXT;
+}
+
+/**
+ * Write all answers to sessions/<prefix>/write.<session_id>.<pid>.<thread> and move it over the session file.
+ * The new session file contains all journal records, the journal is removed (compaction).
+ */
+static int session_write_file(struct session *s, enum session_format format) {
+  int retVal = 0;
+  FILE *o = NULL;
+
+  do {
+    int dirfd = session_dirfd(s->session_id, 1);
+    if (dirfd < 0) {
+      BREAK_ERRORV("Could not open directory for writing session '%s'", s->session_id);
+    }
+
+    // unique per writer, optimistic requests write concurrently
+    char filename[1024];
+    snprintf(filename, 1024, "write.%s.%d.%lx", s->session_id, (int) getpid(), (unsigned long) pthread_self());
+
+    o = fopen_at(dirfd, filename, "w");
+    if (!o) {
+      BREAK_ERRORV("Could not create or open session file '%s' for write", filename);
+    }
+
+    char line[MAX_LINE];
+    int len;
+
+    if (format == SESSION_FORMAT_BINARY) {
+      len = serialise_session_header_binary(s->survey_id, s->answer_count, line, MAX_LINE);
+      if (len < 0) {
+        BREAK_ERRORV("Could not serialise header for session '%s'", s->session_id);
+      }
+      fwrite(line, len, 1, o);
+    } else {
+      fprintf(o, "%s\n", s->survey_id);
+    }
+
+    for (int i = 0; i < s->answer_count; i++) {
+      if (format == SESSION_FORMAT_BINARY) {
+        len = serialise_answer_binary(s->answers[i], line, MAX_LINE);
+        if (len < 0) {
+          BREAK_ERRORV("Could not serialise answer for question '%s' for session '%s'.  Text field too long?", s->answers[i]->uid, s->session_id);
+        }
+        fwrite(line, len, 1, o);
+        continue;
+      }
+
+      if (serialise_answer(s->answers[i], ANSWER_SCOPE_FULL, line, MAX_LINE)) {
+        BREAK_ERRORV("Could not serialise answer for question '%s' for session "
+                   "'%s'.  Text field too long?",
+                   s->answers[i]->uid, s->session_id);
+      }
+      fprintf(o, "%s\n", line);
+    }
+
+    if (retVal) {
+      break;
+    }
+
+    int res = fclose(o);
+    o = NULL;
+    if (res) {
+      BREAK_ERRORV("Could not write session file '%s'", filename);
+    }
+
+    if (s->generation[0] && session_optimistic()) {
+      res = session_publish_cas(s, dirfd, filename);
+      if (res) {
+        unlinkat(dirfd, filename, 0);
+        BREAK_CODEV(res, "Could not publish session file '%s'", s->session_id);
+      }
+    } else if (renameat(dirfd, filename, dirfd, s->session_id)) {
+      BREAK_ERRORV("rename('%s','%s') failed when updating file for session '%s' "
+                 "(errno=%d)",
+                 filename, s->session_id, s->session_id, errno);
+    }
+
+    // the session file now contains all journal records (compaction)
+    char journal_name[1024];
+    session_journal_name(s->session_id, journal_name, 1024);
+    if (unlinkat(dirfd, journal_name, 0) && errno != ENOENT) {
+      BREAK_ERRORV("unlink('%s') failed when compacting journal for session '%s' (errno=%d)", journal_name, s->session_id, errno);
+    }
+    s->journal_records = 0;
+
+    for (int i = 0; i < s->answer_count; i++) {
+      s->answers[i]->changed = 0;
+    }
+
+    LOG_INFOV("Updated session file '%s'.", s->session_id);
+  } while (0);
+
+  if (o) {
+    fclose(o);
+  }
+  return retVal;
+}
+
+/**
+ * rewrites a session file in the given format, including the journal
+ */
+int convert_session(char *session_id, enum session_format format) {
+  int retVal = 0;
+
+  struct session *ses = NULL;
+
+  do {
+    int res;
+    ses = load_session(session_id, &res);
+    if (!ses) {
+      BREAK_CODEV(res, "Could not load session '%s'", (session_id) ? session_id : "NULL");
+    }
+
+    if (session_write_file(ses, format)) {
+      BREAK_CODEV(SS_SYSTEM_SAVE_SESSION, "Could not write session '%s'", session_id);
+    }
+  } while (0);
+
+  free_session(ses);
+  return retVal;
+}
+
+/**
+ * Answers loaded by load_session() borrow their strings from the session file mapping,
+ * this creates private copies which can be modified or freed.
+ */
+static int answer_own_strings(struct answer *a) {
+  int retVal = 0;
+
+  do {
+    if (!a->borrowed) {
+      break;
+    }
+
+    a->uid = request_strdup(a->uid);
+    a->text = request_strdup(a->text);
+    a->unit = request_strdup(a->unit);
+    a->borrowed = 0;
+
+    BREAK_IF(a->uid == NULL, SS_ERROR_MEM, "strdup(a->uid)");
+  } while (0);
+
+  return retVal;
+}
+
 /*
   Save the provided session, including all provided answers.
   Questions are not saved, as they are part of the survey, i.e., form specification.
  */
 int save_session(struct session *s) {
   int retVal = 0;
-  FILE *o = NULL;
 
   do {
     if (!s) {
@@ -1136,78 +1650,76 @@ int save_session(struct session *s) {
       // record time of session closure, note: create_session (SESSION_NEW) writes timestamp into `time_begin` field
       header->time_end = (s->state == SESSION_CLOSED) ? (long long)time(NULL) : 0;
       header->stored = (long long)time(NULL);
+      header->changed = 1;
       LOG_INFOV("pre-save: Updated state header, old state: %d, new state: %d", old, s->state);
     }
 
     // #461 purge previous next_questions from @state->text and set current next_question_uids
-    freez(header->text);
-    header->text = NULL;
-    if (s->next_questions) {
-      header->text = strdup(s->next_questions); // always separately allocate
-    }
-
-    // write session
+    int next_questions_changed = (!header->text != !s->next_questions)
+      || (header->text && s->next_questions && strcmp(header->text, s->next_questions));
 
-    char session_path[1024];
-    char session_path_final[1024];
-    char session_path_suffix[1024];
-    char session_prefix[5];
-
-    for (int i = 0; i < 4; i++) {
-      session_prefix[i] = s->session_id[i];
+    if (next_questions_changed) {
+      header->changed = 1;
+      if (answer_own_strings(header)) {
+        BREAK_ERROR("Could not copy state header");
+      }
+      request_free(header->text);
+      header->text = NULL;
+      if (s->next_questions) {
+        header->text = request_strdup(s->next_questions); // always separately allocate
+      }
     }
-    session_prefix[4] = 0;
 
-    snprintf(session_path_suffix, 1024, "sessions/%s/write.%s", session_prefix,
-             s->session_id);
-    if (generate_path(session_path_suffix, session_path, 1024)) {
-      BREAK_ERRORV(
-          "generate_path('%s') failed to build path for loading session '%s'",
-          session_path_suffix, s->session_id);
+    if (header->changed) {
+      s->dirty = 1;
     }
 
-    o = fopen(session_path, "w");
-    if (!o) {
-      BREAK_ERRORV("Could not create or open session file '%s' for write", session_path);
+    // nothing to write, i.e. a read-only next questions request
+    if (!s->dirty) {
+      LOG_INFOV("session '%s' is unchanged, not saving", s->session_id);
+      break;
     }
-    fprintf(o, "%s\n", s->survey_id);
 
-    for (int i = 0; i < s->answer_count; i++) {
-      char line[MAX_LINE];
-      if (serialise_answer(s->answers[i], ANSWER_SCOPE_FULL, line, MAX_LINE)) {
-        BREAK_ERRORV("Could not serialise answer for question '%s' for session "
-                   "'%s'.  Text field too long?",
-                   s->answers[i]->uid, s->session_id);
+    // session journal: append changed answers instead of rewriting the session file
+    int journal_limit = (session_optimistic()) ? 0 : session_journal_limit();
+    if (journal_limit) {
+      int changes = 0;
+      for (int i = 0; i < s->answer_count; i++) {
+        changes += (s->answers[i]->changed) ? 1 : 0;
       }
-      fprintf(o, "%s\n", line);
-    }
-    fclose(o);
-    o = NULL;
 
-    snprintf(session_path_suffix, 1024, "sessions/%s/%s", session_prefix, s->session_id);
+      // a new session needs to be written in full first
+      int dirfd = session_dirfd(s->session_id, 0);
+      if (dirfd > -1 && !faccessat(dirfd, s->session_id, F_OK, 0) && s->journal_records + changes <= journal_limit) {
+        if (session_append_journal(s)) {
+          BREAK_ERRORV("Could not update journal for session '%s'", s->session_id);
+        }
 
-    if (generate_path(session_path_suffix, session_path_final, 1024)) {
-      BREAK_ERRORV(
-          "generate_path('%s') failed to build path for loading session '%s'",
-          session_path_suffix, s->session_id);
+        for (int i = 0; i < s->answer_count; i++) {
+          s->answers[i]->changed = 0;
+        }
+
+        if (session_generate_consistency_hash(s)) {
+          BREAK_ERRORV("failed to generate consistency hash for session '%s'", s->session_id);
+        }
+        s->dirty = 0;
+        break;
+      }
     }
-    if (rename(session_path, session_path_final)) {
-      BREAK_ERRORV("rename('%s','%s') failed when updating file for session '%s' "
-                 "(errno=%d)",
-                 session_path, session_path_final, s->session_id, errno);
+
+    // write session
+    int res = session_write_file(s, session_file_format());
+    if (res) {
+      BREAK_CODEV((res == SS_SESSION_CONFLICT) ? res : SS_EVAL, "Could not write session file for session '%s'", s->session_id);
     }
 
     // #268 finally update current sha1 checksum
     if (session_generate_consistency_hash(s)) {
       BREAK_ERRORV("failed to generate consistency hash for session '%s'", s->session_id);
     }
-
-    LOG_INFOV("Updated session file '%s'.", session_path_final);
+    s->dirty = 0;
   } while (0);
 
-  if (o) {
-    fclose(o);
-  }
   return retVal;
 }
 
@@ -1226,12 +1738,12 @@ int session_exists(char *session_id) {
       BREAK_CODEV(SS_INVALID_SESSION_ID, "validate_session_id('%s') failed", (session_id) ? session_id : "NULL");
     }
 
-    char path[1024];
-    if (generate_session_path(session_id, session_id, path, 1024)) {
-      BREAK_CODEV(SS_SYSTEM_FILE_PATH, "generate_session_path() failed to build path for loading session '%s'", session_id);
+    if (path_dirfd(PATH_DIR_SESSIONS) < 0) {
+      BREAK_CODEV(SS_SYSTEM_FILE_PATH, "Could not open sessions directory for session '%s'", session_id);
     }
 
-    if (!access(path, R_OK)) {
+    int dirfd = session_dirfd(session_id, 0);
+    if (dirfd > -1 && !faccessat(dirfd, session_id, R_OK, 0)) {
       retVal = SS_SESSION_EXISTS;
     }
   } while (0);
@@ -1258,12 +1770,7 @@ int session_get_question_index(char *uid, struct session *ses) {
     return -1;
   }
 
-  for (int i = 0; i < ses->question_count; i++) {
-    if (!strcmp(ses->questions[i]->uid, uid)) {
-      return i;
-    }
-  }
-  return -1;
+  return session_find_question_index(ses, uid);
 }
 
 /**
@@ -1279,12 +1786,8 @@ struct question *session_get_question(char *uid, struct session *ses) {
     return NULL;
   }
 
-  for (int i = 0; i < ses->question_count; i++) {
-    if (!strcmp(ses->questions[i]->uid, uid)) {
-      return ses->questions[i];
-    }
-  }
-  return NULL;
+  int index = session_find_question_index(ses, uid);
+  return (index < 0) ? NULL : ses->questions[index];
 }
 
 /**
@@ -1300,12 +1803,8 @@ struct answer *session_get_answer(char *uid, struct session *ses) {
     return NULL;
   }
 
-  for (int i = ses->answer_offset; i < ses->answer_count; i++) {
-    if (!strcmp(ses->answers[i]->uid, uid)) {
-      return ses->answers[i];
-    }
-  }
-  return NULL;
+  int index = session_find_answer_index(ses, uid);
+  return (index < ses->answer_offset) ? NULL : ses->answers[index];
 }
 
 /**
@@ -1322,12 +1821,8 @@ int session_get_answer_index(char *uid, struct session *ses) {
     return -1;
   }
 
-  for (int i = ses->answer_offset; i < ses->answer_count; i++) {
-    if (!strcmp(ses->answers[i]->uid, uid)) {
-      return i;
-    }
-  }
-  return -1;
+  int index = session_find_answer_index(ses, uid);
+  return (index < ses->answer_offset) ? -1 : index;
 }
 
 /**
@@ -1360,12 +1855,8 @@ struct answer *session_get_header(char *uid, struct session *ses) {
     return NULL;
   }
 
-  for (int i = 0; i < ses->answer_offset; i++) {
-    if (!strcmp(ses->answers[i]->uid, uid)) {
-      return ses->answers[i];
-    }
-  }
-  return NULL;
+  int index = session_find_answer_index(ses, uid);
+  return (index < 0 || index >= ses->answer_offset) ? NULL : ses->answers[index];
 }
 
 /**
@@ -1571,13 +2062,13 @@ int pre_add_answer_special_transformations(struct answer *an) {
     // QTYPE_SHA1_HASH: replace answer->text with a hash of that value
     if (an->type == QTYPE_SHA1_HASH) {
 
-      char hash[HASHSTRING_LENGTH];
+      char hash[HASHSTRING_LENGTH + 1];
       if(sha1_string(an->text, hash)) {
         BREAK_ERRORV("sha1_string(answer->text) failed for answer '%s'", an->uid);
       }
 
-      freez(an->text);
-      an->text = strdup(hash);
+      request_free(an->text);
+      an->text = request_strdup(hash);
 
       if (!an->text) {
         BREAK_ERRORV("strdup(hash) failed for answer '%s' (out of memory)", an->uid);
@@ -1612,6 +2103,7 @@ int answer_mark_as_deleted(struct answer *ans) {
 
     ans->flags |= ANSWER_DELETED;
     ans->stored = (long long)time(NULL);
+    ans->changed = 1;
     LOG_INFOV("Deleted from session answer '%s'.", ans->uid);
     return 1;
 }
@@ -1622,28 +2114,29 @@ struct answer *copy_answer(struct answer *aa) {
   do {
     // Duplicate aa into a, so that we don't put pointers to structures that are on the
     // stack into our list.
-    a = malloc(sizeof(struct answer));
+    a = request_calloc(sizeof(struct answer), 1);
     if (!a) {
       BREAK_ERROR("malloc() of struct answer failed.");
     }
     bcopy(aa, a, sizeof(struct answer));
+    a->borrowed = 0;
 
     if (a->uid) {
-      a->uid = strdup(a->uid);
+      a->uid = request_strdup(a->uid);
       if (!a->uid) {
         BREAK_ERROR("Could not copy a->uid");
       }
     }
 
     if (a->text) {
-      a->text = strdup(a->text);
+      a->text = request_strdup(a->text);
       if (!a->text) {
         BREAK_ERROR("Could not copy a->text");
       }
     }
 
     if (a->unit) {
-      a->unit = strdup(a->unit);
+      a->unit = request_strdup(a->unit);
       if (!a->unit) {
         BREAK_ERROR("Could not copy a->unit");
       }
@@ -1673,28 +2166,28 @@ struct question *copy_question(struct question *qq, char *default_value) {
   do {
     // Duplicate aa into a, so that we don't put pointers to structures that are on the
     // stack into our list.
-    q = malloc(sizeof(struct question));
+    q = request_calloc(sizeof(struct question), 1);
     if (!q) {
       BREAK_ERROR("malloc() of struct question failed.");
     }
     bcopy(qq, q, sizeof(struct question));
 
     if (q->uid) {
-      q->uid = strdup(q->uid);
+      q->uid = request_strdup(q->uid);
       if (!q->uid) {
         BREAK_ERROR("Could not copy uid");
       }
     }
 
     if (q->question_text) {
-      q->question_text = strdup(q->question_text);
+      q->question_text = request_strdup(q->question_text);
       if (!q->question_text) {
         BREAK_ERROR("Could not copy question_text");
       }
     }
 
     if (q->question_html) {
-      q->question_html = strdup(q->question_html);
+      q->question_html = request_strdup(q->question_html);
       if (!q->question_html) {
         BREAK_ERROR("Could not copy question_html");
       }
@@ -1703,21 +2196,21 @@ struct question *copy_question(struct question *qq, char *default_value) {
     // #213 arg default_value (if having content) has predecence over question->default_value
     char *dv = (default_value && strlen(default_value)) ? default_value : q->default_value;
     if (dv) {
-      q->default_value = strdup(dv);
+      q->default_value = request_strdup(dv);
       if (!q->default_value) {
         BREAK_ERROR("Could not copy default_value");
       }
     }
 
     if (q->choices) {
-      q->choices = strdup(q->choices);
+      q->choices = request_strdup(q->choices);
       if (!q->choices) {
         BREAK_ERROR("Could not copy choices");
       }
     }
 
     if (q->unit) {
-      q->unit = strdup(q->unit);
+      q->unit = request_strdup(q->unit);
       if (!q->unit) {
         BREAK_ERROR("Could not copy unit");
       }
@@ -1771,9 +2264,9 @@ int session_add_answer(struct session *ses, struct answer *a) {
     a->stored = (long long)time(NULL);
     a->type = qn->type;
     if (a->unit) { // should not be the case, except maybe in tests
-      freez(a->unit);
+      request_free(a->unit);
     }
-    a->unit = strdup(qn->unit);
+    a->unit = request_strdup(qn->unit);
 
     if (pre_add_answer_special_transformations(a)) {
       BREAK_ERRORV("pre-addanswer hook failed for answer '%s', session '%s'", a->uid, ses->session_id);
@@ -1788,7 +2281,7 @@ int session_add_answer(struct session *ses, struct answer *a) {
     int exists = session_get_answer_index(a->uid, ses);
     if (exists >= 0) {
         if (ses->answers[exists]->flags & ANSWER_DELETED) {
-          free(ses->answers[exists]);
+          request_free(ses->answers[exists]);
           index = exists;
           undeleted = 1;
           LOG_INFOV("Question '%s' has been deleted in session '%s'.", a->uid, ses->session_id);
@@ -1797,15 +2290,27 @@ int session_add_answer(struct session *ses, struct answer *a) {
         }
     }
 
-    if (ses->answer_count >= MAX_ANSWERS) {
-      BREAK_ERRORV("Too many answers in session '%s' (increase MAX_ANSWERS?)", ses->session_id);
+    if (!undeleted) {
+      if (ses->answer_count >= env_limit("SS_MAX_ANSWERS", MAX_ANSWERS)) {
+        BREAK_ERRORV("Too many answers in session '%s' (increase SS_MAX_ANSWERS?)", ses->session_id);
+      }
+      if (session_reserve_answers(ses, ses->answer_count + 1)) {
+        BREAK_ERRORV("Failed to allocate answers for session '%s'", ses->session_id);
+      }
     }
 
     ses->answers[index] = copy_answer(a);
+    if (!ses->answers[index]) {
+      BREAK_ERRORV("copy_answer() failed for answer '%s', session '%s'", a->uid, ses->session_id);
+    }
+    ses->answers[index]->changed = 1;
 
     // #186 Don't append answer if we are undeleting it.
     if (!undeleted) {
       ses->answer_count++;
+      if (session_index_answers(ses)) {
+        LOG_WARNV("Failed to index answer '%s' in session '%s'", a->uid, ses->session_id);
+      }
     }
 
     // #13 update count given answers, system answers are already excluded
@@ -1814,6 +2319,7 @@ int session_add_answer(struct session *ses, struct answer *a) {
 
     // #379 set session state to 'open' get_next_questions might later progrress this to 'finished'
     ses->state = SESSION_OPEN;
+    ses->dirty = 1;
 
   } while (0);
 
@@ -1869,6 +2375,9 @@ int session_delete_answer(struct session *ses, char *uid) {
 
   if (!retVal) {
     ses->given_answer_count -= deletions;
+    if (deletions) {
+      ses->dirty = 1;
+    }
     retVal = deletions;
   }
 
@@ -1889,15 +2398,14 @@ int session_add_datafile(char *session_id, char *filename, const char *data) {
     BREAK_IF(session_id == NULL, SS_ERROR_ARG, "session_id");
     BREAK_IF(filename == NULL, SS_ERROR_ARG, "filename");
 
-    char session_path[1024];
-
-    if (generate_session_path(session_id, filename, session_path, 1024)) {
-      BREAK_CODEV(SS_SYSTEM_FILE_PATH, "generate_path('%s') failed to build path for data file, session '%s'", filename, session_id);
+    int dirfd = session_dirfd(session_id, 0);
+    if (dirfd < 0) {
+      BREAK_CODEV(SS_SYSTEM_FILE_PATH, "Could not open directory for data file '%s', session '%s'", filename, session_id);
     }
 
-    fp = fopen(session_path, "w");
+    fp = fopen_at(dirfd, filename, "w");
     if (!fp) {
-      BREAK_CODEV(SS_ERROR_OPEN_FILE, "Could not create or open data file '%s' for write", session_path);
+      BREAK_CODEV(SS_ERROR_OPEN_FILE, "Could not create or open data file '%s' for write", filename);
     }
 
     if (data) {
@@ -1912,6 +2420,121 @@ int session_add_datafile(char *session_id, char *filename, const char *data) {
   return retVal;
 }
 
+/**
+ * Analysis cache: sessions/<prefix>/<session_id>.analysis.cache holds the analysis of a session state.
+ * The first line is the cache key "<consistency_hash> <hook_id>", followed by the analysis.
+ */
+static void session_analysis_cache_name(char *session_id, char *name_out, int max_len) {
+  snprintf(name_out, max_len, "%s.analysis.cache", session_id);
+}
+
+/**
+ * Store the analysis for the current session state (ses->consistency_hash) and an analysis hook identity.
+ * The cache file is replaced atomically, concurrent readers see either the previous or the new analysis.
+ */
+int session_save_analysis(struct session *ses, const char *hook_id, const char *analysis) {
+  int retVal = 0;
+  FILE *fp = NULL;
+  int dirfd = -1;
+  char temp_name[1024] = { 0 };
+
+  do {
+    BREAK_IF(ses == NULL, SS_ERROR_ARG, "ses");
+    BREAK_IF(ses->consistency_hash == NULL, SS_ERROR_ARG, "ses->consistency_hash");
+    BREAK_IF(hook_id == NULL, SS_ERROR_ARG, "hook_id");
+    BREAK_IF(analysis == NULL, SS_ERROR_ARG, "analysis");
+
+    dirfd = session_dirfd(ses->session_id, 0);
+    if (dirfd < 0) {
+      BREAK_CODEV(SS_SYSTEM_FILE_PATH, "Could not open analysis cache directory for session '%s'", ses->session_id);
+    }
+
+    char cache_name[1024];
+    session_analysis_cache_name(ses->session_id, cache_name, 1024);
+
+    // unique per writer, parallel requests for the same session may store the same state
+    snprintf(temp_name, 1024, "write.%s.analysis.%d.%lx", ses->session_id, (int) getpid(), (unsigned long) pthread_self());
+
+    fp = fopen_at(dirfd, temp_name, "w");
+    if (!fp) {
+      temp_name[0] = 0;
+      BREAK_CODEV(SS_ERROR_OPEN_FILE, "Could not create or open analysis cache file for session '%s' for write", ses->session_id);
+    }
+
+    fprintf(fp, "%s %s\n%s", ses->consistency_hash, hook_id, analysis);
+
+    int res = fclose(fp);
+    fp = NULL;
+    if (res) {
+      BREAK_CODEV(SS_ERROR_OPEN_FILE, "Could not write analysis cache file '%s'", temp_name);
+    }
+
+    if (renameat(dirfd, temp_name, dirfd, cache_name)) {
+      BREAK_CODEV(SS_ERROR_OPEN_FILE, "rename('%s','%s') failed for analysis cache (errno=%d)", temp_name, cache_name, errno);
+    }
+    temp_name[0] = 0;
+  } while (0);
+
+  if (fp) {
+    fclose(fp);
+  }
+
+  if (temp_name[0]) {
+    unlinkat(dirfd, temp_name, 0);
+  }
+
+  return retVal;
+}
+
+/**
+ * Map the cached analysis of a session if it was stored for the current session state (ses->consistency_hash)
+ * and the given analysis hook identity.
+ * On a cache hit *offset is the start of the analysis within map->data, on a miss map->data is NULL.
+ * returns 0 on hit or miss, an error code if the cache could not be read
+ */
+int session_get_cached_analysis(struct session *ses, const char *hook_id, struct file_map *map, size_t *offset) {
+  int retVal = 0;
+
+  do {
+    BREAK_IF(map == NULL, SS_ERROR_ARG, "map");
+    map->data = NULL;
+    map->len = 0;
+    map->map_len = 0;
+
+    BREAK_IF(ses == NULL, SS_ERROR_ARG, "ses");
+    BREAK_IF(hook_id == NULL, SS_ERROR_ARG, "hook_id");
+    BREAK_IF(offset == NULL, SS_ERROR_ARG, "offset");
+
+    if (!ses->consistency_hash) {
+      break;
+    }
+
+    int dirfd = session_dirfd(ses->session_id, 0);
+    char cache_name[1024];
+    session_analysis_cache_name(ses->session_id, cache_name, 1024);
+
+    if (dirfd < 0 || faccessat(dirfd, cache_name, F_OK, 0)) {
+      break;
+    }
+
+    // a cache file which is replaced now is still mapped in full
+    if (map_file_at(dirfd, cache_name, map)) {
+      BREAK_CODEV(SS_ERROR_OPEN_FILE, "Could not read analysis cache for session '%s'", ses->session_id);
+    }
+
+    char key[HASHSTRING_LENGTH + 1 + 1024];
+    int len = snprintf(key, sizeof(key), "%s %s\n", ses->consistency_hash, hook_id);
+    if (len < 1 || len >= (int) sizeof(key) || map->len < (size_t) len || strncmp(map->data, key, len)) {
+      unmap_file(map);
+      break;
+    }
+
+    *offset = len;
+  } while (0);
+
+  return retVal;
+}
+
 /**
  * find the last given answer (conditions: no system answer && not deleted) within a session
  * #268
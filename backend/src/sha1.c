@@ -1,111 +1,457 @@
 /* This code is public-domain - it is based on libcrypt
  * placed in the public domain by Wei Dai and other contributors.
  */
-// gcc -Wall -DSHA1TEST -o sha1test sha1.c && ./sha1test
+// gcc -Wall -DSHA1TEST -Iinclude -o sha1test src/sha1.c src/errorlog.c && ./sha1test
 
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
 
-#ifdef __BIG_ENDIAN__
-#define SHA_BIG_ENDIAN
-#elif defined __LITTLE_ENDIAN__
-/* override */
-#elif defined __BYTE_ORDER
-#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
-#define SHA_BIG_ENDIAN
-#endif
-#else               // ! defined __LITTLE_ENDIAN__
-#include <endian.h> // machine/endian.h
-#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
-#define SHA_BIG_ENDIAN
-#endif
-#endif
-
 #include "sha1.h"
 #include "errorlog.h"
 
+/**
+ * SHA-1 block compression
+ *
+ * Input is buffered until a complete 64 byte block is available, whole blocks are passed directly from the
+ * callers buffer to a block compression function. The compression function is selected at runtime:
+ *  - "shani": x86 SHA extensions (SHA-NI)
+ *  - "ssse3": SSSE3 message schedule, four words at a time, scalar rounds
+ *  - "portable": plain C, any architecture
+ * Without SHA-NI the portable rounds are selected: the scalar rounds dominate and the vector schedule does not
+ * pay off on the cpus we measured (see sha1_bench.c). The ssse3 implementation can be selected explicitly.
+ * Use sha1_set_implementation() to override the selection (tests, benchmark)
+ */
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SHA1_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 /* code */
 #define SHA1_K0 0x5a827999
 #define SHA1_K20 0x6ed9eba1
 #define SHA1_K40 0x8f1bbcdc
 #define SHA1_K60 0xca62c1d6
 
-void sha1_init(sha1nfo *s) {
-  int retVal = 0; // #428 enable logging
+#define SHA1_ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
 
-  do {
-    if (!s) {
-      BREAK_ERROR("s is null");
+typedef void (*sha1_compress_fn)(uint32_t state[5], const uint8_t *data, size_t blocks);
+
+static inline uint32_t sha1_load_be32(const uint8_t *p) {
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+static inline void sha1_store_be32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+// one round, rotating the working variables by argument position instead of moving them
+#define SHA1_ROUND(a, b, c, d, e, f, k, w) \
+  do {                                     \
+    e += SHA1_ROL(a, 5) + (f) + (k) + (w); \
+    b = SHA1_ROL(b, 30);                   \
+  } while (0)
+
+#define SHA1_F0(b, c, d) (d ^ (b & (c ^ d)))
+#define SHA1_F1(b, c, d) (b ^ c ^ d)
+#define SHA1_F2(b, c, d) ((b & c) | (d & (b | c)))
+
+// portable: rounds on the 16 word message schedule ring
+static void sha1_compress_portable(uint32_t state[5], const uint8_t *data, size_t blocks) {
+  uint32_t w[16];
+
+  while (blocks--) {
+    uint32_t a = state[0];
+    uint32_t b = state[1];
+    uint32_t c = state[2];
+    uint32_t d = state[3];
+    uint32_t e = state[4];
+
+    for (int i = 0; i < 16; i++) {
+      w[i] = sha1_load_be32(data + 4 * i);
+    }
+
+#define SHA1_W(i) (w[(i) & 15] = SHA1_ROL(w[((i) + 13) & 15] ^ w[((i) + 8) & 15] ^ w[((i) + 2) & 15] ^ w[(i) & 15], 1))
+#define SHA1_FIVE(i, F, K, W)                         \
+    SHA1_ROUND(a, b, c, d, e, F(b, c, d), K, W(i));     \
+    SHA1_ROUND(e, a, b, c, d, F(a, b, c), K, W(i + 1)); \
+    SHA1_ROUND(d, e, a, b, c, F(e, a, b), K, W(i + 2)); \
+    SHA1_ROUND(c, d, e, a, b, F(d, e, a), K, W(i + 3)); \
+    SHA1_ROUND(b, c, d, e, a, F(c, d, e), K, W(i + 4))
+#define SHA1_W0(i) w[i]
+
+    SHA1_FIVE(0, SHA1_F0, SHA1_K0, SHA1_W0);
+    SHA1_FIVE(5, SHA1_F0, SHA1_K0, SHA1_W0);
+    SHA1_FIVE(10, SHA1_F0, SHA1_K0, SHA1_W0);
+    SHA1_ROUND(a, b, c, d, e, SHA1_F0(b, c, d), SHA1_K0, w[15]);
+    SHA1_ROUND(e, a, b, c, d, SHA1_F0(a, b, c), SHA1_K0, SHA1_W(16));
+    SHA1_ROUND(d, e, a, b, c, SHA1_F0(e, a, b), SHA1_K0, SHA1_W(17));
+    SHA1_ROUND(c, d, e, a, b, SHA1_F0(d, e, a), SHA1_K0, SHA1_W(18));
+    SHA1_ROUND(b, c, d, e, a, SHA1_F0(c, d, e), SHA1_K0, SHA1_W(19));
+
+    SHA1_FIVE(20, SHA1_F1, SHA1_K20, SHA1_W);
+    SHA1_FIVE(25, SHA1_F1, SHA1_K20, SHA1_W);
+    SHA1_FIVE(30, SHA1_F1, SHA1_K20, SHA1_W);
+    SHA1_FIVE(35, SHA1_F1, SHA1_K20, SHA1_W);
+
+    SHA1_FIVE(40, SHA1_F2, SHA1_K40, SHA1_W);
+    SHA1_FIVE(45, SHA1_F2, SHA1_K40, SHA1_W);
+    SHA1_FIVE(50, SHA1_F2, SHA1_K40, SHA1_W);
+    SHA1_FIVE(55, SHA1_F2, SHA1_K40, SHA1_W);
+
+    SHA1_FIVE(60, SHA1_F1, SHA1_K60, SHA1_W);
+    SHA1_FIVE(65, SHA1_F1, SHA1_K60, SHA1_W);
+    SHA1_FIVE(70, SHA1_F1, SHA1_K60, SHA1_W);
+    SHA1_FIVE(75, SHA1_F1, SHA1_K60, SHA1_W);
+
+#undef SHA1_W
+#undef SHA1_W0
+#undef SHA1_FIVE
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+
+    data += BLOCK_LENGTH;
+  }
+}
+
+#ifdef SHA1_X86
+
+// ssse3: byte swap and message schedule on four words at a time, W[i] + K precomputed for the scalar rounds
+__attribute__((target("ssse3")))
+static void sha1_compress_ssse3(uint32_t state[5], const uint8_t *data, size_t blocks) {
+  const __m128i bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+  const __m128i k[4] = {
+    _mm_set1_epi32(SHA1_K0), _mm_set1_epi32(SHA1_K20), _mm_set1_epi32(SHA1_K40), _mm_set1_epi32(SHA1_K60)
+  };
+  __m128i w[20];
+  uint32_t wk[80] __attribute__((aligned(16)));
+
+  while (blocks--) {
+    for (int t = 0; t < 4; t++) {
+      w[t] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16 * t)), bswap);
     }
 
-    s->state[0] = 0x67452301;
-    s->state[1] = 0xefcdab89;
-    s->state[2] = 0x98badcfe;
-    s->state[3] = 0x10325476;
-    s->state[4] = 0xc3d2e1f0;
-    s->byteCount = 0;
-    s->bufferOffset = 0;
-  } while (0);
+    // W[i] = rol(W[i-3] ^ W[i-8] ^ W[i-14] ^ W[i-16], 1)
+    // the last lane depends on W[i] of the same vector: it is computed without it and fixed afterwards
+    for (int t = 4; t < 20; t++) {
+      __m128i x = _mm_xor_si128(w[t - 4], _mm_alignr_epi8(w[t - 3], w[t - 4], 8));
+      x = _mm_xor_si128(x, w[t - 2]);
+      x = _mm_xor_si128(x, _mm_srli_si128(w[t - 1], 4));
+      x = _mm_or_si128(_mm_slli_epi32(x, 1), _mm_srli_epi32(x, 31));
+
+      __m128i fix = _mm_slli_si128(x, 12);
+      fix = _mm_or_si128(_mm_slli_epi32(fix, 1), _mm_srli_epi32(fix, 31));
+      w[t] = _mm_xor_si128(x, fix);
+    }
+
+    for (int t = 0; t < 20; t++) {
+      _mm_store_si128((__m128i *) &wk[4 * t], _mm_add_epi32(w[t], k[t / 5]));
+    }
+
+    uint32_t a = state[0];
+    uint32_t b = state[1];
+    uint32_t c = state[2];
+    uint32_t d = state[3];
+    uint32_t e = state[4];
+
+#define SHA1_FIVE(i, F)                                  \
+    SHA1_ROUND(a, b, c, d, e, F(b, c, d), 0, wk[i]);     \
+    SHA1_ROUND(e, a, b, c, d, F(a, b, c), 0, wk[i + 1]); \
+    SHA1_ROUND(d, e, a, b, c, F(e, a, b), 0, wk[i + 2]); \
+    SHA1_ROUND(c, d, e, a, b, F(d, e, a), 0, wk[i + 3]); \
+    SHA1_ROUND(b, c, d, e, a, F(c, d, e), 0, wk[i + 4])
+
+    for (int i = 0; i < 20; i += 5) {
+      SHA1_FIVE(i, SHA1_F0);
+    }
+    for (int i = 20; i < 40; i += 5) {
+      SHA1_FIVE(i, SHA1_F1);
+    }
+    for (int i = 40; i < 60; i += 5) {
+      SHA1_FIVE(i, SHA1_F2);
+    }
+    for (int i = 60; i < 80; i += 5) {
+      SHA1_FIVE(i, SHA1_F1);
+    }
+
+#undef SHA1_FIVE
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
 
+    data += BLOCK_LENGTH;
+  }
 }
 
-uint32_t sha1_rol32(uint32_t number, uint8_t bits) {
-  // #428 enable logging: removed
-  uint32_t retVal = ((number << bits) | (number >> (32 - bits)));
-  // #428 enable logging: removed
-  return retVal;
+// shani: SHA extensions, four rounds per instruction
+__attribute__((target("sha,sse4.1")))
+static void sha1_compress_shani(uint32_t state[5], const uint8_t *data, size_t blocks) {
+  const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  __m128i abcd, abcd_save, e0, e0_save, e1;
+  __m128i msg0, msg1, msg2, msg3;
+
+  abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state), 0x1b);
+  e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+  while (blocks--) {
+    abcd_save = abcd;
+    e0_save = e0;
+
+    // rounds 0-3
+    msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 0)), mask);
+    e0 = _mm_add_epi32(e0, msg0);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+    // rounds 4-7
+    msg1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16)), mask);
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+
+    // rounds 8-11
+    msg2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 32)), mask);
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+
+    // rounds 12-15
+    msg3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 48)), mask);
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+
+    // rounds 16-19
+    e0 = _mm_sha1nexte_epu32(e0, msg0);
+    e1 = abcd;
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+
+    // rounds 20-23
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+    msg3 = _mm_xor_si128(msg3, msg1);
+
+    // rounds 24-27
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 1);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+
+    // rounds 28-31
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+
+    // rounds 32-35
+    e0 = _mm_sha1nexte_epu32(e0, msg0);
+    e1 = abcd;
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 1);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+
+    // rounds 36-39
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+    msg3 = _mm_xor_si128(msg3, msg1);
+
+    // rounds 40-43
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+
+    // rounds 44-47
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 2);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+
+    // rounds 48-51
+    e0 = _mm_sha1nexte_epu32(e0, msg0);
+    e1 = abcd;
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+
+    // rounds 52-55
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 2);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+    msg3 = _mm_xor_si128(msg3, msg1);
+
+    // rounds 56-59
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+
+    // rounds 60-63
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+
+    // rounds 64-67
+    e0 = _mm_sha1nexte_epu32(e0, msg0);
+    e1 = abcd;
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+
+    // rounds 68-71
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+    msg3 = _mm_xor_si128(msg3, msg1);
+
+    // rounds 72-75
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+    // rounds 76-79
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+    e0 = _mm_sha1nexte_epu32(e0, e0_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+
+    data += BLOCK_LENGTH;
+  }
+
+  _mm_storeu_si128((__m128i *) state, _mm_shuffle_epi32(abcd, 0x1b));
+  state[4] = _mm_extract_epi32(e0, 3);
 }
 
-void sha1_hashBlock(sha1nfo *s) {
-  int retVal = 0; // #428 enable logging
+static int sha1_cpu_supports(const char *name) {
+  unsigned int eax, ebx, ecx, edx;
 
-  do {
-    if (!s) {
-      BREAK_ERROR("s is null");
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    return 0;
+  }
+  int ssse3 = (ecx >> 9) & 1;
+  int sse41 = (ecx >> 19) & 1;
+
+  if (!strcmp(name, "ssse3")) {
+    return ssse3;
+  }
+
+  if (!strcmp(name, "shani")) {
+    if (!ssse3 || !sse41 || __get_cpuid_max(0, NULL) < 7) {
+      return 0;
     }
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx >> 29) & 1;
+  }
 
-    uint8_t i;
-    uint32_t a, b, c, d, e, t;
+  return 0;
+}
 
-    a = s->state[0];
-    b = s->state[1];
-    c = s->state[2];
-    d = s->state[3];
-    e = s->state[4];
-    for (i = 0; i < 80; i++) {
-      if (i >= 16) {
-        t = s->buffer[(i + 13) & 15] ^ s->buffer[(i + 8) & 15] ^
-            s->buffer[(i + 2) & 15] ^ s->buffer[i & 15];
-        s->buffer[i & 15] = sha1_rol32(t, 1);
-      }
-      if (i < 20) {
-        t = (d ^ (b & (c ^ d))) + SHA1_K0;
-      } else if (i < 40) {
-        t = (b ^ c ^ d) + SHA1_K20;
-      } else if (i < 60) {
-        t = ((b & c) | (d & (b | c))) + SHA1_K40;
-      } else {
-        t = (b ^ c ^ d) + SHA1_K60;
-      }
-      t += sha1_rol32(a, 5) + e + s->buffer[i & 15];
-      e = d;
-      d = c;
-      c = sha1_rol32(b, 30);
-      b = a;
-      a = t;
-    }
-    s->state[0] += a;
-    s->state[1] += b;
-    s->state[2] += c;
-    s->state[3] += d;
-    s->state[4] += e;
-  } while (0);
+#endif
+
+static const struct {
+  const char *name;
+  sha1_compress_fn compress;
+  int automatic; // considered by sha1_set_implementation(NULL)
+} sha1_implementations[] = {
+#ifdef SHA1_X86
+  { "shani", sha1_compress_shani, 1 },
+  { "ssse3", sha1_compress_ssse3, 0 },
+#endif
+  { "portable", sha1_compress_portable, 1 },
+};
+
+#define SHA1_NUM_IMPLEMENTATIONS (int) (sizeof(sha1_implementations) / sizeof(sha1_implementations[0]))
+
+static int sha1_selected = -1;
+
+/**
+ * select a block compression implementation by name, returns 0 on success or -1 if it is not supported by the CPU
+ * NULL selects the fastest available implementation
+ */
+int sha1_set_implementation(const char *name) {
+  for (int i = 0; i < SHA1_NUM_IMPLEMENTATIONS; i++) {
+    if (name && strcmp(name, sha1_implementations[i].name)) {
+      continue;
+    }
+    if (!name && !sha1_implementations[i].automatic) {
+      continue;
+    }
+#ifdef SHA1_X86
+    if (sha1_implementations[i].compress != sha1_compress_portable && !sha1_cpu_supports(sha1_implementations[i].name)) {
+      continue;
+    }
+#endif
+    sha1_selected = i;
+    return 0;
+  }
+  return -1;
+}
+
+const char *sha1_implementation(void) {
+  if (sha1_selected < 0) {
+    sha1_set_implementation(NULL);
+  }
+  return sha1_implementations[sha1_selected].name;
+}
 
+static inline void sha1_compress(sha1nfo *s, const uint8_t *data, size_t blocks) {
+  if (sha1_selected < 0) {
+    sha1_set_implementation(NULL);
+  }
+  sha1_implementations[sha1_selected].compress(s->state, data, blocks);
 }
 
-void sha1_addUncounted(sha1nfo *s, uint8_t data) {
+void sha1_init(sha1nfo *s) {
   int retVal = 0; // #428 enable logging
 
   do {
@@ -113,26 +459,48 @@ void sha1_addUncounted(sha1nfo *s, uint8_t data) {
       BREAK_ERROR("s is null");
     }
 
-    uint8_t *const b = (uint8_t *)s->buffer;
+    s->state[0] = 0x67452301;
+    s->state[1] = 0xefcdab89;
+    s->state[2] = 0x98badcfe;
+    s->state[3] = 0x10325476;
+    s->state[4] = 0xc3d2e1f0;
+    s->byteCount = 0;
+    s->bufferOffset = 0;
+  } while (0);
 
-#ifdef SHA_BIG_ENDIAN
-    int endianBufferOffset = s->bufferOffset;
-#else
-    int endianBufferOffset = s->bufferOffset ^ 3;
-#endif
-    if (endianBufferOffset >= sizeof(s->buffer)) {
-      BREAK_ERROR("endianBufferOffset past buffer end");
+}
+
+// buffer and compress input without updating the message length
+static void sha1_update(sha1nfo *s, const uint8_t *data, size_t len) {
+  uint8_t *buffer = (uint8_t *) s->buffer;
+
+  if (s->bufferOffset) {
+    size_t n = BLOCK_LENGTH - s->bufferOffset;
+    if (n > len) {
+      n = len;
     }
-    b[endianBufferOffset] = data;
+    memcpy(buffer + s->bufferOffset, data, n);
+    s->bufferOffset += n;
+    data += n;
+    len -= n;
 
-    s->bufferOffset++;
-    if (s->bufferOffset == BLOCK_LENGTH) {
-      sha1_hashBlock(s);
-      s->bufferOffset = 0;
+    if (s->bufferOffset < BLOCK_LENGTH) {
+      return;
     }
+    sha1_compress(s, buffer, 1);
+    s->bufferOffset = 0;
+  }
 
-  } while (0);
+  if (len >= BLOCK_LENGTH) {
+    sha1_compress(s, data, len / BLOCK_LENGTH);
+    data += len - len % BLOCK_LENGTH;
+    len %= BLOCK_LENGTH;
+  }
 
+  if (len) {
+    memcpy(buffer, data, len);
+    s->bufferOffset = len;
+  }
 }
 
 void sha1_writebyte(sha1nfo *s, uint8_t data) {
@@ -145,7 +513,7 @@ void sha1_writebyte(sha1nfo *s, uint8_t data) {
     }
 
     ++s->byteCount;
-    sha1_addUncounted(s, data);
+    sha1_update(s, &data, 1);
   } while (0);
 
 }
@@ -167,40 +535,32 @@ void sha1_write(sha1nfo *s, const char *data, size_t len) {
       LOG_WARNV("len might be wrong: %d", (int)len);
     }
 
-    for (; len--;)
-      sha1_writebyte(s, (uint8_t)*data++);
+    s->byteCount += len;
+    sha1_update(s, (const uint8_t *) data, len);
   } while (0);
 
 }
 
-void sha1_pad(sha1nfo *s) {
-  int retVal = 0; // #428 enable logging
-
-  do {
+static void sha1_pad(sha1nfo *s) {
+  // Implement SHA-1 padding (fips180-2 §5.1.1)
+  uint8_t *buffer = (uint8_t *) s->buffer;
 
-    if (!s) {
-      BREAK_ERROR("s is null");
-    }
-
-    // Implement SHA-1 padding (fips180-2 Â§5.1.1)
-
-    // Pad with 0x80 followed by 0x00 until the end of the block
-    sha1_addUncounted(s, 0x80);
-    while (s->bufferOffset != 56)
-      sha1_addUncounted(s, 0x00);
+  // Pad with 0x80 followed by 0x00 until the end of the block
+  buffer[s->bufferOffset++] = 0x80;
+  if (s->bufferOffset > 56) {
+    memset(buffer + s->bufferOffset, 0, BLOCK_LENGTH - s->bufferOffset);
+    sha1_compress(s, buffer, 1);
+    s->bufferOffset = 0;
+  }
+  memset(buffer + s->bufferOffset, 0, 56 - s->bufferOffset);
 
-    // Append length in the last 8 bytes
-    sha1_addUncounted(s, 0); // We're only using 32 bit lengths
-    sha1_addUncounted(s, 0); // But SHA-1 supports 64 bit lengths
-    sha1_addUncounted(s, 0); // So zero pad the top bits
-    sha1_addUncounted(s, s->byteCount >> 29); // Shifting to multiply by 8
-    sha1_addUncounted(s, s->byteCount >>
-                             21); // as SHA-1 supports bitstreams as well as
-    sha1_addUncounted(s, s->byteCount >> 13); // byte.
-    sha1_addUncounted(s, s->byteCount >> 5);
-    sha1_addUncounted(s, s->byteCount << 3);
+  // Append length in bits in the last 8 bytes, we're only using 32 bit lengths
+  uint64_t bits = (uint64_t) s->byteCount << 3;
+  sha1_store_be32(buffer + 56, (uint32_t) (bits >> 32));
+  sha1_store_be32(buffer + 60, (uint32_t) bits);
 
-  } while (0);
+  sha1_compress(s, buffer, 1);
+  s->bufferOffset = 0;
 }
 
 uint8_t *sha1_result(sha1nfo *s) {
@@ -216,21 +576,14 @@ uint8_t *sha1_result(sha1nfo *s) {
     // Pad to complete the last block
     sha1_pad(s);
 
-#ifndef SHA_BIG_ENDIAN
-    // Swap byte order back
-    int i;
-    for (i = 0; i < 5; i++) {
-      s->state[i] = (((s->state[i]) << 24) & 0xff000000) |
-                    (((s->state[i]) << 8) & 0x00ff0000) |
-                    (((s->state[i]) >> 8) & 0x0000ff00) |
-                    (((s->state[i]) >> 24) & 0x000000ff);
+    // Store hash in big endian byte order
+    uint32_t state[HASH_LENGTH / 4];
+    memcpy(state, s->state, HASH_LENGTH);
+    for (int i = 0; i < HASH_LENGTH / 4; i++) {
+      sha1_store_be32((uint8_t *) &s->state[i], state[i]);
     }
-#endif
 
     res = (uint8_t *)s->state;
-    if (!res) {
-      BREAK_ERROR("result is null");
-    }
 
   } while (0);
 
@@ -254,13 +607,11 @@ void sha1_initHmac(sha1nfo *s, const uint8_t *key, int keyLength) {
       BREAK_ERROR("key is null");
     }
 
-    uint8_t i;
     memset(s->keyBuffer, 0, BLOCK_LENGTH);
     if (keyLength > BLOCK_LENGTH) {
       // Hash long keys
       sha1_init(s);
-      for (; keyLength--;)
-        sha1_writebyte(s, *key++);
+      sha1_write(s, (const char *) key, keyLength);
       memcpy(s->keyBuffer, sha1_result(s), HASH_LENGTH);
     } else {
       // Block length keys are used as is
@@ -268,10 +619,12 @@ void sha1_initHmac(sha1nfo *s, const uint8_t *key, int keyLength) {
     }
 
     // Start inner hash
-    sha1_init(s);
-    for (i = 0; i < BLOCK_LENGTH; i++) {
-      sha1_writebyte(s, s->keyBuffer[i] ^ HMAC_IPAD);
+    uint8_t pad[BLOCK_LENGTH];
+    for (int i = 0; i < BLOCK_LENGTH; i++) {
+      pad[i] = s->keyBuffer[i] ^ HMAC_IPAD;
     }
+    sha1_init(s);
+    sha1_write(s, (const char *) pad, BLOCK_LENGTH);
 
   } while (0);
 
@@ -287,17 +640,17 @@ uint8_t *sha1_resultHmac(sha1nfo *s) {
       BREAK_ERROR("s is null");
     }
 
-    uint8_t i;
     // Complete inner hash
     memcpy(s->innerHash, sha1_result(s), HASH_LENGTH);
+
     // Calculate outer hash
-    sha1_init(s);
-    for (i = 0; i < BLOCK_LENGTH; i++) {
-      sha1_writebyte(s, s->keyBuffer[i] ^ HMAC_OPAD);
-    }
-    for (i = 0; i < HASH_LENGTH; i++) {
-      sha1_writebyte(s, s->innerHash[i]);
+    uint8_t pad[BLOCK_LENGTH];
+    for (int i = 0; i < BLOCK_LENGTH; i++) {
+      pad[i] = s->keyBuffer[i] ^ HMAC_OPAD;
     }
+    sha1_init(s);
+    sha1_write(s, (const char *) pad, BLOCK_LENGTH);
+    sha1_write(s, (const char *) s->innerHash, HASH_LENGTH);
 
     res = sha1_result(s);
     if (!res) {
@@ -423,7 +776,7 @@ int sha1_validate_string(char *src, char *hash) {
       BREAK_ERROR("input hash string is invalid (length)");
     }
 
-    char new_hash[HASHSTRING_LENGTH];
+    char new_hash[HASHSTRING_LENGTH + 1];
     if (sha1_string(src, new_hash)) {
       BREAK_ERROR("generating sha1 hash from input string src failed");
     }
@@ -0,0 +1,198 @@
+/**
+ * SHA-1 throughput benchmark
+ * Compares the byte-wise reference implementation (sha1.c before block compression) with the block compression
+ * implementations available on this cpu.
+ *
+ * build and run: make sha1_bench && ./sha1_bench
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sha1.h"
+
+/**
+ * legacy byte-wise implementation, for comparison only
+ */
+
+struct legacy_sha1 {
+  uint8_t buffer[BLOCK_LENGTH];
+  uint32_t state[HASH_LENGTH / 4];
+  uint32_t byteCount;
+  uint8_t bufferOffset;
+};
+
+static uint32_t legacy_rol32(uint32_t number, uint8_t bits) {
+  return ((number << bits) | (number >> (32 - bits)));
+}
+
+static void legacy_init(struct legacy_sha1 *s) {
+  s->state[0] = 0x67452301;
+  s->state[1] = 0xefcdab89;
+  s->state[2] = 0x98badcfe;
+  s->state[3] = 0x10325476;
+  s->state[4] = 0xc3d2e1f0;
+  s->byteCount = 0;
+  s->bufferOffset = 0;
+}
+
+static void legacy_hash_block(struct legacy_sha1 *s) {
+  uint32_t w[16];
+  uint32_t a = s->state[0], b = s->state[1], c = s->state[2], d = s->state[3], e = s->state[4], t;
+
+  for (int i = 0; i < 16; i++) {
+    w[i] = ((uint32_t) s->buffer[4 * i] << 24) | ((uint32_t) s->buffer[4 * i + 1] << 16) |
+           ((uint32_t) s->buffer[4 * i + 2] << 8) | s->buffer[4 * i + 3];
+  }
+
+  for (int i = 0; i < 80; i++) {
+    if (i >= 16) {
+      t = w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^ w[i & 15];
+      w[i & 15] = legacy_rol32(t, 1);
+    }
+    if (i < 20) {
+      t = (d ^ (b & (c ^ d))) + 0x5a827999;
+    } else if (i < 40) {
+      t = (b ^ c ^ d) + 0x6ed9eba1;
+    } else if (i < 60) {
+      t = ((b & c) | (d & (b | c))) + 0x8f1bbcdc;
+    } else {
+      t = (b ^ c ^ d) + 0xca62c1d6;
+    }
+    t += legacy_rol32(a, 5) + e + w[i & 15];
+    e = d;
+    d = c;
+    c = legacy_rol32(b, 30);
+    b = a;
+    a = t;
+  }
+
+  s->state[0] += a;
+  s->state[1] += b;
+  s->state[2] += c;
+  s->state[3] += d;
+  s->state[4] += e;
+}
+
+static void legacy_add_uncounted(struct legacy_sha1 *s, uint8_t data) {
+  s->buffer[s->bufferOffset] = data;
+  s->bufferOffset++;
+  if (s->bufferOffset == BLOCK_LENGTH) {
+    legacy_hash_block(s);
+    s->bufferOffset = 0;
+  }
+}
+
+static void legacy_write(struct legacy_sha1 *s, const char *data, size_t len) {
+  for (; len--;) {
+    ++s->byteCount;
+    legacy_add_uncounted(s, (uint8_t) *data++);
+  }
+}
+
+static void legacy_result(struct legacy_sha1 *s, uint8_t *out) {
+  legacy_add_uncounted(s, 0x80);
+  while (s->bufferOffset != 56) {
+    legacy_add_uncounted(s, 0x00);
+  }
+  legacy_add_uncounted(s, 0);
+  legacy_add_uncounted(s, 0);
+  legacy_add_uncounted(s, 0);
+  legacy_add_uncounted(s, s->byteCount >> 29);
+  legacy_add_uncounted(s, s->byteCount >> 21);
+  legacy_add_uncounted(s, s->byteCount >> 13);
+  legacy_add_uncounted(s, s->byteCount >> 5);
+  legacy_add_uncounted(s, s->byteCount << 3);
+
+  for (int i = 0; i < HASH_LENGTH; i++) {
+    out[i] = s->state[i / 4] >> (24 - 8 * (i % 4));
+  }
+}
+
+/**
+ * benchmark
+ */
+
+static double bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// hash len bytes of data until at least 64MB were processed, returns MB/s
+static double bench_run(const char *impl, const char *data, size_t len, uint8_t *digest) {
+  size_t rounds = (64 * 1024 * 1024) / len;
+  double start = bench_now();
+
+  for (size_t i = 0; i < rounds; i++) {
+    if (!impl) {
+      struct legacy_sha1 s;
+      legacy_init(&s);
+      legacy_write(&s, data, len);
+      legacy_result(&s, digest);
+    } else {
+      sha1nfo s;
+      sha1_init(&s);
+      sha1_write(&s, data, len);
+      memcpy(digest, sha1_result(&s), HASH_LENGTH);
+    }
+  }
+
+  double elapsed = bench_now() - start;
+  return (rounds * len) / (1024.0 * 1024.0) / elapsed;
+}
+
+int main(int argc, char **argv) {
+  const char *impls[] = { "shani", "ssse3", "portable" };
+  size_t sizes[] = { 64, 1024, 1024 * 1024 };
+  uint8_t expected[HASH_LENGTH];
+  uint8_t digest[HASH_LENGTH];
+
+  char *data = malloc(sizes[2]);
+  if (!data) {
+    fprintf(stderr, "failed to allocate benchmark data\n");
+    return -1;
+  }
+  for (size_t i = 0; i < sizes[2]; i++) {
+    data[i] = (char) (i * 131 + 7);
+  }
+
+  printf("%-10s %12s %12s %12s\n", "impl", "64B MB/s", "1KB MB/s", "1MB MB/s");
+
+  printf("%-10s", "legacy");
+  for (int j = 0; j < 3; j++) {
+    printf(" %12.1f", bench_run(NULL, data, sizes[j], expected));
+  }
+  printf("\n");
+
+  int retVal = 0;
+  for (int i = 0; i < 3; i++) {
+    if (sha1_set_implementation(impls[i])) {
+      printf("%-10s %12s\n", impls[i], "unsupported");
+      continue;
+    }
+    printf("%-10s", impls[i]);
+    for (int j = 0; j < 3; j++) {
+      double mbs = bench_run(impls[i], data, sizes[j], digest);
+      // compare with the legacy implementation
+      struct legacy_sha1 s;
+      legacy_init(&s);
+      legacy_write(&s, data, sizes[j]);
+      legacy_result(&s, expected);
+      if (memcmp(digest, expected, HASH_LENGTH)) {
+        retVal = -1;
+      }
+      printf(" %12.1f", mbs);
+    }
+    printf("\n");
+  }
+
+  if (retVal) {
+    fprintf(stderr, "digest mismatch against legacy implementation\n");
+  }
+
+  free(data);
+  return retVal;
+}
@@ -0,0 +1,402 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "errorlog.h"
+#include "paths.h"
+#include "serialisers.h"
+#include "sha1.h"
+#include "survey.h"
+#include "utils.h"
+
+/**
+ * In-process cache of parsed survey snapshots
+ *
+ * A snapshot file surveys/<survey name>/<sha1> never changes once written (see create_survey_snapshot()).
+ * The long running surveyfcgi process therefore parses each snapshot only once and hands out the
+ * same immutable question set to every session that references it.
+ * Sessions borrow a survey via survey_cache_get() and return it with survey_release().
+ *
+ * Surveys which are not referenced by a snapshot id (i.e. "<survey name>/current") are
+ * parsed for every request and owned by the borrowing session only.
+ * The cache is shared by all threads of a process, cached surveys are read-only.
+ */
+
+#define SURVEY_CACHE_SIZE 64
+
+static struct survey *survey_cache[SURVEY_CACHE_SIZE];
+static unsigned long survey_cache_clock = 0;
+static pthread_mutex_t survey_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * djb2 string hash, used as a cheap pre-comparison for cache lookups
+ */
+static unsigned long survey_id_hash(const char *str) {
+  unsigned long hash = 5381;
+  int c;
+  while ((c = (unsigned char) *str++)) {
+    hash = ((hash << 5) + hash) + c;
+  }
+  return hash;
+}
+
+/**
+ * checks if a survey id references an immutable snapshot: <survey name>/<sha1>
+ */
+static int survey_is_snapshot(const char *survey_id) {
+  char *sep = strrchr(survey_id, '/');
+  if (!sep) {
+    return 0;
+  }
+  return !sha1_validate_string_hashlike(sep + 1);
+}
+
+/**
+ * parse the options of the "with python" directive, space separated:
+ *  - timeout=<ms>: time budget of a python hook call, see py_watchdog.c
+ *  - memoise, memoise=disk: nextquestion hooks are pure functions of their arguments, results are reused, see py_memo.c
+ */
+static int parse_python_directive(struct survey *survey, char *options) {
+  char *sav = NULL;
+  char buffer[256];
+
+  if (strlen(options) >= sizeof(buffer)) {
+    return -1;
+  }
+  snprintf(buffer, sizeof(buffer), "%s", options);
+
+  for (char *option = strtok_r(buffer, " ", &sav); option; option = strtok_r(NULL, " ", &sav)) {
+    int value = 0;
+    int offset = 0;
+    if (sscanf(option, "timeout=%d%n", &value, &offset) == 1 && !option[offset] && value >= 0) {
+      survey->python_timeout = value;
+      continue;
+    }
+    if (!strcmp(option, "memoise")) {
+      survey->python_memoise = PY_MEMO_PROCESS;
+      continue;
+    }
+    if (!strcmp(option, "memoise=disk")) {
+      survey->python_memoise = PY_MEMO_DISK;
+      continue;
+    }
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * uid_index_key callback for survey->questions
+ */
+static char *survey_question_uid(void *items, int index) {
+  return ((struct question **) items)[index]->uid;
+}
+
+void free_survey(struct survey *survey) {
+  if (!survey) {
+    return;
+  }
+
+  freez(survey->survey_id);
+  freez(survey->description);
+
+  for (int i = 0; i < survey->question_count; i++) {
+    if (survey->map) {
+      free(survey->questions[i]); // strings are part of the mapping
+    } else {
+      free_question(survey->questions[i]);
+    }
+  }
+  freez(survey->questions);
+  uid_index_free(&survey->question_index);
+
+  unmap_file(survey->map);
+  freez(survey->map);
+
+  free(survey);
+  return;
+}
+
+/**
+ * Load and deserialise the set of questions for the form specified by survey_id (<survey name>/<hash|current>)
+ * The survey file is mapped into memory and tokenised in place, question strings point into the mapping.
+ */
+struct survey *load_survey(char *survey_id, int *error) {
+  int retVal = 0;
+
+  struct survey *survey = NULL;
+
+  do {
+    *error = 0;
+    BREAK_IF(survey_id == NULL, SS_ERROR_ARG, "survey_id");
+
+    char survey_path[1024];
+    snprintf(survey_path, 1024, "surveys/%s", survey_id);
+
+    int dirfd = path_dirfd(PATH_DIR_SURVEYS);
+    if (dirfd < 0) {
+      BREAK_CODEV(SS_SYSTEM_FILE_PATH, "Could not open surveys directory for survey '%s'", survey_id);
+    }
+
+    survey = calloc(sizeof(struct survey), 1);
+    BREAK_IF(survey == NULL, SS_ERROR_MEM, "calloc(struct survey)");
+
+    survey->survey_id = strdup(survey_id);
+    BREAK_IF(survey->survey_id == NULL, SS_ERROR_MEM, "strdup(survey->survey_id)");
+
+    survey->map = calloc(sizeof(struct file_map), 1);
+    BREAK_IF(survey->map == NULL, SS_ERROR_MEM, "calloc(struct file_map)");
+
+    if (map_file_at(dirfd, survey_id, survey->map)) {
+      BREAK_CODEV(SS_ERROR_OPEN_FILE, "Could not open survey file '%s'", survey_path);
+    }
+
+    char *sav = NULL;
+    char *line;
+
+    // Check survey file format version
+    line = map_next_line(survey->map, &sav);
+    if (!line || !line[0]) {
+      BREAK_CODEV(SS_CONFIG_MALFORMED_SURVEY, "Failed to read survey file format version in survey specification file '%s'", survey_path);
+    }
+
+    int format_version = 0;
+    int offset = 0;
+    if (sscanf(line, "version %d%n", &format_version, &offset) != 1) {
+      BREAK_CODEV(SS_CONFIG_MALFORMED_SURVEY, "Error parsing file format version in survey file '%s'", survey_path);
+    }
+
+    if (offset < strlen(line)) {
+      BREAK_CODEV(SS_CONFIG_MALFORMED_SURVEY, "Junk at end of version string in survey file '%s'. Line was '%s'", survey_path, line);
+    }
+    if (format_version < 1 || format_version > 2) {
+      BREAK_CODEV(SS_CONFIG_MALFORMED_SURVEY, "Unknown survey file format version in survey file '%s'", survey_path);
+    }
+
+    // Get survey file description
+    line = map_next_line(survey->map, &sav);
+    if (!line || !line[0]) {
+      BREAK_CODEV(SS_CONFIG_MALFORMED_SURVEY, "Failed to read survey description in survey specification file '%s'", survey_path);
+    }
+
+    survey->description = strdup(line);
+    BREAK_IF(survey->description == NULL, SS_ERROR_MEM, "strdup(survey->description)");
+
+    // version 1: Only allow generic implementation of next question picker if explicitly allowed
+    survey->nextquestions_flag = NEXTQUESTIONS_FLAG_PYTHON;
+
+    if (format_version > 1) {
+      // Check for python directives
+      line = map_next_line(survey->map, &sav);
+      if (!line || !line[0]) {
+        BREAK_CODEV(SS_CONFIG_MALFORMED_SURVEY, "Failed to read survey description in survey specification file '%s'", survey_path);
+      }
+
+      if (!strcasecmp(line, "without python")) {
+        survey->nextquestions_flag = NEXTQUESTIONS_FLAG_GENERIC;
+      } else if (!strncasecmp(line, "with python", 11) && (!line[11] || line[11] == ' ')) {
+        // do nothing, see above
+        // We are using python, and have recorded a python library directory to add to the search path.
+        if (parse_python_directive(survey, line + 11)) {
+          BREAK_CODEV(SS_CONFIG_MALFORMED_SURVEY, "Invalid <with python> option in survey specification file '%s'. Line was '%s'", survey_path, line);
+        }
+      } else {
+        BREAK_CODEV(SS_CONFIG_MALFORMED_SURVEY, "Missing <without python|with python> directive in survey specification file '%s'", survey_path);
+      }
+    }
+
+    // Now read questions
+    int max_questions = env_limit("SS_MAX_QUESTIONS", MAX_QUESTIONS);
+    int line_number = (format_version > 1) ? 3 : 2;
+    while ((line = map_next_line(survey->map, &sav))) {
+      line_number++;
+
+      // a blank line ends the question list
+      if (!line[0]) {
+        break;
+      }
+
+      if (survey->question_count >= max_questions) {
+        BREAK_CODEV(SS_CONFIG_MALFORMED_SURVEY, "Too many questions in survey '%s' (increase SS_MAX_QUESTIONS?)", survey_path);
+      }
+
+      struct question **questions = array_reserve(survey->questions, &survey->question_capacity, survey->question_count + 1, sizeof(struct question *));
+      BREAK_IF(questions == NULL, SS_ERROR_MEM, "array_reserve(survey->questions)");
+      survey->questions = questions;
+
+      struct question *q = calloc(sizeof(struct question), 1);
+      BREAK_IF(q == NULL, SS_ERROR_MEM, "calloc(struct question)");
+
+      if (deserialise_question_inplace(line, q)) {
+        free(q);
+        q = NULL;
+        BREAK_CODEV(SS_CONFIG_MALFORMED_SURVEY, "Error deserialising question in line %d of survey file '%s'", line_number, survey_path);
+      }
+
+      survey->questions[survey->question_count++] = q;
+    }
+
+    if (retVal) {
+      break;
+    }
+
+    // question uid lookups, shared by all sessions borrowing this survey
+    for (int i = 0; i < survey->question_count; i++) {
+      if (uid_index_insert(&survey->question_index, survey->questions[i]->uid, i, survey->questions, survey_question_uid)) {
+        BREAK_CODEV(SS_ERROR_MEM, "Failed to index question '%s' of survey '%s'", survey->questions[i]->uid, survey_id);
+      }
+    }
+
+  } while (0);
+
+  if (retVal) {
+    free_survey(survey);
+    survey = NULL;
+  }
+
+  *error = retVal;
+  return survey;
+}
+
+/**
+ * evicts the least recently used cache entry which is currently not borrowed by any session
+ * returns the free slot or -1 if all entries are in use
+ */
+static int survey_cache_evict(void) {
+  int slot = -1;
+
+  for (int i = 0; i < SURVEY_CACHE_SIZE; i++) {
+    if (!survey_cache[i]) {
+      return i;
+    }
+    if (survey_cache[i]->refs) {
+      continue;
+    }
+    if (slot < 0 || survey_cache[i]->last_used < survey_cache[slot]->last_used) {
+      slot = i;
+    }
+  }
+
+  if (slot > -1) {
+    LOG_INFOV("survey cache: evicting '%s'", survey_cache[slot]->survey_id);
+    free_survey(survey_cache[slot]);
+    survey_cache[slot] = NULL;
+  }
+  return slot;
+}
+
+/**
+ * cache entry of a survey id, called with the cache mutex held
+ */
+static struct survey *survey_cache_find(char *survey_id, unsigned long hash) {
+  for (int i = 0; i < SURVEY_CACHE_SIZE; i++) {
+    if (survey_cache[i] && survey_cache[i]->hash == hash && !strcmp(survey_cache[i]->survey_id, survey_id)) {
+      return survey_cache[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Get a parsed survey, either from the cache or from disk.
+ * Surveys are loaded without holding the cache mutex, if another thread cached the same survey meanwhile
+ * its entry is used and the duplicate is dropped.
+ * The returned survey is borrowed and needs to be returned with survey_release()
+ */
+struct survey *survey_cache_get(char *survey_id, int *error) {
+  int retVal = 0;
+
+  struct survey *survey = NULL;
+  struct survey *duplicate = NULL;
+
+  do {
+    *error = 0;
+    BREAK_IF(survey_id == NULL, SS_ERROR_ARG, "survey_id");
+
+    unsigned long hash = survey_id_hash(survey_id);
+    int snapshot = survey_is_snapshot(survey_id);
+
+    if (snapshot) {
+      pthread_mutex_lock(&survey_cache_mutex);
+      survey = survey_cache_find(survey_id, hash);
+      if (survey) {
+        survey->refs++;
+        survey->last_used = ++survey_cache_clock;
+      }
+      pthread_mutex_unlock(&survey_cache_mutex);
+
+      if (survey) {
+        break;
+      }
+    }
+
+    int res;
+    struct survey *loaded = load_survey(survey_id, &res);
+    if (!loaded) {
+      BREAK_CODEV(res, "Failed to load survey '%s'", survey_id);
+    }
+    loaded->hash = hash;
+
+    pthread_mutex_lock(&survey_cache_mutex);
+    survey = (snapshot) ? survey_cache_find(survey_id, hash) : NULL;
+    if (survey) {
+      duplicate = loaded;
+    } else {
+      survey = loaded;
+      if (snapshot) {
+        int slot = survey_cache_evict();
+        if (slot < 0) {
+          LOG_WARNV("survey cache: all %d entries are in use, not caching '%s'", SURVEY_CACHE_SIZE, survey_id);
+        } else {
+          survey->cached = 1;
+          survey_cache[slot] = survey;
+        }
+      }
+    }
+    survey->refs++;
+    survey->last_used = ++survey_cache_clock;
+    pthread_mutex_unlock(&survey_cache_mutex);
+  } while (0);
+
+  free_survey(duplicate);
+
+  *error = retVal;
+  return survey;
+}
+
+/**
+ * Return a borrowed survey. Uncached surveys are freed when they are no longer referenced
+ */
+void survey_release(struct survey *survey) {
+  if (!survey) {
+    return;
+  }
+
+  pthread_mutex_lock(&survey_cache_mutex);
+  if (survey->refs > 0) {
+    survey->refs--;
+  }
+
+  if (!survey->cached && !survey->refs) {
+    free_survey(survey);
+  }
+  pthread_mutex_unlock(&survey_cache_mutex);
+  return;
+}
+
+/**
+ * Purge all cache entries which are not borrowed by a session
+ */
+void survey_cache_clear(void) {
+  pthread_mutex_lock(&survey_cache_mutex);
+  for (int i = 0; i < SURVEY_CACHE_SIZE; i++) {
+    if (survey_cache[i] && !survey_cache[i]->refs) {
+      free_survey(survey_cache[i]);
+      survey_cache[i] = NULL;
+    }
+  }
+  pthread_mutex_unlock(&survey_cache_mutex);
+  return;
+}
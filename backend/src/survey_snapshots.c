@@ -0,0 +1,413 @@
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/prctl.h>
+#endif
+
+#include "errorlog.h"
+#include "sha1.h"
+#include "survey.h"
+#include "utils.h"
+#include "validators.h"
+
+/**
+ * Survey snapshot registry
+ *
+ * create_survey_snapshot() needs the sha1 of surveys/<survey name>/current for every new session.
+ * The registry maps the identity of a "current" file (device, inode, size and mtime in ns) to the sha1 of its
+ * content, so that the file has to be read and hashed only once per version.
+ *
+ * Known snapshots are cached in process and persisted in surveys/<survey name>/snapshots, one entry per line,
+ * most recent first:
+ *    <dev> <inode> <size> <mtime_ns> <sha1>
+ * The persisted registry is shared between surveyfcgi processes, surveycli and the snapshot watcher.
+ *
+ * Replacing "current" (editor, rename) or writing to it changes the identity and causes a new snapshot.
+ * Snapshot files are never removed by the survey system, cached entries are not revalidated.
+ */
+
+#define SNAPSHOT_CACHE_SIZE 64
+#define SNAPSHOT_REGISTRY_SIZE 16
+#define SNAPSHOT_REGISTRY_FILE "snapshots"
+
+struct survey_snapshot {
+  char survey_id[256];
+  unsigned long long dev;
+  unsigned long long ino;
+  long long size;
+  long long mtime_ns;
+  char sha1[HASHSTRING_LENGTH + 1];
+  unsigned long last_used;
+};
+
+static struct survey_snapshot snapshot_cache[SNAPSHOT_CACHE_SIZE];
+static unsigned long snapshot_cache_clock = 0;
+// shared by all threads, also serialises writing the registry file
+static pthread_mutex_t snapshot_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void survey_snapshot_key(struct stat *st, struct survey_snapshot *snap) {
+  snap->dev = (unsigned long long) st->st_dev;
+  snap->ino = (unsigned long long) st->st_ino;
+  snap->size = (long long) st->st_size;
+  snap->mtime_ns = (long long) st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+static int survey_snapshot_matches(struct survey_snapshot *a, struct survey_snapshot *b) {
+  return a->dev == b->dev && a->ino == b->ino && a->size == b->size && a->mtime_ns == b->mtime_ns;
+}
+
+static void survey_snapshot_cache_put(char *survey_id, struct survey_snapshot *snap) {
+  int slot = 0;
+
+  for (int i = 0; i < SNAPSHOT_CACHE_SIZE; i++) {
+    if (!snapshot_cache[i].survey_id[0] || !strcmp(snapshot_cache[i].survey_id, survey_id)) {
+      slot = i;
+      break;
+    }
+    if (snapshot_cache[i].last_used < snapshot_cache[slot].last_used) {
+      slot = i;
+    }
+  }
+
+  snapshot_cache[slot] = *snap;
+  snprintf(snapshot_cache[slot].survey_id, sizeof(snapshot_cache[slot].survey_id), "%s", survey_id);
+  snapshot_cache[slot].last_used = ++snapshot_cache_clock;
+  return;
+}
+
+/**
+ * read persisted registry entries, returns the number of entries read
+ */
+static int survey_snapshot_read(char *survey_id, struct survey_snapshot *entries, int max_entries) {
+  char path[1024];
+  int count = 0;
+
+  if (generate_survey_path(survey_id, SNAPSHOT_REGISTRY_FILE, path, 1024)) {
+    return 0;
+  }
+
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    return 0;
+  }
+
+  char line[1024];
+  while (count < max_entries && fgets(line, 1024, f)) {
+    struct survey_snapshot *e = &entries[count];
+    if (sscanf(line, "%llu %llu %lld %lld %40s", &e->dev, &e->ino, &e->size, &e->mtime_ns, e->sha1) != 5) {
+      continue;
+    }
+    if (sha1_validate_string_hashlike(e->sha1)) {
+      continue;
+    }
+    count++;
+  }
+
+  fclose(f);
+  return count;
+}
+
+/**
+ * Look up the sha1 of a survey's "current" file by its stat() identity
+ * returns 0 and writes the sha1 if the snapshot is known, -1 otherwise
+ */
+int survey_snapshot_lookup(char *survey_id, struct stat *st, char *sha1, int sha1_len) {
+  struct survey_snapshot key;
+
+  if (!survey_id || !st || !sha1 || sha1_len < HASHSTRING_LENGTH + 1) {
+    return -1;
+  }
+  survey_snapshot_key(st, &key);
+
+  pthread_mutex_lock(&snapshot_cache_mutex);
+  for (int i = 0; i < SNAPSHOT_CACHE_SIZE; i++) {
+    if (survey_snapshot_matches(&snapshot_cache[i], &key) && !strcmp(snapshot_cache[i].survey_id, survey_id)) {
+      snapshot_cache[i].last_used = ++snapshot_cache_clock;
+      snprintf(sha1, sha1_len, "%s", snapshot_cache[i].sha1);
+      pthread_mutex_unlock(&snapshot_cache_mutex);
+      return 0;
+    }
+  }
+  pthread_mutex_unlock(&snapshot_cache_mutex);
+
+  struct survey_snapshot entries[SNAPSHOT_REGISTRY_SIZE];
+  int count = survey_snapshot_read(survey_id, entries, SNAPSHOT_REGISTRY_SIZE);
+
+  for (int i = 0; i < count; i++) {
+    if (!survey_snapshot_matches(&entries[i], &key)) {
+      continue;
+    }
+
+    // persisted entries were written by another process, make sure the snapshot is still there
+    char snapshot_path[1024];
+    if (generate_survey_path(survey_id, entries[i].sha1, snapshot_path, 1024) || access(snapshot_path, F_OK)) {
+      return -1;
+    }
+
+    pthread_mutex_lock(&snapshot_cache_mutex);
+    survey_snapshot_cache_put(survey_id, &entries[i]);
+    pthread_mutex_unlock(&snapshot_cache_mutex);
+    snprintf(sha1, sha1_len, "%s", entries[i].sha1);
+    return 0;
+  }
+
+  return -1;
+}
+
+/**
+ * Record the sha1 of a survey's "current" file for its stat() identity, the snapshot file must exist
+ */
+int survey_snapshot_register(char *survey_id, struct stat *st, char *sha1) {
+  int retVal = 0;
+
+  pthread_mutex_lock(&snapshot_cache_mutex);
+  do {
+    BREAK_IF(survey_id == NULL, SS_ERROR_ARG, "survey_id");
+    BREAK_IF(st == NULL, SS_ERROR_ARG, "st");
+    BREAK_IF(sha1 == NULL, SS_ERROR_ARG, "sha1");
+
+    struct survey_snapshot snap;
+    survey_snapshot_key(st, &snap);
+    snprintf(snap.sha1, sizeof(snap.sha1), "%s", sha1);
+    survey_snapshot_cache_put(survey_id, &snap);
+
+    // persist: new entry first, followed by the previous entries for other versions
+    struct survey_snapshot entries[SNAPSHOT_REGISTRY_SIZE];
+    int count = survey_snapshot_read(survey_id, entries, SNAPSHOT_REGISTRY_SIZE);
+
+    char path[1024];
+    char temp_path[1024];
+    char temp_name[1024];
+    snprintf(temp_name, 1024, "temp.%d.%s", getpid(), SNAPSHOT_REGISTRY_FILE);
+
+    if (generate_survey_path(survey_id, SNAPSHOT_REGISTRY_FILE, path, 1024)) {
+      BREAK_ERRORV("generate_survey_path() failed to build registry path for survey '%s'", survey_id);
+    }
+    if (generate_survey_path(survey_id, temp_name, temp_path, 1024)) {
+      BREAK_ERRORV("generate_survey_path() failed to build temporary registry path for survey '%s'", survey_id);
+    }
+
+    FILE *f = fopen(temp_path, "w");
+    if (!f) {
+      BREAK_ERRORV("Could not create snapshot registry '%s'", temp_path);
+    }
+
+    int written = 1;
+    fprintf(f, "%llu %llu %lld %lld %s\n", snap.dev, snap.ino, snap.size, snap.mtime_ns, snap.sha1);
+    for (int i = 0; i < count && written < SNAPSHOT_REGISTRY_SIZE; i++) {
+      if (survey_snapshot_matches(&entries[i], &snap)) {
+        continue;
+      }
+      fprintf(f, "%llu %llu %lld %lld %s\n", entries[i].dev, entries[i].ino, entries[i].size, entries[i].mtime_ns, entries[i].sha1);
+      written++;
+    }
+
+    if (fclose(f)) {
+      unlink(temp_path);
+      BREAK_ERRORV("Could not write snapshot registry '%s'", temp_path);
+    }
+
+    if (rename(temp_path, path)) {
+      unlink(temp_path);
+      BREAK_ERRORV("Could not rename snapshot registry '%s' to '%s'", temp_path, path);
+    }
+  } while (0);
+  pthread_mutex_unlock(&snapshot_cache_mutex);
+
+  return retVal;
+}
+
+/**
+ * purge the in-process registry cache, persisted entries are kept
+ */
+void survey_snapshot_cache_clear(void) {
+  pthread_mutex_lock(&snapshot_cache_mutex);
+  memset(snapshot_cache, 0, sizeof(snapshot_cache));
+  snapshot_cache_clock = 0;
+  pthread_mutex_unlock(&snapshot_cache_mutex);
+  return;
+}
+
+#ifdef __linux__
+
+struct snapshot_watch {
+  int wd;
+  char survey_id[256];
+};
+
+static void survey_snapshot_watch_refresh(char *survey_id) {
+  char sha1[HASHSTRING_LENGTH + 1];
+
+  char path[1024];
+
+  if (validate_survey_id(survey_id)) {
+    clear_errors();
+    return;
+  }
+  // new survey directory, "current" is not written yet
+  if (generate_survey_path(survey_id, "current", path, 1024) || access(path, F_OK)) {
+    clear_errors();
+    return;
+  }
+  if (create_survey_snapshot(survey_id, sha1, HASHSTRING_LENGTH + 1)) {
+    LOG_INFOV("snapshot watcher: failed to snapshot survey '%s'", survey_id);
+  }
+  clear_errors();
+  return;
+}
+
+static int survey_snapshot_watch_add(int fd, char *survey_id, struct snapshot_watch **watches, int *count, int *capacity) {
+  char path[1024];
+
+  if (generate_survey_path(survey_id, NULL, path, 1024)) {
+    return -1;
+  }
+
+  int wd = inotify_add_watch(fd, path, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+  if (wd < 0) {
+    LOG_INFOV("snapshot watcher: inotify_add_watch('%s') failed: %s", path, strerror(errno));
+    return -1;
+  }
+
+  struct snapshot_watch *w = array_reserve(*watches, capacity, *count + 1, sizeof(struct snapshot_watch));
+  if (!w) {
+    return -1;
+  }
+  *watches = w;
+  w[*count].wd = wd;
+  snprintf(w[*count].survey_id, sizeof(w[*count].survey_id), "%s", survey_id);
+  (*count)++;
+
+  survey_snapshot_watch_refresh(survey_id);
+  return 0;
+}
+
+static void survey_snapshot_watch_loop(void) {
+  struct snapshot_watch *watches = NULL;
+  int count = 0;
+  int capacity = 0;
+
+  char surveys_path[1024];
+  if (generate_path("surveys", surveys_path, 1024)) {
+    return;
+  }
+
+  int fd = inotify_init1(IN_CLOEXEC);
+  if (fd < 0) {
+    LOG_INFOV("snapshot watcher: inotify_init1() failed: %s", strerror(errno));
+    return;
+  }
+
+  // new survey directories
+  int root_wd = inotify_add_watch(fd, surveys_path, IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+  if (root_wd < 0) {
+    LOG_INFOV("snapshot watcher: inotify_add_watch('%s') failed: %s", surveys_path, strerror(errno));
+    close(fd);
+    return;
+  }
+
+  // existing surveys, snapshot them right away
+  DIR *dir = opendir(surveys_path);
+  if (dir) {
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+      if (de->d_name[0] == '.') {
+        continue;
+      }
+      survey_snapshot_watch_add(fd, de->d_name, &watches, &count, &capacity);
+    }
+    closedir(dir);
+  }
+
+  LOG_INFOV("snapshot watcher: watching %d surveys in '%s'", count, surveys_path);
+
+  char buffer[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+  for (;;) {
+    ssize_t len = read(fd, buffer, sizeof(buffer));
+    if (len < 0 && errno == EINTR) {
+      continue;
+    }
+    if (len <= 0) {
+      break;
+    }
+
+    for (char *p = buffer; p < buffer + len;) {
+      struct inotify_event *ev = (struct inotify_event *) p;
+      p += sizeof(struct inotify_event) + ev->len;
+
+      if (!ev->len) {
+        continue;
+      }
+
+      if (ev->wd == root_wd) {
+        if (ev->mask & IN_ISDIR) {
+          survey_snapshot_watch_add(fd, ev->name, &watches, &count, &capacity);
+        }
+        continue;
+      }
+
+      // only "current" is snapshotted, snapshot and registry files are written by ourselves
+      if (strcmp(ev->name, "current") || (ev->mask & IN_CREATE)) {
+        continue;
+      }
+
+      for (int i = 0; i < count; i++) {
+        if (watches[i].wd == ev->wd) {
+          survey_snapshot_watch_refresh(watches[i].survey_id);
+          break;
+        }
+      }
+    }
+  }
+
+  free(watches);
+  close(fd);
+  return;
+}
+
+/**
+ * Start the snapshot watcher process (surveyfcgi, SS_SNAPSHOT_WATCH)
+ * The watcher snapshots all surveys on startup and again whenever surveys/<survey name>/current is updated,
+ * so that create_session() finds the snapshot in the registry. The watcher terminates with its parent.
+ * returns the pid of the watcher or -1 on error
+ */
+int survey_snapshot_watch(void) {
+  pid_t parent = getpid();
+  pid_t pid = fork();
+
+  if (pid < 0) {
+    LOG_INFOV("snapshot watcher: fork() failed: %s", strerror(errno));
+    return -1;
+  }
+
+  if (pid > 0) {
+    return pid;
+  }
+
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  if (getppid() != parent) {
+    _exit(0);
+  }
+
+  survey_snapshot_watch_loop();
+  _exit(0);
+}
+
+#else
+
+int survey_snapshot_watch(void) {
+  LOG_INFO("snapshot watcher: inotify is not available on this platform");
+  return -1;
+}
+
+#endif
@@ -4,12 +4,21 @@
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
 
+#include "arena.h"
 #include "errorlog.h"
+#include "paths.h"
 #include "serialisers.h"
 #include "survey.h"
 #include "sha1.h"
 #include "question_types.h"
+#include "utils.h"
+#include "py_module.h"
 
 #define MAX_TEST_BUFFER 2048
 
@@ -38,6 +47,98 @@ struct answer* create_answer(char *uid, int type, char *text, char *unit) {
   return ans;
 }
 
+#define TEST_SURVEY_ID "smoke/0123456789abcdef0123456789abcdef01234567"
+#define TEST_HOME_TEMPLATE "/tmp/ss_test_units.XXXXXX"
+
+/**
+ * creates a temporary SURVEY_HOME from a TEST_HOME_TEMPLATE buffer and switches to it
+ * returns the previous SURVEY_HOME for teardown_test_home(), NULL on error
+ */
+char *setup_test_home(char *home) {
+  char *survey_home = getenv("SURVEY_HOME");
+  if (!mkdtemp(home)) {
+    return NULL;
+  }
+  survey_home = strdup(survey_home ? survey_home : "");
+  setenv("SURVEY_HOME", home, 1);
+  return survey_home;
+}
+
+/**
+ * restores the previous SURVEY_HOME and removes the (emptied) temporary one
+ */
+void teardown_test_home(char *home, char *survey_home) {
+  rmdir(home);
+  if (survey_home) {
+    setenv("SURVEY_HOME", survey_home, 1);
+    free(survey_home);
+  }
+}
+
+/**
+ * writes a survey snapshot and a session of it (answer q2: 43) into a temporary SURVEY_HOME
+ */
+void create_test_session(char *home, char *session_id) {
+  char path[1100];
+  char *dirs[] = { "sessions", "surveys", "surveys/smoke", NULL };
+  for (int i = 0; dirs[i]; i++) {
+    snprintf(path, 1100, "%s/%s", home, dirs[i]);
+    mkdir(path, 0700);
+  }
+  snprintf(path, 1100, "%s/sessions/%.4s", home, session_id);
+  mkdir(path, 0700);
+
+  snprintf(path, 1100, "%s/surveys/%s", home, TEST_SURVEY_ID);
+  FILE *fp = fopen(path, "w");
+  if (fp) {
+    fprintf(fp, "version 2\nTest survey\nwithout python\nq2:Question2::INT:0::0:100:0:0::\n");
+    fclose(fp);
+  }
+
+  snprintf(path, 1100, "%s/sessions/%.4s/%s", home, session_id, session_id);
+  fp = fopen(path, "w");
+  if (fp) {
+    fprintf(fp, TEST_SURVEY_ID "\n"
+                "@user:META::0:0:0:0:0:0:0::0:0\n"
+                "@state:META::1:0:0:0:0:0:0::0:0\n"
+                "q2:INT::43:0:0:0:0:0:0::0:0\n");
+    fclose(fp);
+  }
+}
+
+/**
+ * removes the files and directories of create_test_session()
+ */
+void remove_test_session(char *home, char *session_id) {
+  char path[1100];
+  char *files[] = { "", ".journal", NULL };
+  for (int i = 0; files[i]; i++) {
+    snprintf(path, 1100, "%s/sessions/%.4s/%s%s", home, session_id, session_id, files[i]);
+    unlink(path);
+  }
+  snprintf(path, 1100, "%s/surveys/%s", home, TEST_SURVEY_ID);
+  unlink(path);
+
+  snprintf(path, 1100, "%s/sessions/%.4s", home, session_id);
+  rmdir(path);
+  char *dirs[] = { "sessions", "surveys/smoke", "surveys", NULL };
+  for (int i = 0; dirs[i]; i++) {
+    snprintf(path, 1100, "%s/%s", home, dirs[i]);
+    rmdir(path);
+  }
+}
+
+/**
+ * sets the value of answer q2 and marks it changed
+ */
+void set_test_answer(struct session *ses, long long value) {
+  int index = session_get_question_index("q2", ses);
+  if (index > -1) {
+    ses->answers[index]->value = value;
+    ses->answers[index]->changed = 1;
+    ses->dirty = 1;
+  }
+}
 
 enum {
   FORMAT_FAIL, FORMAT_PASS, FORMAT_SKIP, FORMAT_SECTION, FORMAT_NONE
@@ -353,6 +454,10 @@ struct question_serialiser_test qst[] = {    // An empty string should not be ac
   }
 };
 
+static char *test_uid_key(void *items, int index) {
+  return ((char **) items)[index];
+}
+
 int main(int argc, char **argv) {
   int retVal = 0;
 
@@ -435,6 +540,7 @@ int main(int argc, char **argv) {
     {
       struct nextquestions  *nq = calloc(1, sizeof(struct nextquestions));
       nq->question_count = 3;
+      nq->next_questions = calloc(3, sizeof(struct question *));
       nq->next_questions[0] = create_question("uid1", QTYPE_TEXT, "Q1");
       nq->next_questions[1] = create_question("uid2", QTYPE_TEXT, "Q2");
       nq->next_questions[2] = create_question("uid3", QTYPE_TEXT, "Q3");
@@ -454,6 +560,7 @@ int main(int argc, char **argv) {
     {
       struct nextquestions  *nq = calloc(1, sizeof(struct nextquestions));
       nq->question_count = 1;
+      nq->next_questions = calloc(1, sizeof(struct question *));
       nq->next_questions[0] = create_question("uid1", QTYPE_TEXT, "Q1");
 
       char *text = NULL;
@@ -920,6 +1027,192 @@ int main(int argc, char **argv) {
       free_answer(a);
     }
 
+    SECTION("in-place answer deserialisation: deserialise_answer_inplace()");
+
+    {
+      char str[1024];
+      int ret;
+      char uid[] = "inplace";
+
+      struct answer *a = create_answer(uid, QTYPE_TEXT, "with:\n\r\b\tescapes", "unit");
+      ret = serialise_answer(a, ANSWER_SCOPE_FULL, str, 1024);
+      ASSERT(ret == 0, "answer '%s' serialised", uid);
+      free_answer(a);
+
+      struct answer *in = calloc(sizeof(struct answer), 1);
+      ret = deserialise_answer(str, ANSWER_SCOPE_FULL, in);
+      ASSERT(ret == 0, "answer '%s' deserialised", uid);
+
+      struct answer *out = calloc(sizeof(struct answer), 1);
+      out->borrowed = 1;
+      ret = deserialise_answer_inplace(str, out);
+      ASSERT(ret == 0, "answer '%s' deserialised in place", uid);
+      ASSERT(out->text > str && out->text < str + 1024, "answer '%s' text points into input string", uid);
+
+      assert_answers_compare(in, out);  // answers are freed in func
+    }
+
+    {
+      char str[] = "uid:TEXT:illegal\\escape:0:0:0:0:0:0:0::0:0";
+      struct answer *out = calloc(sizeof(struct answer), 1);
+      out->borrowed = 1;
+      LOG_MUTE();
+      int ret = deserialise_answer_inplace(str, out);
+      LOG_UNMUTE();
+      ASSERT(ret != 0, "illegal escape sequence is rejected", "");
+      free_answer(out);
+    }
+
+    {
+      char str[] = "uid:TEXT:text:0:0:0:0:0:0:0::0";
+      struct answer *out = calloc(sizeof(struct answer), 1);
+      out->borrowed = 1;
+      LOG_MUTE();
+      int ret = deserialise_answer_inplace(str, out);
+      LOG_UNMUTE();
+      ASSERT(ret != 0, "missing column is rejected", "");
+      free_answer(out);
+    }
+
+    SECTION("binary session format: serialise_answer_binary(), deserialise_answer_binary()");
+
+    {
+      char buf[1024];
+      int ret;
+      char uid[] = "binary";
+
+      struct answer *in = create_answer(uid, QTYPE_TEXT, "with:\n\r\b\tescapes", "unit");
+      in->value = -42;
+      in->lat = 1LL << 40;
+      in->stored = 1595557084;
+      in->flags = ANSWER_DELETED;
+
+      int len = serialise_answer_binary(in, buf, 1024);
+      ASSERT(len > 0, "answer '%s' serialised (%d bytes)", uid, len);
+
+      struct answer *out = calloc(sizeof(struct answer), 1);
+      out->borrowed = 1;
+      ret = deserialise_answer_binary(buf, len, out);
+      ASSERT(ret == len, "answer '%s' deserialised (%d bytes)", uid, ret);
+      ASSERT(out->stored == in->stored && out->flags == in->flags, "answer '%s' protected fields match", uid);
+
+      assert_answers_compare(in, out);  // answers are freed in func
+    }
+
+    {
+      char buf[1024];
+      struct answer *in = create_answer("corrupt", QTYPE_TEXT, "text", "unit");
+      int len = serialise_answer_binary(in, buf, 1024);
+      free_answer(in);
+
+      buf[len - 8] ^= 1; // flip a bit in the last string
+      struct answer *out = calloc(sizeof(struct answer), 1);
+      out->borrowed = 1;
+      LOG_MUTE();
+      int ret = deserialise_answer_binary(buf, len, out);
+      LOG_UNMUTE();
+      ASSERT(ret < 0, "checksum mismatch is detected", "");
+
+      LOG_MUTE();
+      ret = deserialise_answer_binary(buf, len - 1, out);
+      LOG_UNMUTE();
+      ASSERT(ret < 0, "truncated record is detected", "");
+      free_answer(out);
+    }
+
+    {
+      char buf[1024];
+      char *survey_id = NULL;
+      int count = 0;
+
+      int len = serialise_session_header_binary("foo/b884bcb19954b245d8be53db2b266c4798dc742d", 42, buf, 1024);
+      ASSERT(len > 0, "session header serialised (%d bytes)", len);
+
+      int ret = deserialise_session_header_binary(buf, len, &survey_id, &count);
+      ASSERT(ret == len, "session header deserialised (%d bytes)", ret);
+      ASSERT_STR_EQ(survey_id, "foo/b884bcb19954b245d8be53db2b266c4798dc742d", "survey id");
+      ASSERT(count == 42, "answer count %d", count);
+    }
+
+    SECTION("uid index: uid_index_insert(), uid_index_find()");
+
+    {
+      char *uids[200];
+      char buf[200][16];
+      struct uid_index idx = { NULL };
+
+      int errors = 0;
+      for (int i = 0; i < 200; i++) {
+        snprintf(buf[i], 16, "q%d", i);
+        uids[i] = buf[i];
+        errors += (uid_index_insert(&idx, uids[i], i, uids, test_uid_key) != 0);
+      }
+      ASSERT(errors == 0, "200 uids inserted (%d errors)", errors);
+      ASSERT(idx.size >= 400, "index has grown to %d slots", idx.size);
+
+      int found = 0;
+      for (int i = 0; i < 200; i++) {
+        found += (uid_index_find(&idx, uids[i], uids, test_uid_key) == i);
+      }
+      ASSERT(found == 200, "all uids found at their position (%d)", found);
+      ASSERT(uid_index_find(&idx, "q200", uids, test_uid_key) == -1, "unknown uid is not found", "");
+
+      // a duplicate uid keeps the first position, like a linear search
+      uids[199] = "q7";
+      uid_index_insert(&idx, uids[199], 199, uids, test_uid_key);
+      ASSERT(uid_index_find(&idx, "q7", uids, test_uid_key) == 7, "duplicate uid resolves to first position", "");
+
+      uid_index_free(&idx);
+      ASSERT(uid_index_find(&idx, "q1", uids, test_uid_key) == -1, "freed index is empty", "");
+    }
+
+    SECTION("arena allocator: arena_calloc(), arena_reset()");
+
+    {
+      struct arena a = { NULL };
+
+      char *s1 = arena_strdup(&a, "hello");
+      int *n = arena_calloc(&a, 4, sizeof(int));
+      char *big = arena_calloc(&a, 100000, 1);
+
+      ASSERT_STR_EQ(s1, "hello", "arena_strdup()");
+      ASSERT(n && !n[0] && !n[3], "arena_calloc() returns zeroed memory", "");
+      ASSERT(((size_t) n % 16) == 0, "arena_calloc() returns aligned memory", "");
+      ASSERT(big != NULL, "large allocation", "");
+      ASSERT(arena_owns(&a, s1) && arena_owns(&a, big + 99999), "arena owns its allocations", "");
+
+      char *own = strdup("foreign");
+      ASSERT(!arena_owns(&a, own), "arena does not own foreign memory", "");
+      free(own);
+
+      arena_reset(&a);
+      ASSERT(a.allocated == 0 && arena_owns(&a, s1), "arena reset, the address range stays owned", "");
+
+      char *s2 = arena_strdup(&a, "again");
+      ASSERT(s2 == s1, "memory is reused after reset", "");
+
+      arena_free(&a);
+    }
+
+    {
+      // request arena, without an active request these are calloc(), strdup() and free()
+      char *s1 = request_strdup("outside");
+      request_free(s1);
+
+      request_arena_begin();
+      struct answer *ans = request_calloc(1, sizeof(struct answer));
+      ans->uid = request_strdup("inside");
+      ans->text = strdup("foreign"); // i.e. allocated by a library
+      free_answer(ans);             // frees text only
+      ASSERT_STR_EQ(ans->uid, "inside", "arena allocations stay valid until the request ends");
+      char *late = request_strdup("late");
+      request_arena_end();
+
+      // arena memory released after the request has ended must not reach free()
+      request_free(late);
+      ASSERT(1, "request_free() after request_arena_end()", "");
+    }
+
     ////
     // multiline answers deserialisation
     ////
@@ -1062,7 +1355,7 @@ int main(int argc, char **argv) {
     SECTION("sha1 tests: sha1_string(), #268, #237");
 
     {
-      char hash[HASHSTRING_LENGTH];
+      char hash[HASHSTRING_LENGTH + 1];
       int ret;
       LOG_MUTE(); // supress error printing in sha1.c
 
@@ -1118,6 +1411,52 @@ int main(int argc, char **argv) {
       LOG_UNMUTE();
     }
 
+    SECTION("sha1 tests: block compression implementations");
+
+    {
+      const char *impls[] = { "shani", "ssse3", "portable" };
+      const char *selected = sha1_implementation();
+      sha1nfo info;
+      char hash[HASHSTRING_LENGTH + 1];
+      char million[1000];
+      memset(million, 'a', sizeof(million));
+
+      int ret = sha1_set_implementation("portable");
+      ASSERT(ret == 0, "portable implementation is always available", "");
+      ret = sha1_set_implementation("unknown");
+      ASSERT(ret != 0, "unknown implementation is rejected", "");
+
+      for (int i = 0; i < 3; i++) {
+        if (sha1_set_implementation(impls[i])) {
+          SKIP("sha1 implementation '%s' not supported by this cpu", impls[i]);
+          continue;
+        }
+
+        sha1_string("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", hash);
+        ASSERT(strcmp(hash, "84983e441c3bd26ebaae4aa1f95129e5e54670f1") == 0, "sha1 '%s': FIPS 180-2 C.2 '%s'", impls[i], hash);
+
+        // FIPS 180-2 C.3, written in uneven chunks to cross block boundaries
+        sha1_init(&info);
+        for (int n = 0; n < 1000000;) {
+          int len = (1000000 - n < 997) ? 1000000 - n : 997;
+          sha1_write(&info, million, len);
+          n += len;
+        }
+        sha1_hash(&info, hash);
+        ASSERT(strcmp(hash, "34aa973cd4c4daa4f61eeb2bdbad27316534016f") == 0, "sha1 '%s': FIPS 180-2 C.3 '%s'", impls[i], hash);
+
+        // RFC3174 7.3 TEST4, byte by byte
+        sha1_init(&info);
+        for (int n = 0; n < 640; n++) {
+          sha1_writebyte(&info, "01234567"[n % 8]);
+        }
+        sha1_hash(&info, hash);
+        ASSERT(strcmp(hash, "dea356a2cddd90c7a7ecedc5ebb563934f460452") == 0, "sha1 '%s': RFC3174 TEST4 '%s'", impls[i], hash);
+      }
+
+      sha1_set_implementation(selected);
+    }
+
     SECTION("sha1 tests: sha1_validate_string(), #237");
 
     {
@@ -1501,6 +1840,874 @@ int main(int argc, char **argv) {
       free_question(cpy);
     }
 
+    SECTION("analysis cache: session_save_analysis(), session_get_cached_analysis()");
+
+    {
+      char home[] = TEST_HOME_TEMPLATE;
+      char *survey_home = setup_test_home(home);
+      ASSERT(survey_home != NULL, "setup_test_home('%s')", home);
+
+      char dir[1024];
+      snprintf(dir, 1024, "%s/sessions", home);
+      mkdir(dir, 0700);
+      snprintf(dir, 1024, "%s/sessions/abcd", home);
+      mkdir(dir, 0700);
+
+      struct session ses = { 0 };
+      struct file_map map;
+      size_t offset = 0;
+      int ret;
+
+      ses.session_id = "abcdabcd-0000-0000-0000-000000000000";
+      ses.consistency_hash = "0123456789abcdef0123456789abcdef01234567";
+
+      ret = session_get_cached_analysis(&ses, "python:test/1", &map, &offset);
+      ASSERT(ret == 0 && map.data == NULL, "miss without cache file (ret %d)", ret);
+
+      ret = session_save_analysis(&ses, "python:test/1", "{\"a\":1}");
+      ASSERT(ret == 0, "session_save_analysis() returns %d", ret);
+
+      ret = session_get_cached_analysis(&ses, "python:test/1", &map, &offset);
+      ASSERT(ret == 0 && map.data != NULL, "hit for same state and hook (ret %d)", ret);
+      if (map.data) {
+        ASSERT_STR_EQ(map.data + offset, "{\"a\":1}", "cached analysis");
+      }
+      unmap_file(&map);
+
+      ret = session_get_cached_analysis(&ses, "python:test/2", &map, &offset);
+      ASSERT(ret == 0 && map.data == NULL, "miss for another hook identity (ret %d)", ret);
+
+      ses.consistency_hash = "76543210fedcba9876543210fedcba9876543210";
+      ret = session_get_cached_analysis(&ses, "python:test/1", &map, &offset);
+      ASSERT(ret == 0 && map.data == NULL, "miss for another session state (ret %d)", ret);
+
+      // dir + '/' + session id + suffix
+      char path[1024 + 64];
+      snprintf(path, sizeof(path), "%s/%s.analysis.cache", dir, ses.session_id);
+      unlink(path);
+      rmdir(dir);
+      snprintf(dir, 1024, "%s/sessions", home);
+      rmdir(dir);
+      teardown_test_home(home, survey_home);
+    }
+
+    SECTION("analysis queue: analysis_job_submit(), claim, finish, failures, stale jobs");
+
+    {
+      char home[] = TEST_HOME_TEMPLATE;
+      char *survey_home = setup_test_home(home);
+      ASSERT(survey_home != NULL, "setup_test_home('%s')", home);
+
+      char *sid = "abcdabcd-0000-0000-0000-000000000001";
+      char claimed[64];
+      int ret;
+
+      ret = analysis_job_claim(claimed, 64);
+      ASSERT(ret == 0 && !claimed[0], "claim without queue (ret %d)", ret);
+
+      ret = analysis_job_submit(sid);
+      ASSERT(ret == 0 && analysis_job_status(sid) == ANALYSIS_JOB_QUEUED, "submit queues a job (ret %d)", ret);
+      ret = analysis_job_submit(sid);
+      ASSERT(ret == 0 && analysis_job_status(sid) == ANALYSIS_JOB_QUEUED, "submit does not duplicate a job (ret %d)", ret);
+
+      ret = analysis_job_claim(claimed, 64);
+      ASSERT(ret == 0 && !strcmp(claimed, sid), "claim returns the queued job '%s'", claimed);
+      ASSERT(analysis_job_status(sid) == ANALYSIS_JOB_RUNNING, "claimed job is running (%d)", analysis_job_status(sid));
+
+      ret = analysis_job_claim(claimed, 64);
+      ASSERT(ret == 0 && !claimed[0], "a running job is not claimed twice ('%s')", claimed);
+
+      ret = analysis_job_requeue_stale();
+      ASSERT(ret == 0, "a job of a live worker is not stale (%d)", ret);
+
+      ret = analysis_job_finish(sid, 0);
+      ASSERT(ret == 0 && analysis_job_status(sid) == ANALYSIS_JOB_NONE, "finished job is removed (ret %d)", ret);
+
+      // failure, reported once
+      analysis_job_submit(sid);
+      analysis_job_claim(claimed, 64);
+      ret = analysis_job_finish(sid, SS_INVALID_SESSION_ID);
+      ASSERT(ret == 0 && analysis_job_status(sid) == ANALYSIS_JOB_FAILED, "failed job is recorded (ret %d)", ret);
+      ret = analysis_job_take_failure(sid);
+      ASSERT(ret == SS_INVALID_SESSION_ID, "failure returns the error code of the job (%d)", ret);
+      ASSERT(analysis_job_status(sid) == ANALYSIS_JOB_NONE, "failure is reported once (%d)", analysis_job_status(sid));
+
+      // job of a worker which no longer exists
+      analysis_job_submit(sid);
+      analysis_job_claim(claimed, 64);
+
+      pid_t pid = fork();
+      if (pid == 0) {
+        _exit(0);
+      }
+      int status;
+      waitpid(pid, &status, 0);
+
+      char path[1100];
+      snprintf(path, 1100, "%s/analysis_queue/running.%s", home, sid);
+      FILE *fp = fopen(path, "w");
+      if (fp) {
+        fprintf(fp, "%d\n", (int) pid);
+        fclose(fp);
+      }
+
+      ret = analysis_job_requeue_stale();
+      ASSERT(ret == 1 && analysis_job_status(sid) == ANALYSIS_JOB_QUEUED, "job of a dead worker is queued again (%d)", ret);
+
+      ret = analysis_job_claim(claimed, 64);
+      ASSERT(ret == 0 && !strcmp(claimed, sid), "requeued job is claimed again '%s'", claimed);
+      analysis_job_finish(sid, 0);
+
+      snprintf(path, 1100, "%s/analysis_queue", home);
+      rmdir(path);
+      teardown_test_home(home, survey_home);
+    }
+
+    SECTION("survey cache: survey_cache_get(), survey_release(), eviction");
+
+    {
+      char home[] = TEST_HOME_TEMPLATE;
+      char *survey_home = setup_test_home(home);
+      ASSERT(survey_home != NULL, "setup_test_home('%s')", home);
+
+      // 65 snapshots, one more than the cache holds, and a "current" file
+      char path[1100];
+      snprintf(path, 1100, "%s/surveys", home);
+      mkdir(path, 0700);
+      snprintf(path, 1100, "%s/surveys/cache", home);
+      mkdir(path, 0700);
+      for (int i = 0; i <= 65; i++) {
+        if (i < 65) {
+          snprintf(path, 1100, "%s/surveys/cache/%040d", home, i);
+        } else {
+          snprintf(path, 1100, "%s/surveys/cache/current", home);
+        }
+        FILE *fp = fopen(path, "w");
+        if (fp) {
+          fprintf(fp, "version 2\nCache survey\nwithout python\nq1:Question1::INT:0::0:100:0:0::\n");
+          fclose(fp);
+        }
+      }
+
+      char survey_id[256];
+      int ret = 0;
+      survey_cache_clear();
+
+      // hit and reference count
+      snprintf(survey_id, 256, "cache/%040d", 0);
+      struct survey *first = survey_cache_get(survey_id, &ret);
+      struct survey *second = survey_cache_get(survey_id, &ret);
+      ASSERT(first != NULL && first == second, "survey_cache_get('%s'): same cached survey (ret %d)", survey_id, ret);
+      if (first) {
+        ASSERT(first->cached == 1 && first->refs == 2, "cached %d, refs %d", first->cached, first->refs);
+        survey_release(second);
+        ASSERT(first->refs == 1, "survey_release(): refs %d", first->refs);
+      }
+
+      // surveys which are not snapshots are not cached
+      struct survey *current = survey_cache_get("cache/current", &ret);
+      second = survey_cache_get("cache/current", &ret);
+      ASSERT(current != NULL && second != NULL && current != second, "survey_cache_get('cache/current'): not shared (ret %d)", ret);
+      if (current && second) {
+        ASSERT(!current->cached && current->refs == 1, "'cache/current': cached %d, refs %d", current->cached, current->refs);
+      }
+      survey_release(current);
+      survey_release(second);
+
+      // eviction: the least recently used unreferenced entry, a borrowed entry stays
+      snprintf(survey_id, 256, "cache/%040d", 1);
+      struct survey *lru = survey_cache_get(survey_id, &ret);
+      if (lru) {
+        lru->python_timeout = 4711; // marker, a reloaded survey has the default
+        survey_release(lru);
+      }
+      for (int i = 2; i < 65; i++) {
+        snprintf(survey_id, 256, "cache/%040d", i);
+        struct survey *survey = survey_cache_get(survey_id, &ret);
+        ASSERT(survey != NULL && survey->cached, "survey_cache_get('%s') (ret %d)", survey_id, ret);
+        survey_release(survey);
+      }
+
+      snprintf(survey_id, 256, "cache/%040d", 0);
+      second = survey_cache_get(survey_id, &ret);
+      ASSERT(second == first, "borrowed survey '%s' not evicted", survey_id);
+      survey_release(second);
+
+      snprintf(survey_id, 256, "cache/%040d", 1);
+      lru = survey_cache_get(survey_id, &ret);
+      ASSERT(lru != NULL && lru->python_timeout != 4711, "least recently used survey '%s' evicted and reloaded", survey_id);
+      survey_release(lru);
+
+      survey_release(first);
+      survey_cache_clear();
+      paths_close();
+
+      for (int i = 0; i <= 65; i++) {
+        if (i < 65) {
+          snprintf(path, 1100, "%s/surveys/cache/%040d", home, i);
+        } else {
+          snprintf(path, 1100, "%s/surveys/cache/current", home);
+        }
+        unlink(path);
+      }
+      snprintf(path, 1100, "%s/surveys/cache", home);
+      rmdir(path);
+      snprintf(path, 1100, "%s/surveys", home);
+      rmdir(path);
+      teardown_test_home(home, survey_home);
+    }
+
+    SECTION("session journal: append, replay, compaction, stale journals");
+
+    {
+      char home[] = TEST_HOME_TEMPLATE;
+      char *survey_home = setup_test_home(home);
+      ASSERT(survey_home != NULL, "setup_test_home('%s')", home);
+      setenv("SS_SESSION_JOURNAL", "2", 1);
+
+      char *sid = "abcdabcd-0000-0000-0000-000000000001";
+      char session_path[1100];
+      char journal_path[1100];
+      snprintf(session_path, 1100, "%s/sessions/abcd/%s", home, sid);
+      snprintf(journal_path, 1100, "%s/sessions/abcd/%s.journal", home, sid);
+      create_test_session(home, sid);
+
+      int ret = 0;
+      struct stat st;
+      struct stat st_session;
+      stat(session_path, &st_session);
+
+      // append
+      struct session *ses = load_session(sid, &ret);
+      ASSERT(ses != NULL, "load_session() (ret %d)", ret);
+      for (int i = 1; ses && i <= 2; i++) {
+        set_test_answer(ses, 43 + i);
+        ret = save_session(ses);
+        ASSERT(ret == 0, "save_session() #%d appends to journal (ret %d)", i, ret);
+      }
+      free_session(ses);
+
+      struct stat st_after;
+      stat(session_path, &st_after);
+      ASSERT(st_after.st_ino == st_session.st_ino, "session file not rewritten while journalling (inode %lu)", (unsigned long) st_after.st_ino);
+
+      char line[1024] = { 0 };
+      FILE *fp = fopen(journal_path, "r");
+      if (fp) {
+        if (!fgets(line, 1024, fp)) {
+          line[0] = 0;
+        }
+        fclose(fp);
+      }
+      trim_crlf(line);
+      ASSERT(!strncmp(line, "journal ", 8), "journal header '%s'", line);
+
+      // replay
+      ses = load_session(sid, &ret);
+      ASSERT(ses != NULL, "load_session() replays journal (ret %d)", ret);
+      if (ses) {
+        int index = session_get_question_index("q2", ses);
+        ASSERT(ses->answers[index]->value == 45, "replayed answer value %lld", ses->answers[index]->value);
+        ASSERT(ses->journal_records == 2, "replayed journal records %d", ses->journal_records);
+
+        // compaction: the limit of 2 records is exceeded
+        set_test_answer(ses, 46);
+        ret = save_session(ses);
+        ASSERT(ret == 0, "save_session() compacts journal (ret %d)", ret);
+        ASSERT(stat(journal_path, &st), "journal removed after compaction: '%s'", journal_path);
+        ASSERT(ses->journal_records == 0, "journal records after compaction %d", ses->journal_records);
+        free_session(ses);
+      }
+
+      // stale journal: compaction was interrupted before the journal was removed
+      fp = fopen(journal_path, "w");
+      if (fp) {
+        fprintf(fp, "journal 0-0.000000000-0\nq2:INT::99:0:0:0:0:0:0::0:0\n");
+        fclose(fp);
+      }
+      ses = load_session(sid, &ret);
+      ASSERT(ses != NULL, "load_session() with stale journal (ret %d)", ret);
+      if (ses) {
+        int index = session_get_question_index("q2", ses);
+        ASSERT(ses->answers[index]->value == 46, "stale journal not replayed, answer value %lld", ses->answers[index]->value);
+        free_session(ses);
+      }
+      ASSERT(stat(journal_path, &st), "stale journal removed on load: '%s'", journal_path);
+
+      // a stale journal is never appended to
+      ses = load_session(sid, &ret);
+      fp = fopen(journal_path, "w");
+      if (fp) {
+        fprintf(fp, "journal 0-0.000000000-0\nq2:INT::99:0:0:0:0:0:0::0:0\n");
+        fclose(fp);
+      }
+      if (ses) {
+        set_test_answer(ses, 47);
+        ret = save_session(ses);
+        ASSERT(ret == 0, "save_session() replaces stale journal (ret %d)", ret);
+        free_session(ses);
+      }
+      ses = load_session(sid, &ret);
+      if (ses) {
+        int index = session_get_question_index("q2", ses);
+        ASSERT(ses->answers[index]->value == 47, "answer value after replacing stale journal %lld", ses->answers[index]->value);
+        ASSERT(ses->journal_records == 1, "journal records after replacing stale journal %d", ses->journal_records);
+        free_session(ses);
+      }
+
+      unsetenv("SS_SESSION_JOURNAL");
+      paths_close();
+      remove_test_session(home, sid);
+
+      teardown_test_home(home, survey_home);
+    }
+
+    SECTION("optimistic sessions: compare and swap, session claims");
+
+    {
+      char home[] = TEST_HOME_TEMPLATE;
+      char *survey_home = setup_test_home(home);
+      ASSERT(survey_home != NULL, "setup_test_home('%s')", home);
+      setenv("SS_SESSION_OPTIMISTIC", "1", 1);
+
+      char *sid = "abcdabcd-0000-0000-0000-000000000002";
+      create_test_session(home, sid);
+
+      int ret = 0;
+      int status = 0;
+
+      // two concurrent saves of the same generation: exactly one succeeds
+      int barrier[2];
+      ret = pipe(barrier);
+      ASSERT(ret == 0, "pipe(%s)", "barrier");
+      pid_t pids[2];
+      for (int i = 0; i < 2; i++) {
+        pids[i] = fork();
+        if (pids[i] == 0) {
+          close(barrier[1]);
+          struct session *ses = load_session(sid, &ret);
+          if (!ses) {
+            _exit(2);
+          }
+          set_test_answer(ses, 50 + i);
+          char c;
+          if (read(barrier[0], &c, 1) < 0) {
+            _exit(2);
+          }
+          ret = save_session(ses);
+          _exit((ret == 0) ? 0 : (ret == SS_SESSION_CONFLICT) ? 1 : 2);
+        }
+      }
+      close(barrier[0]);
+      usleep(100000);
+      close(barrier[1]);
+
+      int saved = 0;
+      int conflicts = 0;
+      for (int i = 0; i < 2; i++) {
+        waitpid(pids[i], &status, 0);
+        saved += (WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        conflicts += (WIFEXITED(status) && WEXITSTATUS(status) == 1);
+      }
+      ASSERT(saved == 1 && conflicts == 1, "concurrent saves of one generation: %d saved, %d SS_SESSION_CONFLICT", saved, conflicts);
+
+      // a session loaded before another update was published
+      struct session *first = load_session(sid, &ret);
+      struct session *second = load_session(sid, &ret);
+      ASSERT(first && second, "load_session() twice (ret %d)", ret);
+      if (first && second) {
+        set_test_answer(first, 60);
+        set_test_answer(second, 61);
+        ret = save_session(first);
+        ASSERT(ret == 0, "save_session() of current generation (ret %d)", ret);
+        ret = save_session(second);
+        ASSERT(ret == SS_SESSION_CONFLICT, "save_session() of replaced generation: SS_SESSION_CONFLICT (ret %d)", ret);
+      }
+      free_session(first);
+      free_session(second);
+
+      // a claim of a running writer is never broken, a claim of a crashed writer is taken over
+      struct session *ses = load_session(sid, &ret);
+      ASSERT(ses != NULL, "load_session() (ret %d)", ret);
+      if (ses) {
+        char claim_path[1100];
+        snprintf(claim_path, 1100, "%s/sessions/abcd/cas.%s.%s", home, sid, ses->generation);
+
+        int held[2];
+        int release[2];
+        ret = pipe(held) || pipe(release);
+        ASSERT(ret == 0, "pipe(%s)", "claim");
+        pid_t pid = fork();
+        if (pid == 0) {
+          close(release[1]);
+          int fd = open(claim_path, O_RDWR | O_CREAT, 0600);
+          struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+          if (fd < 0 || fcntl(fd, F_SETLK, &fl)) {
+            _exit(1);
+          }
+          char c = 1;
+          if (write(held[1], &c, 1) != 1 || read(release[0], &c, 1) < 0) {
+            _exit(1);
+          }
+          _exit(0);
+        }
+        char c = 0;
+        ret = read(held[0], &c, 1);
+        ASSERT(ret == 1, "claim '%s' held by pid %d", claim_path, pid);
+
+        set_test_answer(ses, 70);
+        ret = save_session(ses);
+        ASSERT(ret == SS_SESSION_CONFLICT, "save_session() with a live claim: SS_SESSION_CONFLICT (ret %d)", ret);
+
+        close(release[1]);
+        waitpid(pid, &status, 0);
+        ret = save_session(ses);
+        ASSERT(ret == 0, "save_session() takes over the claim of an exited writer (ret %d)", ret);
+
+        struct stat st;
+        ASSERT(stat(claim_path, &st), "claim '%s' removed", claim_path);
+
+        close(held[0]);
+        close(held[1]);
+        close(release[0]);
+        free_session(ses);
+      }
+
+      ses = load_session(sid, &ret);
+      if (ses) {
+        int index = session_get_question_index("q2", ses);
+        ASSERT(ses->answers[index]->value == 70, "published answer value %lld", ses->answers[index]->value);
+        free_session(ses);
+      }
+
+      unsetenv("SS_SESSION_OPTIMISTIC");
+      paths_close();
+      remove_test_session(home, sid);
+
+      teardown_test_home(home, survey_home);
+    }
+
+    SECTION("nextquestion hook memoisation: py_memo_put(), py_memo_get(), LRU eviction");
+
+    {
+      struct survey survey = { 0 };
+      struct session ses = { 0 };
+      struct nextquestions nq = { 0 };
+      char *value;
+      int ret;
+
+      survey.python_memoise = PY_MEMO_PROCESS;
+      ses.survey = &survey;
+      nq.status = 1;
+      nq.progress[0] = 2;
+      nq.progress[1] = 3;
+      nq.message = "multi\nline";
+
+      setenv("SS_PYTHON_MEMO_SIZE", "2", 1);
+      py_memo_clear();
+
+      ret = py_memo_put(&ses, "1111111111111111111111111111111111111111", &nq);
+      ASSERT(ret == 0, "py_memo_put() returns %d", ret);
+      value = py_memo_get(&ses, "1111111111111111111111111111111111111111");
+      ASSERT_STR_EQ(value, "1\n2 3\n0\nmulti\nline", "memoised result");
+      free(value);
+
+      py_memo_put(&ses, "2222222222222222222222222222222222222222", &nq);
+      // 1111.. is the most recently used entry, 2222.. is evicted
+      value = py_memo_get(&ses, "1111111111111111111111111111111111111111");
+      free(value);
+      py_memo_put(&ses, "3333333333333333333333333333333333333333", &nq);
+
+      value = py_memo_get(&ses, "2222222222222222222222222222222222222222");
+      ASSERT(value == NULL, "least recently used entry evicted: %s", (value) ? value : "(null)");
+      free(value);
+      value = py_memo_get(&ses, "1111111111111111111111111111111111111111");
+      ASSERT(value != NULL, "recently used entry kept: %s", (value) ? "yes" : "no");
+      free(value);
+      value = py_memo_get(&ses, "3333333333333333333333333333333333333333");
+      ASSERT(value != NULL, "new entry kept: %s", (value) ? "yes" : "no");
+      free(value);
+
+      py_memo_clear();
+      unsetenv("SS_PYTHON_MEMO_SIZE");
+    }
+
+    SECTION("nextquestion hook memoisation: memoise=disk, bounded store");
+
+    {
+      char home[] = TEST_HOME_TEMPLATE;
+      char *survey_home = setup_test_home(home);
+      ASSERT(survey_home != NULL, "setup_test_home('%s')", home);
+
+      struct survey survey = { 0 };
+      struct session ses = { 0 };
+      struct nextquestions nq = { 0 };
+      char *value;
+      char path[1100];
+
+      survey.python_memoise = PY_MEMO_DISK;
+      ses.survey = &survey;
+      nq.message = "disk";
+
+      // two entries per memo directory
+      setenv("SS_PYTHON_MEMO_DISK_SIZE", "512", 1);
+      char *keys[] = {
+        "cc11111111111111111111111111111111111111",
+        "cc22222222222222222222222222222222222222",
+        "cc33333333333333333333333333333333333333",
+        "dd11111111111111111111111111111111111111",
+        "dd22222222222222222222222222222222222222",
+      };
+
+      // file timestamps are coarse, age the entries explicitly
+      py_memo_put(&ses, keys[0], &nq);
+      py_memo_put(&ses, keys[1], &nq);
+      for (int i = 0; i < 2; i++) {
+        snprintf(path, 1100, "%s/memo/cc/%s", home, keys[i]);
+        struct timespec used[2] = { { time(NULL) - 100 + i * 50, 0 }, { time(NULL) - 100 + i * 50, 0 } };
+        utimensat(AT_FDCWD, path, used, 0);
+      }
+      py_memo_clear();
+      value = py_memo_get(&ses, keys[0]); // disk hit, now the most recently used file
+      ASSERT(value != NULL, "disk hit: %s", (value) ? value : "(null)");
+      free(value);
+
+      py_memo_put(&ses, keys[2], &nq);
+      py_memo_clear();
+      value = py_memo_get(&ses, keys[1]);
+      ASSERT(value == NULL, "least recently used file evicted: %s", (value) ? value : "(null)");
+      free(value);
+      value = py_memo_get(&ses, keys[0]);
+      ASSERT(value != NULL, "recently used file kept: %s", (value) ? "yes" : "no");
+      free(value);
+
+      // expired entries
+      py_memo_put(&ses, keys[3], &nq);
+      snprintf(path, 1100, "%s/memo/dd/%s", home, keys[3]);
+      struct timespec expired[2] = { { time(NULL) - 8 * 86400, 0 }, { time(NULL) - 8 * 86400, 0 } };
+      utimensat(AT_FDCWD, path, expired, 0);
+      py_memo_put(&ses, keys[4], &nq);
+      py_memo_clear();
+      value = py_memo_get(&ses, keys[3]);
+      ASSERT(value == NULL, "expired file removed: %s", (value) ? value : "(null)");
+      free(value);
+
+      for (int i = 0; i < 5; i++) {
+        snprintf(path, 1100, "%s/memo/%.2s/%s", home, keys[i], keys[i]);
+        unlink(path);
+      }
+      char *dirs[] = { "memo/cc", "memo/dd", "memo", NULL };
+      for (int i = 0; dirs[i]; i++) {
+        snprintf(path, 1100, "%s/%s", home, dirs[i]);
+        rmdir(path);
+      }
+
+      py_memo_clear();
+      unsetenv("SS_PYTHON_MEMO_DISK_SIZE");
+      teardown_test_home(home, survey_home);
+    }
+
+    ////
+    // python hook latency statistics
+    ////
+
+    SECTION("python hook latency statistics (py_stats.c)");
+
+    {
+      struct py_hook_stats stats[4];
+      py_stats_clear();
+
+      // 1ms .. 100ms
+      for (int i = 1; i <= 100; i++) {
+        py_stats_record("nextquestion_foo", i * 1000ULL, 0, 0);
+      }
+      py_stats_record("analyse", 5000ULL, 1, 1);
+
+      int count = py_stats_get(stats, 4);
+      ASSERT(count == 2, "py_stats_get() returns %d entries", count);
+      ASSERT_STR_EQ(stats[0].function_name, "nextquestion_foo", "entry 0 function name");
+      ASSERT(stats[0].count == 100, "entry 0 count %lu", stats[0].count);
+      ASSERT(stats[0].errors == 0 && stats[0].timeouts == 0, "entry 0 errors %lu, timeouts %lu", stats[0].errors, stats[0].timeouts);
+      ASSERT(stats[0].p50_ms >= 50 && stats[0].p50_ms < 50 * 1.2, "entry 0 p50 %.3fms ~ 50ms", stats[0].p50_ms);
+      ASSERT(stats[0].p95_ms >= 95 && stats[0].p95_ms <= 100, "entry 0 p95 %.3fms ~ 95ms", stats[0].p95_ms);
+      ASSERT(stats[0].p99_ms >= 99 && stats[0].p99_ms <= 100, "entry 0 p99 %.3fms ~ 99ms", stats[0].p99_ms);
+      ASSERT(stats[0].max_ms == 100, "entry 0 max %.3fms", stats[0].max_ms);
+      ASSERT(stats[0].mean_ms == 50.5, "entry 0 mean %.3fms", stats[0].mean_ms);
+
+      ASSERT_STR_EQ(stats[1].function_name, "analyse", "entry 1 function name");
+      ASSERT(stats[1].errors == 1 && stats[1].timeouts == 1, "entry 1 errors %lu, timeouts %lu", stats[1].errors, stats[1].timeouts);
+      ASSERT(stats[1].p99_ms == 5, "entry 1 p99 %.3fms (single value)", stats[1].p99_ms);
+
+      py_stats_clear();
+      ASSERT(py_stats_get(stats, 4) == 0, "py_stats_clear() %s", "resets all entries");
+    }
+
+    ////
+    // python worker pool
+    ////
+
+    SECTION("python worker pool: hook_worker.py round trip, survey handshake, reconnect");
+
+    {
+      char home[] = TEST_HOME_TEMPLATE;
+      char *survey_home = setup_test_home(home);
+      ASSERT(survey_home != NULL, "setup_test_home('%s')", home);
+
+      char *sid = "abcdabcd-0000-0000-0000-000000000004";
+      create_test_session(home, sid);
+
+      char hooks[1100];
+      char sock[1100];
+      snprintf(hooks, 1100, "%s/nextquestion.py", home);
+      snprintf(sock, 1100, "%s/hooks.sock", home);
+      FILE *fp = fopen(hooks, "w");
+      if (fp) {
+        fprintf(fp, "def nextquestion(questions, answers, **kwargs):\n"
+                    "    return {'status': 1, 'progress': [0, len(questions)], 'next_questions': list(questions),\n"
+                    "            'message': kwargs['session_id']}\n"
+                    "\n"
+                    "def analyse(questions, answers, **kwargs):\n"
+                    "    return '{\"q2\": %%d}' %% answers['q2'].value\n");
+        fclose(fp);
+      }
+
+      // one worker, restarted by the pool after each hook call (survey handshake + call)
+      pid_t pool = fork();
+      if (pool == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 2);
+        setenv("SURVEY_PYTHONDIR", home, 1);
+        execlp("python3", "python3", "python/hook_worker.py", "--socket", sock, "--workers", "1", "--max-requests", "2", (char *) NULL);
+        _exit(127);
+      }
+      for (int i = 0; i < 100 && access(sock, F_OK); i++) {
+        usleep(50000);
+      }
+      ASSERT(access(sock, F_OK) == 0, "hook_worker.py listens on '%s'", sock);
+      setenv("SS_PYTHON_WORKER_SOCKET", sock, 1);
+
+      int ret = 0;
+      struct session *ses = load_session(sid, &ret);
+      ASSERT(ses != NULL, "load_session() (ret %d)", ret);
+
+      for (int call = 1; ses && call <= 2; call++) {
+        struct nextquestions *nq = calloc(1, sizeof(struct nextquestions));
+        ret = get_next_question_remote(ses, nq, ACTION_SESSION_NEXTQUESTIONS, 0);
+        ASSERT(ret == 0, "get_next_question_remote() call %d returns %d", call, ret);
+        ASSERT(nq->question_count == 1 && !strcmp(nq->next_questions[0]->uid, "q2"), "questions of the survey handshake (call %d)", call);
+        ASSERT(nq->status == 1 && nq->progress[1] == 1, "status and progress (call %d)", call);
+        ASSERT_STR_EQ(nq->message, sid, "session id passed to the hook");
+        free_next_questions(nq);
+      }
+
+      if (ses) {
+        // the worker of the last call has exited, the call reconnects to its replacement
+        const char *analysis = NULL;
+        ret = get_analysis_remote(ses, &analysis);
+        ASSERT(ret == 0, "get_analysis_remote() after a worker restart returns %d", ret);
+        ASSERT_STR_EQ(analysis, "{\"q2\": 43}", "analysis");
+        free((char *) analysis);
+      }
+      free_session(ses);
+
+      unsetenv("SS_PYTHON_WORKER_SOCKET");
+      kill(pool, SIGTERM);
+      int status;
+      waitpid(pool, &status, 0);
+
+      unlink(hooks);
+      snprintf(hooks, 1100, "%s/__pycache__", home);
+      char cmd[1200];
+      snprintf(cmd, 1200, "rm -rf '%s'", hooks);
+      ret = system(cmd);
+      unlink(sock);
+      paths_close();
+      remove_test_session(home, sid);
+
+      teardown_test_home(home, survey_home);
+    }
+
+    ////
+    // session lock manager
+    ////
+
+    SECTION("session lock manager: lock_session_timeout(), release_my_session_locks()");
+
+    {
+      char home[] = TEST_HOME_TEMPLATE;
+      char *survey_home = setup_test_home(home);
+      ASSERT(survey_home != NULL, "setup_test_home('%s')", home);
+
+      char *sid = "abcdabcd-0000-0000-0000-000000000000";
+      const char *backends[] = { "fcntl", "shm" };
+
+      for (int b = 0; b < 2; b++) {
+        setenv("SS_LOCK_BACKEND", backends[b], 1);
+        lock_manager_init();
+
+        struct lock_stats before;
+        struct lock_stats after;
+        int ret;
+        lock_manager_stats(&before);
+
+        ret = lock_session_timeout(sid, 0);
+        ASSERT(ret == 0, "%s: lock free session (ret %d)", backends[b], ret);
+        ret = lock_session_timeout(sid, 0);
+        ASSERT(ret == 0, "%s: lock held session again, same thread (ret %d)", backends[b], ret);
+
+        // another process times out while the lock is held
+        pid_t pid = fork();
+        if (!pid) {
+          _exit((lock_session_timeout(sid, 50) == SS_SYSTEM_LOCK_SESSION_TIMEOUT) ? 1 : 0);
+        }
+        int status = -1;
+        waitpid(pid, &status, 0);
+        ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 1, "%s: other process times out with SS_SYSTEM_LOCK_SESSION_TIMEOUT (status %d)", backends[b], status);
+
+        // a process without the lock table (surveycli) uses the fcntl backend
+        pid = fork();
+        if (!pid) {
+          unsetenv("SS_LOCK_BACKEND");
+          _exit((lock_session_timeout(sid, 50) == SS_SYSTEM_LOCK_SESSION_TIMEOUT) ? 1 : 0);
+        }
+        waitpid(pid, &status, 0);
+        ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 1, "%s: fcntl process times out with SS_SYSTEM_LOCK_SESSION_TIMEOUT (status %d)", backends[b], status);
+
+        release_my_session_locks();
+
+        pid = fork();
+        if (!pid) {
+          _exit(lock_session_timeout(sid, 50) ? 1 : 0);
+        }
+        waitpid(pid, &status, 0);
+        ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "%s: other process locks released session (status %d)", backends[b], status);
+
+        pid = fork();
+        if (!pid) {
+          unsetenv("SS_LOCK_BACKEND");
+          int res = lock_session_timeout(sid, 0);
+          _exit((res) ? 1 : 0);
+        }
+        waitpid(pid, &status, 0);
+        ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "%s: fcntl process locks released session (status %d)", backends[b], status);
+
+        lock_manager_stats(&after);
+        ASSERT(after.acquisitions == before.acquisitions + ((b) ? 2 : 1), "%s: acquisitions %lu -> %lu", backends[b], before.acquisitions, after.acquisitions);
+        ASSERT(after.backend == ((b) ? LOCK_BACKEND_SHM : LOCK_BACKEND_FCNTL), "%s: backend %d", backends[b], after.backend);
+
+        // shared locks: concurrent readers, writers wait
+        ret = lock_session_mode(sid, SESSION_LOCK_SHARED, 0);
+        ASSERT(ret == 0, "%s: shared lock (ret %d)", backends[b], ret);
+
+        pid = fork();
+        if (!pid) {
+          _exit(lock_session_mode(sid, SESSION_LOCK_SHARED, 50) ? 1 : 0);
+        }
+        waitpid(pid, &status, 0);
+        ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "%s: other process shares lock (status %d)", backends[b], status);
+
+        pid = fork();
+        if (!pid) {
+          _exit(lock_session_timeout(sid, 50) ? 1 : 0);
+        }
+        waitpid(pid, &status, 0);
+        ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 1, "%s: exclusive lock waits for shared holder (status %d)", backends[b], status);
+
+        int released = -1;
+        ret = upgrade_session_lock(sid, 0, &released);
+        ASSERT(ret == 0 && released == 0, "%s: upgrade in place (ret %d, released %d)", backends[b], ret, released);
+
+        pid = fork();
+        if (!pid) {
+          _exit(lock_session_mode(sid, SESSION_LOCK_SHARED, 50) ? 1 : 0);
+        }
+        waitpid(pid, &status, 0);
+        ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 1, "%s: shared lock waits for upgraded holder (status %d)", backends[b], status);
+        release_my_session_locks();
+
+        // upgrade while another process holds a shared lock: released and acquired again
+        int fds[2];
+        char c = 0;
+        ret = pipe(fds);
+        ASSERT(ret == 0, "%s: pipe() returns %d", backends[b], ret);
+        pid = fork();
+        if (!pid) {
+          int res = lock_session_mode(sid, SESSION_LOCK_SHARED, 0);
+          if (write(fds[1], "x", 1) != 1 || res) {
+            _exit(1);
+          }
+          usleep(100000);
+          release_my_session_locks();
+          _exit(0);
+        }
+        ret = (int) read(fds[0], &c, 1);
+        ASSERT(ret == 1, "%s: other process holds shared lock (read %d)", backends[b], ret);
+        close(fds[0]);
+        close(fds[1]);
+
+        lock_session_mode(sid, SESSION_LOCK_SHARED, 0);
+        ret = upgrade_session_lock(sid, 2000, &released);
+        ASSERT(ret == 0 && released == 1, "%s: upgrade released shared lock (ret %d, released %d)", backends[b], ret, released);
+        waitpid(pid, &status, 0);
+        release_my_session_locks();
+      }
+
+      unsetenv("SS_LOCK_BACKEND");
+
+      setenv("SS_LOCK_TIMEOUT", "250", 1);
+      ASSERT(lock_wait_budget() == 250, "lock_wait_budget(): SS_LOCK_TIMEOUT=250 (%d)", lock_wait_budget());
+      unsetenv("SS_LOCK_TIMEOUT");
+      ASSERT(lock_wait_budget() > 0, "lock_wait_budget(): bounded by default (%d)", lock_wait_budget());
+
+      char path[1024];
+      for (int i = 0; i < 16; i++) {
+        snprintf(path, 1024, "%s/locks/shard.%d", home, i);
+        unlink(path);
+      }
+      snprintf(path, 1024, "%s/locks", home);
+      rmdir(path);
+      teardown_test_home(home, survey_home);
+    }
+
+    SECTION("directory descriptors: path_dirfd(), session_dirfd()");
+
+    {
+      char home[] = TEST_HOME_TEMPLATE;
+      char *survey_home = setup_test_home(home);
+      ASSERT(survey_home != NULL, "setup_test_home('%s')", home);
+
+      int fd = path_dirfd(PATH_DIR_SESSIONS);
+      ASSERT(fd > -1, "path_dirfd(PATH_DIR_SESSIONS) creates sessions directory (fd %d)", fd);
+      int cached = path_dirfd(PATH_DIR_SESSIONS);
+      ASSERT(cached == fd, "path_dirfd(PATH_DIR_SESSIONS) is cached (fd %d, %d)", fd, cached);
+
+      char *sid = "abcdabcd-0000-0000-0000-000000000000";
+      fd = session_dirfd(sid, 0);
+      ASSERT(fd == -1, "session_dirfd(): missing prefix directory not created (fd %d)", fd);
+      fd = session_dirfd(sid, 1);
+      ASSERT(fd > -1, "session_dirfd(): prefix directory created (fd %d)", fd);
+      cached = session_dirfd("abcd0000-0000-0000-0000-000000000000", 0);
+      ASSERT(cached == fd, "session_dirfd(): same prefix is cached (fd %d, %d)", fd, cached);
+
+      char path[1024];
+      snprintf(path, 1024, "%s/sessions/abcd", home);
+      struct stat st;
+      ASSERT(!stat(path, &st) && S_ISDIR(st.st_mode), "session_dirfd(): '%s' exists", path);
+
+      // the cache follows SURVEY_HOME
+      setenv("SURVEY_HOME", survey_home, 1);
+      fd = path_dirfd(PATH_DIR_HOME);
+      ASSERT(fd > -1, "path_dirfd(PATH_DIR_HOME) after changing SURVEY_HOME (fd %d)", fd);
+      fd = session_dirfd(sid, 0);
+      ASSERT(fd == -1, "session_dirfd(): prefix directory of previous SURVEY_HOME dropped (fd %d)", fd);
+
+      paths_close();
+      rmdir(path);
+      snprintf(path, 1024, "%s/sessions", home);
+      rmdir(path);
+      teardown_test_home(home, survey_home);
+    }
+
   } while (0);
 
   DEBUG("\n-------------\nTESTS FINISHED\n-------------\n", "");
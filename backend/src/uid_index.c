@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "errorlog.h"
+#include "survey.h"
+#include "utils.h"
+
+/**
+ * Open addressing hash table mapping question and answer uids to their position in
+ * survey->questions[] or session->answers[].
+ *
+ * The table stores array positions only, keys are resolved through a uid_index_key callback on lookup.
+ * Replacing an array entry with an entry of the same uid (i.e. updating or undeleting an answer) therefore
+ * does not require an index update, only appended entries need to be inserted.
+ * Linear probing, the table is doubled once it is half full.
+ */
+
+#define UID_INDEX_MIN_SIZE 64
+
+/**
+ * FNV-1a string hash
+ */
+static unsigned int uid_index_hash(const char *uid) {
+  unsigned int hash = 2166136261u;
+  while (*uid) {
+    hash ^= (unsigned char) *uid++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static int uid_index_grow(struct uid_index *idx) {
+  int size = (idx->size) ? idx->size * 2 : UID_INDEX_MIN_SIZE;
+
+  int *slots = calloc(sizeof(int), size);
+  unsigned int *hashes = calloc(sizeof(unsigned int), size);
+  if (!slots || !hashes) {
+    free(slots);
+    free(hashes);
+    LOG_WARNV("uid index: failed to allocate %d slots", size);
+    return -1;
+  }
+
+  for (int i = 0; i < idx->size; i++) {
+    if (!idx->slots[i]) {
+      continue;
+    }
+    unsigned int pos = idx->hashes[i] & (size - 1);
+    while (slots[pos]) {
+      pos = (pos + 1) & (size - 1);
+    }
+    slots[pos] = idx->slots[i];
+    hashes[pos] = idx->hashes[i];
+  }
+
+  free(idx->slots);
+  free(idx->hashes);
+  idx->slots = slots;
+  idx->hashes = hashes;
+  idx->size = size;
+  return 0;
+}
+
+/**
+ * Add array position index for uid.
+ * If the uid is already indexed the first position is kept (same result as a linear search).
+ * returns 0 on success or -1 on error
+ */
+int uid_index_insert(struct uid_index *idx, char *uid, int index, void *items, uid_index_key key) {
+  if (!idx || !uid || index < 0) {
+    return -1;
+  }
+
+  if ((idx->count + 1) * 2 > idx->size) {
+    if (uid_index_grow(idx)) {
+      return -1;
+    }
+  }
+
+  unsigned int hash = uid_index_hash(uid);
+  unsigned int pos = hash & (idx->size - 1);
+
+  while (idx->slots[pos]) {
+    if (idx->hashes[pos] == hash && !strcmp(key(items, idx->slots[pos] - 1), uid)) {
+      idx->count++;
+      return 0;
+    }
+    pos = (pos + 1) & (idx->size - 1);
+  }
+
+  idx->slots[pos] = index + 1;
+  idx->hashes[pos] = hash;
+  idx->count++;
+  return 0;
+}
+
+/**
+ * Find the array position for uid
+ * returns index or -1 if uid is not indexed
+ */
+int uid_index_find(struct uid_index *idx, char *uid, void *items, uid_index_key key) {
+  if (!idx || !uid || !idx->size) {
+    return -1;
+  }
+
+  unsigned int hash = uid_index_hash(uid);
+  unsigned int pos = hash & (idx->size - 1);
+
+  while (idx->slots[pos]) {
+    if (idx->hashes[pos] == hash && !strcmp(key(items, idx->slots[pos] - 1), uid)) {
+      return idx->slots[pos] - 1;
+    }
+    pos = (pos + 1) & (idx->size - 1);
+  }
+  return -1;
+}
+
+void uid_index_free(struct uid_index *idx) {
+  if (!idx) {
+    return;
+  }
+  freez(idx->slots);
+  freez(idx->hashes);
+  idx->slots = NULL;
+  idx->hashes = NULL;
+  idx->size = 0;
+  idx->count = 0;
+  return;
+}
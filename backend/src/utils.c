@@ -1,9 +1,16 @@
+#include <fcntl.h>
+#include <pthread.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
 
+#include "arena.h"
 #include "errorlog.h"
+#include "utils.h"
 
 /*
   Various functions for freeing data structures.
@@ -33,7 +40,8 @@ void trim_crlf(char *line) {
 }
 
 struct tm *format_time_ISO8601(time_t t, char *buf, size_t len) {
-  struct tm *lt = localtime(&t);
+  static THREAD_LOCAL struct tm lt_buf;
+  struct tm *lt = localtime_r(&t, &lt_buf);
   if (!lt) {
     return lt;
   }
@@ -45,7 +53,7 @@ struct tm *format_time_ISO8601(time_t t, char *buf, size_t len) {
 
 /**
  * non-destructive line parsing from a string
- * The returned char *line needs to be deallocated by the callee
+ * The returned char *line needs to be deallocated by the callee with request_free()
  *
  * #461 deserialise a sequence of answers
  */
@@ -68,7 +76,7 @@ char *parse_line(const char *body, char separator, char **saveptr) {
       return NULL;
   }
 
-  line = malloc(len + 1);
+  line = request_calloc(len + 1, 1);
   if (!line) {
     LOG_CODE(SS_ERROR_MEM, "Error allocating memory for parsing line");
     return NULL;
@@ -84,3 +92,217 @@ char *parse_line(const char *body, char separator, char **saveptr) {
   *saveptr = sep + 1;
   return line;
 }
+
+/**
+ * Maps a file into private (copy-on-write) memory, so that the caller can tokenise the content in place
+ * without modifying the file. The content is always NUL terminated.
+ * Files which end exactly on a page boundary without a trailing line break have no room for the
+ * terminating NUL, these (and empty files) are read into allocated memory instead.
+ */
+int map_file(const char *path, struct file_map *map) {
+  return map_file_at(AT_FDCWD, path, map);
+}
+
+/**
+ * map_file() with a path relative to the directory descriptor dirfd
+ */
+int map_file_at(int dirfd, const char *path, struct file_map *map) {
+  int retVal = 0;
+  int fd = -1;
+
+  do {
+    BREAK_IF(map == NULL, SS_ERROR_ARG, "map");
+    map->data = NULL;
+    map->len = 0;
+    map->map_len = 0;
+
+    BREAK_IF(path == NULL, SS_ERROR_ARG, "path");
+
+    fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      BREAK_CODEV(SS_ERROR_OPEN_FILE, "Could not open file '%s'", path);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+      BREAK_CODEV(SS_ERROR_OPEN_FILE, "Could not stat file '%s'", path);
+    }
+    map->len = st.st_size;
+
+    long page = sysconf(_SC_PAGESIZE);
+    if (map->len && map->len % page) {
+      // the remainder of the last page is zero filled
+      char *data = mmap(NULL, map->len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+        BREAK_CODEV(SS_ERROR_OPEN_FILE, "Could not map file '%s'", path);
+      }
+      map->data = data;
+      map->map_len = map->len;
+      break;
+    }
+
+    map->data = malloc(map->len + 1);
+    BREAK_IF(map->data == NULL, SS_ERROR_MEM, "malloc(map->data)");
+
+    size_t offset = 0;
+    while (offset < map->len) {
+      ssize_t r = read(fd, map->data + offset, map->len - offset);
+      if (r <= 0) {
+        break;
+      }
+      offset += r;
+    }
+    if (offset < map->len) {
+      BREAK_CODEV(SS_ERROR_OPEN_FILE, "Could not read file '%s'", path);
+    }
+    map->data[map->len] = 0;
+  } while (0);
+
+  if (fd > -1) {
+    close(fd);
+  }
+
+  if (retVal) {
+    unmap_file(map);
+  }
+
+  return retVal;
+}
+
+/**
+ * fopen() with a path relative to the directory descriptor dirfd, modes "r", "w" and "a"
+ */
+FILE *fopen_at(int dirfd, const char *path, const char *mode) {
+  int flags;
+  switch (mode[0]) {
+  case 'w':
+    flags = O_WRONLY | O_CREAT | O_TRUNC;
+    break;
+  case 'a':
+    flags = O_WRONLY | O_CREAT | O_APPEND;
+    break;
+  default:
+    flags = O_RDONLY;
+  }
+
+  int fd = openat(dirfd, path, flags | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  FILE *fp = fdopen(fd, mode);
+  if (!fp) {
+    close(fd);
+  }
+  return fp;
+}
+
+void unmap_file(struct file_map *map) {
+  if (!map || !map->data) {
+    return;
+  }
+
+  if (map->map_len) {
+    munmap(map->data, map->map_len);
+  } else {
+    free(map->data);
+  }
+
+  map->data = NULL;
+  map->len = 0;
+  map->map_len = 0;
+  return;
+}
+
+/**
+ * Destructive line parsing of a mapped file: terminates the next line in place and strips CR/LF.
+ * Start with *saveptr = NULL, returns NULL after the last line
+ */
+char *map_next_line(struct file_map *map, char **saveptr) {
+  char *end = map->data + map->len;
+  char *line = (*saveptr) ? *saveptr : map->data;
+
+  if (line >= end) {
+    return NULL;
+  }
+
+  char *nl = memchr(line, '\n', end - line);
+  if (nl) {
+    *nl = 0;
+    *saveptr = nl + 1;
+  } else {
+    *saveptr = end;
+  }
+
+  trim_crlf(line);
+  return line;
+}
+
+static uint32_t crc32_table[256];
+static pthread_once_t crc32_table_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init_table(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) {
+      c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+    }
+    crc32_table[i] = c;
+  }
+}
+
+/**
+ * CRC-32 (IEEE 802.3, reflected polynomial 0xEDB88320) of a memory block
+ */
+uint32_t crc32_checksum(const void *data, size_t len) {
+  pthread_once(&crc32_table_once, crc32_init_table);
+
+  const unsigned char *p = data;
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < len; i++) {
+    crc = crc32_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return crc ^ 0xFFFFFFFF;
+}
+
+/**
+ * Ensure a growable array has room for count items, the capacity is doubled as required.
+ * returns the (re)allocated array and updates *capacity, or NULL on error (the old array stays valid)
+ */
+void *array_reserve(void *items, int *capacity, int count, size_t item_size) {
+  if (count <= *capacity && items) {
+    return items;
+  }
+
+  int size = (*capacity > 0) ? *capacity : 16;
+  while (size < count) {
+    size *= 2;
+  }
+
+  void *resized = realloc(items, size * item_size);
+  if (!resized) {
+    LOG_WARNV("array_reserve(): failed to allocate %d items", size);
+    return NULL;
+  }
+
+  *capacity = size;
+  return resized;
+}
+
+/**
+ * Read a positive integer limit from the environment, returns default_value if the variable is not set or invalid
+ */
+int env_limit(const char *name, int default_value) {
+  char *val = getenv(name);
+  if (!val || !val[0]) {
+    return default_value;
+  }
+
+  char *end = NULL;
+  long limit = strtol(val, &end, 10);
+  if (*end || limit < 1 || limit > 0x7fffffff / 8) {
+    LOG_WARNV("Ignoring invalid value '%s' for %s, using %d", val, name, default_value);
+    return default_value;
+  }
+  return (int) limit;
+}